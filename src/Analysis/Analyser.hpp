@@ -1,161 +1,315 @@
 #pragma once
 
-#include <limits>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
-#include <set>
 
 #include <Core/Cartridge.hpp>
+#include <Core/Coverage.hpp>
+#include <Core/Disassembler.hpp>
 #include <Core/LR35902.hpp>
-#include <Tools/Hexadecimal.hpp>
 
+/**
+ * Static code analysis of a ROM: Follows the control flow from the entry points (or any location)
+ * to find the instructions and the jump/call targets (labels).
+ *
+ * Locations are ROM offsets (see offset), so each bank is analysed separately: Code of the switchable
+ * area is assumed to stay in its bank, and code of bank 0 to call the bank it last mapped
+ * ('LD A,n' followed by 'LD (2000-3FFF),A', bank 1 otherwise). Bank 0 is only walked once,
+ * with the first mapped bank reaching each location. Code in RAM isn't followed, and indirect jumps (JP (HL))
+ * only from the destinations recorded at runtime (see CodeCoverage).
+ *
+ * Uses a worklist (no recursion) and two bits per ROM byte (instruction starts and labels),
+ * names are only kept for labels. With parallel, each round processes the pending locations of
+ * distinct banks in separate threads, then exchanges the locations reached in other banks.
+**/
 class Analyser
 {
 public:
-	struct Label
-	{
-		unsigned int	id = std::numeric_limits<unsigned int>::max();
-		std::string		name;
-		addr_t			addr;
-		
-		operator bool() const
-		{
-			return id != std::numeric_limits<unsigned int>::max();
-		}
-	};
-	
+	/// bank * 0x4000 + (address & 0x3FFF), see Cartridge::rom_offset
+	using Offset = uint32_t;
+	static constexpr Offset BankSize = 0x4000;
+
+	bool	parallel = true;
+
+	/// Analyses from the interrupt vectors and the entry point.
 	void process(const Cartridge& c)
 	{
 		clear();
-		labels.resize(c.getROMSize());
-		process(c, 0x0040);
-		process(c, 0x0048);
-		process(c, 0x0050);
-		process(c, 0x0058);
-		process(c, 0x0060);
-		process(c, 0x0100);
+		std::vector<Item> entries;
+		for(addr_t addr : {0x0040, 0x0048, 0x0050, 0x0058, 0x0060, 0x0100})
+			entries.push_back(Item{addr, 1});
+		run(c, entries);
 	}
-	
-	void process(const Cartridge& c, addr_t addr)
+
+	/**
+	 * Continues the analysis from the code executed at runtime and the destinations of its indirect jumps,
+	 * e.g. to complete the static analysis with a coverage saved while playing.
+	**/
+	void process(const Cartridge& c, const CodeCoverage& coverage)
+	{
+		if(_instructions.empty())
+			init(c);
+		std::vector<Item> entries;
+		const auto& executed = coverage.get_executed();
+		for(size_t w = 0; w < std::min(executed.size(), _instructions.size()); ++w)
+			for(uint64_t bits = executed[w] & ~_instructions[w]; bits != 0; bits &= bits - 1)
+			{
+				const Offset o = static_cast<Offset>(w * 64 + __builtin_ctzll(bits));
+				entries.push_back(Item{o, std::max(1, bank(o)), false});
+			}
+		for(const CodeCoverage::IndirectJump& j : coverage.get_indirect_jumps())
+			if(j.target / 64 < _labels.size())
+				entries.push_back(Item{j.target, std::max(1, bank(j.target))});
+		run(c, entries);
+	}
+
+	/// Continues the analysis from addr, with bank mapped in 0x4000 - 0x7FFF.
+	void process(const Cartridge& c, int bank, addr_t addr)
 	{
-		while(addr < c.getROMSize())
+		if(addr >= 0x8000)
+			return;
+		if(_instructions.empty())
+			init(c);
+		const int mapped = std::max(1, bank);
+		run(c, {Item{offset(addr < 0x4000 ? 0 : mapped, addr), mapped}});
+	}
+
+	void clear()
+	{
+		_instructions.clear();
+		_labels.clear();
+		_names.clear();
+		_bank_count = 0;
+	}
+
+	inline bool is_instruction(Offset o) const { return test(_instructions, o); }
+	inline bool is_label(Offset o) const { return test(_labels, o); }
+	/// nullptr if o isn't a label.
+	inline const char* get_label(Offset o) const
+	{
+		auto it = _names.find(o);
+		return it != _names.end() ? it->second.c_str() : nullptr;
+	}
+	/// Renames a label (creating it if needed).
+	inline void set_label(Offset o, const std::string& name)
+	{
+		if(o / 64 >= _labels.size())
+			return;
+		set(_labels, o);
+		_names[o] = name;
+	}
+
+	inline size_t get_instruction_count() const { return count(_instructions); }
+	inline unsigned int get_label_count() const { return static_cast<unsigned int>(_names.size()); }
+	inline size_t get_bank_count() const { return _bank_count; }
+
+	/// Offsets of all instructions, in order (out is cleared).
+	void get_instructions(std::vector<Offset>& out) const
+	{
+		out.clear();
+		out.reserve(get_instruction_count());
+		for(size_t w = 0; w < _instructions.size(); ++w)
+			for(uint64_t bits = _instructions[w]; bits != 0; bits &= bits - 1)
+				out.push_back(static_cast<Offset>(w * 64 + __builtin_ctzll(bits)));
+	}
+
+	/// Calls f(Offset, const std::string& name) for each label.
+	template<typename F>
+	void for_each_label(F&& f) const
+	{
+		for(const auto& p : _names)
+			f(p.first, p.second);
+	}
+
+	static inline Offset offset(int bank, addr_t addr) { return Cartridge::rom_offset(bank, addr); }
+	static inline int bank(Offset o) { return static_cast<int>(o / BankSize); }
+	static inline addr_t address(Offset o) { return static_cast<addr_t>(o < BankSize ? o : 0x4000 + (o % BankSize)); }
+
+private:
+	struct Item
+	{
+		Offset	offset;
+		int		mapped;			///< Bank mapped in 0x4000 - 0x7FFF
+		bool	label = true;	///< Jump/call target (or entry point)
+	};
+
+	std::vector<uint64_t>					_instructions;	///< Bit per ROM byte: First byte of an instruction
+	std::vector<uint64_t>					_labels;		///< Bit per ROM byte: Jump/Call target
+	std::unordered_map<Offset, std::string>	_names;
+	size_t									_bank_count = 0;
+
+	static inline bool test(const std::vector<uint64_t>& bits, Offset o) { return o / 64 < bits.size() && (bits[o / 64] >> (o % 64)) & 1; }
+	static inline void set(std::vector<uint64_t>& bits, Offset o) { bits[o / 64] |= uint64_t(1) << (o % 64); }
+	static inline size_t count(const std::vector<uint64_t>& bits)
+	{
+		size_t r = 0;
+		for(uint64_t w : bits)
+			r += __builtin_popcountll(w);
+		return r;
+	}
+
+	void init(const Cartridge& c)
+	{
+		_bank_count = 0;
+		while(c.rom_bank_data(_bank_count) != nullptr)
+			++_bank_count;
+		// Banks are multiples of 64 bits: Threads working on different banks never share a word.
+		_instructions.assign(_bank_count * BankSize / 64, 0);
+		_labels.assign(_bank_count * BankSize / 64, 0);
+	}
+
+	void run(const Cartridge& c, const std::vector<Item>& entries)
+	{
+		if(_instructions.empty())
+			init(c);
+		if(_bank_count == 0)
+			return;
+
+		std::vector<std::vector<Item>> pending(_bank_count);
+		const auto add = [&](const Item& i) {
+			if(i.label)
+				set(_labels, i.offset);
+			if(!is_instruction(i.offset))
+				pending[bank(i.offset)].push_back(i);
+		};
+		for(const Item& i : entries)
+			add(i);
+
+		const size_t max_threads = parallel ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+		std::vector<std::vector<Item>> outboxes(max_threads);	// Locations reached in other banks, by thread
+		std::vector<size_t> banks;
+		while(true)
 		{
-			if(instructions.count(addr) > 0)
-				return;
-			
-			word_t opcode = c.read(addr);
+			banks.clear();
+			for(size_t b = 0; b < _bank_count; ++b)
+				if(!pending[b].empty())
+					banks.push_back(b);
+			if(banks.empty())
+				break;
 
-			if(LR35902::instr_length[opcode] == 0)
+			const size_t thread_count = std::min(max_threads, banks.size());
+			const auto work = [&](size_t t) {
+				for(size_t i = t; i < banks.size(); i += thread_count)
+					walk(c, pending[banks[i]], outboxes[t]);
+			};
+			if(thread_count == 1)
 			{
-				if(opcode == 0xCB)
-				{
-					instructions.insert(addr);
-					addr += 2;
-					continue;
-				} else {
-					break;
-				}
+				work(0);
+			} else {
+				std::vector<std::thread> threads;
+				for(size_t t = 0; t < thread_count; ++t)
+					threads.emplace_back(work, t);
+				for(auto& t : threads)
+					t.join();
 			}
 
-			instructions.insert(addr);
-			
-			auto jump = [&] (addr_t jp_addr) {
-				if(!labels[jp_addr])
-				{
-					add_label(jp_addr);
-					process(c, jp_addr);
-				}
-			};
-			
-			// TODO: Do something with rets? (marks 'functions')
-			switch(opcode)
+			for(size_t b : banks)
+				pending[b].clear();
+			for(auto& outbox : outboxes)
 			{
-				case 0x20: //[[fallthrough]] // JR NZ,r8;	Conditional (non-zero) relative jump
-				case 0x30: //[[fallthrough]] // JR NC,r8;	Conditional (non-carry) relative jump
-				case 0x28: //[[fallthrough]] // JR Z,r8;	Conditional (zero) relative jump
-				case 0x38: //[[fallthrough]] // JR C,r8;	Conditional (carry) relative jump
-				case 0xCD: 					 // Call a16;	Unconditional absolute jump, but will return after!
+				for(const Item& i : outbox)
+					add(i);
+				outbox.clear();
+			}
+		}
+
+		name_labels();
+	}
+
+	/// Follows the control flow from the items (all in the same bank), until it leaves the bank.
+	void walk(const Cartridge& c, std::vector<Item>& worklist, std::vector<Item>& outbox)
+	{
+		const int walked_bank = bank(worklist.front().offset);
+		const word_t* data = reinterpret_cast<const word_t*>(c.rom_bank_data(walked_bank));
+		const auto reach = [&](addr_t addr, int mapped, std::vector<Item>& local) {
+			if(addr >= 0x8000) // RAM
+				return;
+			const Offset target = offset(addr < 0x4000 ? 0 : (walked_bank == 0 ? mapped : walked_bank), addr);
+			if(target / 64 >= _labels.size())
+				return;
+			if(bank(target) == walked_bank)
+			{
+				set(_labels, target);
+				local.push_back(Item{target, mapped});
+			} else {
+				outbox.push_back(Item{target, mapped}); // Labeled between the rounds (see run)
+			}
+		};
+
+		while(!worklist.empty())
+		{
+			Item item = worklist.back();
+			worklist.pop_back();
+			int a = -1; // Known value of A (bank switches)
+			for(Offset o = item.offset; ; )
+			{
+				if(bank(o) != walked_bank)
 				{
-					addr_t jp_addr = addr + from_2c_to_signed(c.read(addr + 1));
-					jump(jp_addr);
+					if(walked_bank == 0) // Runs into the mapped bank
+						outbox.push_back(Item{offset(item.mapped, 0x4000), item.mapped, false});
 					break;
 				}
-				case 0xC2: // JP NZ,a16;	Conditional (non-zero) absolute jump
-				case 0xD2: // JP NC,a16;	Conditional (non-carry) absolute jump
-				case 0xC4: // CALL NZ,a16;	Conditional (non-zero) absolute jump
-				case 0xD4: // CALL NC,a16;	Conditional (non-carry) absolute jump
-				case 0xCC: // CALL Z,a16;	Conditional (carry) absolute jump
-				case 0xDC: // CALL C,a16;	Conditional (carry) absolute jump
-				{
-					addr_t jp_addr = read16(c, addr + 1);
-					jump(jp_addr);
+				if(is_instruction(o))
 					break;
-				}
-				case 0x18: // JR r8;		Unconditional relative jump
-				{
-					addr_t jp_addr = addr + from_2c_to_signed(c.read(addr + 1));
-					jump(jp_addr);
-					return; // Unconditional => Next instruction can't be reach this way.
-				}
-				case 0xC3: // JP a16;		Unconditional absolute jump
-				{
-					addr_t jp_addr = read16(c, addr + 1);
-					jump(jp_addr);
-					return; // Unconditional => Next instruction can't be reach this way.
-				}
-				// RST 00H, 08H, 10H, 18H, 20H, 28H, 30H, 38H; Unconditional absolute jumps, but will return after!
-				case 0xC7: jump(0x0000); break;
-				case 0xCF: jump(0x0008); break;
-				case 0xD7: jump(0x0010); break;
-				case 0xDF: jump(0x0018); break;
-				case 0xE7: jump(0x0020); break;
-				case 0xEF: jump(0x0028); break;
-				case 0xF7: jump(0x0030); break;
-				case 0xFF: jump(0x0038); break;
-				// Unconditional returns
-				case 0xC9: // RET
-				case 0xD9: // RETI
-					return;
-				case 0xE9: // JP (HL); Unconditional, 'runtime' jump don't know what to do with it for now (TODO)
-					return;
-				// RET NZ (0xC0), RET NC (0xD0), RET Z (0xC8), RET C (0xD8 Conditional returns, nothing to do.
-				default:
+				const size_t index = o % BankSize;
+				const DisassembledInstr instr = Disassembler::decode(data + index, BankSize - index, address(o));
+				if(instr.flow == DisassembledInstr::Flow::Invalid)
 					break;
+				set(_instructions, o);
+
+				// Bank switches: 'LD A,n' (or 'XOR A') then 'LD (2000-3FFF),A'
+				if(instr.id == 0xEA && in_range(instr.value, 0x2000, 0x4000) && a >= 0)
+					item.mapped = std::max(1, static_cast<int>(a % _bank_count));
+				a = instr.id == 0x3E ? instr.value : instr.id == 0xAF ? 0 : writes_a(instr.id) ? -1 : a;
+
+				if(instr.has_target && instr.flow != DisassembledInstr::Flow::Next)
+					reach(instr.target, item.mapped, worklist);
+				const bool stop = (instr.flow == DisassembledInstr::Flow::Jump || instr.flow == DisassembledInstr::Flow::Return) &&
+								  !instr.conditional;
+				if(stop)
+					break;
+				o += instr.length;
 			}
-			
-			addr += LR35902::instr_length[opcode];
 		}
 	}
-	
-	void clear()
-	{
-		_next_id = 0;
-		labels.clear();
-		instructions.clear();
-	}
-	
-	unsigned int get_label_count() const 
-	{
-		return _next_id;
-	}
-
-	std::vector<Label>	labels;
-	std::set<addr_t>	instructions;
-
-private:
-	unsigned int _next_id = 0;
 
-	void add_label(addr_t addr)
+	void name_labels()
 	{
-		auto id_str = std::to_string(_next_id);
-		std::string label = "L" + std::string(3 - id_str.length(), '0') + id_str;
-		labels[addr] = {_next_id, label, addr};
-		++_next_id;
+		char name[16];
+		for(size_t w = 0; w < _labels.size(); ++w)
+			for(uint64_t bits = _labels[w]; bits != 0; bits &= bits - 1)
+			{
+				const Offset o = static_cast<Offset>(w * 64 + __builtin_ctzll(bits));
+				if(_names.count(o) == 0)
+				{
+					std::snprintf(name, sizeof(name), "L%02X_%04X", bank(o), address(o));
+					_names.emplace(o, name);
+				}
+			}
 	}
-	
-	static inline addr_t read16(const Cartridge& c, addr_t addr)
+
+	/// The instruction may modify A (approximation used to track bank switches).
+	static bool writes_a(uint16_t id)
 	{
-		return ((static_cast<addr_t>(c.read(addr + 1)) << 8) & 0xFF00) | c.read(addr);
+		static const std::vector<bool> table = [] {
+			std::vector<bool> t(0x200);
+			const char* prefixes[] = {"LD A,", "LDH A,", "ADD A,", "ADC A,", "SUB ", "SBC A,", "AND ", "XOR ", "OR ",
+				"INC A", "DEC A", "CPL", "DAA", "RLA", "RRA", "RLCA", "RRCA", "POP AF"};
+			for(int i = 0; i < 0x100; ++i)
+			{
+				const std::string& s = LR35902::instr_str[i];
+				for(const char* p : prefixes)
+					t[i] = t[i] || s.compare(0, std::strlen(p), p) == 0;
+				const std::string& cb = LR35902::instr_cb_str[i];
+				t[0x100 | i] = cb.back() == 'A' && cb.compare(0, 3, "BIT") != 0;
+			}
+			return t;
+		}();
+		return table[id & 0x1FF];
 	}
-	
-	static inline int from_2c_to_signed(word_t src) { return (src & 0x80) ? -((~src + 1) & 0xFF) : src; }
 };
@@ -0,0 +1,309 @@
+#include "Breakpoint.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <Core/LR35902.hpp>
+
+namespace
+{
+	struct BinaryOp
+	{
+		const char*		token;
+		Condition::Op	op;
+		int				precedence;
+	};
+
+	// Longest tokens first ('&&' before '&', '<=' before '<'...)
+	const BinaryOp BinaryOps[] = {
+		{"||", Condition::Op::LOr, 1},
+		{"&&", Condition::Op::LAnd, 2},
+		{"==", Condition::Op::Eq, 6},
+		{"!=", Condition::Op::Ne, 6},
+		{"<=", Condition::Op::Le, 7},
+		{">=", Condition::Op::Ge, 7},
+		{"<", Condition::Op::Lt, 7},
+		{">", Condition::Op::Gt, 7},
+		{"|", Condition::Op::Or, 3},
+		{"^", Condition::Op::Xor, 4},
+		{"&", Condition::Op::And, 5},
+		{"+", Condition::Op::Add, 8},
+		{"-", Condition::Op::Sub, 8},
+		{"*", Condition::Op::Mul, 9}
+	};
+
+	// Two letters names first
+	const std::pair<const char*, Condition::Register> Registers[] = {
+		{"AF", Condition::AF}, {"BC", Condition::BC}, {"DE", Condition::DE}, {"HL", Condition::HL},
+		{"SP", Condition::SP}, {"PC", Condition::PC},
+		{"A", Condition::A}, {"F", Condition::F}, {"B", Condition::B}, {"C", Condition::C},
+		{"D", Condition::D}, {"E", Condition::E}, {"H", Condition::H}, {"L", Condition::L}
+	};
+
+	/// Recursive descent parser, emitting the bytecode in postfix order.
+	class Parser
+	{
+	public:
+		std::string		error;
+		size_t			max_depth = 0;
+
+		Parser(const std::string& src, std::vector<Condition::Instr>& code) : _src(src), _code(code) {}
+
+		bool parse()
+		{
+			if(!expression(1))
+				return false;
+			skip_spaces();
+			if(_pos < _src.size())
+				return fail("Unexpected '" + _src.substr(_pos, 1) + "'");
+			return true;
+		}
+
+	private:
+		const std::string&				_src;
+		std::vector<Condition::Instr>&	_code;
+		size_t							_pos = 0;
+		size_t							_depth = 0;
+
+		bool fail(const std::string& msg)
+		{
+			error = msg + " at column " + std::to_string(_pos + 1) + ".";
+			return false;
+		}
+
+		void skip_spaces()
+		{
+			while(_pos < _src.size() && std::isspace(static_cast<unsigned char>(_src[_pos])))
+				++_pos;
+		}
+
+		bool accept(char c)
+		{
+			skip_spaces();
+			if(_pos < _src.size() && _src[_pos] == c)
+			{
+				++_pos;
+				return true;
+			}
+			return false;
+		}
+
+		void emit(Condition::Op op, int value = 0)
+		{
+			if(op == Condition::Op::Const || op == Condition::Op::Reg)
+				max_depth = std::max(max_depth, ++_depth);
+			else if(op >= Condition::Op::Mul)
+				--_depth;
+			_code.push_back(Condition::Instr{op, value});
+		}
+
+		/// Binary operators of at least min_precedence (precedence climbing).
+		bool expression(int min_precedence)
+		{
+			if(!unary())
+				return false;
+			while(true)
+			{
+				skip_spaces();
+				const BinaryOp* op = nullptr;
+				for(const BinaryOp& o : BinaryOps)
+					if(_src.compare(_pos, std::strlen(o.token), o.token) == 0)
+					{
+						op = &o;
+						break;
+					}
+				if(op == nullptr || op->precedence < min_precedence)
+					return true;
+				_pos += std::strlen(op->token);
+				if(!expression(op->precedence + 1))
+					return false;
+				emit(op->op);
+			}
+		}
+
+		bool unary()
+		{
+			if(accept('!'))
+				return unary_op(Condition::Op::Not);
+			if(accept('~'))
+				return unary_op(Condition::Op::Compl);
+			if(accept('-'))
+				return unary_op(Condition::Op::Neg);
+			return primary();
+		}
+
+		bool unary_op(Condition::Op op)
+		{
+			if(!unary())
+				return false;
+			emit(op);
+			return true;
+		}
+
+		bool primary()
+		{
+			if(accept('('))
+			{
+				if(!expression(1))
+					return false;
+				return accept(')') || fail("Expected ')'");
+			}
+			if(accept('['))
+			{
+				if(!expression(1))
+					return false;
+				emit(Condition::Op::Load);
+				return accept(']') || fail("Expected ']'");
+			}
+
+			skip_spaces();
+			if(_pos >= _src.size())
+				return fail("Unexpected end of expression");
+
+			int base = 10;
+			if(_src[_pos] == '$')
+			{
+				base = 16;
+				++_pos;
+			} else if(_src.compare(_pos, 2, "0x") == 0 || _src.compare(_pos, 2, "0X") == 0) {
+				base = 16;
+				_pos += 2;
+			}
+			if(base == 16 || std::isdigit(static_cast<unsigned char>(_src[_pos])))
+			{
+				const char* start = _src.c_str() + _pos;
+				char* end = nullptr;
+				const long value = std::strtol(start, &end, base);
+				if(end == start)
+					return fail("Expected a number");
+				_pos += end - start;
+				emit(Condition::Op::Const, static_cast<int>(value));
+				return true;
+			}
+
+			size_t len = 0;
+			while(_pos + len < _src.size() && std::isalpha(static_cast<unsigned char>(_src[_pos + len])))
+				++len;
+			std::string word = _src.substr(_pos, len);
+			for(auto& c : word)
+				c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+			for(const auto& r : Registers)
+				if(word == r.first)
+				{
+					_pos += len;
+					emit(Condition::Op::Reg, r.second);
+					return true;
+				}
+			return fail(word.empty() ? "Unexpected '" + _src.substr(_pos, 1) + "'" : "Unknown register '" + word + "'");
+		}
+	};
+
+	inline int register_value(const LR35902& cpu, int r)
+	{
+		switch(r)
+		{
+			case Condition::A: return cpu.get_af() >> 8;
+			case Condition::F: return cpu.get_af() & 0xFF;
+			case Condition::B: return cpu.get_bc() >> 8;
+			case Condition::C: return cpu.get_bc() & 0xFF;
+			case Condition::D: return cpu.get_de() >> 8;
+			case Condition::E: return cpu.get_de() & 0xFF;
+			case Condition::H: return cpu.get_hl() >> 8;
+			case Condition::L: return cpu.get_hl() & 0xFF;
+			case Condition::AF: return cpu.get_af();
+			case Condition::BC: return cpu.get_bc();
+			case Condition::DE: return cpu.get_de();
+			case Condition::HL: return cpu.get_hl();
+			case Condition::SP: return cpu.get_sp();
+			case Condition::PC: return cpu.get_pc();
+		}
+		return 0;
+	}
+	
+	/// Add, Sub, Mul and Neg are computed unsigned: Their overflows wrap around (two's complement) instead of being undefined.
+	inline int wrap(unsigned int v)
+	{
+		return static_cast<int>(v);
+	}
+}
+
+bool Condition::compile(const std::string& expr)
+{
+	_code.clear();
+	_error.clear();
+	_source.clear();
+
+	bool blank = true;
+	for(char c : expr)
+		blank = blank && std::isspace(static_cast<unsigned char>(c));
+	if(blank)
+		return true;
+
+	Parser parser(expr, _code);
+	if(!parser.parse())
+		_error = parser.error;
+	else if(parser.max_depth > MaxDepth)
+		_error = "Expression too complex.";
+	if(!_error.empty())
+	{
+		_code.clear();
+		return false;
+	}
+	_source = expr;
+	return true;
+}
+
+int Condition::eval(const LR35902& cpu, const MMU& mmu) const
+{
+	int stack[MaxDepth];
+	size_t top = 0;
+	for(const Instr& i : _code)
+	{
+		switch(i.op)
+		{
+			case Op::Const: stack[top++] = i.value; break;
+			case Op::Reg: stack[top++] = register_value(cpu, i.value); break;
+			case Op::Load: stack[top - 1] = mmu.read(static_cast<addr_t>(stack[top - 1])); break;
+			case Op::Not: stack[top - 1] = !stack[top - 1]; break;
+			case Op::Compl: stack[top - 1] = ~stack[top - 1]; break;
+			case Op::Neg: stack[top - 1] = wrap(0u - static_cast<unsigned int>(stack[top - 1])); break;
+			default:
+			{
+				const int r = stack[--top];
+				int& l = stack[top - 1];
+				switch(i.op)
+				{
+					case Op::Mul: l = wrap(static_cast<unsigned int>(l) * static_cast<unsigned int>(r)); break;
+					case Op::Add: l = wrap(static_cast<unsigned int>(l) + static_cast<unsigned int>(r)); break;
+					case Op::Sub: l = wrap(static_cast<unsigned int>(l) - static_cast<unsigned int>(r)); break;
+					case Op::And: l = l & r; break;
+					case Op::Xor: l = l ^ r; break;
+					case Op::Or: l = l | r; break;
+					case Op::Eq: l = l == r; break;
+					case Op::Ne: l = l != r; break;
+					case Op::Lt: l = l < r; break;
+					case Op::Le: l = l <= r; break;
+					case Op::Gt: l = l > r; break;
+					case Op::Ge: l = l >= r; break;
+					case Op::LAnd: l = l && r; break;
+					case Op::LOr: l = l || r; break;
+					default: break;
+				}
+			}
+		}
+	}
+	return top > 0 ? stack[0] : 1;
+}
+
+std::string Breakpoint::name() const
+{
+	char str[16];
+	if(bank == AnyBank)
+		std::snprintf(str, sizeof(str), "%04X", addr);
+	else
+		std::snprintf(str, sizeof(str), "%02X:%04X", bank, addr);
+	return condition.empty() ? str : std::string(str) + " if " + condition.get_source();
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <Tools/Common.hpp>
+
+class LR35902;
+class MMU;
+
+/**
+ * Breakpoint condition, compiled once to a tiny stack bytecode (see compile and eval).
+ *
+ * C-like expression over the registers (A, F, B, C, D, E, H, L, AF, BC, DE, HL, SP, PC),
+ * the memory ([addr] is the byte at addr) and numbers ($FF, 0xFF or decimal), using the operators
+ * ! ~ - * + & ^ | == != < <= > >= && || with the C precedence, and parenthesis.
+ * e.g. 'A == $3C && [HL] != 0', '[$FF44] >= 144', 'BC & $8000'.
+**/
+class Condition
+{
+public:
+	enum class Op : word_t
+	{
+		Const,		///< Pushes value
+		Reg,		///< Pushes register value (see Register)
+		Load,		///< Replaces the address on top of the stack by the byte there
+		Not, Compl, Neg,
+		Mul, Add, Sub, And, Xor, Or,
+		Eq, Ne, Lt, Le, Gt, Ge,
+		LAnd, LOr
+	};
+
+	enum Register : word_t { A, F, B, C, D, E, H, L, AF, BC, DE, HL, SP, PC };
+
+	struct Instr
+	{
+		Op		op;
+		int		value;
+	};
+
+	/// Maximum depth of the evaluation stack.
+	static constexpr size_t MaxDepth = 16;
+
+	/**
+	 * Replaces the condition by expr (an empty expr is always true).
+	 * @return false on a syntax error (see get_error), the condition is then left empty.
+	**/
+	bool compile(const std::string& expr);
+
+	inline bool empty() const { return _code.empty(); }
+	inline const std::string& get_source() const { return _source; }
+	inline const std::string& get_error() const { return _error; }
+	inline const std::vector<Instr>& get_code() const { return _code; }
+
+	/// Value of the expression for this state (memory read without side effects), arithmetic wraps around on overflow.
+	int eval(const LR35902& cpu, const MMU& mmu) const;
+	inline bool test(const LR35902& cpu, const MMU& mmu) const { return empty() || eval(cpu, mmu) != 0; }
+
+private:
+	std::string			_source;
+	std::string			_error;
+	std::vector<Instr>	_code;
+};
+
+/// Execution breakpoint, see LR35902::add_breakpoint.
+struct Breakpoint
+{
+	static constexpr int AnyBank = std::numeric_limits<int>::min();
+
+	addr_t		addr = 0;
+	/// ROM bank for 0x4000 - 0x7FFF, WRAM bank for 0xD000 - 0xDFFF, AnyBank otherwise.
+	int			bank = AnyBank;
+	Condition	condition;
+
+	/// 'AAAA', 'BB:AAAA' with a bank, followed by ' if condition' with a condition.
+	std::string name() const;
+};
@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include <Tools/Config.hpp>
+#include <Core/SaveWriter.hpp>
 
 Cartridge::Cartridge(const std::string& path)
 {
@@ -16,17 +17,15 @@ Cartridge::Cartridge(const std::string& path)
 	
 bool Cartridge::load(const std::string& path)
 {
-	std::ifstream file(path, std::ios::binary);
-
-	if(!file)
+	std::string error;
+	auto rom = ROMImage::open(path, error);
+	if(!rom)
 	{
 		if(Log)
-			Log("Error: '" + path + "' could not be opened.");
+			Log("Error: '" + path + "' could not be opened (" + error + ").");
 		return false;
 	}
-	
-	_data.assign(std::istreambuf_iterator<byte_t>(file),
-				std::istreambuf_iterator<byte_t>());
+	_rom = std::move(rom);
 			
 	if(Log)	
 		Log("Loaded '" + path + "'");
@@ -36,12 +35,19 @@ bool Cartridge::load(const std::string& path)
 
 bool Cartridge::load_from_memory(const unsigned char data[], size_t size)
 {
-	_data = std::vector<byte_t>(data, data + size);
+	return load_from_memory(std::vector<byte_t>(data, data + size));
+}
+
+bool Cartridge::load_from_memory(std::vector<byte_t>&& data)
+{
+	_rom = ROMImage::from_memory(std::move(data));
 	if(Log)
 		Log("Loaded a ROM from memory");
 	return init();
 }
 
+const byte_t Cartridge::EmptyBank[0x4000] = {0};
+
 void Cartridge::reset()
 {
 	_rom_bank = 1;
@@ -50,26 +56,45 @@ void Cartridge::reset()
 	_ram_size = 0;
 	_ram.clear();
 	_mode = 0;
+	_rtc_latch = false;
 	std::memset(_rtc_registers, 0, 5);
+	update_banks();
 }
 
 bool Cartridge::init()
 {
+	_mapper = Mapper::None;
+	_save_writer.reset();
 	reset();
-	if(!(isMBC1() || isMBC3() || isMBC5()))
+	if(_rom->size() < 0x150)
 	{
 		if(Log)
-			Log("Error: Cartridge format " + Hexa8(getType()).str() + " not supported!");
+			Log("Error: " + std::to_string(_rom->size()) + "B is too small for a ROM header.");
+		_rom = ROMImage::empty_image();
 		return false;
 	}
+	switch(getType())
+	{
+		case ROM: case ROM_RAM: case ROM_RAM_BATTERY: _mapper = Mapper::ROMOnly; break;
+		case MBC1: case MBC1_RAM: case MBC1_RAM_BATTERY: _mapper = Mapper::MBC1; break;
+		case MBC2: case MBC2_BATTERY: _mapper = Mapper::MBC2; break;
+		case MBC3_TIMER_BATTERY: case MBC3_TIMER_RAM_BATTERY: case MBC3: case MBC3_RAM: case MBC3_RAM_BATTERY:
+			_mapper = Mapper::MBC3; break;
+		case MBC5: case MBC5_RAM: case MBC5_RAM_BATTERY: case MBC5_RUMBLE: case MBC5_RUMBLE_RAM: case MBC5_RUMBLE_RAM_BATTERY:
+			_mapper = Mapper::MBC5; break;
+		default:
+			if(Log)
+				Log("Error: Cartridge format " + Hexa8(getType()).str() + " not supported!");
+			return false;
+	}
 
-	_ram_size = getRAMSize();
+	_ram_size = _mapper == Mapper::MBC2 ? 512 : getRAMSize();
 	
 	if(Log)
 	{
 		Log(" Title: '" + getName() +
-			"', Size: " + std::to_string(_data.size()) + "B (" + Hexa8(*(_data.data() + ROMSize)).str() +
-			"), RAM Size: " + std::to_string(_ram_size) + "B (" + Hexa8(*(_data.data() + RAMSize)).str() +
+			"', Size: " + std::to_string(_rom->size()) + "B (" + Hexa8(*(_rom->data() + ROMSize)).str() +
+			"), RAM Size: " + std::to_string(_ram_size) + "B (" + Hexa8(*(_rom->data() + RAMSize)).str() +
 			"), Type: " + Hexa8(getType()).str() +
 			", Battery: " + (hasBattery() ? "Yes" : "No"));
 
@@ -81,6 +106,15 @@ bool Cartridge::init()
 		}
 	}
 
+	// Whole banks only (at least two), so the current ones can always be accessed directly.
+	const size_t rom_size = std::max<size_t>(2 * 0x4000, (_rom->size() + 0x3FFF) & ~static_cast<size_t>(0x3FFF));
+	if(_rom->size() != rom_size)
+	{
+		std::vector<byte_t> data(_rom->data(), _rom->data() + _rom->size());
+		data.resize(rom_size, 0);
+		_rom = ROMImage::from_memory(std::move(data));
+	}
+
 	if(_ram_size == 0 && hasRAM())
 	{
 		if(Log)
@@ -90,158 +124,204 @@ bool Cartridge::init()
 
 	if(_ram_size > 0)
 	{
-		// Search for a saved RAM
-		if(hasBattery() && file_exists(save_path()))
+		std::string error;
+		if(hasBattery() && _save_mode == SaveMode::Mapped)
 		{
-			if(Log)
-				Log("Found a save file, loading it... ");
-			std::ifstream save(save_path(), std::ios::binary);
-			_ram.assign(std::istreambuf_iterator<byte_t>(save),
-						std::istreambuf_iterator<byte_t>());
-			if(Log)
-				Log("Done.");
-		} else {
-			_ram.clear();
-			_ram.resize(_ram_size, 0);
+			if(_ram.map(save_path(), _ram_size, error))
+			{
+				if(Log)
+					Log("Mapped the save file '" + save_path() + "'.");
+			} else if(Log) {
+				Log(" Warning: Couldn't map '" + save_path() + "' (" + error + "), saving in the background instead.");
+			}
 		}
+		if(!_ram.is_mapped())
+		{
+			_ram.allocate(_ram_size);
+			// Search for a saved RAM
+			if(hasBattery() && file_exists(save_path()))
+			{
+				if(Log)
+					Log("Found a save file, loading it... ");
+				std::ifstream save(save_path(), std::ios::binary);
+				save.read(_ram.data(), _ram.size());
+				if(Log)
+					Log("Done.");
+			}
+		}
+		if(_mapper == Mapper::MBC2) // Upper bits are always set
+			for(size_t i = 0; i < _ram.size(); ++i)
+				_ram[i] |= 0xF0;
+		if(hasBattery() && !_ram.is_mapped() && _save_mode != SaveMode::Sync)
+			_save_writer = std::make_shared<SaveWriter>(save_path(), _ram.data(), _ram.size());
 	}
+	_enable_ram = _mapper == Mapper::ROMOnly; // No register
+	update_banks();
 	return true;
 }
 
-byte_t Cartridge::read(addr_t addr) const
+void Cartridge::update_banks()
 {
-	if(addr < 0x4000) // ROM Bank 0
+	size_t rom_bank = _rom_bank;
+	size_t ram_bank = 0;
+	bool ram_mapped = !_ram.empty();
+	switch(_mapper)
 	{
-		//assert(addr < _data.size());
-		if(addr < _data.size())
-			return _data[addr];
-		else
-			return 0;
-	} else if(addr < 0x8000) { // Switchable ROM Bank
-		if(isMBC1() || isMBC2() || isMBC3())
-		{
-			size_t a = addr + static_cast<size_t>((rom_bank() & 0x7F) - 1) * 0x4000;
-			if(a < _data.size())
-				return _data[a];
-			else
-				return 0;
-		} else if(isMBC5()) {
-			return _data[addr + ((rom_bank() & 0x1FF) - 1) * 0x4000];
-		}
-	} else if(addr >= 0xA000 && addr < 0xC000) { // Switchable RAM Bank
-		if(isMBC1() || isMBC5())
-		{
-			size_t a = static_cast<size_t>(ram_bank() * 0x2000 + (addr & 0x1FFF));
-			if(a < _ram_size)
-				return _ram[a];
-			else
-				return 0;
-		} else if(isMBC3()) {
-			if(_ram_bank >= 0x8 && _ram_bank <= 0xC)
-				return _rtc_registers[_ram_bank - 0x8];
-			else
-				return _ram[_ram_bank * 0x2000 + (addr & 0x1FFF)];
-		} else if(isMBC2()) {
-			return _ram[addr & 0x1FF];
-		}
+		case Mapper::None: ram_mapped = false; break;
+		case Mapper::ROMOnly: rom_bank = 1; break;
+		case Mapper::MBC1:
+			rom_bank = (_rom_bank & 0x1F) | ((_ram_bank & 3) << 5);
+			ram_bank = _mode == 1 ? (_ram_bank & 3) : 0;
+			break;
+		case Mapper::MBC2: break;
+		case Mapper::MBC3:
+			ram_bank = _ram_bank;
+			ram_mapped = ram_mapped && _ram_bank < 0x08; // RTC registers
+			break;
+		case Mapper::MBC5: ram_bank = _ram_bank; break;
+	}
+
+	// Banks out of range are mirrored
+	const size_t rom_bank_count = _mapper == Mapper::None ? 0 : _rom->size() / 0x4000;
+	_current_rom_bank = rom_bank_count > 0 ? static_cast<int>(rom_bank % rom_bank_count) : 0;
+	_rom_bank_data[0] = rom_bank_count > 0 ? _rom->data() : EmptyBank;
+	_rom_bank_data[1] = rom_bank_count > 0 ? _rom->data() + _current_rom_bank * 0x4000 : EmptyBank;
+
+	if(_mapper == Mapper::MBC2)
+	{
+		_ram_mask = 0x01FF;
+		_ram_bank_offset = 0;
+	} else {
+		_ram_mask = 0x1FFF;
+		ram_mapped = ram_mapped && _ram.size() >= 0x2000; // 2kB RAM: see read_unmapped
+		_ram_bank_offset = ram_mapped ? (ram_bank % (_ram.size() / 0x2000)) * 0x2000 : 0;
 	}
+	_ram_mapped = ram_mapped;
+}
 
-	Log("Error: Wrong address queried to the Cartridge: " + Hexa(addr).str());
+byte_t Cartridge::read_unmapped(addr_t addr) const
+{
+	if(addr >= 0xA000 && addr < 0xC000)
+	{
+		if(_mapper == Mapper::MBC3 && _ram_bank >= 0x08 && _ram_bank <= 0x0C)
+			return _rtc_registers[_ram_bank - 0x08];
+		if((addr & 0x1FFF) < _ram.size())
+			return _ram[addr & 0x1FFF];
+		return 0;
+	}
+	if(Log)
+		Log("Error: Wrong address queried to the Cartridge: " + Hexa(addr).str());
 	return 0;
 }
 
+const byte_t* Cartridge::read_page(addr_t addr) const
+{
+	// Same mapping as read, for whole pages only.
+	if(addr < 0x8000)
+		return _rom_bank_data[addr >> 14] + (addr & 0x3FFF);
+	if(_ram_mapped && addr >= 0xA000 && addr < 0xC000)
+		return _ram.data() + _ram_bank_offset + (addr & _ram_mask);
+	return nullptr;
+}
+
+byte_t* Cartridge::write_page(addr_t addr)
+{
+	// Same mapping as write_ram (MBC2 RAM has to be masked), everything else is a MBC register.
+	if(!_enable_ram || !_ram_mapped || _mapper == Mapper::MBC2 || addr < 0xA000 || addr >= 0xC000)
+		return nullptr;
+	return _ram.data() + _ram_bank_offset + (addr & _ram_mask);
+}
+
 void Cartridge::write_ram(addr_t addr, byte_t value)
 {
-	if(_enable_ram)
+	if(!_enable_ram)
+		return;
+	if(_ram_mapped)
+		_ram[_ram_bank_offset + (addr & _ram_mask)] = _mapper == Mapper::MBC2 ? (value | 0xF0) : value;
+	else if(_mapper == Mapper::MBC3 && _ram_bank >= 0x08 && _ram_bank <= 0x0C)
+		_rtc_registers[_ram_bank - 0x08] = value;
+	else if((addr & 0x1FFF) < _ram.size())
+		_ram[addr & 0x1FFF] = value;
+}
+
+void Cartridge::write(addr_t addr, byte_t value)
+{
+	if(addr >= 0xA000 && addr < 0xC000) // External RAM
+	{
+		write_ram(addr, value);
+		return;
+	}
+	if(addr >= 0x8000)
+	{
+		if(Log)
+			Log("Error: Write on Cartridge on " + Hexa(addr).str());
+		return;
+	}
+	switch(_mapper)
 	{
-		assert(!_ram.empty());
-		assert(static_cast<size_t>(ram_bank() * 0x2000 + (addr & 0x1FFF)) < _ram_size);
-		_ram[ram_bank() * 0x2000 + (addr & 0x1FFF)] = value;
+		case Mapper::MBC1: write_mbc1(addr, value); break;
+		case Mapper::MBC2: write_mbc2(addr, value); break;
+		case Mapper::MBC3: write_mbc3(addr, value); break;
+		case Mapper::MBC5: write_mbc5(addr, value); break;
+		default: return; // No registers
 	}
+	update_banks();
 }
 
-void Cartridge::write(addr_t addr, byte_t value)
+void Cartridge::write_mbc1(addr_t addr, ubyte_t value)
 {
-	// MBC1/MBC3/MBC5 only for now
-	switch(addr & 0xF000)
+	switch(addr & 0xE000)
 	{
-		// External RAM Switch
-		case 0x0000:
-		case 0x1000:
-			_enable_ram = ((value & 0x0F) == 0x0A);
-		break;
-
-		// Select ROM bank (5 low bits)
-		case 0x2000:
-		case 0x3000:
-			if(isMBC1()) // lower 5 bits of the ROM Bank
-			{
-				value &= 0x1F;
-				if(value == 0) value = 1;
-				_rom_bank = value;
-			} else if(isMBC2()) {
-				_rom_bank = (value & 0x0F);
-			} else if(isMBC3()) {
-				if(value == 0) value = 1;
-				value &= 0x7F;
-				_rom_bank = value;
-			} else if(isMBC5()) {
-				if(addr < 0x3000) {	// Bits 0-7
-					_rom_bank = (_rom_bank & 0x100) | (value & 0xFF);
-				} else {			// Bit 8
-					if(getROMBankCount() >= 0x100)
-						_rom_bank = (_rom_bank & 0x0FF) | ((value & 0x01) ? 0x100 : 0);
-				}
-				assert(_rom_bank < 0x1E0 && _rom_bank < getROMBankCount());
-			}
-		break;
+		case 0x0000: _enable_ram = ((value & 0x0F) == 0x0A); break;
+		case 0x2000: _rom_bank = (value & 0x1F) == 0 ? 1 : (value & 0x1F); break; // Lower 5 bits of the ROM Bank
+		case 0x4000: _ram_bank = value & 3; break; // RAM bank and/or upper bits of the ROM Bank
+		case 0x6000: _mode = value & 1; break;
+	}
+}
 
-		case 0x4000:
-		case 0x5000:
-			if(isMBC1())
-			{
-				_ram_bank = value & 3; // Select RAM bank or upper bits of ROM Bank
-			} else if(isMBC3()) {
-				_ram_bank = value; // Select RAM bank OR RTC Register
-			} else if(isMBC5()) {
-				_ram_bank = value & 0x0F;
-			}
-		break;
+void Cartridge::write_mbc2(addr_t addr, ubyte_t value)
+{
+	if(addr >= 0x4000)
+		return;
+	if(addr & 0x0100) // Selected by the address bit 8
+		_rom_bank = (value & 0x0F) == 0 ? 1 : (value & 0x0F);
+	else
+		_enable_ram = ((value & 0x0F) == 0x0A);
+}
 
-		// Mode Switch
-		case 0x6000:
-		case 0x7000:
-			if(isMBC1())
-			{
-				_mode = value & 1;
-			} else if(isMBC3()) {
-				static bool zero_received = false;
-				if(value == 0)
-				{
-					zero_received = true;
-				} else if(zero_received && value == 1) {
-					latch_clock_data();
-					zero_received = false;
-				} else {
-					zero_received = false;
-				}
-			}
-		break;
-
-		// External RAM
-		case 0xA000:
-		case 0xB000:
-			if(isMBC1() || isMBC2() || _ram_bank <= 0x3 || isMBC5())
-				write_ram(addr, value);
-			else if(isMBC3())
-				_rtc_registers[_ram_bank - 0x8] = value;
-		break;
-		default:
-			Log("Error: Write on Cartridge on " + Hexa(addr).str());
-		break;
+void Cartridge::write_mbc3(addr_t addr, ubyte_t value)
+{
+	switch(addr & 0xE000)
+	{
+		case 0x0000: _enable_ram = ((value & 0x0F) == 0x0A); break;
+		case 0x2000: _rom_bank = (value & 0x7F) == 0 ? 1 : (value & 0x7F); break;
+		case 0x4000: _ram_bank = value; break; // Select RAM bank OR RTC Register
+		case 0x6000: // Latch Clock Data: 0x00 then 0x01
+			if(_rtc_latch && value == 1)
+				latch_clock_data();
+			_rtc_latch = (value == 0);
+			break;
+	}
+}
+
+void Cartridge::write_mbc5(addr_t addr, ubyte_t value)
+{
+	switch(addr & 0xF000)
+	{
+		case 0x0000: case 0x1000: _enable_ram = ((value & 0x0F) == 0x0A); break;
+		case 0x2000: _rom_bank = (_rom_bank & 0x100) | value; break;			// Bits 0-7
+		case 0x3000: _rom_bank = (_rom_bank & 0x0FF) | ((value & 1) << 8); break; // Bit 8
+		case 0x4000: case 0x5000: _ram_bank = value & 0x0F; break;
 	}
 }
 
+bool Cartridge::same_state(const Cartridge& c) const
+{
+	return _ram == c._ram && _rom_bank == c._rom_bank && _ram_bank == c._ram_bank &&
+		_enable_ram == c._enable_ram && _mode == c._mode && _rtc_latch == c._rtc_latch &&
+		std::memcmp(_rtc_registers, c._rtc_registers, sizeof(_rtc_registers)) == 0;
+}
+
 void Cartridge::latch_clock_data()
 {
 	auto t = std::chrono::system_clock::now();
@@ -264,7 +344,17 @@ bool Cartridge::file_exists(const std::string& path)
 
 std::string Cartridge::save_path() const
 {
-	if(_data.empty()) return "";
+	return file_path(".sav");
+}
+
+std::string Cartridge::idle_loops_path() const
+{
+	return file_path(".idle");
+}
+
+std::string Cartridge::file_path(const char* extension) const
+{
+	if(_rom->empty()) return "";
 	std::string n = getName();
 	n.erase(remove_if(n.begin(), n.end(), [](char c) { return !(c >= 48 && c < 122); }), n.end());
 	std::stringstream ss;
@@ -274,19 +364,33 @@ std::string Cartridge::save_path() const
 	ss << std::hex << getHeaderChecksum();
 	ss << '_';
 	ss << std::hex << getChecksum();
-	ss << ".sav";
+	ss << extension;
 	return config::to_abs(ss.str());
 }
 
 void Cartridge::save() const
 {
-	if(!hasBattery())
+	if(!hasBattery() || _ram.empty())
 		return;
 
+	if(_ram.is_mapped())
+	{
+		_ram.sync();
+		return;
+	}
+	if(_save_writer)
+	{
+		_save_writer->submit(_ram.data(), _ram.size());
+		const std::string error = _save_writer->take_error();
+		if(!error.empty() && Log)
+			Log(error);
+		return;
+	}
+
 	if(Log)
 		Log("Saving RAM to '" + save_path() + "'... ");
-	std::ofstream save(save_path(), std::ios::binary | std::ios::trunc);
-	save.write(_ram.data(), _ram.size());
+	std::string error;
+	const bool success = SaveWriter::write_file(save_path(), _ram.data(), _ram.size(), error);
 	if(Log)
-		Log("Done.");
+		Log(success ? "Done." : "Error: " + error);
 }
@@ -8,9 +8,15 @@
 #include <cassert>
 
 #include <Tools/Common.hpp>
+#include <Core/ROMImage.hpp>
+#include <Core/CartridgeRAM.hpp>
+
+class SaveWriter;
 
 /**
  * GameBoy Cartridge
+ *
+ * The ROM is a shared, read only ROMImage: Copies (save states...) only duplicate the mutable state.
 **/
 class Cartridge
 {
@@ -72,6 +78,25 @@ public:
 		Only		= 0xC0	// CGB only game
 	};
 	
+	/// Memory Bank Controller, resolved from the Type when loading (see write).
+	enum class Mapper : ubyte_t
+	{
+		None,		// No ROM, or unsupported type
+		ROMOnly,	// 32kB, optional RAM without banking
+		MBC1,
+		MBC2,		// Built-in 512 x 4 bits RAM
+		MBC3,		// RTC registers mapped as RAM banks 0x08 - 0x0C
+		MBC5
+	};
+	
+	/// How the battery backed RAM is persisted (see save).
+	enum class SaveMode : ubyte_t
+	{
+		Sync,			// Writes the file (atomically)
+		WriteBehind,	// Submits the changes to a SaveWriter, writing the file in the background
+		Mapped			// The file is the RAM (see CartridgeRAM::map), falls back to WriteBehind if it can't be mapped
+	};
+	
 	using LogFunc = std::function<void(const std::string&)>;
 	LogFunc Log = LogFunc{};
 	
@@ -83,14 +108,32 @@ public:
 
 	bool load(const std::string& path);
 	bool load_from_memory(const unsigned char data[], size_t size);
+	/// Same, without copying data.
+	bool load_from_memory(std::vector<byte_t>&& data);
 	void reset();
 
-	byte_t read(addr_t addr) const;
+	inline byte_t read(addr_t addr) const;
 	void write_ram(addr_t addr, byte_t value);
 	void write(addr_t addr, byte_t value);
+	
+	/**
+	 * Host memory mapped to the 256 bytes page starting at addr (see MMU::update_map),
+	 * nullptr if it has to be accessed through read/write (RTC registers, disabled RAM...).
+	 * Only valid until the next call to write.
+	**/
+	const byte_t* read_page(addr_t addr) const;
+	byte_t* write_page(addr_t addr);
+	/// Content of a 16kB ROM bank, regardless of the current mapping. nullptr if it doesn't exist.
+	inline const byte_t* rom_bank_data(size_t bank) const;
+	/// Position in the ROM data of addr (0x0000 - 0x7FFF) when bank is mapped in 0x4000 - 0x7FFF.
+	static inline uint32_t rom_offset(int bank, addr_t addr);
+	
+	/// Compares the mutable state (RAM, banks and RTC registers).
+	bool same_state(const Cartridge& c) const;
 
 	inline std::string getName() const;				///< @return Game name
 	inline Type getType() const;					///< @return Cartridge type (mapper)
+	inline Mapper getMapper() const { return _mapper; }
 	inline bool isMBC1() const;
 	inline bool isMBC2() const;
 	inline bool isMBC3() const;
@@ -98,6 +141,7 @@ public:
 	inline bool hasBattery() const;
 	inline size_t getROMSize() const;
 	inline size_t getROMBankCount() const;
+	inline int getCurrentROMBank() const;			///< @return ROM Bank currently mapped in 0x4000 - 0x7FFF
 	inline bool hasRAM() const;
 	inline size_t getRAMSize() const;
 	inline CGBFlag getCGBFlag() const;
@@ -105,29 +149,54 @@ public:
 	inline unsigned int getHeaderChecksum() const;
 
 	/**
-	 * Saves RAM to a file if a battery is present
+	 * Saves RAM to a file if a battery is present, see SaveMode.
+	 * Cheap unless in Sync mode: Can be called frequently to limit the progress lost on a crash.
 	**/
 	void save() const;
+	/// Applies to the next load.
+	inline void set_save_mode(SaveMode mode) { _save_mode = mode; }
+	inline SaveMode get_save_mode() const { return _save_mode; }
 	std::string save_path() const;
+	/// @return Path of the idle loops database of this ROM (see LR35902::load_idle_loops)
+	std::string idle_loops_path() const;
+	/// @return Path of a file associated to this ROM in the saves folder
+	std::string file_path(const char* extension) const;
 
 private:
-	std::vector<byte_t> _data;
-	std::vector<byte_t> _ram;
+	std::shared_ptr<const ROMImage> _rom = ROMImage::empty_image();
+	CartridgeRAM _ram;
+	Mapper		_mapper = Mapper::None;
+	SaveMode	_save_mode = SaveMode::Sync;
+	std::shared_ptr<SaveWriter>	_save_writer;	///< WriteBehind mode, shared with the copies (which never save)
 
+	// Mapper registers
 	size_t		_rom_bank = 1;
-	size_t		_ram_bank = 0;
+	size_t		_ram_bank = 0;			///< MBC1: Also the upper bits of the ROM bank
 	bool		_enable_ram = false;
 	size_t		_ram_size = 0;
-	byte_t		_mode = 0;				///< 0: ROM Banking Mode, 1: RAM Banking Mode
+	byte_t		_mode = 0;				///< MBC1 - 0: ROM Banking Mode, 1: RAM Banking Mode
+	bool		_rtc_latch = false;		///< MBC3: 0x00 written to 0x6000 - 0x7FFF, latching on the next 0x01
 
 	byte_t		_rtc_registers[5];
 
+	// Current mapping, derived from the registers by update_banks.
+	static const byte_t EmptyBank[0x4000];
+	const byte_t*	_rom_bank_data[2] = {EmptyBank, EmptyBank};	///< 0x0000 - 0x3FFF, 0x4000 - 0x7FFF (in _rom)
+	int				_current_rom_bank = 0;
+	bool			_ram_mapped = false;	///< Current RAM bank is in _ram (not RTC, disabled, or smaller than a bank)
+	size_t			_ram_bank_offset = 0;	///< Offset in _ram, rather than a pointer to keep copies valid
+	addr_t			_ram_mask = 0x1FFF;
+
+	void update_banks();
+	byte_t read_unmapped(addr_t addr) const;
+	void write_mbc1(addr_t addr, ubyte_t value);
+	void write_mbc2(addr_t addr, ubyte_t value);
+	void write_mbc3(addr_t addr, ubyte_t value);
+	void write_mbc5(addr_t addr, ubyte_t value);
+
 	void latch_clock_data();
 	static bool file_exists(const std::string& path);
 	
-	inline int rom_bank() const;
-	inline int ram_bank() const;
-	
 	bool init();
 };
 
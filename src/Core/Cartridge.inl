@@ -4,17 +4,17 @@
 
 inline std::string Cartridge::getName() const
 {
-	if(_data.empty()) return "";
+	if(_rom->empty()) return "";
 	unsigned int size = 0;
-	while(_data[Title + size] != 0 && size < 15)
+	while((*_rom)[Title + size] != 0 && size < 15)
 		++size;
-	return std::string(_data.data() + Title, size);
+	return std::string(_rom->data() + Title, size);
 }
 
 inline Cartridge::Type Cartridge::getType() const
 {
-	if(_data.empty()) return ROM;
-	return Type(*(_data.data() + CartType));
+	if(_rom->empty()) return ROM;
+	return Type(*(_rom->data() + CartType));
 }
 
 inline bool Cartridge::isMBC1() const
@@ -39,7 +39,7 @@ inline bool Cartridge::isMBC5() const
 
 inline bool Cartridge::hasBattery() const
 {
-	return !_data.empty() && one_of(getType(), 
+	return !_rom->empty() && one_of(getType(), 
 		MBC1_RAM_BATTERY, 
 		MBC2_BATTERY, 
 		ROM_RAM_BATTERY, 
@@ -53,9 +53,14 @@ inline bool Cartridge::hasBattery() const
 		HuC1_RAM_BATTERY);
 }
 
+inline int Cartridge::getCurrentROMBank() const
+{
+	return _current_rom_bank;
+}
+
 inline bool Cartridge::hasRAM() const
 {
-	return !_data.empty() && one_of(getType(),
+	return !_rom->empty() && one_of(getType(),
 		MBC1_RAM, 
 		MBC1_RAM_BATTERY, 
 		ROM_RAM, 			
@@ -76,7 +81,7 @@ inline bool Cartridge::hasRAM() const
 
 inline size_t Cartridge::getROMSize() const
 {
-	size_t s = *(_data.data() + ROMSize);
+	size_t s = *(_rom->data() + ROMSize);
 	if(s < 0x08) return (32 * 1024) << s;
 	switch(s)
 	{
@@ -93,10 +98,20 @@ inline size_t Cartridge::getROMBankCount() const
 	return getROMSize() / 0x4000;
 }
 
+inline const byte_t* Cartridge::rom_bank_data(size_t bank) const
+{
+	return (bank + 1) * 0x4000 <= _rom->size() ? _rom->data() + bank * 0x4000 : nullptr;
+}
+
+inline uint32_t Cartridge::rom_offset(int bank, addr_t addr)
+{
+	return addr < 0x4000 ? addr : static_cast<uint32_t>(bank) * 0x4000 + (addr & 0x3FFF);
+}
+
 inline size_t Cartridge::getRAMSize() const
 {
-	if(_data.empty()) return 0;
-	switch(*(_data.data() + RAMSize))
+	if(_rom->empty()) return 0;
+	switch(*(_rom->data() + RAMSize))
 	{
 		default:
 		case 0x00: return 0; break;
@@ -110,7 +125,8 @@ inline size_t Cartridge::getRAMSize() const
 
 inline Cartridge::CGBFlag Cartridge::getCGBFlag() const
 {
-	byte_t flag = *(_data.data() + HCGBFlag);
+	if(_rom->empty()) return No;
+	byte_t flag = *(_rom->data() + HCGBFlag);
 	if(!(flag & 0x80))
 		flag = 0;
 	return CGBFlag(flag);
@@ -118,38 +134,21 @@ inline Cartridge::CGBFlag Cartridge::getCGBFlag() const
 
 inline checksum_t Cartridge::getChecksum() const
 {
-	byte_t h = *(_data.data() + Checksum);
-	byte_t l = *(_data.data() + Checksum + 1);
+	byte_t h = *(_rom->data() + Checksum);
+	byte_t l = *(_rom->data() + Checksum + 1);
 	return (h << 8) | l;
 }
 
 inline unsigned int Cartridge::getHeaderChecksum() const
 {
-	return static_cast<unsigned int>(*(_data.data() + HeaderChecksum) & 0xFF);
+	return static_cast<unsigned int>(*(_rom->data() + HeaderChecksum) & 0xFF);
 }
 	
-inline int Cartridge::rom_bank() const
-{
-	if(isMBC1())
-	{
-		if(_mode == 0 && *(_data.data() + CartType) >= 0x05)
-			return _rom_bank | ((_ram_bank & 3) << 5);
-		else
-			return _rom_bank;
-	} else {
-		return _rom_bank;
-	}
-}
-
-inline int Cartridge::ram_bank() const
+inline byte_t Cartridge::read(addr_t addr) const
 {
-	if(isMBC1())
-	{
-		if(_mode == 1)
-			return _ram_bank;
-		else
-			return 0;
-	} else {
-		return _ram_bank;
-	}
+	if(addr < 0x8000)
+		return _rom_bank_data[addr >> 14][addr & 0x3FFF];
+	if(_ram_mapped && addr >= 0xA000 && addr < 0xC000)
+		return _ram[_ram_bank_offset + (addr & _ram_mask)];
+	return read_unmapped(addr);
 }
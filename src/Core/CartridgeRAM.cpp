@@ -0,0 +1,109 @@
+#include "CartridgeRAM.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+CartridgeRAM::CartridgeRAM(const CartridgeRAM& ram) :
+	_buffer(ram._data, ram._data + ram._size)
+{
+	_data = _buffer.data();
+	_size = _buffer.size();
+}
+
+CartridgeRAM& CartridgeRAM::operator=(const CartridgeRAM& ram)
+{
+	if(this == &ram)
+		return *this;
+	if(_size != ram._size)
+	{
+		clear();
+		_buffer.assign(ram._data, ram._data + ram._size);
+		_data = _buffer.data();
+		_size = _buffer.size();
+	} else if(_size > 0) {
+		std::memcpy(_data, ram._data, _size);
+	}
+	return *this;
+}
+
+CartridgeRAM::~CartridgeRAM()
+{
+	clear();
+}
+
+void CartridgeRAM::allocate(size_t size)
+{
+	clear();
+	_buffer.assign(size, 0);
+	_data = _buffer.data();
+	_size = size;
+}
+
+bool CartridgeRAM::map(const std::string& path, size_t size, std::string& error)
+{
+	clear();
+#ifdef _WIN32
+	(void) path;
+	(void) size;
+	error = "Mapped saves aren't supported on Windows.";
+	return false;
+#else
+	// Only a new file is sized: An existing save of another size is left as it is.
+	int fd = ::open(path.c_str(), O_RDWR);
+	const bool created = fd < 0 && errno == ENOENT && (fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644)) >= 0;
+	if(fd < 0)
+	{
+		error = std::strerror(errno);
+		return false;
+	}
+	struct stat st;
+	void* mapping = MAP_FAILED;
+	if(fstat(fd, &st) != 0 || (created && ftruncate(fd, size) != 0))
+		error = std::strerror(errno);
+	else if(!created && static_cast<size_t>(st.st_size) != size)
+		error = "file of " + std::to_string(st.st_size) + " bytes, expected " + std::to_string(size);
+	else if((mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		error = std::strerror(errno);
+	::close(fd); // The mapping keeps the file
+	if(mapping == MAP_FAILED)
+		return false;
+	_mapping = mapping;
+	_data = static_cast<byte_t*>(mapping);
+	_size = size;
+	return true;
+#endif
+}
+
+void CartridgeRAM::clear()
+{
+#ifndef _WIN32
+	if(_mapping)
+		munmap(_mapping, _size);
+#endif
+	_mapping = nullptr;
+	_buffer.clear();
+	_buffer.shrink_to_fit();
+	_data = nullptr;
+	_size = 0;
+}
+
+void CartridgeRAM::sync() const
+{
+#ifndef _WIN32
+	if(_mapping)
+		msync(_mapping, _size, MS_ASYNC);
+#endif
+}
+
+bool CartridgeRAM::operator==(const CartridgeRAM& ram) const
+{
+	return _size == ram._size && (_size == 0 || std::memcmp(_data, ram._data, _size) == 0);
+}
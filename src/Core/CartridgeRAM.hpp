@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <Tools/Common.hpp>
+
+/**
+ * External RAM of a Cartridge: Owned memory, or a file mapped as its backing store
+ * (see Cartridge::SaveMode::Mapped), persisted by the system as it is written even if the emulator crashes.
+ *
+ * Copies (save states...) always own their memory. Assigning copies the content in place (into the mapped file)
+ * if the size matches, keeping data() valid.
+**/
+class CartridgeRAM
+{
+public:
+	CartridgeRAM() =default;
+	CartridgeRAM(const CartridgeRAM& ram);
+	CartridgeRAM& operator=(const CartridgeRAM& ram);
+	~CartridgeRAM();
+
+	/// Owned memory of size bytes, set to 0.
+	void allocate(size_t size);
+	/**
+	 * Maps the file at path, created with size bytes if it doesn't exist.
+	 * @return false on error (described by error, only supported on POSIX systems), leaving the RAM empty.
+	 *         An existing file of another size is an error: It isn't modified.
+	**/
+	bool map(const std::string& path, size_t size, std::string& error);
+	void clear();
+	/// Starts writing the modified pages of the mapped file to the disk, without waiting.
+	void sync() const;
+
+	inline bool is_mapped() const { return _mapping != nullptr; }
+	inline byte_t* data() { return _data; }
+	inline const byte_t* data() const { return _data; }
+	inline size_t size() const { return _size; }
+	inline bool empty() const { return _size == 0; }
+	inline byte_t& operator[](size_t i) { return _data[i]; }
+	inline const byte_t& operator[](size_t i) const { return _data[i]; }
+	bool operator==(const CartridgeRAM& ram) const;
+
+private:
+	byte_t*				_data = nullptr;
+	size_t				_size = 0;
+	std::vector<byte_t>	_buffer;			///< Owned memory
+	void*				_mapping = nullptr;
+};
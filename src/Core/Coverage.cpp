@@ -0,0 +1,91 @@
+#include "Coverage.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace
+{
+	constexpr char		CoverageMagic[8] = {'S', 'B', 'C', 'O', 'D', 'E', '\0', '\0'};
+	constexpr uint32_t	CoverageVersion = 1;
+
+	struct CoverageHeader
+	{
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	indirect_count;
+		uint64_t	words;
+	};
+}
+
+void CodeCoverage::indirect_jump(int source_bank, addr_t source, int target_bank, addr_t target)
+{
+	if(source_bank < 0 || source >= 0x8000 || target_bank < 0 || target >= 0x8000)
+		return;
+	_indirect.insert(static_cast<uint64_t>(Cartridge::rom_offset(source_bank, source)) << 32 |
+					 Cartridge::rom_offset(target_bank, target));
+}
+
+size_t CodeCoverage::get_executed_count() const
+{
+	size_t r = 0;
+	for(uint64_t w : _executed)
+		r += __builtin_popcountll(w);
+	return r;
+}
+
+std::vector<CodeCoverage::IndirectJump> CodeCoverage::get_indirect_jumps() const
+{
+	std::vector<IndirectJump> r;
+	r.reserve(_indirect.size());
+	for(uint64_t j : _indirect)
+		r.push_back(IndirectJump{static_cast<Offset>(j >> 32), static_cast<Offset>(j)});
+	std::sort(r.begin(), r.end(), [](const IndirectJump& l, const IndirectJump& r) {
+		return l.source < r.source || (l.source == r.source && l.target < r.target);
+	});
+	return r;
+}
+
+void CodeCoverage::clear()
+{
+	_executed.clear();
+	_indirect.clear();
+}
+
+bool CodeCoverage::save(const std::string& path) const
+{
+	std::ofstream file(path, std::ios::binary);
+	if(!file)
+		return false;
+	CoverageHeader header;
+	std::memcpy(header.magic, CoverageMagic, sizeof(CoverageMagic));
+	header.version = CoverageVersion;
+	header.indirect_count = static_cast<uint32_t>(_indirect.size());
+	header.words = _executed.size();
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(_executed.data()), _executed.size() * sizeof(uint64_t));
+	for(const IndirectJump& j : get_indirect_jumps())
+		file.write(reinterpret_cast<const char*>(&j), sizeof(j));
+	return static_cast<bool>(file);
+}
+
+bool CodeCoverage::load(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	CoverageHeader header;
+	if(!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		std::memcmp(header.magic, CoverageMagic, sizeof(CoverageMagic)) != 0 ||
+		header.version != CoverageVersion)
+		return false;
+	std::vector<uint64_t> executed(header.words);
+	if(!file.read(reinterpret_cast<char*>(executed.data()), executed.size() * sizeof(uint64_t)))
+		return false;
+	if(_executed.size() < executed.size())
+		_executed.resize(executed.size(), 0);
+	for(size_t i = 0; i < executed.size(); ++i)
+		_executed[i] |= executed[i];
+	IndirectJump j;
+	for(uint32_t i = 0; i < header.indirect_count && file.read(reinterpret_cast<char*>(&j), sizeof(j)); ++i)
+		_indirect.insert(static_cast<uint64_t>(j.source) << 32 | j.target);
+	return true;
+}
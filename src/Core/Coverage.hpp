@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <Core/Cartridge.hpp>
+
+/**
+ * Code executed from ROM, recorded by the CPU while enabled (see LR35902::coverage): A bit per ROM byte
+ * for each executed instruction, and the destinations taken by the indirect jumps (JP (HL): jump tables,
+ * calls through a trampoline...), which static analysis can't follow (see Analyser::process).
+ *
+ * Locations are ROM offsets (see Cartridge::rom_offset). Code running from RAM or the boot ROM isn't recorded.
+**/
+class CodeCoverage
+{
+public:
+	using Offset = uint32_t;
+
+	struct IndirectJump
+	{
+		Offset	source;
+		Offset	target;
+	};
+
+	bool	enabled = false;
+
+	/// Marks the instruction at addr, with bank mapped in 0x4000 - 0x7FFF (see MMU::code_bank).
+	inline void executed(int bank, addr_t addr)
+	{
+		if(bank < 0 || addr >= 0x8000)
+			return;
+		const Offset o = Cartridge::rom_offset(bank, addr);
+		if(o / 64 >= _executed.size())
+			_executed.resize(o / 64 + 1, 0);
+		_executed[o / 64] |= uint64_t(1) << (o % 64);
+	}
+	/// Indirect jump between two ROM locations (others are ignored).
+	void indirect_jump(int source_bank, addr_t source, int target_bank, addr_t target);
+
+	inline bool is_executed(Offset o) const { return o / 64 < _executed.size() && (_executed[o / 64] >> (o % 64)) & 1; }
+	size_t get_executed_count() const;
+	inline size_t get_indirect_jump_count() const { return _indirect.size(); }
+	/// Bit per ROM byte, may be shorter than the ROM.
+	inline const std::vector<uint64_t>& get_executed() const { return _executed; }
+	std::vector<IndirectJump> get_indirect_jumps() const;
+
+	inline bool empty() const { return _executed.empty() && _indirect.empty(); }
+	void clear();
+
+	/**
+	 * Writes the coverage to a binary file: 'SBCODE' magic, version, bitmap length (in 64 bits words)
+	 * and indirect jumps count, followed by the bitmap and the jumps (little endian).
+	**/
+	bool save(const std::string& path) const;
+	/// Adds the coverage saved in path (by a previous run of the same ROM, see Cartridge::file_path).
+	bool load(const std::string& path);
+
+private:
+	std::vector<uint64_t>		_executed;
+	std::unordered_set<uint64_t>	_indirect;	///< source << 32 | target
+};
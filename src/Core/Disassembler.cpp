@@ -0,0 +1,214 @@
+#include "Disassembler.hpp"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <Core/Cartridge.hpp>
+#include <Core/LR35902.hpp>
+
+namespace
+{
+	using Info = Disassembler::Info;
+	using Operand = DisassembledInstr::Operand;
+	using Indirect = DisassembledInstr::Indirect;
+	using Flow = DisassembledInstr::Flow;
+
+	inline bool starts_with(const std::string& s, const char* prefix)
+	{
+		return s.compare(0, std::strlen(prefix), prefix) == 0;
+	}
+
+	Info make_info(uint16_t id)
+	{
+		const bool cb = id & 0x100;
+		const std::string& str = cb ? LR35902::instr_cb_str[id & 0xFF] : LR35902::instr_str[id];
+		Info i{};
+		i.length = cb ? 2 : static_cast<word_t>(std::max<size_t>(1, LR35902::instr_length[id]));
+		if(id == 0xCB)
+			i.length = 2;
+
+		i.operand = str.find("d16") != std::string::npos ? Operand::D16 :
+					str.find("a16") != std::string::npos ? Operand::A16 :
+					str.find("d8") != std::string::npos ? Operand::D8 :
+					str.find("a8") != std::string::npos ? Operand::A8 :
+					str.find("SP+r8") != std::string::npos || str.find("SP,r8") != std::string::npos ? Operand::SPOffset :
+					str.find("r8") != std::string::npos ? Operand::R8 : Operand::None;
+		// 'JP (HL)' jumps to HL, it doesn't access (HL).
+		i.indirect = id == 0xE9 ? Indirect::None :
+					 str.find("(BC)") != std::string::npos ? Indirect::BC :
+					 str.find("(DE)") != std::string::npos ? Indirect::DE :
+					 str.find("(HL") != std::string::npos ? Indirect::HL :
+					 str.find("(C)") != std::string::npos ? Indirect::C : Indirect::None;
+
+		if(cb)
+			return i;
+		if(str == "_")
+			i.flow = Flow::Invalid;
+		else if(starts_with(str, "JP") || starts_with(str, "JR"))
+			i.flow = Flow::Jump;
+		else if(starts_with(str, "CALL") || starts_with(str, "RST"))
+			i.flow = Flow::Call;
+		else if(starts_with(str, "RET"))
+			i.flow = Flow::Return;
+		// 'JP NZ,a16', 'RET C'... but not 'JP (HL)' or 'RETI'
+		i.conditional = (one_of(i.flow, Flow::Jump, Flow::Call) && str.find(',') != std::string::npos) ||
+						(i.flow == Flow::Return && str.find(' ') != std::string::npos);
+		if(starts_with(str, "RST"))
+			i.restart = static_cast<addr_t>(std::strtoul(str.c_str() + 4, nullptr, 16));
+		return i;
+	}
+
+	/// Appends to a fixed-size buffer, always null-terminated.
+	struct Writer
+	{
+		char*	buf;
+		size_t	size;
+		size_t	length = 0;
+
+		void put(char c)
+		{
+			if(length + 1 < size)
+				buf[length++] = c;
+		}
+
+		void put(const char* s)
+		{
+			while(*s)
+				put(*s++);
+		}
+
+		void hex(unsigned int v, int digits)
+		{
+			static const char digit[] = "0123456789ABCDEF";
+			for(int d = digits - 1; d >= 0; --d)
+				put(digit[(v >> (4 * d)) & 0xF]);
+		}
+	};
+}
+
+const Disassembler::Info& Disassembler::info(uint16_t id)
+{
+	static const std::vector<Info> table = [] {
+		std::vector<Info> t;
+		t.reserve(0x200);
+		for(uint16_t id = 0; id < 0x200; ++id)
+			t.push_back(make_info(id));
+		return t;
+	}();
+	return table[id & 0x1FF];
+}
+
+const char* DisassembledInstr::mnemonic() const
+{
+	return (id & 0x100) ? LR35902::instr_cb_str[id & 0xFF].c_str() : LR35902::instr_str[id].c_str();
+}
+
+DisassembledInstr Disassembler::decode(const word_t* bytes, size_t size, addr_t addr)
+{
+	DisassembledInstr r;
+	r.addr = addr;
+	if(size == 0)
+	{
+		r.flow = Flow::Invalid;
+		return r;
+	}
+
+	r.id = bytes[0];
+	if(r.id == 0xCB)
+		r.id = 0x100 | (size > 1 ? bytes[1] : 0);
+	const Info& i = info(r.id);
+	r.length = i.length;
+	r.operand = i.operand;
+	r.indirect = i.indirect;
+	r.flow = i.flow;
+	r.conditional = i.conditional;
+
+	if(i.operand != Operand::None)
+		r.value = (size > 1 ? bytes[1] : 0) | ((i.length > 2 && size > 2) ? (static_cast<addr_t>(bytes[2]) << 8) : 0);
+	switch(i.operand)
+	{
+		case Operand::A8: r.target = 0xFF00 | r.value; r.has_target = true; break;
+		case Operand::A16: r.target = r.value; r.has_target = true; break;
+		case Operand::R8: r.target = static_cast<addr_t>(addr + 2 + r.offset()); r.has_target = true; break;
+		default: break;
+	}
+	if(r.flow == Flow::Call && !r.has_target)
+	{
+		r.target = i.restart;
+		r.has_target = true;
+	}
+	return r;
+}
+
+void Disassembler::decode_range(const word_t* bytes, size_t size, addr_t addr, std::vector<DisassembledInstr>& out)
+{
+	out.clear();
+	for(size_t offset = 0; offset < size; offset += out.back().length)
+		out.push_back(decode(bytes + offset, size - offset, static_cast<addr_t>(addr + offset)));
+}
+
+bool Disassembler::decode_bank(const Cartridge& cartridge, size_t bank, std::vector<DisassembledInstr>& out)
+{
+	const byte_t* data = cartridge.rom_bank_data(bank);
+	if(data == nullptr)
+	{
+		out.clear();
+		return false;
+	}
+	decode_range(reinterpret_cast<const word_t*>(data), 0x4000, bank == 0 ? 0x0000 : 0x4000, out);
+	return true;
+}
+
+size_t Disassembler::format(const DisassembledInstr& instr, char* buf, size_t size, const char* target_name)
+{
+	if(size == 0)
+		return 0;
+	Writer w{buf, size};
+	const char* s = instr.mnemonic();
+	while(*s)
+	{
+		// Operand placeholders are the only lowercase characters (see LR35902::instr_str).
+		if(!std::islower(static_cast<unsigned char>(*s)))
+		{
+			w.put(*s++);
+			continue;
+		}
+		const bool d16 = std::strncmp(s, "d16", 3) == 0, a16 = std::strncmp(s, "a16", 3) == 0;
+		const bool d8 = std::strncmp(s, "d8", 2) == 0, a8 = std::strncmp(s, "a8", 2) == 0, r8 = std::strncmp(s, "r8", 2) == 0;
+		if((a16 || a8 || r8) && target_name != nullptr && instr.operand != Operand::SPOffset)
+		{
+			w.put(target_name);
+		} else if(d16 || a16) {
+			w.put('$');
+			w.hex(instr.value, 4);
+		} else if(d8) {
+			w.put('$');
+			w.hex(instr.value & 0xFF, 2);
+		} else if(a8) {
+			w.put("$FF");
+			w.hex(instr.value & 0xFF, 2);
+		} else if(r8 && instr.operand == Operand::R8) {
+			w.put('$');
+			w.hex(instr.target, 4);
+		} else if(r8) {
+			// 'SP+r8' becomes 'SP-2' for negative offsets.
+			if(instr.offset() < 0)
+			{
+				if(w.length > 0 && buf[w.length - 1] == '+')
+					--w.length;
+				w.put('-');
+			}
+			char n[4];
+			std::snprintf(n, sizeof(n), "%d", std::abs(instr.offset()));
+			w.put(n);
+		} else {
+			w.put(*s++);
+			continue;
+		}
+		s += (d16 || a16) ? 3 : 2;
+	}
+	buf[w.length] = '\0';
+	return w.length;
+}
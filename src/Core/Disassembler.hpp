@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <Tools/Common.hpp>
+
+class Cartridge;
+
+/**
+ * Decoded CPU instruction, see Disassembler.
+**/
+struct DisassembledInstr
+{
+	enum class Operand : word_t
+	{
+		None,
+		D8,			///< 8 bits immediate
+		D16,		///< 16 bits immediate
+		A8,			///< 0xFF00 + 8 bits (LDH), see target
+		A16,		///< 16 bits address (loads, jumps and calls), see target
+		R8,			///< Signed 8 bits relative jump, see target
+		SPOffset	///< Signed 8 bits added to SP (ADD SP,r8 and LD HL,SP+r8)
+	};
+
+	/// Memory accessed through a register.
+	enum class Indirect : word_t { None, BC, DE, HL, C };
+
+	enum class Flow : word_t
+	{
+		Next,		///< Continues with the following instruction
+		Jump,		///< JP/JR, to target (JP (HL) has none)
+		Call,		///< CALL/RST, to target
+		Return,		///< RET/RETI
+		Invalid		///< Unused opcode (locks the CPU)
+	};
+
+	addr_t		addr = 0;
+	uint16_t	id = 0;			///< Mnemonic: Opcode, or 0x100 | opcode following a 0xCB prefix (see mnemonic)
+	word_t		length = 1;		///< In bytes
+	Operand		operand = Operand::None;
+	Indirect	indirect = Indirect::None;
+	Flow		flow = Flow::Next;
+	bool		conditional = false;
+	bool		has_target = false;
+	addr_t		value = 0;		///< Immediate operand as encoded
+	addr_t		target = 0;		///< Jump/call destination, or address of an A8/A16 operand
+
+	inline word_t opcode() const { return (id & 0x100) ? 0xCB : static_cast<word_t>(id); }
+	/// Template of the instruction (see LR35902::instr_str), e.g. 'LD A,(a16)'.
+	const char* mnemonic() const;
+	/// Signed value of R8 and SPOffset operands.
+	inline int offset() const { return static_cast<int8_t>(value & 0xFF); }
+};
+
+/**
+ * Decodes instructions to plain structures and formats them to text, without any allocation:
+ * decode and decode_range are meant to be called on every frame by the debug views.
+ *
+ * Immediate values are formatted as '$XXXX', relative jumps with their destination.
+**/
+class Disassembler
+{
+public:
+	/// Operand, flow... of each mnemonic id (see DisassembledInstr::id), computed once from LR35902::instr_str.
+	struct Info
+	{
+		word_t							length;
+		DisassembledInstr::Operand		operand;
+		DisassembledInstr::Indirect		indirect;
+		DisassembledInstr::Flow			flow;
+		bool							conditional;
+		addr_t							restart;	///< RST destination
+	};
+	static const Info& info(uint16_t id);
+
+	/// @param read Any callable returning the byte at an address (e.g. MMU::read).
+	template<typename Read>
+	static DisassembledInstr decode(addr_t addr, Read&& read);
+	/// Instruction at addr, encoded at bytes (up to size bytes readable).
+	static DisassembledInstr decode(const word_t* bytes, size_t size, addr_t addr);
+
+	/**
+	 * Linear sweep of size bytes (data is decoded as well) mapped at addr.
+	 * @param out Cleared, its capacity is reused.
+	**/
+	static void decode_range(const word_t* bytes, size_t size, addr_t addr, std::vector<DisassembledInstr>& out);
+	/// Whole ROM bank, mapped at 0x0000 (bank 0) or 0x4000. @return false if the bank doesn't exist.
+	static bool decode_bank(const Cartridge& cartridge, size_t bank, std::vector<DisassembledInstr>& out);
+
+	/**
+	 * Writes the instruction (e.g. 'LD A,($C000)', 'JR NZ,$0150') to buf, always null-terminated.
+	 * @param target_name Replaces the target (e.g. a label) if not nullptr.
+	 * @return Length of the text (truncated to size - 1).
+	**/
+	static size_t format(const DisassembledInstr& instr, char* buf, size_t size, const char* target_name = nullptr);
+};
+
+template<typename Read>
+DisassembledInstr Disassembler::decode(addr_t addr, Read&& read)
+{
+	word_t bytes[3];
+	bytes[0] = read(addr);
+	const size_t length = bytes[0] == 0xCB ? 2 : std::max<size_t>(1, info(bytes[0]).length);
+	for(size_t i = 1; i < length; ++i)
+		bytes[i] = read(static_cast<addr_t>(addr + i));
+	return decode(bytes, length, addr);
+}
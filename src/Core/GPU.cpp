@@ -1,8 +1,210 @@
 #include "GPU.hpp"
 
-#include <list>
+#include <algorithm>
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+#elif defined(__SSSE3__)
+	#include <tmmintrin.h>
+#elif defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
 
 constexpr word_t GPU::Colors[4];
+constexpr unsigned int GPU::ModeCycles[4];
+
+// Scanline compositing, 8 pixels (one tile row) at a time.
+// Vectorized with AVX2 or SSE2 depending on the target of the build, the scalar
+// versions are the reference (see GPU::vectorized).
+namespace
+{
+
+/// out[i] = palette[indices[i]]
+template<bool Vectorized>
+inline void lookup8(const word_t* indices, const color_t* palette, color_t* out)
+{
+#if defined(__AVX2__)
+	if(Vectorized)
+	{
+		// Indices are < 4: Only the low lane of the palette is used.
+		const __m256i pal = _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(palette)));
+		const __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permutevar8x32_epi32(pal, idx));
+		return;
+	}
+#elif defined(__SSE2__)
+	if(Vectorized)
+	{
+		// No variable shuffle in SSE2: Selects each palette entry by comparison.
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i idx16 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices)), zero);
+		const __m128i idx[2] = {_mm_unpacklo_epi16(idx16, zero), _mm_unpackhi_epi16(idx16, zero)};
+		int colors[4];
+		std::memcpy(colors, palette, sizeof(colors));
+		for(int h = 0; h < 2; ++h)
+		{
+			__m128i r = zero;
+			for(int c = 0; c < 4; ++c)
+				r = _mm_or_si128(r, _mm_and_si128(_mm_cmpeq_epi32(idx[h], _mm_set1_epi32(c)), _mm_set1_epi32(colors[c])));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * h), r);
+		}
+		return;
+	}
+#endif
+	for(int i = 0; i < 8; ++i)
+		out[i] = palette[indices[i]];
+}
+
+/// out[i] = palette[indices[i]] (RGB565 format)
+template<bool Vectorized>
+inline void lookup8(const word_t* indices, const uint16_t* palette, uint16_t* out)
+{
+#if defined(__SSSE3__)
+	if(Vectorized)
+	{
+		// The palette fits in 8 bytes: Pixel i takes its bytes 2 * indices[i] and 2 * indices[i] + 1.
+		const __m128i pal = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(palette));
+		const __m128i idx16 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices)), _mm_setzero_si128());
+		const __m128i low = _mm_add_epi16(idx16, idx16);
+		const __m128i bytes = _mm_or_si128(low, _mm_slli_epi16(_mm_add_epi16(low, _mm_set1_epi16(1)), 8));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(pal, bytes));
+		return;
+	}
+#elif defined(__SSE2__)
+	if(Vectorized)
+	{
+		const __m128i idx = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices)), _mm_setzero_si128());
+		__m128i r = _mm_setzero_si128();
+		for(int c = 0; c < 4; ++c)
+			r = _mm_or_si128(r, _mm_and_si128(_mm_cmpeq_epi16(idx, _mm_set1_epi16(c)), _mm_set1_epi16(static_cast<short>(palette[c]))));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), r);
+		return;
+	}
+#endif
+	for(int i = 0; i < 8; ++i)
+		out[i] = palette[indices[i]];
+}
+
+/// out[i] = base + indices[i]
+template<bool Vectorized>
+inline void offset8(const word_t* indices, word_t base, word_t* out)
+{
+#if defined(__SSE2__)
+	if(Vectorized)
+	{
+		const __m128i idx = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_add_epi8(idx, _mm_set1_epi8(static_cast<char>(base))));
+		return;
+	}
+#endif
+	for(int i = 0; i < 8; ++i)
+		out[i] = base + indices[i];
+}
+
+// A sprite pixel is drawn if it isn't transparent (color 0), and if the sprite has the priority over
+// the BG (see GPU::OAMOption::Priority, GPU::BGMapAttribute::BGtoOAMPriority) or the BG pixel is transparent.
+
+inline bool sprite_visible(word_t color, bool bg_no_priority, bool behind_bg, word_t bg_index, word_t bg_priority)
+{
+	const bool over_bg = (!bg_priority && !behind_bg) || bg_index == 0;
+	return color != 0 && (bg_no_priority || over_bg);
+}
+
+#if defined(__SSE2__)
+/// @return 0xFF for each of the 8 pixels of the sprite row to draw (low half), see sprite_visible
+inline __m128i sprite_mask(const word_t* row, bool bg_no_priority, bool behind_bg, const word_t* bg_indices, const word_t* bg_priorities)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_cmpeq_epi8(zero, zero);
+	const __m128i transparent = _mm_cmpeq_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row)), zero);
+	__m128i mask = _mm_andnot_si128(transparent, ones);
+	if(!bg_no_priority)
+	{
+		const __m128i bg_transparent = _mm_cmpeq_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(bg_indices)), zero);
+		const __m128i over_bg = behind_bg ? bg_transparent :
+			_mm_or_si128(_mm_andnot_si128(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(bg_priorities)), ones), bg_transparent);
+		mask = _mm_and_si128(mask, over_bg);
+	}
+	return mask;
+}
+#endif
+
+#if defined(__SSE2__)
+/// colors[i] = mask[i] ? sprite[i] : colors[i], with a mask from sprite_mask.
+inline void blend8(__m128i mask, const color_t* sprite, color_t* colors)
+{
+#if defined(__AVX2__)
+	const __m256i mask32 = _mm256_cvtepi8_epi32(mask);
+	__m256i* dst = reinterpret_cast<__m256i*>(colors);
+	_mm256_storeu_si256(dst, _mm256_blendv_epi8(_mm256_loadu_si256(dst),
+		_mm256_load_si256(reinterpret_cast<const __m256i*>(sprite)), mask32));
+#else
+	const __m128i mask16 = _mm_unpacklo_epi8(mask, mask);
+	const __m128i mask32[2] = {_mm_unpacklo_epi16(mask16, mask16), _mm_unpackhi_epi16(mask16, mask16)};
+	for(int h = 0; h < 2; ++h)
+	{
+		__m128i* dst = reinterpret_cast<__m128i*>(colors + 4 * h);
+		const __m128i src = _mm_load_si128(reinterpret_cast<const __m128i*>(sprite + 4 * h));
+		_mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(mask32[h], src), _mm_andnot_si128(mask32[h], _mm_loadu_si128(dst))));
+	}
+#endif
+}
+
+/// RGB565 format
+inline void blend8(__m128i mask, const uint16_t* sprite, uint16_t* colors)
+{
+	const __m128i mask16 = _mm_unpacklo_epi8(mask, mask);
+	__m128i* dst = reinterpret_cast<__m128i*>(colors);
+	const __m128i src = _mm_load_si128(reinterpret_cast<const __m128i*>(sprite));
+	_mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(mask16, src), _mm_andnot_si128(mask16, _mm_loadu_si128(dst))));
+}
+#endif
+
+/// Draws a sprite row over the line colors (color_t, or uint16_t in the RGB565 format).
+template<bool Vectorized, typename Pixel>
+inline void merge_sprite(const word_t* row, const Pixel* palette, bool bg_no_priority, bool behind_bg,
+						 const word_t* bg_indices, const word_t* bg_priorities, Pixel* colors)
+{
+	alignas(32) Pixel sprite[8];
+	lookup8<Vectorized>(row, palette, sprite);
+#if defined(__SSE2__)
+	if(Vectorized)
+	{
+		blend8(sprite_mask(row, bg_no_priority, behind_bg, bg_indices, bg_priorities), sprite, colors);
+		return;
+	}
+#endif
+	for(int x = 0; x < 8; ++x)
+		if(sprite_visible(row[x], bg_no_priority, behind_bg, bg_indices[x], bg_priorities[x]))
+			colors[x] = sprite[x];
+}
+
+/// Draws a sprite row over the line palette indices (base + color).
+template<bool Vectorized>
+inline void merge_sprite(const word_t* row, word_t base, bool bg_no_priority, bool behind_bg,
+						 const word_t* bg_indices, const word_t* bg_priorities, word_t* indices)
+{
+#if defined(__SSE2__)
+	if(Vectorized)
+	{
+		const __m128i mask = sprite_mask(row, bg_no_priority, behind_bg, bg_indices, bg_priorities);
+		const __m128i src = _mm_add_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row)), _mm_set1_epi8(static_cast<char>(base)));
+		__m128i* dst = reinterpret_cast<__m128i*>(indices);
+		_mm_storel_epi64(dst, _mm_or_si128(_mm_and_si128(mask, src), _mm_andnot_si128(mask, _mm_loadl_epi64(dst))));
+		return;
+	}
+#endif
+	for(int x = 0; x < 8; ++x)
+		if(sprite_visible(row[x], bg_no_priority, behind_bg, bg_indices[x], bg_priorities[x]))
+			indices[x] = base + row[x];
+}
+
+inline uint16_t to_rgb565(const color_t& c)
+{
+	return static_cast<uint16_t>(((c.r >> 3) << 11) | ((c.g >> 2) << 5) | (c.b >> 3));
+}
+
+}
 
 GPU::GPU(MMU& mmu) :
 	_mmu(&mmu),
@@ -18,7 +220,7 @@ GPU::GPU(const GPU& gpu) :
 
 void GPU::reset()
 {
-	std::memset(_screen.get(), 0xFF, ScreenWidth * ScreenHeight * sizeof(color_t));
+	clear_screen();
 	
 	get_line() = get_scroll_x() = get_scroll_y() = get_bgp() = get_lcdstat() = _cycles = 0;
 	get_lcdc() = 0x91;
@@ -26,40 +228,155 @@ void GPU::reset()
 	
 	_cycles = 0;
 	_completed_frame = false;
+	_vblank_fired = false;
+	_mmu->scheduler().invalidate(Scheduler::GPUMode);
+	_mmu->scheduler().invalidate(Scheduler::GPUInterrupt);
+}
+
+void GPU::set_format(Format format)
+{
+	if(format == Format::RGB565 && !_screen_rgb565)
+	{
+		_screen_rgb565.reset(new uint16_t[ScreenWidth * ScreenHeight]);
+		std::fill_n(_screen_rgb565.get(), ScreenWidth * ScreenHeight, 0xFFFF);
+	}
+	if(format == Format::Indexed && !_screen_indexed)
+	{
+		_screen_indexed.reset(new word_t[ScreenWidth * ScreenHeight]);
+		std::memset(_screen_indexed.get(), IndexedBlank, ScreenWidth * ScreenHeight);
+		_line_palettes.reset(new LinePalette[ScreenHeight]);
+	}
+	if(format != _format)
+	{
+		_valid_lines.reset();
+		_changed_lines.set();
+	}
+	_format = format;
+}
+
+void GPU::get_line_colors(word_t line, color_t (&colors)[IndexedPaletteSize]) const
+{
+	assert(line < ScreenHeight && _line_palettes);
+	const LinePalette& p = _line_palettes[line];
+	for(word_t c = 0; c < 4; ++c)
+	{
+		if(p.cgb)
+		{
+			for(word_t pal = 0; pal < 8; ++pal)
+			{
+				colors[pal * 4 + c] = MMU::to_color(p.bg[pal][c * 2], p.bg[pal][c * 2 + 1]);
+				colors[IndexedOBJ + pal * 4 + c] = MMU::to_color(p.obj[pal][c * 2], p.obj[pal][c * 2 + 1]);
+			}
+		} else {
+			for(word_t pal = 0; pal < 8; ++pal)
+				colors[pal * 4 + c] = Colors[(p.bgp >> (c << 1)) & 3]; // Same as the RGBA8 format (see render_line)
+			for(word_t pal = 0; pal < 8; ++pal)
+				colors[IndexedOBJ + pal * 4 + c] = color_t{Colors[(p.obp[pal & 1] >> (c << 1)) & 3]};
+		}
+	}
+	colors[IndexedBlank] = color_t{255};
+}
+
+void GPU::to_rgba8(color_t* out) const
+{
+	assert(_screen_indexed);
+	color_t colors[IndexedPaletteSize];
+	for(word_t line = 0; line < ScreenHeight; ++line)
+	{
+		get_line_colors(line, colors);
+		const word_t* indices = &_screen_indexed[line * ScreenWidth];
+		for(word_t x = 0; x < ScreenWidth; ++x)
+			*out++ = colors[indices[x]];
+	}
+}
+
+void GPU::clear_screen()
+{
+	std::memset(_screen.get(), 0xFF, ScreenWidth * ScreenHeight * sizeof(color_t));
+	if(_format == Format::RGB565)
+		std::fill_n(_screen_rgb565.get(), ScreenWidth * ScreenHeight, 0xFFFF);
+	if(_format == Format::Indexed)
+		std::memset(_screen_indexed.get(), IndexedBlank, ScreenWidth * ScreenHeight);
+	_valid_lines.reset();
+	_changed_lines.set();
+}
+
+bool GPU::line_unchanged()
+{
+	const word_t line = get_line();
+	const bool cgb = _mmu->cgb_mode();
+	LineSignature signature;
+	signature.vram_generation = _mmu->vram_generation();
+	signature.oam_generation = _mmu->oam_generation();
+	signature.palette_generation = cgb ? _mmu->palette_generation() : 0;
+	signature.window_y = _window_y;
+	signature.cgb = cgb;
+	const MMU::Register registers[8] = {MMU::LCDC, MMU::SCX, MMU::SCY, MMU::WX, MMU::WY, MMU::BGP, MMU::OBP0, MMU::OBP1};
+	for(int i = 0; i < 8; ++i)
+		signature.registers[i] = _mmu->rw_reg(registers[i]);
+	
+	if(skip_unchanged && _valid_lines[line] && _line_signatures[line] == signature)
+	{
+		// Same window line counter as render_line: The window isn't drawn if wx < 0 and the BG is disabled (non CGB).
+		const int wx = signature.registers[3] - 7;
+		const word_t LCDC = signature.registers[0];
+		if((LCDC & WindowDisplay) && wx < 160 && line >= signature.registers[4] && (cgb || (LCDC & BGDisplay) || wx >= 0))
+			++_window_y;
+		return true;
+	}
+	_line_signatures[line] = signature;
+	_valid_lines[line] = true;
+	_changed_lines[line] = true;
+	return false;
 }
 
 void GPU::step(size_t cycles, bool render)
 {
 	assert(_mmu != nullptr && _screen != nullptr);
-	static bool s_cleared_screen = false;
 	
 	_completed_frame = false;
 	word_t l = get_line();
 	
 	if(!enabled())
 	{
-		if(!s_cleared_screen)
+		if(!_cleared_screen)
 		{
 			_cycles = 0;
 			get_line() = 0;
-			std::memset(_screen.get(), 0xFF, ScreenWidth * ScreenHeight * sizeof(color_t));
+			clear_screen();
 			_completed_frame = true;
-			s_cleared_screen = true;
+			_cleared_screen = true;
 		}
+		_mmu->scheduler().invalidate(Scheduler::GPUMode);
+		_mmu->scheduler().invalidate(Scheduler::GPUInterrupt);
 		return;
-	} else if(s_cleared_screen) {
+	} else if(_cleared_screen) {
 		_cycles = 0;
 		get_line() = 0;
-		s_cleared_screen = false;
+		_cleared_screen = false;
 	}
 	
 	_cycles += cycles;
-	update_mode(render && enabled());
+	// A single step may span several modes when the CPU executes whole blocks at once (see LR35902JIT).
+	do
+	{
+		const bool transition = update_mode(render && enabled());
+		lyc(get_line() != l);
+		if(!transition) break;
+		l = get_line();
+	} while(_cycles >= 80); // Shortest mode
 	
-	lyc(get_line() != l);
+	// Events are scheduled in CPU cycles.
+	Scheduler& scheduler = _mmu->scheduler();
+	const unsigned int speed = _mmu->double_speed() ? 2 : 1;
+	if(scheduler.due(Scheduler::GPUInterrupt))
+		scheduler.schedule(Scheduler::GPUInterrupt, speed * next_event());
+	// The VBlank interrupt is requested at the beginning of the next step.
+	const word_t mode = get_lcdstat() & LCDMode;
+	scheduler.schedule(Scheduler::GPUMode, (mode == Mode::VBlank && !_vblank_fired) ? 0 : speed * (ModeCycles[mode] - _cycles));
 }
 	
-void GPU::update_mode(bool render)
+bool GPU::update_mode(bool render)
 {	
 	switch(get_lcdstat() & LCDMode)
 	{
@@ -76,12 +393,12 @@ void GPU::update_mode(bool render)
 					get_lcdstat() = (get_lcdstat() & ~LCDMode) | Mode::VBlank;
 					exec_stat_interrupt(Mode01);
 				}
+				return true;
 			}
 			break;
 		case Mode::VBlank:
 		{
-			static bool fired_interrupt = false;
-			if(!fired_interrupt) { _mmu->rw_reg(MMU::IF) |= MMU::VBlank; fired_interrupt = true; }
+			if(!_vblank_fired) { _mmu->rw_reg(MMU::IF) |= MMU::VBlank; _vblank_fired = true; }
 			if(_cycles >= 456)
 			{
 				_cycles -= 456;
@@ -94,8 +411,9 @@ void GPU::update_mode(bool render)
 					_window_y = 0;
 					get_lcdstat() = (get_lcdstat() & ~LCDMode) | Mode::OAM;
 					exec_stat_interrupt(Mode10);
-					fired_interrupt = false;
+					_vblank_fired = false;
 				}
+				return true;
 			}
 			break;
 		}
@@ -104,6 +422,7 @@ void GPU::update_mode(bool render)
 			{
 				_cycles -= 80;
 				get_lcdstat() = (get_lcdstat() & ~LCDMode) | Mode::VRAM;
+				return true;
 			}
 			break;
 		case Mode::VRAM:
@@ -114,217 +433,342 @@ void GPU::update_mode(bool render)
 				get_lcdstat() = (get_lcdstat() & ~LCDMode) | Mode::HBlank;
 				_mmu->check_hdma();
 				exec_stat_interrupt(Mode00);
+				return true;
 			}
 			break;
 	}
+	return false;
 }
 
-struct Sprite
+unsigned int GPU::next_event() const
 {
-	word_t		idx;
-	int			x;
-	int			y;
+	const word_t ie = _mmu->read(MMU::IE);
+	const word_t stat = get_lcdstat();
+	const auto stat_interrupt = [&](LCDStatus m) { return (ie & MMU::LCDSTAT) && (stat & m); };
 	
-	Sprite(word_t _idx = 0, int _x = 0, int _y = 0) :
-		idx(_idx), x(_x), y(_y)
-	{}
+	word_t mode = stat & LCDMode;
+	word_t line = get_line();
+	if(mode == Mode::VBlank && !_vblank_fired && (ie & MMU::VBlank))
+		return 0; // Requested by the next step
 	
-	inline bool operator<(const Sprite& s) const
+	// Follows the modes (see update_mode) until one of them may request an enabled interrupt.
+	unsigned int cycles = 0;
+	unsigned int elapsed = _cycles;
+	while(cycles < 154 * 456)
 	{
-		return x < s.x || idx < s.idx;
+		const word_t prev_line = line;
+		switch(mode)
+		{
+			case Mode::HBlank:
+				cycles += 204 - elapsed;
+				if(++line < ScreenHeight)
+				{
+					mode = Mode::OAM;
+					if(stat_interrupt(Mode10)) return cycles;
+				} else {
+					mode = Mode::VBlank;
+					if((ie & MMU::VBlank) || stat_interrupt(Mode01)) return cycles;
+				}
+				break;
+			case Mode::VBlank:
+				cycles += 456 - elapsed;
+				if(++line == 153)
+					line = 0;
+				else if(line == 1)
+					return cycles; // Completed frame
+				break;
+			case Mode::OAM:
+				cycles += 80 - elapsed;
+				mode = Mode::VRAM;
+				break;
+			case Mode::VRAM:
+				cycles += 172 - elapsed;
+				mode = Mode::HBlank;
+				if(stat_interrupt(Mode00)) return cycles;
+				break;
+		}
+		elapsed = 0;
+		if(line != prev_line && line == get_lyc() && stat_interrupt(LYC))
+			return cycles;
 	}
-};
-	
+	return cycles;
+}
+
+void GPU::decode_sprites(word_t height)
+{
+	std::memset(_line_sprite_count, 0, sizeof(_line_sprite_count));
+	for(word_t s = 0; s < 40; s++)
+	{
+		Sprite& sprite = _sprites[s];
+		sprite.y = _mmu->read(0xFE00 + s * 4) - 16;
+		sprite.x = _mmu->read(0xFE00 + s * 4 + 1) - 8;
+		sprite.tile = _mmu->read(0xFE00 + s * 4 + 2);
+		sprite.options = _mmu->read(0xFE00 + s * 4 + 3);
+		// Lines where it is visible
+		// (Not testing x: On real hardware, 'out of bounds' sprites still counts towards 
+		// the 10 sprites per scanline limit)
+		const int last = std::min<int>(ScreenHeight, sprite.y + height);
+		for(int l = std::max(0, sprite.y); l < last; ++l)
+			if(_line_sprite_count[l] < SpritesPerLine)
+				_line_sprites[l][_line_sprite_count[l]++] = s;
+	}
+	_sprites_valid = true;
+	_sprites_generation = _mmu->oam_generation();
+	_sprites_height = height;
+}
+
+template<bool CGB, bool Vectorized>
 void GPU::render_line()
 {
 	const word_t line = get_line();
 	const word_t LCDC = get_lcdc();
 	
 	assert(line < ScreenHeight);
+	// The line is composed in these buffers, padded so whole tile rows and sprites can be written
+	// even if they're partially off screen. Pixel x is at Pad + x.
+	constexpr int Pad = 8;
+	constexpr int LineSize = Pad + ScreenWidth + Pad;
+	alignas(32) color_t line_colors[LineSize];
 	// BG Transparency
-	word_t line_color_idx[ScreenWidth];
-	
-	// CGB Only - Per tile BG priority
-	bool line_bg_priorities[ScreenWidth];
+	alignas(16) word_t line_color_idx[LineSize];
+	// CGB Only - Per tile BG priority (0xFF if the BG has priority over the sprites)
+	alignas(16) word_t line_bg_priorities[LineSize];
+	// Indexed format: Palette entries, replace line_colors
+	const bool indexed = _format == Format::Indexed;
+	alignas(16) word_t line_indices[LineSize];
+	// RGB565 format: Replace line_colors
+	const bool rgb565 = _format == Format::RGB565;
+	alignas(16) uint16_t line_rgb565[LineSize];
 	
 	int wx = _mmu->read(MMU::WX) - 7; // Can be < 0
 	word_t wy = _mmu->read(MMU::WY);
 	
 	bool draw_window = (LCDC & WindowDisplay) && wx < 160 && line >= wy;
+	bool drawn = false;
 
 	// BG Disabled, draw blank in non CGB mode
 	word_t start_col = 0;
-	if(!_mmu->cgb_mode() && !(LCDC & BGDisplay))
+	if(!CGB && !(LCDC & BGDisplay))
 	{
-		for(word_t i = 0; i < (draw_window ? wx : ScreenWidth); ++i)
+		for(int i = 0; i < (draw_window ? wx : ScreenWidth); ++i)
 		{
-			_screen[to1D(i, line)] = 255;
-			line_color_idx[i] = 0;
-			line_bg_priorities[i] = false;
+			if(indexed)
+				line_indices[Pad + i] = IndexedBlank;
+			else if(rgb565)
+				line_rgb565[Pad + i] = 0xFFFF;
+			else
+				line_colors[Pad + i] = color_t{255};
+			line_color_idx[Pad + i] = 0;
+			line_bg_priorities[Pad + i] = 0;
 		}
+		drawn = !draw_window || wx >= 0;
 		start_col = wx; // Skip to window drawing
 	}
 
 	// Render Background Or Window
-	if((LCDC & BGDisplay) || draw_window)
+	if(((LCDC & BGDisplay) || draw_window) && start_col < ScreenWidth)
 	{
-		// Selects the Tile Map & Tile Data Set
-		addr_t mapoffs = (LCDC & BGTileMapDisplaySelect) ? 0x9C00 : 0x9800;
-		addr_t base_tile_data = (LCDC & BGWindowsTileDataSelect) ? 0x8000 : 0x9000;
-		
-		word_t scroll_x = get_scroll_x();
-		word_t scroll_y = get_scroll_y();
-		
-		mapoffs += 0x20 * (((line + scroll_y) & 0xFF) >> 3);
-		word_t lineoffs = (scroll_x >> 3);
-
-		word_t x = scroll_x & 7;
-		word_t y = (scroll_y + line) & 7;
-		
-		// Tile Index
-		word_t tile;
-		word_t tile_l;
-		word_t tile_h;
-		word_t tile_data0 = 0, tile_data1 = 0;
-		
+		TileCache& tiles = _mmu->tiles();
 		color_t colors_cache[4];
-		if(!_mmu->cgb_mode())
+		uint16_t colors_cache_rgb565[4];
+		if(!CGB && !indexed)
 		{
 			for(int i = 0; i < 4; ++i)
+			{
 				colors_cache[i] = get_bg_color(i);
+				colors_cache_rgb565[i] = to_rgb565(colors_cache[i]);
+			}
 		}
 		
-		// CGB Only
-		word_t	map_attributes = 0;
-		word_t	vram_bank = 0;
-		bool	xflip = false;
-		bool	yflip = false;
-		
-		for(word_t i = start_col; i < ScreenWidth; ++i)
+		// Draws the tiles of a row of the map starting at the column lineoffs, from the screen column px
+		// (possibly negative for the first tile) up to the column end (overwriting up to 7 pixels after it).
+		const auto draw_tiles = [&](addr_t mapoffs, word_t lineoffs, word_t y, int px, int end)
 		{
-			// Switch to window rendering
-			if(draw_window && i >= wx)
+			const bool unsigned_index = LCDC & BGWindowsTileDataSelect;
+			word_t priority = 0;
+			word_t palette = 0;
+			for(; px < end; px += 8)
 			{
-				mapoffs = (LCDC & WindowsTileMapDisplaySelect) ? 0x9C00 : 0x9800;
-				mapoffs += 0x20 * (_window_y >> 3);
-				lineoffs = 0;
-
-				// X & Y in window space.
-				x = 8; // Force Tile Fetch
-				y = _window_y & 7;
-				++_window_y;
-				draw_window = false; // No need to do it again.
-			}
-			
-			if(x == 8 || i == start_col) // Loading Tile Data (Next Tile)
-			{
-				if(_mmu->cgb_mode())
+				word_t	vram_bank = 0;
+				bool	xflip = false;
+				bool	yflip = false;
+				if(CGB)
 				{
-					map_attributes = _mmu->read_vram(1, mapoffs + lineoffs);
-					for(int i = 0; i < 4; ++i)
-						colors_cache[i] = _mmu->get_bg_color(map_attributes & BackgroundPalette, i);
+					const word_t map_attributes = _mmu->read_vram(1, mapoffs + lineoffs);
+					palette = map_attributes & BackgroundPalette;
+					if(!indexed)
+						for(int i = 0; i < 4; ++i)
+						{
+							colors_cache[i] = _mmu->get_bg_color(palette, i);
+							colors_cache_rgb565[i] = to_rgb565(colors_cache[i]);
+						}
 					vram_bank = (map_attributes & TileVRAMBank) ? 1 : 0;
 					xflip = (map_attributes & HorizontalFlip);
 					yflip = (map_attributes & VerticalFlip);
+					priority = (map_attributes & BGtoOAMPriority) ? 0xFF : 0;
 				}
 				
-				x = x & 7;
-				tile = _mmu->read_vram(0, mapoffs + lineoffs);
-				int idx = tile;
-				// If the second Tile Set is used, the tile index is signed.
-				if(!(LCDC & BGWindowsTileDataSelect) && (tile & 0x80))
-					idx = -((~tile + 1) & 0xFF);
-				int Y = yflip ? 7 - y : y;
-				tile_l = _mmu->read_vram(vram_bank, base_tile_data + 16 * idx + Y * 2);
-				tile_h = _mmu->read_vram(vram_bank, base_tile_data + 16 * idx + Y * 2 + 1);
-				palette_translation(tile_l, tile_h, tile_data0, tile_data1);
+				const word_t tile = _mmu->read_vram(0, mapoffs + lineoffs);
+				// If the second Tile Set is used, the tile index is signed (from 0x9000).
+				const int idx = unsigned_index ? tile : 256 + static_cast<int8_t>(tile);
+				const word_t* tile_row = tiles.row(vram_bank, idx, yflip ? 7 - y : y, xflip);
+				if(indexed)
+					offset8<Vectorized>(tile_row, palette * 4, line_indices + Pad + px);
+				else if(rgb565)
+					lookup8<Vectorized>(tile_row, colors_cache_rgb565, line_rgb565 + Pad + px);
+				else
+					lookup8<Vectorized>(tile_row, colors_cache, line_colors + Pad + px);
+				std::memcpy(line_color_idx + Pad + px, tile_row, 8);
+				std::memset(line_bg_priorities + Pad + px, priority, 8);
 				lineoffs = (lineoffs + 1) & 31;
 			}
-			
-			word_t color_x = xflip ? (7 - x) : x;
-			word_t shift = ((7 - color_x) & 3) << 1;
-			word_t color = ((color_x > 3 ? tile_data1 : tile_data0) >> shift) & 0b11;
-			line_color_idx[i] = color;
-			line_bg_priorities[i] = (map_attributes & BGtoOAMPriority);
-			_screen[to1D(i, line)] = colors_cache[color];
-			
-			++x;
+		};
+		
+		// The window starts at the first column drawn if wx < 0.
+		const int window_col = draw_window ? std::max<int>(wx, start_col) : ScreenWidth;
+		if(start_col < window_col)
+		{
+			// Selects the Tile Map (the Tile Data Set is selected for each tile)
+			addr_t mapoffs = (LCDC & BGTileMapDisplaySelect) ? 0x9C00 : 0x9800;
+			const word_t scroll_x = get_scroll_x();
+			const word_t scroll_y = get_scroll_y();
+			mapoffs += 0x20 * (((line + scroll_y) & 0xFF) >> 3);
+			draw_tiles(mapoffs, scroll_x >> 3, (scroll_y + line) & 7, start_col - (scroll_x & 7), window_col);
+		}
+		
+		if(draw_window)
+		{
+			// X & Y in window space.
+			addr_t mapoffs = (LCDC & WindowsTileMapDisplaySelect) ? 0x9C00 : 0x9800;
+			mapoffs += 0x20 * (_window_y >> 3);
+			draw_tiles(mapoffs, 0, _window_y & 7, window_col, ScreenWidth);
+			++_window_y;
+		}
+		drawn = true;
+	}
+	
+	if(!drawn) // Nothing to draw under the sprites: The line keeps its previous content.
+	{
+		switch(_format)
+		{
+			case Format::RGBA8:
+				std::memcpy(line_colors + Pad, &_screen[to1D(0, line)], ScreenWidth * sizeof(color_t));
+				break;
+			case Format::RGB565:
+				std::memcpy(line_rgb565 + Pad, &_screen_rgb565[to1D(0, line)], ScreenWidth * sizeof(uint16_t));
+				break;
+			case Format::Indexed:
+				std::memcpy(line_indices + Pad, &_screen_indexed[to1D(0, line)], ScreenWidth);
+				break;
 		}
+		std::memset(line_color_idx + Pad, 0, ScreenWidth);
+		std::memset(line_bg_priorities + Pad, 0, ScreenWidth);
 	}
 	
 	// Render Sprites
 	if(get_lcdc() & OBJDisplay)
 	{
-		word_t Tile, Opt;
-		word_t tile_l = 0;
-		word_t tile_h = 0;
-		word_t tile_data0 = 0, tile_data1 = 0;
-		word_t sprite_limit = 10;
+		TileCache& tiles = _mmu->tiles();
+		// Sprites partially off screen are merged with the padding.
+		std::memset(line_color_idx, 0, Pad);
+		std::memset(line_color_idx + Pad + ScreenWidth, 0, Pad);
+		std::memset(line_bg_priorities, 0, Pad);
+		std::memset(line_bg_priorities + Pad + ScreenWidth, 0, Pad);
 		
 		// 8*16 Sprites ?
 		word_t size = (get_lcdc() & OBJSize) ? 16 : 8;
+		update_sprites(size);
 		
-		std::list<Sprite> sprites;
-		for(word_t s = 0; s < 40; s++)
+		// Priority: In CGB mode, only the OAM index, i.e. sprites are already sorted.
+		// Otherwise the lowest x coordinate, then the OAM index (insertion sort, keeping the OAM order).
+		const word_t count = _line_sprite_count[line];
+		word_t sprites[SpritesPerLine];
+		for(word_t i = 0; i < count; ++i)
 		{
-			auto y = _mmu->read(0xFE00 + s * 4) - 16;
-			 // Visible on this scanline?
-			 // (Not testing x: On real hardware, 'out of bounds' sprites still counts towards 
-			 // the 10 sprites per scanline limit)
-			if(y <= line && (y + size) > line)
-				sprites.emplace_back(
-					s, 
-					_mmu->read(0xFE00 + s * 4 + 1) - 8, 
-					y
-				);
+			const word_t idx = _line_sprites[line][i];
+			word_t j = i;
+			if(!CGB)
+				for(; j > 0 && _sprites[sprites[j - 1]].x > _sprites[idx].x; --j)
+					sprites[j] = sprites[j - 1];
+			sprites[j] = idx;
 		}
 		
-		// If CGB mode, prioriy is only idx, i.e. sprites are already sorted.
-		if(!_mmu->cgb_mode())
-			sprites.sort();
-		
-		if(sprites.size() > sprite_limit)
-			sprites.resize(sprite_limit);
+		bool bg_window_no_priority = CGB && !(LCDC & BGDisplay); // (CGB Only: BG loses all priority)
 		
 		// Draw the sprites in reverse priority order.
-		sprites.reverse();
-		
-		bool bg_window_no_priority = _mmu->cgb_mode() && !(LCDC & BGDisplay); // (CGB Only: BG loses all priority)
-		
-		for(const auto& s : sprites)
+		for(int i = count - 1; i >= 0; --i)
 		{
+			const Sprite& s = _sprites[sprites[i]];
 			// Visible on _screen?
 			if(s.x > -8 && s.x < ScreenWidth)
 			{
-				Tile = _mmu->read(0xFE00 + s.idx * 4 + 2);
-				Opt = _mmu->read(0xFE00 + s.idx * 4 + 3);
-				if(get_lcdc() & OBJSize) Tile &= 0xFE; // Bit 0 is ignored for 8x16 sprites
-				if(s.y - line >= 8 && (Opt & YFlip)) Tile &= 0xFE;
-				const word_t palette = _mmu->read((Opt & Palette) ? MMU::OBP1 : MMU::OBP0); // non CGB Only
+				word_t Tile = s.tile;
+				const word_t Opt = s.options;
+				if(size == 16) Tile &= 0xFE; // Bit 0 is ignored for 8x16 sprites
+				color_t palette[4]; // Unused in the indexed format (see get_line_colors)
+				uint16_t palette_rgb565[4];
+				if(CGB && !indexed)
+				{
+					for(int c = 0; c < 4; ++c)
+						palette[c] = _mmu->get_sprite_color((Opt & PaletteNumber), c);
+				} else if(!indexed) {
+					const word_t obp = _mmu->read((Opt & Palette) ? MMU::OBP1 : MMU::OBP0);
+					for(int c = 0; c < 4; ++c)
+						palette[c] = color_t{Colors[(obp >> (c << 1)) & 3]};
+				}
+				if(rgb565)
+					for(int c = 0; c < 4; ++c)
+						palette_rgb565[c] = to_rgb565(palette[c]);
 				// Only Tile Set #0 ?
 				int Y = (Opt & YFlip) ? (size - 1) - (line - s.y) : line - s.y;
-				const word_t vram_bank = (_mmu->cgb_mode() && (Opt & OBJTileVRAMBank)) ? 1 : 0;
-				tile_l = _mmu->read_vram(vram_bank, 0x8000 + 16 * Tile + Y * 2);
-				tile_h = _mmu->read_vram(vram_bank, 0x8000 + 16 * Tile + Y * 2 + 1);
-				palette_translation(tile_l, tile_h, tile_data0, tile_data1);
-				word_t right_limit = (s.x > ScreenWidth - 8 ? ScreenWidth - s.x : 8);
-				for(word_t x = (s.x >= 0 ? 0 : -s.x); x < right_limit; x++)
+				const word_t vram_bank = (CGB && (Opt & OBJTileVRAMBank)) ? 1 : 0;
+				// The second half of 8x16 sprites is the next tile.
+				const word_t* tile_row = tiles.row(vram_bank, Tile + (Y >> 3), Y & 7, Opt & XFlip);
+				if(indexed)
 				{
-					word_t color_x = (Opt & XFlip) ? x : (7 - x);
-					word_t shift = (color_x & 3) << 1;
-					word_t color = ((color_x > 3 ? tile_data0 : tile_data1) >> shift) & 3;
-					bool over_bg = (!line_bg_priorities[s.x + x] && 					// (CGB Only - BG Attributes)
-									!(Opt & Priority)) || line_color_idx[s.x + x] == 0;	// Priority over background or transparency
-									
-					if(color != 0 && 						// Transparency
-						(bg_window_no_priority || over_bg)) // Priority
-					{
-						_screen[to1D(s.x + x, line)] = _mmu->cgb_mode() ?
-							_mmu->get_sprite_color((Opt & PaletteNumber), color) :
-							color_t{Colors[(palette >> (color << 1)) & 3]};
-					}
+					const word_t obj_palette = CGB ? (Opt & PaletteNumber) : ((Opt & Palette) ? 1 : 0);
+					merge_sprite<Vectorized>(tile_row, IndexedOBJ + obj_palette * 4, bg_window_no_priority, Opt & Priority,
+						line_color_idx + Pad + s.x, line_bg_priorities + Pad + s.x, line_indices + Pad + s.x);
+				} else if(rgb565) {
+					merge_sprite<Vectorized>(tile_row, palette_rgb565, bg_window_no_priority, Opt & Priority,
+						line_color_idx + Pad + s.x, line_bg_priorities + Pad + s.x, line_rgb565 + Pad + s.x);
+				} else {
+					merge_sprite<Vectorized>(tile_row, palette, bg_window_no_priority, Opt & Priority,
+						line_color_idx + Pad + s.x, line_bg_priorities + Pad + s.x, line_colors + Pad + s.x);
 				}
 			}
 		}
 	}
+	
+	write_line(line, CGB, drawn, line_colors + Pad, line_rgb565 + Pad, line_indices + Pad);
+}
+
+inline void GPU::write_line(word_t line, bool cgb, bool bg_drawn, const color_t* colors, const uint16_t* rgb565, const word_t* indices)
+{
+	switch(_format)
+	{
+		case Format::RGBA8:
+			std::memcpy(&_screen[to1D(0, line)], colors, ScreenWidth * sizeof(color_t));
+			break;
+		case Format::RGB565:
+			std::memcpy(&_screen_rgb565[to1D(0, line)], rgb565, ScreenWidth * sizeof(uint16_t));
+			break;
+		case Format::Indexed:
+		{
+			std::memcpy(&_screen_indexed[to1D(0, line)], indices, ScreenWidth);
+			LinePalette& p = _line_palettes[line];
+			if(bg_drawn) // Otherwise the BG pixels still use the previous palettes
+			{
+				p.cgb = cgb;
+				p.bgp = get_bgp();
+				if(cgb)
+					std::memcpy(p.bg, _mmu->get_bg_palette_data(), sizeof(p.bg));
+			}
+			p.obp[0] = _mmu->read(MMU::OBP0);
+			p.obp[1] = _mmu->read(MMU::OBP1);
+			if(cgb)
+				std::memcpy(p.obj, _mmu->get_sprite_palette_data(), sizeof(p.obj));
+			break;
+		}
+	}
 }
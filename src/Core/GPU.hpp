@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <bitset>
 #include <cstring> // Memset
 #include <memory>
 
@@ -12,6 +14,8 @@ public:
 	static constexpr word_t ScreenWidth = 160;
 	static constexpr word_t ScreenHeight = 144;
 	static constexpr word_t Colors[4] = {255, 192, 96, 0};
+	/// Duration of each mode (HBlank, VBlank (one line), OAM, VRAM)
+	static constexpr unsigned int ModeCycles[4] = {204, 456, 80, 172};
 	
 	enum Mode : word_t
 	{
@@ -63,12 +67,50 @@ public:
 		BGtoOAMPriority		= 0x80
 	};
 	
+	/// Pixel format of the screen (see set_format).
+	enum class Format
+	{
+		RGBA8,		///< color_t (get_screen)
+		RGB565,		///< 16 bits, red in the high bits (get_screen_rgb565)
+		Indexed		///< 8 bits index in the palette of the line (get_screen_indexed, get_line_colors)
+	};
+	
+	/**
+	 * Indexed format: Palette entries.
+	 * BG/Window: Palette * 4 + color (Palette is always 0 in non CGB mode).
+	 * Sprites: IndexedOBJ + Palette * 4 + color (OBP0/OBP1 in non CGB mode).
+	 * Blank (BG disabled in non CGB mode): IndexedBlank.
+	**/
+	static constexpr word_t IndexedOBJ = 32;
+	static constexpr word_t IndexedBlank = 64;
+	static constexpr word_t IndexedPaletteSize = 65;
+	
+	/**
+	 * Composes the lines 8 pixels at a time with SSE2/AVX2 (depending on the target of the build).
+	 * Otherwise one pixel at a time, the reference (same output, see RenderCheck).
+	**/
+	bool vectorized = true;
+	/// Skips the lines identical to the previous frame (see LineSignature). Otherwise renders every line.
+	bool skip_unchanged = true;
+	
 	explicit GPU(MMU& _mmu);
 	explicit GPU(const GPU& gpu);
 	GPU& operator=(const GPU& gpu) {
+		set_format(gpu._format);
 		std::memcpy(_screen.get(), gpu._screen.get(), ScreenWidth * ScreenHeight * sizeof(color_t));
+		if(_format == Format::RGB565)
+			std::memcpy(_screen_rgb565.get(), gpu._screen_rgb565.get(), ScreenWidth * ScreenHeight * sizeof(uint16_t));
+		if(_format == Format::Indexed)
+		{
+			std::memcpy(_screen_indexed.get(), gpu._screen_indexed.get(), ScreenWidth * ScreenHeight);
+			std::copy_n(gpu._line_palettes.get(), ScreenHeight, _line_palettes.get());
+		}
 		_cycles = gpu._cycles;
 		_completed_frame = gpu._completed_frame;
+		_vblank_fired = gpu._vblank_fired;
+		_sprites_valid = false;
+		_valid_lines.reset();
+		_changed_lines.set();
 		
 		return *this;
 	}
@@ -81,15 +123,36 @@ public:
 	
 	inline size_t to1D(word_t x, word_t y);
 		
-	/**
-	 * Treats bits in l as low bits and in h as high bits of 2bits values.
-	**/
-	static inline void palette_translation(word_t l, word_t h, word_t& r0, word_t& r1);
-	
 	/// @param val 0 <= val < 4
 	inline word_t get_bg_color(word_t val) const { return Colors[(get_bgp() >> (val << 1)) & 3]; }
 	
+	/**
+	 * Selects the format of the screen written by the following frames, RGBA8 by default.
+	 * The other formats are cheaper to write and to process (hashing, encoding...): Conversions to RGBA8
+	 * are left to the consumer (see get_line_colors, to_rgba8).
+	**/
+	void set_format(Format format);
+	inline Format get_format() const { return _format; }
+	
+	/// RGBA8 format only
 	inline const color_t* get_screen() const { return _screen.get(); }
+	/// RGB565 format only
+	inline const uint16_t* get_screen_rgb565() const { return _screen_rgb565.get(); }
+	/// Indexed format only
+	inline const word_t* get_screen_indexed() const { return _screen_indexed.get(); }
+	/// Indexed format only: Colors of the palette entries used by the line.
+	void get_line_colors(word_t line, color_t (&colors)[IndexedPaletteSize]) const;
+	/// Indexed format only: Converts the screen (ScreenWidth * ScreenHeight colors).
+	void to_rgba8(color_t* out) const;
+	
+	/**
+	 * Lines of the screen modified since the last call to clear_changed_lines, so frontends
+	 * and encoders can process only these rows.
+	 * Lines are rendered again only if their signature changed (see LineSignature).
+	**/
+	inline const std::bitset<ScreenHeight>& get_changed_lines() const { return _changed_lines; }
+	inline void clear_changed_lines() { _changed_lines.reset(); }
+	
 	inline word_t& get_scroll_x()      const { return _mmu->rw_reg(MMU::Register::SCX); }
 	inline word_t& get_scroll_y()      const { return _mmu->rw_reg(MMU::Register::SCY); }
 	inline word_t& get_bgp()           const { return _mmu->rw_reg(MMU::Register::BGP); }
@@ -100,17 +163,92 @@ public:
 	
 private:
 	MMU* const					_mmu = nullptr;
+	Format						_format = Format::RGBA8;
 	std::unique_ptr<color_t[]>	_screen;
+	std::unique_ptr<uint16_t[]>	_screen_rgb565;		///< Allocated by set_format
+	std::unique_ptr<word_t[]>	_screen_indexed;
+	/// Indexed format: Palettes of a line, converted on request (see get_line_colors).
+	struct LinePalette
+	{
+		bool	cgb = false;
+		word_t	bgp = 0;			///< Non CGB Only
+		word_t	obp[2] = {0, 0};
+		word_t	bg[8][8];			///< CGB Only, see MMU::get_bg_palette_data
+		word_t	obj[8][8];
+	};
+	std::unique_ptr<LinePalette[]>	_line_palettes;
+	/// Everything the rendering of a line depends on: Same signature, same pixels.
+	struct LineSignature
+	{
+		unsigned int	vram_generation;	///< See MMU::vram_generation
+		unsigned int	oam_generation;
+		unsigned int	palette_generation;
+		unsigned int	window_y;
+		word_t			registers[8];		///< LCDC, SCX, SCY, WX, WY, BGP, OBP0, OBP1
+		bool			cgb;
+		
+		inline bool operator==(const LineSignature& s) const
+		{
+			return vram_generation == s.vram_generation && oam_generation == s.oam_generation &&
+				palette_generation == s.palette_generation && window_y == s.window_y && cgb == s.cgb &&
+				std::equal(std::begin(registers), std::end(registers), std::begin(s.registers));
+		}
+	};
+	LineSignature				_line_signatures[ScreenHeight];
+	std::bitset<ScreenHeight>	_valid_lines;	///< The screen holds the rendering of _line_signatures
+	std::bitset<ScreenHeight>	_changed_lines;
 	// Timing
 	unsigned int				_cycles = 0;
 	bool						_completed_frame = false;
+	bool						_vblank_fired = false; ///< VBlank interrupt is requested during the first step in VBlank mode
+	bool						_cleared_screen = false; ///< The screen was cleared since the LCD was disabled
 	unsigned int 				_window_y = 0; // The window have a distinct line counter (window can be deactivated/reactivated between scanlines)
 	
+	static constexpr word_t		SpritesPerLine = 10;
+	/// OAM entry, decoded by update_sprites.
+	struct Sprite
+	{
+		int		x;			///< Screen coordinates of the top left corner
+		int		y;
+		word_t	tile;
+		word_t	options;	///< OAMOption
+	};
+	Sprite						_sprites[40];
+	/// OAM indices of the (first 10) sprites on each line, in OAM order.
+	word_t						_line_sprites[ScreenHeight][SpritesPerLine];
+	word_t						_line_sprite_count[ScreenHeight];
+	bool						_sprites_valid = false;
+	unsigned int				_sprites_generation = 0;	///< MMU::oam_generation of the table
+	word_t						_sprites_height = 8;
+	
 	inline void lyc(bool changed);
 	inline void exec_stat_interrupt(LCDStatus m);
 
-	void update_mode(bool render = true);
-		
+	/// @return true if the mode (or line) changed
+	bool update_mode(bool render = true);
+	
+	/// @return Cycles before the next mode change that may wake up the CPU (see Scheduler::GPUInterrupt)
+	unsigned int next_event() const;
+	
+	/// Fills the screen with white in the current format.
+	void clear_screen();
+	/// @return true if the current line doesn't have to be rendered again (see LineSignature)
+	bool line_unchanged();
+	/// Copies the line composed by render_line to the screen, in the current format.
+	inline void write_line(word_t line, bool cgb, bool bg_drawn, const color_t* colors, const uint16_t* rgb565, const word_t* indices);
+	
+	/// Decodes OAM into _sprites and _line_sprites if it changed (or the sprites height).
+	inline void update_sprites(word_t height);
+	void decode_sprites(word_t height);
+	
+	/// Dispatches to the specialization for the emulated hardware (and vectorized).
+	inline void render_line();
+	/**
+	 * @tparam CGB Color GameBoy rendering: BG map attributes, color palettes, OAM ordering...
+	 *             Resolved once per line instead of for each tile and sprite pixel.
+	 * @tparam Vectorized SIMD compositing (see vectorized)
+	**/
+	template<bool CGB, bool Vectorized>
 	void render_line();
 };
 
@@ -134,13 +272,20 @@ inline size_t GPU::to1D(word_t x, word_t y)
 	return y * ScreenWidth + x;
 }
 
-inline void GPU::palette_translation(word_t l, word_t h, word_t& r0, word_t& r1)
+inline void GPU::update_sprites(word_t height)
+{
+	if(!_sprites_valid || _sprites_generation != _mmu->oam_generation() || _sprites_height != height)
+		decode_sprites(height);
+}
+
+inline void GPU::render_line()
 {
-	r0 = r1 = 0;
-	for(int i = 0; i < 4; i++)
-		r0 |= (((l & (1 << (i + 4))) >> (4 + i)) << (2 * i)) | (((h & (1 << (i + 4))) >> (4 + i))  << (2 * i + 1));
-	for(int i = 0; i < 4; i++)
-		r1 |= ((l & (1 << i)) << (2 * i - i)) | ((h & (1 << i)) << (2 * i + 1 - i));
+	if(line_unchanged())
+		return;
+	if(_mmu->cgb_mode())
+		vectorized ? render_line<true, true>() : render_line<true, false>();
+	else
+		vectorized ? render_line<false, true>() : render_line<false, false>();
 }
 
 inline void GPU::exec_stat_interrupt(LCDStatus m)
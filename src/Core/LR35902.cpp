@@ -1,6 +1,15 @@
 #include "LR35902.hpp"
 
+#include <algorithm>
 #include <cstring> // Memset
+#include <fstream>
+
+#ifdef USE_JIT
+	#include <Core/LR35902JIT.hpp>
+#endif
+#ifdef USE_AOT
+	#include <Core/LR35902AOT.hpp>
+#endif
 
 LR35902::LR35902(MMU& mmu, Gb_Apu& apu) :
 	_mmu(&mmu),
@@ -18,18 +27,34 @@ LR35902::LR35902(MMU& mmu, Gb_Apu& apu) :
 	assert(&_l == &_r[6]);
 }
 
+LR35902::LR35902(const LR35902& rhs)
+{
+	*this = rhs;
+}
+
+LR35902::~LR35902()
+{
+}
+
 void LR35902::reset()
 {
 	_pc = 0;
 	_sp = 0;
 	for(int i = 0; i < 7; ++i)
 		_r[i] = 0;
-	_f = 0;
+	set_f(0);
 	
 	frame_cycles = 0;
+	_instructions = 0;
+	_divider_register = 0;
+	_timer_counter = 0;
+	_timers_clock = 0;
 	_ime = true;
 	_stop = false;
 	_halt = false;
+	
+	_idle_loops.clear();
+	flush_blocks();
 }
 
 void LR35902::reset_cart()
@@ -86,26 +111,293 @@ bool LR35902::reached_breakpoint() const
 	return _breakpoint;
 }
 
-void LR35902::add_breakpoint(addr_t addr)
+void LR35902::add_breakpoint(addr_t addr, int bank, const Condition& condition)
 {
-	_breakpoints.push_back(addr);
+	Breakpoint b;
+	b.addr = addr;
+	b.bank = (in_range(addr, 0x4000, 0x8000) || in_range(addr, 0xD000, 0xE000)) ? bank : Breakpoint::AnyBank;
+	b.condition = condition;
+	_breakpoints.push_back(b);
+	_breakpoint_map[addr] = true;
 }
 
-void LR35902::rem_breakpoint(addr_t addr)
+void LR35902::rem_breakpoint(size_t index)
 {
-	_breakpoints.erase(std::find(_breakpoints.begin(), _breakpoints.end(), addr));
+	const addr_t addr = _breakpoints[index].addr;
+	_breakpoints.erase(_breakpoints.begin() + index);
+	_breakpoint_map[addr] = std::any_of(_breakpoints.begin(), _breakpoints.end(), [addr](const Breakpoint& b) { return b.addr == addr; });
 }
 
-std::vector<addr_t>& LR35902::get_breakpoints()
+void LR35902::clear_breakpoints()
 {
-	return _breakpoints;
+	_breakpoints.clear();
+	_breakpoint_map.reset();
 }
 
-void LR35902::clear_breakpoints()
+bool LR35902::check_breakpoints() const
 {
-	_breakpoints.clear();
+	for(const Breakpoint& b : _breakpoints)
+	{
+		if(b.addr != _pc)
+			continue;
+		if(b.bank != Breakpoint::AnyBank)
+		{
+			const int bank = _mmu->code_bank(_pc);
+			if(b.bank != (bank >= MMU::RAMCodeBank ? bank - MMU::RAMCodeBank : bank))
+				continue;
+		}
+		if(b.condition.test(*this, *_mmu))
+			return true;
+	}
+	return false;
+}
+
+void LR35902::flush_blocks()
+{
+	_block = nullptr;
+	_idle_block = nullptr;
+	_rom_blocks.clear();
+	_ram_blocks.clear();
+#ifdef USE_JIT
+	if(_jit)
+		_jit->clear();
+#endif
+}
+
+void LR35902::set_jit(JITMode mode)
+{
+#ifdef USE_NATIVE_BLOCKS
+	_jit_mode = mode;
+#else
+	(void) mode;
+#endif
+#ifdef USE_JIT
+	if(_jit_mode != JITMode::Off && !_jit)
+		_jit.reset(new LR35902JIT(*this));
+#endif
+}
+
+#ifdef USE_AOT
+bool LR35902::load_aot(const std::string& path)
+{
+	flush_blocks(); // Drops the previous translations
+	_aot.reset();
+	std::unique_ptr<LR35902AOT> aot(new LR35902AOT());
+	if(!aot->load(path, _mmu->get_cartridge()))
+	{
+		std::cerr << "AOT: Error loading '" << path << "': " << aot->get_error() << std::endl;
+		return false;
+	}
+	_aot = std::move(aot);
+	return true;
+}
+#endif
+
+bool LR35902::ends_block(word_t opcode)
+{
+	switch(opcode)
+	{
+		case 0x10: case 0x76:										// STOP, HALT
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:		// JR
+		case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:		// JP
+		case 0xE9:													// JP (HL)
+		case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC:		// CALL
+		case 0xC9: case 0xC0: case 0xC8: case 0xD0: case 0xD8:		// RET
+		case 0xD9:													// RETI
+		case 0xC7: case 0xCF: case 0xD7: case 0xDF:					// RST
+		case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+			return true;
+		default:
+			return LR35902::instr_length[opcode] == 0;				// Unknown opcode
+	}
+}
+
+size_t LR35902::native_length(const Block& block)
+{
+	for(size_t idx = 0; idx < block.instrs.size(); ++idx)
+		if(instr_length[block.instrs[idx].opcode] == 0)
+			return idx;
+	return block.instrs.size();
+}
+
+bool LR35902::needs_native_step(const DecodedInstr& i)
+{
+	switch(i.opcode)
+	{
+		case 0x10: case 0x76:				// STOP, HALT
+		case 0xF3: case 0xFB: case 0xD9:	// DI, EI, RETI
+			return true;
+		case 0xE0: case 0xF0:				// LDH
+			return is_io(0xFF00 + (i.operand & 0xFF));
+		case 0x08:							// LD (a16), SP
+			return is_io(i.operand) || is_io(i.operand + 1);
+		case 0xEA: case 0xFA:				// LD (a16), A, LD A, (a16)
+			return is_io(i.operand);
+		default:
+			return false;
+	}
+}
+
+bool LR35902::writes_memory(const DecodedInstr& i)
+{
+	switch(i.opcode)
+	{
+		case 0x02: case 0x12: case 0x22: case 0x32:					// LD (BC/DE/HL+/HL-), A
+		case 0x34: case 0x35: case 0x36:							// INC/DEC (HL), LD (HL), d8
+		case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x77:
+		case 0x08: case 0xEA:										// LD (a16), SP/A
+		case 0xE0: case 0xE2:										// LDH (a8), A, LD (C), A
+		case 0xC5: case 0xD5: case 0xE5: case 0xF5:					// PUSH
+			return true;
+		case 0xCB:
+			return (i.operand & 0x07) == 0x06 && !(i.operand >= 0x40 && i.operand < 0x80); // Except BIT n, (HL)
+		default:
+			return false;
+	}
+}
+
+LR35902::DecodedInstr LR35902::decode(addr_t addr) const
+{
+	DecodedInstr r;
+	r.addr = addr;
+	r.opcode = read(addr);
+	r.handler = instr_handlers[r.opcode];
+	r.cycles = instr_cycles[r.opcode];
+	// STOP operand (0x00) is not skipped; Unknown opcodes are skipped byte by byte.
+	r.length = (r.opcode == 0x10 || instr_length[r.opcode] == 0) ? 1 : instr_length[r.opcode];
+	if(r.length > 2)
+		r.operand = _mmu->read16(addr + 1);
+	else if(r.length > 1)
+		r.operand = read(addr + 1);
+	else
+		r.operand = 0;
+	return r;
 }
+
+LR35902::Block LR35902::build_block(addr_t addr, int bank)
+{
+	Block b;
+	do
+	{
+		const DecodedInstr instr = decode(addr);
+		// Instructions overlapping two banks are never cached.
+		if(_mmu->code_bank(addr + instr.length - 1) != bank)
+			break;
+		if(bank >= MMU::RAMCodeBank)
+			for(addr_t a = addr; a != static_cast<addr_t>(addr + instr.length); ++a)
+				_mmu->mark_code(a);
+		b.instrs.push_back(instr);
+		b.cycles += instr.cycles;
+		addr += instr.length;
+	} while(!ends_block(b.instrs.back().opcode) && _mmu->code_bank(addr) == bank);
+#ifdef USE_NATIVE_BLOCKS
+	b.cycles_before.reserve(b.instrs.size() + 1);
+	b.cycles_before_cb.reserve(b.instrs.size() + 1);
+	b.cycles_before.push_back(0);
+	b.cycles_before_cb.push_back(0);
+	for(const DecodedInstr& i : b.instrs)
+	{
+		b.cycles_before.push_back(b.cycles_before.back() + i.cycles);
+		b.cycles_before_cb.push_back(b.cycles_before_cb.back() + i.cycles + (i.opcode == 0xCB ? instr_cycles_cb[i.operand & 0xFF] : 0));
+	}
+#endif
+	return b;
+}
+
+const LR35902::DecodedInstr& LR35902::lookup_instr()
+{
+	_block = nullptr;
+	
+	const int bank = _mmu->code_bank(_pc);
+	if(bank >= 0)
+	{
+		if(_ram_blocks_generation != _mmu->code_generation())
+		{
+			_idle_block = nullptr;
+			_ram_blocks.clear();
+			_ram_blocks_generation = _mmu->code_generation();
+		}
+		
+		auto& blocks = (bank < MMU::RAMCodeBank) ? _rom_blocks : _ram_blocks;
+		const uint32_t key = (static_cast<uint32_t>(bank) << 16) | _pc;
+		auto it = blocks.find(key);
+		if(it == blocks.end())
+		{
+			Block b = build_block(_pc, bank);
+			if(!b.instrs.empty())
+			{
+				if(bank < MMU::RAMCodeBank && _idle_loops.count(key))
+				{
+					b.idle_loop = true;
+				} else {
+					b.idle_loop = is_idle_loop(b);
+					if(b.idle_loop && bank < MMU::RAMCodeBank)
+						_idle_loops.insert(key);
+				}
+			#ifdef USE_AOT
+				if(_aot && bank < MMU::RAMCodeBank)
+					b.native = _aot->find(key, b);
+			#endif
+			#ifdef USE_JIT
+				if(_jit && _jit_mode != JITMode::Off && bank >= MMU::RAMCodeBank)
+					b.native = _jit->find(b);
+			#endif
+				it = blocks.emplace(key, std::move(b)).first;
+			}
+		}
+		
+		if(it != blocks.end())
+		{
+			_block = &it->second;
+			_block_next = 1;
+			_block_map_generation = _mmu->map_generation();
+			_block_code_generation = _mmu->code_generation();
+			return _block->instrs[0];
+		}
+	}
+	
+	_uncached_instr = decode(_pc);
+	return _uncached_instr;
+}
+	
+inline void LR35902::dispatch(const DecodedInstr& instr)
+{
+#if defined(USE_COMPUTED_GOTO) && defined(__GNUC__)
+	// Threaded dispatch: Every handler is inlined here and reached through a single indirect jump.
+	#define LR35902_LABEL(op) &&op_##op,
+	#define LR35902_CB_LABEL(op) &&cb_op_##op,
+	static void* const labels[0x100] = { LR35902_OPCODES(LR35902_LABEL) };
+	static void* const cb_labels[0x100] = { LR35902_OPCODES(LR35902_CB_LABEL) };
+	#undef LR35902_LABEL
+	#undef LR35902_CB_LABEL
+	
+	word_t opcode = instr.opcode;
+	goto *labels[opcode];
 	
+	#define LR35902_CASE(op) \
+		op_##op: \
+			if(op == 0xCB) goto cb_prefix; \
+			exec<op>(); \
+			return;
+	LR35902_OPCODES(LR35902_CASE)
+	#undef LR35902_CASE
+	
+cb_prefix:
+	opcode = fetch();
+	add_cycles(instr_cycles_cb[opcode]);
+	goto *cb_labels[opcode];
+	
+	#define LR35902_CB_CASE(op) \
+		cb_op_##op: \
+			exec_cb<op>(); \
+			return;
+	LR35902_OPCODES(LR35902_CB_CASE)
+	#undef LR35902_CB_CASE
+#else
+	instr.handler(*this);
+#endif
+}
+
 void LR35902::execute()
 {
 	assert((_f & 0x0F) == 0);
@@ -140,298 +432,567 @@ void LR35902::execute()
 		{
 			_halt = false;
 		} else { 
-			add_cycles(4);
+			// Fast-forwards to the next cycle where an interrupt could be requested.
+			add_cycles(halt_cycles());
 			update_timing();
+		#ifdef USE_PROFILER
+			if(_profiler.enabled)
+				_profiler.halted(_clock_instr_cycles);
+		#endif
 			return;
 		}
 	}
 	
-	// Reads the next instruction opcode.
-	word_t opcode = read(_pc++);
-	add_cycles(instr_cycles[opcode]);
+#ifdef USE_JIT
+	if(_jit_flush)
+	{
+		flush_blocks();
+		_jit_flush = false;
+	}
+#endif
+	
+	// Back at the start of an idle loop after a complete iteration.
+	if(_block && _block == _idle_block && _block_next == _block->instrs.size() && _pc == _block->instrs[0].addr &&
+	   _block_map_generation == _mmu->map_generation() && _block_code_generation == _mmu->code_generation() &&
+	   _breakpoints.empty() && !_mmu->has_watchpoints() && skip_idle_loop())
+	{
+	#ifdef USE_PROFILER
+		if(_profiler.enabled)
+			_profiler.idle_loop(_mmu->code_bank(_pc), _pc, _clock_instr_cycles);
+	#endif
+		return;
+	}
+	
+	// Fetches the next instruction and its operand.
+	const DecodedInstr& instr = next_instr();
+	
+	if(_block && _block_next == 1 && _block->idle_loop)
+	{
+		_idle_block = _block;
+		_idle_start = _mmu->scheduler().now();
+		_idle_deadline = _idle_start + idle_loop_events(*_block);
+	}
+	
+#ifdef USE_NATIVE_BLOCKS
+	if(_block && (_block_next == 1 || _block->native) && _running && native_enabled() && !instrumented() && execute_native())
+		return;
+#endif
+
+#ifdef USE_TRACE
+	if(_trace.recording())
+		trace(instr);
+#endif
+
+	_pc += instr.length;
+	_operand = instr.operand;
+	add_cycles(instr.cycles);
 	
 	if(_mmu->hdma_cycles())
 		add_cycles(double_speed() ? 16 : 8);
 
-	// Decode opcode (http://www.z80.info/decoding.htm)
-	// And I thought I was being smart... A simple jumptable would have be mush cleaner in the end >.<"
-	if(opcode == 0xCB) // Prefixed instructions
+#ifdef USE_PROFILER
+	const addr_t sp = _sp;
+#endif
+#ifdef USE_COVERAGE
+	if(_coverage.enabled)
+		_coverage.executed(_mmu->code_bank(instr.addr), instr.addr);
+#endif
+	const unsigned int watch_hits = _mmu->watch_hits();
+
+	dispatch(instr);
+	++_instructions;
+	
+	_watchpoint = _mmu->watch_hits() != watch_hits;
+
+	update_timing();
+	
+#ifdef USE_PROFILER
+	if(_profiler.enabled)
+		profile(instr, sp);
+#endif
+#ifdef USE_COVERAGE
+	if(_coverage.enabled && instr.opcode == 0xE9) // JP (HL)
+		_coverage.indirect_jump(_mmu->code_bank(instr.addr), instr.addr, _mmu->code_bank(_pc), _pc);
+#endif
+	
+	_breakpoint = _watchpoint || (_breakpoint_map[_pc] && check_breakpoints());
+}
+
+size_t LR35902::run(size_t frame_limit)
+{
+	const Scheduler& scheduler = _mmu->scheduler();
+	const size_t start = frame_cycles;
+#ifdef USE_NATIVE_BLOCKS
+	_running = true;
+	_frame_limit = frame_limit;
+#endif
+	do
 	{
-		opcode = read(_pc++);
-		add_cycles(instr_cycles_cb[opcode]);
-		const word_t x = opcode >> 6; // bits 6 & 7
-		const word_t y = (opcode >> 3) & 0b111; // bits 5 - 3
-		const word_t reg = extract_src_reg(opcode);
-		
-		if(reg < 7)
+		execute();
+		if(_clock_instr_cycles == 0)
+			break;
+	} while(!_breakpoint && scheduler.now() < scheduler.next() && frame_cycles <= frame_limit);
+#ifdef USE_NATIVE_BLOCKS
+	_running = false;
+#endif
+	return frame_cycles - start;
+}
+
+#ifdef USE_PROFILER
+void LR35902::profile(const DecodedInstr& instr, addr_t sp)
+{
+	_profiler.instruction(_mmu->code_bank(instr.addr), instr.addr, instr.opcode, static_cast<word_t>(instr.operand), _clock_instr_cycles);
+	if(!_profiler.call_graph)
+		return;
+	// Conditional calls and returns are only followed if taken (SP moved).
+	switch(instr.opcode)
+	{
+		case 0xC4: case 0xCC: case 0xD4: case 0xDC: case 0xCD: // CALL
+		case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // RST
+			if(_sp == static_cast<addr_t>(sp - 2))
+				_profiler.call(_mmu->code_bank(_pc), _pc, sp);
+			break;
+		case 0xC0: case 0xC8: case 0xD0: case 0xD8: case 0xC9: case 0xD9: // RET, RETI
+			if(_sp == static_cast<addr_t>(sp + 2))
+				_profiler.ret(_sp);
+			break;
+	}
+}
+#endif
+
+#ifdef USE_TRACE
+void LR35902::trace(const DecodedInstr& instr)
+{
+	TraceRecord& r = _trace.next();
+	r.cycles = static_cast<uint32_t>(get_clock_cycles());
+	r.pc = instr.addr;
+	r.sp = _sp;
+	r.a = _a;
+	r.b = _b;
+	r.c = _c;
+	r.d = _d;
+	r.e = _e;
+	r.h = _h;
+	r.l = _l;
+	r.operand = instr.operand;
+	r.opcode = instr.opcode;
+	const int bank = _mmu->code_bank(instr.addr);
+	r.bank = bank < 0 ? TraceRecord::NoBank : static_cast<uint16_t>(bank);
+	r.flags = get_f() >> 4;
+}
+#endif
+
+void LR35902::update_timers()
+{
+	Scheduler& scheduler = _mmu->scheduler();
+	const uint64_t elapsed = scheduler.now() - _timers_clock;
+	_timers_clock = scheduler.now();
+	
+	// Updates at 16384Hz, which is ClockRate / 256. (Affected by double speed mode)
+	const uint64_t divider = _divider_register + elapsed;
+	_mmu->rw_reg(MMU::DIV) += static_cast<word_t>(divider / 256);
+	_divider_register = divider % 256;
+	
+	// TAC: Timer Control
+	// Bit 2   : Timer Enable
+	// Bit 1-0 : Select clock diviser (16 to 1024)
+	const word_t TAC = _mmu->read(MMU::TAC);
+	if(!(TAC & 0b100)) // Is TIMA timer disabled?
+	{
+		scheduler.cancel(Scheduler::Timer);
+		return;
+	}
+	
+	constexpr unsigned int Divisors[4]{1024, 16, 64, 256};
+	const unsigned int tac_divisor = Divisors[TAC & 0b11];
+	const uint64_t counter = _timer_counter + elapsed;
+	uint64_t ticks = counter / tac_divisor;
+	_timer_counter = counter % tac_divisor;
+	word_t& TIMA = _mmu->rw_reg(MMU::TIMA);
+	while(ticks > 0)
+	{
+		const unsigned int to_overflow = 0x100 - TIMA;
+		if(ticks < to_overflow)
 		{
-			word_t& r = _r[reg];
-			switch(x)
-			{
-				case 0b00: // Shift & Rotate
-				{
-					switch((opcode >> 3) & 0b111)
-					{
-						case 0: r = instr_rlc(r); break;
-						case 1: r = instr_rrc(r); break;
-						case 2: r = instr_rl(r); break;
-						case 3: r = instr_rr(r); break;
-						case 4: r = instr_sla(r); break;
-						case 5: r = instr_sra(r); break;
-						case 6: r = instr_swap(r); break;
-						case 7: r = instr_srl(r); break;
-					}
-				}
-				break;
-				case 0b01: instr_bit(y, r); break;
-				case 0b10: r = instr_res(y, r); break;
-				case 0b11: r = instr_set(y, r); break;
-				default: instr_nop(); break;
-			}
-		} else { // (HL)
-			const addr_t addr = get_hl();
-			const word_t value = read(addr);
-			switch(x)
-			{
-				case 0b00: // Shift & Rotate
-				{
-					switch((opcode >> 3) & 0b111)
-					{
-						case 0: write(addr, instr_rlc(value)); break;
-						case 1: write(addr, instr_rrc(value)); break;
-						case 2: write(addr, instr_rl(value)); break;
-						case 3: write(addr, instr_rr(value)); break;
-						case 4: write(addr, instr_sla(value)); break;
-						case 5: write(addr, instr_sra(value)); break;
-						case 6: write(addr, instr_swap(value)); break;
-						case 7: write(addr, instr_srl(value)); break;
-					}
-				}
-				break;
-				case 0b01: instr_bit(y, value); break;
-				case 0b10: write(addr, instr_res(y, value)); break;
-				case 0b11: write(addr, instr_set(y, value)); break;
-				default: instr_nop(); break;
-			}
-						
+			TIMA += static_cast<word_t>(ticks);
+			break;
+		}
+		ticks -= to_overflow;
+		TIMA = _mmu->read(MMU::TMA);
+		// Request the timer interrupt
+		_mmu->rw_reg(MMU::IF) |= MMU::TimerOverflow;
+	}
+	scheduler.schedule(Scheduler::Timer, (0x100 - TIMA) * tac_divisor - _timer_counter);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Idle loops
+
+bool LR35902::is_idle_loop(const Block& b)
+{
+	constexpr size_t MaxLength = 8;
+	// Registers (same order as _r) and flags
+	enum Resource : unsigned int
+	{
+		RegA = 0x001, RegB = 0x002, RegC = 0x004, RegD = 0x008, RegE = 0x010, RegH = 0x020, RegL = 0x040,
+		FlagsZNH = 0x080,
+		FlagCarry = 0x100,
+		AllFlags = FlagsZNH | FlagCarry
+	};
+	const auto reg = [](word_t r) { return (r > 6) ? 0u : (1u << r); };
+	
+	// Loops on itself
+	const DecodedInstr& last = b.instrs.back();
+	addr_t target;
+	unsigned int carried = 0;
+	switch(last.opcode)
+	{
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:		// JR
+			target = last.addr + last.length + from_2c_to_signed(last.operand);
+			break;
+		case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:		// JP
+			target = last.operand;
+			break;
+		default:
+			return false;
+	}
+	if(target != b.instrs[0].addr || b.instrs.size() > MaxLength)
+		return false;
+	
+	// Only reads memory, and no register carries a value from an iteration to the next.
+	unsigned int written = 0;
+	unsigned int address = 0;	///< Registers used as addresses
+	for(size_t idx = 0; idx + 1 < b.instrs.size(); ++idx)
+	{
+		const word_t op = b.instrs[idx].opcode;
+		const word_t src = extract_src_reg(op);
+		const word_t dst = extract_dst_reg(op);
+		unsigned int r = 0;
+		unsigned int w = 0;
+		unsigned int a = 0;
+		if(op == 0x00) {											// NOP
+		} else if(op >= 0x40 && op < 0x80 && dst != 7) {			// LD r, r / LD r, (HL)
+			a = (src == 7) ? (RegH | RegL) : 0;
+			r = a | reg(src);
+			w = reg(dst);
+		} else if((op & 0xC7) == 0x06 && dst != 7) {				// LD r, d8
+			w = reg(dst);
+		} else if(op == 0x01 || op == 0x11 || op == 0x21) {			// LD rr, d16
+			w = reg(1 + 2 * (op >> 4)) | reg(2 + 2 * (op >> 4));
+		} else if(op == 0x0A || op == 0x1A || op == 0xF2) {			// LD A, (BC) / LD A, (DE) / LD A, (C)
+			a = r = (op == 0x0A) ? (RegB | RegC) : (op == 0x1A) ? (RegD | RegE) : RegC;
+			w = RegA;
+		} else if(op == 0xF0 || op == 0xFA) {						// LDH A, (a8) / LD A, (a16)
+			w = RegA;
+		} else if((op >= 0x80 && op < 0xC0) || (op & 0xC7) == 0xC6) { // ALU A, r / A, (HL) / A, d8
+			const word_t kind = (op >> 3) & 0b111;
+			a = (op < 0xC0 && src == 7) ? (RegH | RegL) : 0;
+			r = RegA | a | ((op < 0xC0) ? reg(src) : 0);
+			if(kind == 1 || kind == 3)								// ADC, SBC
+				r |= FlagCarry;
+			w = (kind == 7) ? AllFlags : (RegA | AllFlags);			// CP only sets the flags
+		} else if(((op & 0xC7) == 0x04 || (op & 0xC7) == 0x05) && dst != 7) { // INC/DEC r (Carry is kept)
+			r = reg(dst);
+			w = reg(dst) | FlagsZNH;
+		} else if(op == 0xCB && in_range(b.instrs[idx].operand, 0x40, 0x80)) { // BIT b, r / BIT b, (HL)
+			const word_t cb_src = extract_src_reg(b.instrs[idx].operand);
+			a = (cb_src == 7) ? (RegH | RegL) : 0;
+			r = a | reg(cb_src);
+			w = FlagsZNH;
+		} else {
+			return false;
 		}
-	} else {
-		const word_t x = opcode >> 6; // bits 6 & 7
-		const word_t y = (opcode >> 3) & 0b111; // bits 5 - 3
+		address |= a;
+		carried |= r & ~written;
+		written |= w;
+	}
+	if(one_of(last.opcode, 0x20, 0x28, 0xC2, 0xCA))
+		carried |= FlagsZNH & ~written;
+	else if(one_of(last.opcode, 0x30, 0x38, 0xD2, 0xDA))
+		carried |= FlagCarry & ~written;
+	
+	return !(carried & written) && !(address & written);
+}
+
+unsigned int LR35902::idle_loop_events(const Block& b) const
+{
+	// HDMA cycles are added to the next instruction, don't move them.
+	if(_mmu->hdma_active())
+		return 0;
+	
+	bool gpu_modes = false;
+	for(const auto& i : b.instrs)
+	{
+		const word_t op = i.opcode;
+		addr_t addr;
+		if(op == 0x0A)
+			addr = get_bc();
+		else if(op == 0x1A)
+			addr = get_de();
+		else if(op == 0xF0)
+			addr = 0xFF00 + i.operand;
+		else if(op == 0xF2)
+			addr = 0xFF00 + _c;
+		else if(op == 0xFA)
+			addr = i.operand;
+		else if((op == 0xCB && (i.operand & 0x07) == 0x06) || (op >= 0x40 && op < 0xC0 && (op & 0x07) == 0x06))
+			addr = get_hl();
+		else
+			continue;
 		
-		switch(x)
+		if(addr < 0xA000 || (addr >= 0xC000 && addr < 0xFEA0) || addr >= 0xFF80)
+			continue; // ROM, VRAM, WRAM, OAM, HRAM, IE: Only modified by the CPU
+		switch(addr)
 		{
-			case 0b00:
-			{
-				switch(opcode & 0x0F)
-				{
-					case 0x0C: // Same logic
-					case 0x04: // INC
-					{
-						word_t dst_reg = extract_dst_reg(opcode);
-						if(dst_reg > 6) // LD (HL), d8
-							write(get_hl(), instr_inc_impl(read(get_hl())));
-						else
-							instr_inc(_r[dst_reg]);
-						break;
-					}
-					case 0x0D: // Same logic
-					case 0x05: // DEC
-					{
-						word_t dst_reg = extract_dst_reg(opcode);
-						if(dst_reg > 6) // LD (HL), d8
-							write(get_hl(), instr_dec_impl(read(get_hl())));
-						else
-							instr_dec(_r[dst_reg]);
-						break;
-					}
-					case 0x0E: // LD reg, d8
-					case 0x06:
-					{
-						word_t dst_reg = extract_dst_reg(opcode);
-						if(dst_reg > 6)	{ // LD (HL), d8
-							write(get_hl(), read(_pc++));
-						} else {
-							_r[dst_reg] = read(_pc++);
-						}
-						break;
-					}
-					default: // Uncategorized codes
-					switch(opcode)
-					{
-						case 0x00: instr_nop(); break;
-						case 0x10: instr_stop(); break;
-						case 0x20: instr_jr(!check(Flag::Zero), read(_pc++)); break;
-						case 0x30: instr_jr(!check(Flag::Carry), read(_pc++)); break;
-						
-						case 0x01: set_bc(_mmu->read16(_pc)); _pc += 2; break;
-						case 0x11: set_de(_mmu->read16(_pc)); _pc += 2; break;
-						case 0x21: set_hl(_mmu->read16(_pc)); _pc += 2; break;
-						case 0x31: _sp = _mmu->read16(_pc); _pc += 2; break;
-						
-						case 0x02: write(get_bc(), _a); break;				// LD (BC), A
-						case 0x12: write(get_de(), _a); break;				// LD (DE), A
-						case 0x22: write(get_hl(), _a); incr_hl(); break;	// LD (HL+), A
-						case 0x32: write(get_hl(), _a); decr_hl(); break;	// LD (HL-), A
-						// INC 16bits Reg
-						case 0x03: set_bc(get_bc() + 1); break;
-						case 0x13: set_de(get_de() + 1); break;
-						case 0x23: incr_hl(); break;
-						case 0x33: ++_sp; break;
-						//
-						case 0x07: instr_rlca(); break;
-						case 0x17: instr_rla(); break;
-						case 0x27: instr_daa(); break;
-						case 0x37: instr_scf(); break;
-						//
-						case 0x08: _mmu->write16(_mmu->read16(_pc), _sp); _pc += 2; break;	// 16bits LD
-						case 0x18: instr_jr(read(_pc++)); break;
-						case 0x28: instr_jr(check(Flag::Zero), read(_pc++)); break;
-						case 0x38: instr_jr(check(Flag::Carry), read(_pc++)); break;
-						// ADD HL, 16bits Reg
-						case 0x09: instr_add_hl(get_bc()); break;
-						case 0x19: instr_add_hl(get_de()); break;
-						case 0x29: instr_add_hl(get_hl()); break;
-						case 0x39: instr_add_hl(_sp); break;
-						
-						case 0x0A: _a = read(get_bc()); break;
-						case 0x1A: _a = read(get_de()); break;
-						case 0x2A: _a = read(get_hl()); incr_hl(); break;
-						case 0x3A: _a = read(get_hl()); decr_hl(); break;
-						
-						case 0x0B: set_bc(get_bc() - 1); break;
-						case 0x1B: set_de(get_de() - 1); break;
-						case 0x2B: decr_hl(); break;
-						case 0x3B: --_sp; break;
-						
-						case 0x0F: instr_rrca(); break;
-						case 0x1F: instr_rra(); break;
-						case 0x2F: instr_cpl(); break;
-						case 0x3F: instr_ccf(); break;
-						default:
-							std::cerr << "Unknown opcode: " << Hexa8(opcode) << std::endl;
-							break;
-					}
-				}
+			case MMU::LY: case MMU::STAT: case MMU::IF:
+				gpu_modes = true;
 				break;
-			}
-			case 0b01: // LD on registers
-			{
-				const word_t reg_src = extract_src_reg(opcode);
-				const word_t reg_dst = extract_dst_reg(opcode);
-				if(reg_src > 6 && reg_dst > 6) // (HL), (HL) => HALT !
-					instr_halt();
-				else if(reg_dst > 6)
-					write(get_hl(), fetch_val(reg_src));
-				else
-					_r[reg_dst] = fetch_val(reg_src);
+			case MMU::LCDC: case MMU::SCY: case MMU::SCX: case MMU::LYC: case MMU::BGP: case MMU::OBP0: case MMU::OBP1:
+			case MMU::WY: case MMU::WX: case MMU::VBK: case MMU::SVBK: case MMU::BGPI: case MMU::OBPI:
 				break;
-			}
-			case 0b10: // ALU on registers
-			{ 
-				const word_t reg_src = extract_src_reg(opcode);
-				const word_t value = fetch_val(reg_src);
-				
-				switch((opcode >> 3) & 0b111)
-				{
-					case 0: instr_add(value); break;
-					case 1: instr_adc(value); break;
-					case 2: instr_sub(value); break;
-					case 3: instr_sbc(value); break;
-					case 4: instr_and(value); break;
-					case 5: instr_xor(value); break;
-					case 6: instr_or(value); break;
-					case 7: instr_cp(value); break;
-				}
+			default:
+				return 0; // Timers, joypad, sound, external RAM...
+		}
+	}
+	return next_event_cycles(gpu_modes);
+}
+
+bool LR35902::skip_idle_loop()
+{
+	const uint64_t now = _mmu->scheduler().now();
+	// The last iteration read values that didn't change since it started, the following ones will do the
+	// same (and leave the CPU in the same state) until the next event.
+	if(_idle_deadline < now)
+		return false;
+	const unsigned int iteration = static_cast<unsigned int>(now - _idle_start);
+	const unsigned int iterations = (iteration > 0) ? static_cast<unsigned int>((_idle_deadline - now) / iteration) : 0;
+	if(iterations == 0)
+		return false;
+	
+	add_cycles(iterations * iteration);
+	update_timing();
+	
+	_idle_block = nullptr;
+	return true;
+}
+
+bool LR35902::load_idle_loops(const std::string& path)
+{
+	_idle_loops.clear();
+	std::ifstream file(path);
+	if(!file)
+		return false;
+	uint32_t key;
+	while(file >> std::hex >> key)
+		_idle_loops.insert(key);
+	return true;
+}
+
+void LR35902::save_idle_loops(const std::string& path) const
+{
+	if(_idle_loops.empty())
+		return;
+	std::ofstream file(path, std::ios::trunc);
+	for(uint32_t key : _idle_loops)
+		file << std::hex << key << std::endl;
+}
+
+#ifdef USE_NATIVE_BLOCKS
+bool LR35902::execute_native()
+{
+	Block& b = *_block;
+	const size_t start = _block_next - 1; // Where a previous run() stopped if not 0
+	if(!b.native)
+	{
+	#ifdef USE_JIT
+		if(start > 0 || _jit_mode == JITMode::Off || b.jit_rejected || ++b.executions < JITThreshold)
+			return false;
+		if(_jit->full())
+		{
+			_jit_flush = true;
+			return false;
+		}
+		b.native = _jit->compile(b, _mmu->code_bank(_pc) >= MMU::RAMCodeBank);
+		if(!b.native)
+		{
+			b.jit_rejected = true;
+			return false;
+		}
+	#else
+		return false;
+	#endif
+	}
+	
+	// Stops on breakpoints inside the block.
+	if(!_breakpoints.empty())
+		for(size_t i = start + 1; i < b.instrs.size(); ++i)
+			if(_breakpoint_map[b.instrs[i].addr])
+				return false;
+	
+	// Not worth it if the interpreter would leave run() after this instruction.
+	_native_limit = static_cast<unsigned int>(native_limit(b, start));
+	if(_native_limit < start + 2)
+		return false;
+	
+	const size_t executed = (_jit_mode == JITMode::Verify) ? verify_native(b, start) : run_native(b, start);
+	if(executed == start) // Not translated from there (see native_length)
+		return false;
+	_block_next = executed;
+	
+	update_timing();
+	
+	_watchpoint = false;
+	_breakpoint = _breakpoint_map[_pc] && check_breakpoints();
+	return true;
+}
+
+size_t LR35902::run_native(Block& b, size_t start)
+{
+	_jit_map_generation = _mmu->map_generation();
+	_jit_code_generation = _mmu->code_generation();
+	_native_next = start;
+	_native_clock = _clock_instr_cycles;
+	_native_frame = frame_cycles;
+	const size_t executed = b.native(*this);
+	add_native_cycles(b, executed);
+	return executed;
+}
+
+size_t LR35902::verify_native(Block& b, size_t start)
+{
+	// Note: The APU isn't part of the snapshot, sound registers are written twice.
+	Cartridge& cartridge = _mmu->get_cartridge();
+	const LR35902 cpu_before(*this);
+	const size_t frame_cycles_before = frame_cycles;
+	const unsigned int instr_cycles_before = _clock_instr_cycles;
+	const uint64_t instructions_before = _instructions;
+	const MMU mmu_before(*_mmu);
+	const Cartridge cartridge_before(cartridge);
+	const Scheduler scheduler_before = _mmu->scheduler();
+	
+	const size_t executed_native = run_native(b, start);
+	
+	const LR35902 cpu_native(*this);
+	const size_t frame_cycles_native = frame_cycles;
+	const unsigned int instr_cycles_native = _clock_instr_cycles;
+	const MMU mmu_native(*_mmu);
+	const Cartridge cartridge_native(cartridge);
+	const uint64_t clock_native = _mmu->scheduler().now();
+	
+	// Reference: Same instructions, interpreted up to where the translation has to stop.
+	*this = cpu_before;
+	frame_cycles = frame_cycles_before;
+	_clock_instr_cycles = instr_cycles_before;
+	_instructions = instructions_before;
+	cartridge = cartridge_before;
+	*_mmu = mmu_before; // Rebuilds the memory map: After the cartridge
+	_mmu->scheduler() = scheduler_before; // Not invalidated by the copy: Same deadlines for native_step
+	_block = &b;
+	_jit_map_generation = _mmu->map_generation();
+	_jit_code_generation = _mmu->code_generation();
+	_native_next = start;
+	_native_clock = _clock_instr_cycles;
+	_native_frame = frame_cycles;
+	const bool ram_code = _mmu->code_bank(_pc) >= MMU::RAMCodeBank;
+	const size_t length = native_length(b);
+	size_t executed = start;
+	while(executed < length && executed < _native_limit)
+	{
+		const DecodedInstr& instr = b.instrs[executed];
+		++executed;
+		if(needs_native_step(instr) || io_access(instr.opcode, instr.operand & 0xFF))
+		{
+			if(!native_step(executed - 1))
 				break;
-			}
-			case 0b11:
-			{
-				switch(opcode & 0x0F)
-				{
-					case 0x07: instr_rst(y * 0x08); break;
-					case 0x0F: instr_rst(y * 0x08); break;
-					default: // Uncategorized codes
-					switch(opcode)
-					{
-						case 0xC0: instr_ret(!check(Flag::Zero)); break;
-						case 0xD0: instr_ret(!check(Flag::Carry)); break;
-						case 0xE0: write(0xFF00 + read(_pc++), _a); break;	//	LDH (n), a	
-						case 0xF0: _a = read(0xFF00 + read(_pc++)); break;	//	LDH a, (n)
-						// POP
-						case 0xC1: set_bc(instr_pop()); break;
-						case 0xD1: set_de(instr_pop()); break;
-						case 0xE1: set_hl(instr_pop()); break;
-						case 0xF1: set_af(instr_pop()); break;
-						
-						case 0xC2: _pc += 2; instr_jp(!check(Flag::Zero), _mmu->read16(_pc - 2)); break;
-						case 0xD2: _pc += 2; instr_jp(!check(Flag::Carry), _mmu->read16(_pc - 2)); break;
-						case 0xE2: write(0xFF00 + _c, _a); break;	// LD ($FF00+C),A
-						case 0xF2: _a = read(0xFF00 + _c); break;	// LD A,($FF00+C)
-						
-						case 0xC3: instr_jp(_mmu->read16(_pc)); break;
-						case 0xF3: instr_di(); break;
-						
-						case 0xC4: _pc += 2; instr_call(!check(Flag::Zero), _mmu->read16(_pc - 2)); break;
-						case 0xD4: _pc += 2; instr_call(!check(Flag::Carry), _mmu->read16(_pc - 2)); break;
-						
-						// PUSH
-						case 0xC5: instr_push(get_bc()); break;
-						case 0xD5: instr_push(get_de()); break;
-						case 0xE5: instr_push(get_hl()); break;
-						case 0xF5: instr_push(get_af()); break;
-						
-						case 0xC6: instr_add(read(_pc++)); break;
-						case 0xD6: instr_sub(read(_pc++)); break;
-						case 0xE6: instr_and(read(_pc++)); break;
-						case 0xF6: instr_or(read(_pc++)); break;
-						
-						case 0xC8: instr_ret(check(Flag::Zero)); break;
-						case 0xD8: instr_ret(check(Flag::Carry)); break;
-						case 0xE8: instr_add_sp(read(_pc++)); break;	// ADD SP, n
-						case 0xF8: // LD HL,SP+r8     (16bits LD)
-						{
-							set_hl(add16(_sp, read(_pc++)));
-							break;
-						}
-						
-						case 0xC9: instr_ret(); break;
-						case 0xD9: instr_reti(); break;
-						case 0xE9: _pc = get_hl(); break;	// JP (HL)
-						case 0xF9: _sp = get_hl(); break;	// LD SP, HL
-						
-						case 0xCA: _pc += 2; instr_jp(check(Flag::Zero), _mmu->read16(_pc - 2)); break;
-						case 0xDA: _pc += 2; instr_jp(check(Flag::Carry), _mmu->read16(_pc - 2)); break;
-						case 0xEA: 
-							write(_mmu->read16(_pc), _a);
-							_pc += 2;
-							break;	// 16bits LD
-						case 0xFA:
-							_a = read(_mmu->read16(_pc));
-							_pc += 2;
-							break;
-						
-						case 0xFB: instr_ei(); break;
-					
-						case 0xCC: _pc += 2; instr_call(check(Flag::Zero), _mmu->read16(_pc - 2)); break;
-						case 0xDC: _pc += 2; instr_call(check(Flag::Carry), _mmu->read16(_pc - 2)); break;
-						
-						case 0xCD: _pc += 2; instr_call(_mmu->read16(_pc - 2)); break;
-						
-						case 0xCE: instr_adc(read(_pc++)); break;
-						case 0xDE: instr_sbc(read(_pc++)); break;
-						case 0xEE: instr_xor(read(_pc++)); break;
-						case 0xFE: instr_cp(read(_pc++)); break;
-						default:
-							std::cerr << "Unknown opcode: " << Hexa(opcode) << std::endl;
-							break;
-					}
-				}
-			}
+			continue;
 		}
+		_pc = instr.addr + instr.length;
+		_operand = instr.operand;
+		dispatch(instr);
+		if(_mmu->map_generation() != _jit_map_generation ||
+		   (ram_code && _mmu->code_generation() != _jit_code_generation))
+			break;
 	}
+	add_native_cycles(b, executed);
+	
+	const bool same = cpu_native._pc == _pc && cpu_native._sp == _sp && cpu_native.get_f() == get_f() &&
+		std::equal(_r, _r + 7, cpu_native._r) && cpu_native._ime == _ime &&
+		cpu_native._halt == _halt && cpu_native._stop == _stop &&
+		frame_cycles_native == frame_cycles && instr_cycles_native == _clock_instr_cycles &&
+		clock_native == _mmu->scheduler().now() && executed_native == executed &&
+		mmu_native.same_state(*_mmu) && cartridge_native.same_state(cartridge);
+	if(!same)
+	{
+		std::cerr << "JIT: Translation of the block at " << Hexa(b.instrs[0].addr) 
+				  << " doesn't match the interpreter, disabling it." << std::endl;
+		b.native = nullptr;
+		b.jit_rejected = true;
+	}
+	return executed;
+}
 
+void LR35902::add_native_cycles(const Block& b, size_t end)
+{
+	if(end <= _native_next)
+		return;
+	if(_mmu->hdma_cycles())
+		_clock_instr_cycles += double_speed() ? 16 : 8;
+	_clock_instr_cycles += b.cycles_before[end] - b.cycles_before[_native_next];
+	_instructions += end - _native_next;
+	// Native code only counts the extra cycles (taken branches...) in _clock_instr_cycles.
+	const unsigned int cycles = _clock_instr_cycles - _native_clock;
+	frame_cycles = _native_frame + (double_speed() ? cycles / 2 : cycles);
+	_native_next = end;
+}
+
+size_t LR35902::native_limit(const Block& b, size_t first) const
+{
+	// Same conditions as run(), from the cycles of the instructions executed so far: Only the last instruction
+	// of a block may take a branch, and the HDMA cycles (added to the first one) are only assumed.
+	const Scheduler& scheduler = _mmu->scheduler();
+	const uint64_t clock = scheduler.now() + _clock_instr_cycles; // Includes an interrupt serviced just before
+	const uint64_t speed = double_speed() ? 2 : 1;
+	const uint64_t hdma = _mmu->hdma_active() ? 8 * speed : 0;
+	// Cycles after which run() stops: Next event, or frame_cycles over the limit (counted at half speed in double speed mode).
+	const uint64_t until_event = scheduler.next() > clock ? scheduler.next() - clock : 0;
+	const uint64_t until_frame = frame_cycles <= _frame_limit ? (_frame_limit - frame_cycles + 1) * speed : 0;
+	const uint64_t until = std::min(until_event, until_frame);
+	if(until <= hdma)
+		return first + 1;
+	const auto end = b.cycles_before_cb.begin() + b.instrs.size();
+	return std::lower_bound(b.cycles_before_cb.begin() + first + 1, end, b.cycles_before_cb[first] + until - hdma) - b.cycles_before_cb.begin();
+}
+
+bool LR35902::native_step(size_t idx)
+{
+	const Block& b = *_block;
+	const DecodedInstr& instr = b.instrs[idx];
+	add_native_cycles(b, idx);
+	
+	// From there, the same as the interpreter: No event is due before this instruction (see native_limit).
 	update_timing();
+	_clock_instr_cycles = 0;
+	_pc = instr.addr + instr.length;
+	_operand = instr.operand;
+	add_cycles(instr.cycles);
+	if(_mmu->hdma_cycles())
+		add_cycles(double_speed() ? 16 : 8);
+	dispatch(instr);
+	++_instructions;
+	
+	_native_next = idx + 1;
+	_native_clock = _clock_instr_cycles;
+	_native_frame = frame_cycles;
 	
-	_breakpoint = std::find(_breakpoints.begin(), _breakpoints.end(), _pc) != _breakpoints.end();
+	// Where the interpreter wouldn't simply go on with the next instruction (see run and execute).
+	const Scheduler& scheduler = _mmu->scheduler();
+	if(scheduler.now() + _clock_instr_cycles >= scheduler.next() || frame_cycles > _frame_limit ||
+	   _halt || _stop || _mmu->hdma_active() ||
+	   (_ime && (_mmu->read(MMU::IF) & _mmu->read(MMU::IE) & 0x1F)) ||
+	   _mmu->map_generation() != _jit_map_generation ||
+	   (_mmu->code_bank(instr.addr) >= MMU::RAMCodeBank && _mmu->code_generation() != _jit_code_generation))
+		return false;
+	_native_limit = static_cast<unsigned int>(native_limit(b, idx + 1));
+	return true;
 }
+#endif
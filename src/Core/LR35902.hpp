@@ -1,10 +1,44 @@
 #pragma once
 
+#include <bitset>
+#include <cstdio>
+#include <set>
 #include <vector>
+#include <memory>
+#include <unordered_map>
 
 #include <gb_apu/Gb_Apu.h>
 
 #include <Core/MMU.hpp>
+#include <Core/Breakpoint.hpp>
+#include <Core/Disassembler.hpp>
+#ifdef USE_PROFILER
+	#include <Core/Profiler.hpp>
+#endif
+#ifdef USE_TRACE
+	#include <Core/Trace.hpp>
+#endif
+#ifdef USE_COVERAGE
+	#include <Core/Coverage.hpp>
+#endif
+
+// Blocks may be executed by native code: Translated at runtime (USE_JIT), or ahead of time (USE_AOT).
+#if defined(USE_JIT) || defined(USE_AOT)
+	#define USE_NATIVE_BLOCKS
+#endif
+
+/// Expands X(opcode) for each of the 256 opcodes (0x00 to 0xFF).
+#define LR35902_OPCODE_ROW(X, h) \
+	X(h##0) X(h##1) X(h##2) X(h##3) X(h##4) X(h##5) X(h##6) X(h##7) \
+	X(h##8) X(h##9) X(h##A) X(h##B) X(h##C) X(h##D) X(h##E) X(h##F)
+#define LR35902_OPCODES(X) \
+	LR35902_OPCODE_ROW(X, 0x0) LR35902_OPCODE_ROW(X, 0x1) LR35902_OPCODE_ROW(X, 0x2) LR35902_OPCODE_ROW(X, 0x3) \
+	LR35902_OPCODE_ROW(X, 0x4) LR35902_OPCODE_ROW(X, 0x5) LR35902_OPCODE_ROW(X, 0x6) LR35902_OPCODE_ROW(X, 0x7) \
+	LR35902_OPCODE_ROW(X, 0x8) LR35902_OPCODE_ROW(X, 0x9) LR35902_OPCODE_ROW(X, 0xA) LR35902_OPCODE_ROW(X, 0xB) \
+	LR35902_OPCODE_ROW(X, 0xC) LR35902_OPCODE_ROW(X, 0xD) LR35902_OPCODE_ROW(X, 0xE) LR35902_OPCODE_ROW(X, 0xF)
+
+class LR35902JIT;
+class LR35902AOT;
 
 /**
  * Gameboy CPU (Sharp LR35902)
@@ -25,15 +59,16 @@ public:
 	size_t  frame_cycles = 0;
 	
 	LR35902(MMU& _mmu, Gb_Apu& _apu);
-	~LR35902() =default;
+	~LR35902();
 	
-	explicit LR35902(const LR35902& rhs) {
-		*this = rhs;
-	}
+	explicit LR35902(const LR35902& rhs);
 	LR35902& operator=(const LR35902& rhs) {
 		_pc = rhs._pc;
 		_sp = rhs._sp;
 		_f = rhs._f;
+		_flags_op = rhs._flags_op;
+		_flags_operands = rhs._flags_operands;
+		_flags_res = rhs._flags_res;
 		
 		for(int i = 0; i < 7; ++i)
 			_r[i] = rhs._r[i];
@@ -42,6 +77,13 @@ public:
 		_stop = rhs._stop;
 		_halt = rhs._halt;
 		
+		_divider_register = rhs._divider_register;
+		_timer_counter = rhs._timer_counter;
+		_timers_clock = rhs._timers_clock;
+		
+		_block = nullptr;
+		_idle_block = nullptr;
+		
 		return *this;
 	}
 	
@@ -51,32 +93,102 @@ public:
 	/// Reset to post internal checks
 	void reset_cart();
 	
-	inline bool double_speed() const { return (_mmu->read(MMU::KEY1) & 0x80); }
-	inline uint64_t get_clock_cycles() const { return _clock_cycles; }
+	inline bool double_speed() const { return _mmu->double_speed(); }
+	inline uint64_t get_clock_cycles() const { return _mmu->scheduler().now(); }
 	inline uint64_t get_instr_cycles() const { return _clock_instr_cycles; }
+	/// Instructions executed since reset, interpreted or translated (not the iterations of skipped idle loops).
+	inline uint64_t get_instruction_count() const { return _instructions; }
 	inline addr_t get_pc() const { return _pc; }
 	inline addr_t get_sp() const { return _sp; }
-	inline addr_t get_af() const { return (static_cast<addr_t>(_a) << 8) + _f; }
+	inline addr_t get_af() const { return (static_cast<addr_t>(_a) << 8) + get_f(); }
 	inline addr_t get_bc() const { return (static_cast<addr_t>(_b) << 8) + _c; }
 	inline addr_t get_de() const { return (static_cast<addr_t>(_d) << 8) + _e; }
 	inline addr_t get_hl() const { return (static_cast<addr_t>(_h) << 8) + _l; }
 	
 	inline std::string get_disassembly() const;
 	inline std::string get_disassembly(addr_t addr) const;
+	/**
+	 * Instruction at addr followed by the memory it reads or writes in the current state
+	 * (e.g. 'LD A,(HL) = $3C'), see Disassembler::format. @return Length of the text.
+	**/
+	inline size_t get_disassembly(addr_t addr, char* buf, size_t size) const;
 	inline int get_next_opcode() const { return read(_pc); };
 	inline int get_next_operand0() const { return read(_pc + 1); };
 	inline int get_next_operand1() const { return read(_pc + 2); };
 	
+	/// True if the last instruction stopped on a breakpoint or a watchpoint (see run).
 	bool reached_breakpoint() const;
-	void add_breakpoint(addr_t addr);
-	void rem_breakpoint(addr_t addr);
-	std::vector<addr_t>& get_breakpoints();
+	/// True if the last instruction accessed a watched address (see MMU::get_watch_hit).
+	inline bool reached_watchpoint() const { return _watchpoint; }
+	/**
+	 * Stops before executing the instruction at addr, if the condition holds.
+	 * @param bank ROM bank (0x4000 - 0x7FFF) or WRAM bank (0xD000 - 0xDFFF), ignored elsewhere.
+	**/
+	void add_breakpoint(addr_t addr, int bank = Breakpoint::AnyBank, const Condition& condition = Condition());
+	void rem_breakpoint(size_t index);
+	inline const std::vector<Breakpoint>& get_breakpoints() const { return _breakpoints; }
 	void clear_breakpoints();
 	
+	/// Executes a single instruction (see get_instr_cycles).
 	void execute();
+	/**
+	 * Executes instructions until the next scheduled event (see Scheduler), a breakpoint,
+	 * or frame_cycles exceeding frame_limit. The GPU has to be stepped afterwards.
+	 * @return Cycles executed, in GPU cycles (as frame_cycles). 0 if the CPU is stuck.
+	**/
+	size_t run(size_t frame_limit = 70224);
+	
+	enum class JITMode
+	{
+		Off,
+		On,		///< Hot ROM blocks are translated to native code (see LR35902JIT)
+		Verify	///< Translated blocks are also interpreted and the results compared, one block at a time (slow)
+	};
+	
+	/// Has no effect if built without USE_JIT (Verify also checks the ahead-of-time translations with USE_AOT).
+	void set_jit(JITMode mode);
+	inline JITMode get_jit() const { return _jit_mode; }
+	
+#ifdef USE_AOT
+	/**
+	 * Loads the ahead-of-time translations of the ROM blocks (see LR35902AOT), replacing the previous ones
+	 * (dropped on error). Blocks without translation are still interpreted (or translated at runtime by the JIT).
+	**/
+	bool load_aot(const std::string& path);
+	inline const LR35902AOT* get_aot() const { return _aot.get(); }
+#endif
+	
+#ifdef USE_PROFILER
+	/// Per location instruction counts and cycles, recorded while enabled (translated blocks are interpreted instead).
+	inline Profiler& profiler() { return _profiler; }
+	inline const Profiler& profiler() const { return _profiler; }
+#endif
+#ifdef USE_TRACE
+	/// Last executed instructions, recorded while started (translated blocks are interpreted instead).
+	inline TraceRecorder& trace() { return _trace; }
+	inline const TraceRecorder& trace() const { return _trace; }
+#endif
+#ifdef USE_COVERAGE
+	/// Executed ROM code and indirect jump destinations, recorded while enabled (translated blocks are interpreted instead).
+	inline CodeCoverage& coverage() { return _coverage; }
+	inline const CodeCoverage& coverage() const { return _coverage; }
+#endif
+	
+	/// Idle loops found in ROM (see Block::idle_loop), kept across runs. Cleared by reset().
+	bool load_idle_loops(const std::string& path);
+	void save_idle_loops(const std::string& path) const;
 	
 	/// Return true if the specified flag is set, false otherwise.
-	inline bool check(Flag m) { return _f & m; }
+	inline bool check(Flag m) const
+	{
+		// Conditional jumps only need one of these, don't evaluate the others.
+		return m == Flag::Zero ? zero() : 
+			   m == Flag::Carry ? carry() :
+			   (get_f() & m);
+	}
+	
+	/// Flags register (evaluates the pending flags, see FlagsOp).
+	inline word_t get_f() const;
 	
 	// Static
 	/// Length for each instruction (in bytes)
@@ -89,7 +201,67 @@ public:
 	static std::string	instr_str[0x100];
 	static std::string	instr_cb_str[0x100];
 	
+	using InstrHandler = void (*)(LR35902&);
+	/// Native translation of a Block, from its instruction _native_next: Returns the index of the first one it didn't execute.
+	using JITCode = unsigned int (*)(LR35902&);
+	/// Handler for each instruction (one instantiation of exec<Opcode> each)
+	static const InstrHandler	instr_handlers[0x100];
+	/// Handler for each 0xCB prefixed instruction
+	static const InstrHandler	instr_cb_handlers[0x100];
+	
+	/// Instruction with its immediate operand already fetched.
+	struct DecodedInstr
+	{
+		InstrHandler	handler;	///< instr_handlers[opcode]
+		addr_t			addr;		///< Address of the opcode
+		addr_t			operand;	///< Immediate operand (8 or 16bits), or opcode following a 0xCB prefix
+		word_t			opcode;
+		word_t			length;		///< In bytes
+		word_t			cycles;		///< instr_cycles[opcode]
+	};
+	
+	/// Straight-line sequence of decoded instructions, ending with a jump (or at the end of its memory bank).
+	struct Block
+	{
+		std::vector<DecodedInstr>	instrs;
+		unsigned int				cycles = 0;	///< Sum of the base cycles of its instructions
+		/// Loops on itself, only reading memory: All its iterations are the same until this memory changes (see skip_idle_loop).
+		bool						idle_loop = false;
+	#ifdef USE_NATIVE_BLOCKS
+		/// Sums of the cycles of the instructions before each one, then of the whole block (see native_limit, add_native_cycles).
+		std::vector<unsigned int>	cycles_before;		///< Base cycles
+		std::vector<unsigned int>	cycles_before_cb;	///< With the extra cycles of the prefixed instructions
+		JITCode						native = nullptr;
+		bool						jit_rejected = false;
+	#endif
+	#ifdef USE_JIT
+		unsigned int				executions = 0;
+	#endif
+	};
+	
+	/// Drops all cached blocks.
+	void flush_blocks();
+	
+	/// Jumps, calls, returns and instructions halting the CPU.
+	static bool ends_block(word_t opcode);
+	/**
+	 * Number of instructions at the start of the block that native code may execute (see LR35902JIT, LR35902AOT):
+	 * Up to the first unknown opcode, 0 if the block has to be interpreted.
+	 * Native code stops where the interpreter would leave run() (see native_limit), and executes the instructions
+	 * changing the interrupts state or accessing I/O registers (see needs_native_step, io_access) like the
+	 * interpreter (see native_step): The other components (GPU, timers, APU, interrupts) are only synchronized
+	 * on I/O accesses and between runs, so they can't tell the difference.
+	**/
+	static size_t native_length(const Block& block);
+	/// Changes the interrupts state (EI, DI, RETI, HALT, STOP) or accesses an I/O register at a constant address.
+	static bool needs_native_step(const DecodedInstr& instr);
+	/// Writes to memory (could be a MBC register or cached code): Native code bails out after it if the executable memory changed.
+	static bool writes_memory(const DecodedInstr& instr);
+	
 private:
+	friend class LR35902JIT;
+	friend class LR35902AOT;
+	
 	MMU* const		_mmu = nullptr;
 	Gb_Apu* const	_apu = nullptr;
 	
@@ -97,14 +269,68 @@ private:
 	// Debug
 	
 	bool 					_breakpoint = false;
-	std::vector<addr_t> 	_breakpoints;
+	bool					_watchpoint = false;
+	std::vector<Breakpoint>	_breakpoints;
+	std::bitset<0x10000>	_breakpoint_map;	///< Addresses with at least one breakpoint, regardless of their bank
+	
+	/// Checks the bank and condition of the breakpoints at _pc (only called if flagged in _breakpoint_map).
+	bool check_breakpoints() const;
+#ifdef USE_PROFILER
+	Profiler				_profiler;
+	
+	/// Records the instruction just executed, and the calls/returns for the call graph.
+	void profile(const DecodedInstr& instr, addr_t sp);
+#endif
+#ifdef USE_TRACE
+	TraceRecorder			_trace;
+	
+	/// Records the state before the execution of instr (skipped idle loop iterations and halted cycles aren't).
+	void trace(const DecodedInstr& instr);
+#endif
+#ifdef USE_COVERAGE
+	CodeCoverage			_coverage;
+#endif
+	/// Every instruction has to be interpreted (profiler, trace, coverage or watchpoints enabled).
+	inline bool instrumented() const
+	{
+		if(_mmu->has_watchpoints()) return true;
+	#ifdef USE_PROFILER
+		if(_profiler.enabled) return true;
+	#endif
+	#ifdef USE_TRACE
+		if(_trace.recording()) return true;
+	#endif
+	#ifdef USE_COVERAGE
+		if(_coverage.enabled) return true;
+	#endif
+		return false;
+	}
 	
 	///////////////////////////////////////////////////////////////////////////
 	// Registers
 	
 	addr_t	_pc = 0;	///< Program Counter
 	addr_t	_sp = 0;	///< Stack Pointer Register
-	word_t	_f = 0;		///< Flags Register
+	word_t	_f = 0;		///< Flags Register (Only the flags not described by _flags_op are up to date, see get_f)
+	
+	/**
+	 * Flags are evaluated lazily: ALU instructions only record their kind and result,
+	 * most of them are overwritten before being read (by a conditional jump, PUSH AF, DAA...).
+	**/
+	enum class FlagsOp : word_t
+	{
+		None,	///< _f is up to date
+		Inc,	///< INC: Z, N, H from _flags_res, C from _f
+		Dec,	///< DEC: Z, N, H from _flags_res, C from _f
+		Add,	///< ADD/ADC: _flags_res = lhs + rhs (+ carry)
+		Sub,	///< SUB/SBC/CP: _flags_res = lhs - rhs (- carry)
+		And,	///< Z from _flags_res, H set
+		Or,		///< OR/XOR/SWAP: Z from _flags_res
+		Shift	///< Rotations/Shifts: Z from _flags_res, C from its bit 8
+	};
+	FlagsOp	_flags_op = FlagsOp::None;
+	word_t	_flags_operands = 0;	///< lhs ^ rhs of the last Add/Sub (Half carry)
+	addr_t	_flags_res = 0;			///< Result of the last operation (with its carry in bit 8)
 	
 	union ///< 8 bits general purpose registers.
 	{
@@ -130,8 +356,13 @@ private:
 	inline void set_hl(addr_t val) { _h = (val >> 8) & 0xFF; _l = val & 0xFF; } 
 	inline void set_de(addr_t val) { _d = (val >> 8) & 0xFF; _e = val & 0xFF; } 
 	inline void set_bc(addr_t val) { _b = (val >> 8) & 0xFF; _c = val & 0xFF; } 
-	inline void set_af(addr_t val) { _a = (val >> 8) & 0xFF; _f = val & 0xF0; } // Low nibble of F is always 0!
+	inline void set_af(addr_t val) { _a = (val >> 8) & 0xFF; set_f(val & 0xF0); } // Low nibble of F is always 0!
 		
+	// Immediate operands (Fetched beforehand, see DecodedInstr)
+	addr_t	_operand = 0;
+	inline word_t fetch() { return static_cast<word_t>(_operand); }
+	inline addr_t fetch16() { return _operand; }
+	
 	inline word_t fetch_hl_val() { return read(get_hl()); }
 	inline word_t fetch_val(word_t n) { return (n > 6) ? fetch_hl_val() : _r[n]; }
 	
@@ -141,9 +372,24 @@ private:
 	// Flags helpers
 	/// Sets (or clears if false is passed as second argument) the specified flag.
 	inline void set(Flag m, bool b = true)   { set(static_cast<word_t>(m), b); }
-	inline void set(word_t m, bool b = true) { _f = b ? (_f | m) : (_f & ~m); }
-	
-	// APU Intercept
+	inline void set(word_t m, bool b = true) { const word_t f = get_f(); set_f(b ? (f | m) : (f & ~m)); }
+	/// Sets all flags at once.
+	inline void set_f(word_t f) { _f = f; _flags_op = FlagsOp::None; }
+	/// Records the last ALU operation instead of evaluating the flags (see FlagsOp).
+	inline void set_lazy_flags(FlagsOp op, addr_t res, word_t operands = 0)
+	{
+		_flags_op = op;
+		_flags_res = res;
+		_flags_operands = operands;
+	}
+	/// Only the carry is kept by INC/DEC.
+	inline void keep_carry_only() { _f = carry() ? Flag::Carry : 0; }
+	inline bool zero() const { return (_flags_op == FlagsOp::None) ? (_f & Flag::Zero) : (_flags_res & 0xFF) == 0; }
+	inline bool carry() const { return (_flags_op <= FlagsOp::Dec) ? (_f & Flag::Carry) : (_flags_res & 0x100); }
+	
+	// APU and Timers Intercept
+	inline word_t read(addr_t addr);
+	/// Doesn't bring the timers up to date (see update_timers).
 	inline word_t read(addr_t addr) const;
 	inline void write(addr_t addr, word_t value);
 	
@@ -151,19 +397,126 @@ private:
 	// Interrupts management
 	
 	inline void exec_interrupt(MMU::InterruptFlag i, addr_t addr);
+	/// Advances the clock by the cycles of the last instruction.
 	inline void update_timing();
+	/// Brings DIV and TIMA up to date with the clock and schedules the next TIMA overflow.
+	void update_timers();
 	inline void check_interrupts();
+	/**
+	 * CPU cycles before the next event that may request an interrupt (TIMA overflow or GPU, see Scheduler).
+	 * @param gpu_modes Also stops at the next GPU mode change (LY, STAT).
+	**/
+	inline unsigned int next_event_cycles(bool gpu_modes) const;
+	/// Cycles the CPU can stay halted without missing an interrupt.
+	inline unsigned int halt_cycles();
 	
 	///////////////////////////////////////////////////////////////////////////
 	// Cycles management
 	
-	unsigned int _clock_cycles = 0;			///< Clock cycles since reset
+	// The clock itself is shared with the other components (see MMU::scheduler).
 	unsigned int _clock_instr_cycles = 0;	///< Clock cycles of the last instruction
+	uint64_t	_instructions = 0;			///< See get_instruction_count
 	unsigned int _divider_register = 0;		///< Cycles not yet counted in DIV
 	unsigned int _timer_counter = 0;		///< Cycles not yet counted in TIMA
+	uint64_t	 _timers_clock = 0;			///< Clock cycles when DIV and TIMA were last updated
 	
 	inline void add_cycles(unsigned int c);
 	
+	/// Executes the instruction (its cycles are already accounted for)
+	inline void dispatch(const DecodedInstr& instr);
+	
+	///////////////////////////////////////////////////////////////////////////
+	// Decoded instructions cache
+	
+	/// Blocks from the cartridge ROM, Key: (ROM Bank << 16) | Address (see MMU::code_bank)
+	std::unordered_map<uint32_t, Block>	_rom_blocks;
+	/// Blocks from WRAM/HRAM, flushed whenever one of their bytes is modified.
+	std::unordered_map<uint32_t, Block>	_ram_blocks;
+	unsigned int	_ram_blocks_generation = 0;	///< MMU code generation of _ram_blocks
+	
+	Block*			_block = nullptr;		///< Block being executed
+	size_t			_block_next = 0;		///< Index of the next instruction in _block
+	unsigned int	_block_map_generation = 0;
+	unsigned int	_block_code_generation = 0;
+	
+	DecodedInstr	_uncached_instr;		///< For code running outside of cacheable memory
+	
+	/// Returns the instruction at _pc, following the current block if possible.
+	inline const DecodedInstr& next_instr();
+	const DecodedInstr& lookup_instr();
+	DecodedInstr decode(addr_t addr) const;
+	Block build_block(addr_t addr, int bank);
+	
+	///////////////////////////////////////////////////////////////////////////
+	// Idle loops
+	
+	std::set<uint32_t>	_idle_loops;				///< ROM idle loops: (bank << 16) | address
+	const Block*		_idle_block = nullptr;		///< Idle loop being executed
+	uint64_t			_idle_start = 0;			///< Clock cycles at the start of the last iteration of _idle_block
+	uint64_t			_idle_deadline = 0;			///< Clock cycles of the next event that may change what _idle_block reads
+	
+	/// @return true if the block only polls memory in a loop (see Block::idle_loop).
+	static bool is_idle_loop(const Block& b);
+	/// @return CPU cycles before the memory read by the idle loop may change (0 if unknown).
+	unsigned int idle_loop_events(const Block& b) const;
+	/// Skips the iterations of the current idle loop preceding the next event. @return false if none was skipped.
+	bool skip_idle_loop();
+	
+	///////////////////////////////////////////////////////////////////////////
+	// JIT
+	
+	JITMode			_jit_mode = JITMode::Off;
+#ifdef USE_JIT
+	static constexpr unsigned int JITThreshold = 64;	///< Executions of a block before its translation
+	
+	std::unique_ptr<LR35902JIT>	_jit;
+	bool			_jit_flush = false;			///< The generated code reached its maximum size
+#endif
+#ifdef USE_AOT
+	std::unique_ptr<LR35902AOT>	_aot;
+#endif
+	/// I/O registers (0xFF00-0xFF7F) and IE (0xFFFF).
+	static inline bool is_io(addr_t addr) { return (addr >= 0xFF00 && addr < 0xFF80) || addr == 0xFFFF; }
+#ifdef USE_NATIVE_BLOCKS
+	unsigned int	_jit_map_generation = 0;	///< MMU map generation when entering translated code
+	unsigned int	_jit_code_generation = 0;	///< MMU code generation when entering translated code
+	
+	/// The JIT is enabled, or ahead-of-time translations are loaded.
+	inline bool native_enabled() const
+	{
+	#ifdef USE_AOT
+		if(_aot) return true;
+	#endif
+		return _jit_mode != JITMode::Off;
+	}
+	bool			_running = false;			///< In run(): Blocks are only executed by native code there
+	size_t			_frame_limit = 0;			///< frame_limit of the current run()
+	unsigned int	_native_limit = 0;			///< Instructions of the current block before leaving run() (see native_limit)
+	size_t			_native_next = 0;			///< First instruction of the current block whose base cycles aren't accounted for
+	unsigned int	_native_clock = 0;			///< _clock_instr_cycles before it
+	size_t			_native_frame = 0;			///< frame_cycles before it
+	
+	/// Executes the current block from the current instruction if it is translated (or hot enough to be). @return false otherwise.
+	bool execute_native();
+	/// @return Index of the first instruction of b not executed (start if none).
+	size_t run_native(Block& b, size_t start);
+	/// Runs the translation, then the interpreter from the same state, and compares the results.
+	size_t verify_native(Block& b, size_t start);
+	/// Adds the base cycles of the instructions of b from _native_next to end (excluded), the other ones were added while executing them.
+	void add_native_cycles(const Block& b, size_t end);
+	/// @return Index of the first instruction of b after first that the interpreter wouldn't execute before leaving run().
+	size_t native_limit(const Block& b, size_t first = 0) const;
+	/**
+	 * Executes the instruction idx of the current block for native code, exactly like the interpreter (see execute),
+	 * after accounting for the cycles of the previous ones.
+	 * @return true if native code can go on with the next instruction, false if the interpreter has to take over
+	 *         (pending interrupt, end of run(), memory remapped...).
+	**/
+	bool native_step(size_t idx);
+	/// @return true if the instruction would access an I/O register from the current state (see native_step).
+	inline bool io_access(word_t opcode, word_t cb_opcode) const;
+#endif
+	
 	///////////////////////////////////////////////////////////////////////////
 	// Stack management
 	
@@ -176,6 +529,16 @@ private:
 ///////////////////////////////////////////////////////////////////////////////
 // Implementations of inlined functions
 
+inline const LR35902::DecodedInstr& LR35902::next_instr()
+{
+	if(_block && _block_next < _block->instrs.size() &&
+		_block->instrs[_block_next].addr == _pc &&
+		_block_map_generation == _mmu->map_generation() &&
+		_block_code_generation == _mmu->code_generation())
+		return _block->instrs[_block_next++];
+	return lookup_instr();
+}
+
 inline std::string LR35902::get_disassembly() const
 {
 	return get_disassembly(_pc);
@@ -183,31 +546,39 @@ inline std::string LR35902::get_disassembly() const
 
 inline std::string LR35902::get_disassembly(addr_t addr) const
 {
-	word_t op = read(addr);
-	std::string r = (op == 0xCB) ? instr_cb_str[read(addr + 1)] : instr_str[op];
-	size_t length = (op == 0xCB) ? 2 : instr_length[op];
-	addr_t operand = (op == 0xCB) ? addr + 2 : addr + 1;
-	size_t p = std::string::npos;
-	if(length > 2)
+	char buf[64];
+	get_disassembly(addr, buf, sizeof(buf));
+	return buf;
+}
+
+inline size_t LR35902::get_disassembly(addr_t addr, char* buf, size_t size) const
+{
+	const DisassembledInstr instr = Disassembler::decode(addr, [this](addr_t a) { return _mmu->read(a); });
+	size_t length = Disassembler::format(instr, buf, size);
+	
+	int mem = -1; // Address read or written by the instruction
+	switch(instr.indirect)
 	{
-		if((p = r.find(" a16")) != std::string::npos) r.insert(p + 4, " = " + Hexa(_mmu->read16(operand)).str());
-		if((p = r.find(",a16")) != std::string::npos) r.insert(p + 4, " = " + Hexa(_mmu->read16(operand)).str());
-		if((p = r.find("(a16)")) != std::string::npos) r.insert(p + 5, " = " + Hexa8(read(_mmu->read16(operand))).str());
-		if((p = r.find("d16")) != std::string::npos) r.insert(p + 3, " = " + Hexa(_mmu->read16(operand)).str());
-	} else if(length > 1 && op != 0xCB) {
-		if((p = r.find("a8")) != std::string::npos) r.insert(p + 2, " = " + Hexa(0xFF00 + _mmu->read(operand)).str()
-							+ " => " + Hexa8(_mmu->read(0xFF00 + _mmu->read(operand))).str());
-		if((p = r.find("d8")) != std::string::npos) r.insert(p + 2, " = " + Hexa8(_mmu->read(operand)).str());
-		if((p = r.find("r8")) != std::string::npos) r.insert(p + 2, " = " + Hexa8(from_2c_to_signed(_mmu->read(operand))).str());
+		case DisassembledInstr::Indirect::BC: mem = get_bc(); break;
+		case DisassembledInstr::Indirect::DE: mem = get_de(); break;
+		case DisassembledInstr::Indirect::HL: mem = get_hl(); break;
+		case DisassembledInstr::Indirect::C: mem = 0xFF00 | _c; break;
+		default:
+			if(instr.has_target && instr.flow == DisassembledInstr::Flow::Next && instr.id != 0x08) // Not LD (a16),SP
+				mem = instr.target;
 	}
-	if((p = r.find("(BC)")) != std::string::npos) r.insert(p + 4, " = " + Hexa8(_mmu->read(get_bc())).str());
-	if((p = r.find("(DE)")) != std::string::npos) r.insert(p + 4, " = " + Hexa8(_mmu->read(get_de())).str());
-	if((p = r.find("(HL)")) != std::string::npos) r.insert(p + 4, " = " + Hexa8(_mmu->read(get_hl())).str());
-	if((p = r.find("(HL+)")) != std::string::npos) r.insert(p + 5, " = " + Hexa8(_mmu->read(get_hl())).str());
-	if((p = r.find("(HL-)")) != std::string::npos) r.insert(p + 5, " = " + Hexa8(_mmu->read(get_hl())).str());
-	return r;
-};
+	if(mem >= 0 && length + 1 < size)
+		length += std::snprintf(buf + length, size - length, " = $%02X", _mmu->read(static_cast<addr_t>(mem)));
+	return std::min(length, size - 1);
+}
 	
+inline word_t LR35902::read(addr_t addr)
+{
+	if(in_range(addr, MMU::DIV, MMU::TAC + 1))
+		update_timers();
+	return static_cast<const LR35902*>(this)->read(addr);
+}
+
 inline word_t LR35902::read(addr_t addr) const
 {
 	return in_range(addr, Gb_Apu::start_addr, Gb_Apu::end_addr) ?
@@ -218,15 +589,44 @@ inline word_t LR35902::read(addr_t addr) const
 inline void LR35902::write(addr_t addr, word_t value)
 {
 	if(in_range(addr, Gb_Apu::start_addr, Gb_Apu::end_addr))
+	{
 		_apu->write_register(frame_cycles, addr, value);
-	else
+	} else if(in_range(addr, MMU::DIV, MMU::TAC + 1)) {
+		update_timers(); // Cycles elapsed so far are counted with the previous values
 		_mmu->write(addr, value);
+		update_timers(); // Reschedules the overflow
+	} else {
+		_mmu->write(addr, value);
+	}
+}
+
+inline word_t LR35902::get_f() const
+{
+	const word_t z = ((_flags_res & 0xFF) == 0) ? Flag::Zero : 0;
+	const word_t h = ((_flags_operands ^ _flags_res) & 0x10) ? Flag::HalfCarry : 0;
+	const word_t c = (_flags_res & 0x100) ? Flag::Carry : 0;
+	switch(_flags_op)
+	{
+		case FlagsOp::None: return _f;
+		case FlagsOp::Inc: return z | (((_flags_res & 0x0F) == 0x00) ? Flag::HalfCarry : 0) | (_f & Flag::Carry);
+		case FlagsOp::Dec: return z | Flag::Negative | (((_flags_res & 0x0F) == 0x0F) ? Flag::HalfCarry : 0) | (_f & Flag::Carry);
+		case FlagsOp::Add: return z | h | c;
+		case FlagsOp::Sub: return z | Flag::Negative | h | c;
+		case FlagsOp::And: return z | Flag::HalfCarry;
+		case FlagsOp::Or: return z;
+		case FlagsOp::Shift: return z | c;
+	}
+	return _f;
 }
 
 inline void LR35902::exec_interrupt(MMU::InterruptFlag i, addr_t addr)
 {
 	push(_pc);
 	_pc = addr;
+#ifdef USE_PROFILER
+	if(_profiler.enabled && _profiler.call_graph)
+		_profiler.call(_mmu->code_bank(addr), addr, _sp + 2);
+#endif
 	_ime = false;
 	add_cycles(20);
 	_mmu->rw_reg(MMU::IF) &= ~i;
@@ -235,38 +635,28 @@ inline void LR35902::exec_interrupt(MMU::InterruptFlag i, addr_t addr)
 
 inline void LR35902::update_timing()
 {
-	_clock_cycles += _clock_instr_cycles;
-	
-	// Updates at 16384Hz, which is ClockRate / 256. (Affected by double speed mode)
-	_divider_register += _clock_instr_cycles;
-	if(_divider_register >= 256)
-	{
-		_divider_register -= 256;
-		++_mmu->rw_reg(MMU::DIV);
-	}
-	
-	// TAC: Timer Control
-	// Bit 2   : Timer Enable
-	// Bit 1-0 : Select clock diviser (16 to 1024)
-	const word_t TAC = _mmu->read(MMU::TAC);
-	if(TAC & 0b100) // Is TIMA timer enabled?
-	{
-		_timer_counter += _clock_instr_cycles;
-		constexpr unsigned int Divisors[4]{1024, 16, 64, 256};
-		const unsigned int tac_divisor = Divisors[TAC & 0b11];
-		while(_timer_counter >= tac_divisor)
-		{
-			_timer_counter -= tac_divisor;
-			if(_mmu->read(MMU::TIMA) != 0xFF)
-			{
-				++_mmu->rw_reg(MMU::TIMA);
-			} else {
-				_mmu->rw_reg(MMU::TIMA) = _mmu->read(MMU::TMA);
-				// Request the timer interrupt
-				_mmu->rw_reg(MMU::IF) |= MMU::TimerOverflow;
-			}
-		}
-	}
+	Scheduler& scheduler = _mmu->scheduler();
+	scheduler.advance(_clock_instr_cycles);
+	// DIV and TIMA are only updated when accessed (see read/write) or when TIMA overflows.
+	if(scheduler.due(Scheduler::Timer))
+		update_timers();
+}
+
+inline unsigned int LR35902::next_event_cycles(bool gpu_modes) const
+{
+	// GPU events are due until the GPU is stepped: A CPU halted without stepping it falls back to 4 cycles.
+	const Scheduler& scheduler = _mmu->scheduler();
+	uint64_t cycles = std::min(scheduler.until(Scheduler::GPUInterrupt), scheduler.until(Scheduler::Timer));
+	if(gpu_modes)
+		cycles = std::min(cycles, scheduler.until(Scheduler::GPUMode));
+	return static_cast<unsigned int>(cycles);
+}
+
+inline unsigned int LR35902::halt_cycles()
+{
+	const unsigned int cycles = next_event_cycles(false);
+	// Same number of cycles as repeatedly halting for 4 cycles until then.
+	return std::max(4u, (cycles + 3) & ~3u);
 }
 
 inline void LR35902::check_interrupts()
@@ -291,6 +681,36 @@ inline void LR35902::check_interrupts()
 	}
 }
 
+#ifdef USE_NATIVE_BLOCKS
+inline bool LR35902::io_access(word_t opcode, word_t cb_opcode) const
+{
+	switch(opcode)
+	{
+		case 0x02: case 0x0A:									// LD (BC), A, LD A, (BC)
+			return is_io(get_bc());
+		case 0x12: case 0x1A:									// LD (DE), A, LD A, (DE)
+			return is_io(get_de());
+		case 0x22: case 0x2A: case 0x32: case 0x3A:				// LD (HL+/-), A, LD A, (HL+/-)
+		case 0x34: case 0x35: case 0x36:						// INC/DEC (HL), LD (HL), d8
+			return is_io(get_hl());
+		case 0xE2: case 0xF2:									// LD (C), A, LD A, (C)
+			return is_io(0xFF00 + _c);
+		case 0xCB:
+			return (cb_opcode & 0x07) == 0x06 && is_io(get_hl());
+		case 0xC5: case 0xD5: case 0xE5: case 0xF5:				// PUSH
+		case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC:	// CALL
+		case 0xC7: case 0xCF: case 0xD7: case 0xDF:				// RST
+		case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+			return is_io(_sp - 1) || is_io(_sp - 2);
+		case 0xC1: case 0xD1: case 0xE1: case 0xF1:				// POP
+		case 0xC9: case 0xC0: case 0xC8: case 0xD0: case 0xD8:	// RET
+			return is_io(_sp) || is_io(_sp + 1);
+		default:												// LD r, (HL), LD (HL), r, ALU A, (HL)
+			return opcode >= 0x40 && opcode < 0xC0 && ((opcode & 0x07) == 0x06 || (opcode & 0xF8) == 0x70) && is_io(get_hl());
+	}
+}
+#endif
+
 inline void LR35902::add_cycles(unsigned int c)
 {
 	_clock_instr_cycles += c;
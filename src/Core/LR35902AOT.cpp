@@ -0,0 +1,87 @@
+#include "LR35902AOT.hpp"
+
+#include <algorithm>
+
+#ifndef _WIN32
+	#include <dlfcn.h>
+#endif
+
+/// @return Names of the options of abi (see LR35902AOT::Option).
+static std::string options(uint32_t abi)
+{
+	static const std::pair<uint32_t, const char*> names[] = {
+		{LR35902AOT::JIT, "JIT"}, {LR35902AOT::Profiler, "PROFILER"}, {LR35902AOT::Trace, "TRACE"},
+		{LR35902AOT::Coverage, "COVERAGE"}, {LR35902AOT::ComputedGoto, "COMPUTED_GOTO"}
+	};
+	std::string r;
+	for(const auto& n : names)
+		if(abi & n.first)
+			r += (r.empty() ? "WITH_" : ", WITH_") + std::string(n.second);
+	return r.empty() ? "no option" : r;
+}
+
+LR35902AOT::~LR35902AOT()
+{
+	unload();
+}
+
+bool LR35902AOT::load(const std::string& path, const Cartridge& c)
+{
+	unload();
+	_error.clear();
+#ifdef _WIN32
+	(void) path;
+	(void) c;
+	_error = "Ahead-of-time translations aren't supported on Windows.";
+	return false;
+#else
+	_handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if(!_handle)
+	{
+		const char* error = dlerror();
+		_error = error ? error : "Unknown error.";
+		return false;
+	}
+	using ModuleFunc = const Module* (*)();
+	const auto get_module = reinterpret_cast<ModuleFunc>(dlsym(_handle, "senboy_aot_module"));
+	const Module* module = get_module ? get_module() : nullptr;
+	if(!module)
+		_error = "Not a SenBoy module.";
+	else if(module->version != Version)
+		_error = "Module version " + std::to_string(module->version) + ", expected " + std::to_string(Version) + ".";
+	else if(module->abi != ABI)
+		_error = "Module built with different options (" + options(module->abi) + "), expected " + options(ABI) + ".";
+	else if(module->layout != layout())
+		_error = "Module built from other sources (layout mismatch), it has to be generated again.";
+	else if(module->header_checksum != c.getHeaderChecksum() || module->checksum != c.getChecksum())
+		_error = "Module translated from another ROM.";
+	if(!_error.empty())
+	{
+		unload();
+		return false;
+	}
+	_module = module;
+	return true;
+#endif
+}
+
+void LR35902AOT::unload()
+{
+	_module = nullptr;
+#ifndef _WIN32
+	if(_handle)
+		dlclose(_handle);
+#endif
+	_handle = nullptr;
+}
+
+LR35902::JITCode LR35902AOT::find(uint32_t key, const LR35902::Block& b) const
+{
+	if(!_module)
+		return nullptr;
+	const Entry* end = _module->entries + _module->count;
+	const Entry* e = std::lower_bound(_module->entries, end, key, [](const Entry& e, uint32_t key) { return e.key < key; });
+	if(e == end || e->key != key || e->instructions != b.instrs.size() || e->cycles != b.cycles)
+		return nullptr;
+	return e->code;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include <Core/LR35902.hpp>
+
+/**
+ * Ahead-of-time translations of the ROM blocks (see LR35902::Block), loaded from a module:
+ * A shared library compiled from the C++ generated by AOTCompiler (test/AOTCompiler.cpp).
+ *
+ * Each translation is a function executing the instructions of a block in a row, exactly like a LR35902JIT
+ * translation: Same instructions (LR35902::native_length), starting at LR35902::_native_next (see start),
+ * stopping where the interpreter would leave LR35902::run (see stop), leaving the instructions accessing I/O
+ * registers to LR35902::native_step (see step), and bailing out after a write remapping the memory. Its
+ * instructions are the inlined interpreter handlers with their operands known at compile time, so memory
+ * accesses go through LR35902::read/write and the MMU.
+ *
+ * The module has to be built against the same sources and options as the emulator (see ABI and layout), the
+ * emulator exporting its symbols (-rdynamic). Only supported on POSIX systems (dlopen).
+**/
+class LR35902AOT
+{
+public:
+	static constexpr uint32_t Version = 3;
+	
+	/// Build options changing the layout of LR35902 or the handlers inlined by the modules.
+	enum Option : uint32_t
+	{
+		JIT				= 0x01,
+		Profiler		= 0x02,
+		Trace			= 0x04,
+		Coverage		= 0x08,
+		ComputedGoto	= 0x10
+	};
+	
+	/// Options of this build (see Option) and Version: A module is only compatible with the build it was generated for.
+	static constexpr uint32_t ABI = (Version << 16)
+	#ifdef USE_JIT
+		| JIT
+	#endif
+	#ifdef USE_PROFILER
+		| Profiler
+	#endif
+	#ifdef USE_TRACE
+		| Trace
+	#endif
+	#ifdef USE_COVERAGE
+		| Coverage
+	#endif
+	#ifdef USE_COMPUTED_GOTO
+		| ComputedGoto
+	#endif
+		;
+	
+	/**
+	 * Fingerprint (FNV-1a) of the sizes and offsets of the members accessed by the inlined handlers: The options
+	 * don't catch a module generated from other sources, whose code would silently run on the wrong members.
+	**/
+	static constexpr uint32_t layout()
+	{
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Winvalid-offsetof" // Not standard layout, but the offsets are only compared
+		const size_t values[] = {
+			sizeof(LR35902), sizeof(MMU), sizeof(Cartridge), sizeof(Scheduler), sizeof(TileCache),
+			offsetof(LR35902, _mmu), offsetof(LR35902, _apu), offsetof(LR35902, frame_cycles),
+			offsetof(LR35902, _pc), offsetof(LR35902, _sp), offsetof(LR35902, _f), offsetof(LR35902, _flags_op),
+			offsetof(LR35902, _flags_operands), offsetof(LR35902, _flags_res), offsetof(LR35902, _r),
+			offsetof(LR35902, _ime), offsetof(LR35902, _stop), offsetof(LR35902, _halt), offsetof(LR35902, _operand),
+			offsetof(LR35902, _clock_instr_cycles), offsetof(LR35902, _instructions),
+			offsetof(LR35902, _jit_map_generation), offsetof(LR35902, _native_limit), offsetof(LR35902, _native_next),
+			offsetof(MMU, _cartridge), offsetof(MMU, _mem), offsetof(MMU, _wram), offsetof(MMU, _vram_bank1), offsetof(MMU, _cgb),
+			offsetof(MMU, _tiles), offsetof(MMU, _code_map), offsetof(MMU, _code_pages), offsetof(MMU, _code_generation),
+			offsetof(MMU, _map_generation), offsetof(MMU, _vram_generation), offsetof(MMU, _read_map),
+			offsetof(MMU, _write_map), offsetof(MMU, _read_traps), offsetof(MMU, _write_traps), offsetof(MMU, _scheduler)
+		};
+	#pragma GCC diagnostic pop
+		uint32_t h = 2166136261u;
+		for(size_t v : values)
+			h = (h ^ static_cast<uint32_t>(v)) * 16777619u;
+		return h;
+	}
+
+	/// Translation of the block starting at key, see LR35902::lookup_instr.
+	struct Entry
+	{
+		uint32_t			key;			///< (ROM bank << 16) | address
+		uint32_t			instructions;	///< Checked against the block built at runtime, with cycles
+		uint32_t			cycles;
+		LR35902::JITCode	code;
+	};
+
+	/// Returned by the 'senboy_aot_module' function of a module.
+	struct Module
+	{
+		uint32_t		version;
+		uint32_t		abi;				///< ABI of AOTCompiler, also checked when building the module
+		uint32_t		layout;				///< layout() of AOTCompiler, also checked when building the module
+		uint32_t		header_checksum;	///< Of the translated ROM
+		uint32_t		checksum;
+		uint32_t		count;
+		const Entry*	entries;			///< Sorted by key
+	};
+
+	LR35902AOT() =default;
+	LR35902AOT(const LR35902AOT&) =delete;
+	LR35902AOT& operator=(const LR35902AOT&) =delete;
+	~LR35902AOT();
+
+	/// Loads the module at path, if it matches this build and the ROM of c (see get_error).
+	bool load(const std::string& path, const Cartridge& c);
+	void unload();
+	inline const std::string& get_error() const { return _error; }
+	inline size_t size() const { return _module ? _module->count : 0; }
+
+	/// @return Translation of the block b starting at key, nullptr if there's none (or if it doesn't match b).
+	LR35902::JITCode find(uint32_t key, const LR35902::Block& b) const;
+
+	// Used by the generated code.
+
+	/// Executes the (non prefixed) instruction Opcode, next is the address of the following instruction.
+	template<word_t Opcode>
+	static inline void exec(LR35902& cpu, addr_t next, addr_t operand = 0)
+	{
+		cpu._pc = next;
+		cpu._operand = operand;
+		cpu.exec<Opcode>();
+	}
+
+	/// Executes the 0xCB prefixed instruction Opcode.
+	template<word_t Opcode>
+	static inline void exec_cb(LR35902& cpu, addr_t next)
+	{
+		cpu._pc = next;
+		cpu.add_cycles(LR35902::instr_cycles_cb[Opcode]);
+		cpu.exec_cb<Opcode>();
+	}
+
+	/// Index of the first instruction to execute.
+	static inline unsigned int start(const LR35902& cpu) { return static_cast<unsigned int>(cpu._native_next); }
+	
+	/// The interpreter would leave LR35902::run before the instruction at index idx of the block.
+	static inline bool stop(const LR35902& cpu, unsigned int idx) { return idx >= cpu._native_limit; }
+	
+	/// The instruction Opcode would access an I/O register: It has to be executed by step.
+	template<word_t Opcode>
+	static inline bool io_access(const LR35902& cpu, word_t cb_opcode = 0) { return cpu.io_access(Opcode, cb_opcode); }
+	
+	/// Executes the instruction at index idx like the interpreter (see LR35902::native_step), false if the translation has to return.
+	static inline bool step(LR35902& cpu, unsigned int idx) { return cpu.native_step(idx); }
+
+	/// The memory map changed (bank switch...) since the start of the block: The following instructions may not be the translated ones.
+	static inline bool remapped(const LR35902& cpu) { return cpu._mmu->map_generation() != cpu._jit_map_generation; }
+
+private:
+	void*			_handle = nullptr;
+	const Module*	_module = nullptr;
+	std::string		_error;
+};
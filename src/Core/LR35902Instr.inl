@@ -3,8 +3,8 @@
 ******************************************************************************/
 	
 // Helper functions on opcodes
-static inline word_t extract_src_reg(word_t opcode) { return (opcode + 1) & 0b111; }
-static inline word_t extract_dst_reg(word_t opcode) { return ((opcode >> 3) + 1) & 0b111; }
+static constexpr word_t extract_src_reg(word_t opcode) { return (opcode + 1) & 0b111; }
+static constexpr word_t extract_dst_reg(word_t opcode) { return ((opcode >> 3) + 1) & 0b111; }
 inline void rel_jump(word_t offset) { _pc += from_2c_to_signed(offset); }
 static inline int from_2c_to_signed(word_t src) { return static_cast<int8_t>(src); }
 
@@ -38,23 +38,17 @@ inline void instr_halt()
 **/
 inline void instr_add(word_t src)
 {
-	set(Flag::HalfCarry, ((_a & 0xF) + (src & 0xF)) > 0x0F);
-	uint16_t t = _a + src;
-	set(Flag::Carry, t > 0xFF);
+	const addr_t t = _a + src;
+	set_lazy_flags(FlagsOp::Add, t, _a ^ src);
 	_a = t & 0xFF;
-	set(Flag::Zero, _a == 0);
-	set(Flag::Negative, false);
 }
 	
 /// Add n + Carry flag to A.
 inline void instr_adc(word_t src)
 {
-	set(Flag::HalfCarry, ((((_a & 0xF) + (src & 0xF) + (check(Flag::Carry) ? 1 : 0)) > 0xF)));
-	uint16_t t = _a + src + (check(Flag::Carry) ? 1 : 0);
-	set(Flag::Carry, t > 0xFF);
+	const addr_t t = _a + src + (carry() ? 1 : 0);
+	set_lazy_flags(FlagsOp::Add, t, _a ^ src);
 	_a = t & 0xFF;
-	set(Flag::Zero, _a == 0);
-	set(Flag::Negative, false);
 }
 
 /**
@@ -102,11 +96,9 @@ inline void instr_add_hl(addr_t src)
 **/
 inline void instr_sub(word_t src)
 {
-	set(Flag::HalfCarry, (_a & 0xF) < (src & 0xF));
-	set(Flag::Carry, _a < src);
-	_a -= src;
-	set(Flag::Zero, _a == 0);
-	set(Flag::Negative, true);
+	const addr_t t = _a - src; // Borrow in bit 8
+	set_lazy_flags(FlagsOp::Sub, t, _a ^ src);
+	_a = t & 0xFF;
 }
 
 /**
@@ -118,20 +110,16 @@ inline void instr_sub(word_t src)
 **/
 inline void instr_sbc(word_t src)
 {
-	set(Flag::HalfCarry, (_a & 0xF) < (src & 0xF) + (check(Flag::Carry) ? 1 : 0));
-	int16_t t = _a - src - (check(Flag::Carry) ? 1 : 0);
-	set(Flag::Carry, t < 0x00);
+	const addr_t t = _a - src - (carry() ? 1 : 0);
+	set_lazy_flags(FlagsOp::Sub, t, _a ^ src);
 	_a = t & 0xFF;
-	set(Flag::Zero, _a == 0);
-	set(Flag::Negative, true);
 }
 
 inline word_t instr_inc_impl(word_t src)
 {
-	set(Flag::HalfCarry, (src & 0x0F) == 0x0F);
 	++src;
-	set(Flag::Zero, src == 0);
-	set(Flag::Negative, false);
+	keep_carry_only();
+	set_lazy_flags(FlagsOp::Inc, src);
 	return src;
 }
 
@@ -142,10 +130,9 @@ inline void instr_inc(word_t& src)
 
 inline word_t instr_dec_impl(word_t src)
 {
-	set(Flag::HalfCarry, (src & 0x0F) == 0x00);
 	--src;
-	set(Flag::Zero, src == 0);
-	set(Flag::Negative, true);
+	keep_carry_only();
+	set_lazy_flags(FlagsOp::Dec, src);
 	return src;
 }
 
@@ -201,19 +188,19 @@ inline void instr_daa()
 inline void instr_and(word_t src)
 {
 	_a &= src;
-	_f = Flag::HalfCarry | ((_a == 0) ? Flag::Zero : 0);
+	set_lazy_flags(FlagsOp::And, _a);
 }
 
 inline void instr_or(word_t src)
 {
 	_a |= src;
-	_f = (_a == 0) ? Flag::Zero : 0;
+	set_lazy_flags(FlagsOp::Or, _a);
 }
 
 inline void instr_xor(word_t src)
 {
 	_a ^= src;
-	_f = (_a == 0) ? Flag::Zero : 0;
+	set_lazy_flags(FlagsOp::Or, _a);
 }
 
 /**
@@ -227,10 +214,7 @@ inline void instr_xor(word_t src)
 */
 inline void instr_cp(word_t src)
 {
-	set(Flag::HalfCarry, (_a & 0xF) < (src & 0xF));
-	set(Flag::Carry, _a < src);
-	set(Flag::Zero, _a == src);
-	set(Flag::Negative, true);
+	set_lazy_flags(FlagsOp::Sub, _a - src, _a ^ src);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -246,7 +230,7 @@ inline void instr_cp(word_t src)
 inline word_t instr_swap(word_t v)
 {
 	v = ((v << 4) & 0xF0) | ((v >> 4) & 0x0F);
-	_f = (v == 0) ? Flag::Zero : 0;
+	set_lazy_flags(FlagsOp::Or, v);
 	return v;
 }
 
@@ -389,12 +373,9 @@ inline void instr_rra()
 **/
 inline word_t instr_rl(word_t v)
 {
-	word_t t = v << 1;
-	if(check(Flag::Carry)) t |= 1;
-	_f = 0;
-	set(Flag::Carry, v & 0x80);
-	set(Flag::Zero, t == 0);
-	return t;
+	const addr_t t = (v << 1) | (carry() ? 1 : 0); // Old bit 7 in bit 8
+	set_lazy_flags(FlagsOp::Shift, t);
+	return t & 0xFF;
 }
 
 /**
@@ -407,12 +388,9 @@ inline word_t instr_rl(word_t v)
 **/
 inline word_t instr_rlc(word_t v)
 {
-	_f = 0;
-	set(Flag::Carry, v & 0x80);
-	word_t t = v << 1;
-	if(v & 0x80) t |= 1;
-	set(Flag::Zero, t == 0);
-	return t;
+	const addr_t t = (v << 1) | (v >> 7);
+	set_lazy_flags(FlagsOp::Shift, t);
+	return t & 0xFF;
 }
 
 /**
@@ -425,12 +403,9 @@ inline word_t instr_rlc(word_t v)
 **/
 inline word_t instr_rrc(word_t v)
 {
-	_f = 0;
-	set(Flag::Carry, v & 1);
-	word_t t = v >> 1;
-	if(v & 1) t |= 0x80;
-	set(Flag::Zero, t == 0);
-	return t;
+	const addr_t t = (v >> 1) | ((v & 1) << 7) | ((v & 1) << 8);
+	set_lazy_flags(FlagsOp::Shift, t);
+	return t & 0xFF;
 }
 
 /**
@@ -443,12 +418,9 @@ inline word_t instr_rrc(word_t v)
 */
 inline word_t instr_rr(word_t v)
 {
-	word_t t = v >> 1;
-	if(check(Flag::Carry)) t |= 0x80;
-	_f = 0;
-	set(Flag::Carry, v & 1);
-	set(Flag::Zero, t == 0);
-	return t;
+	const addr_t t = (v >> 1) | (carry() ? 0x80 : 0) | ((v & 1) << 8);
+	set_lazy_flags(FlagsOp::Shift, t);
+	return t & 0xFF;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -460,32 +432,25 @@ inline word_t instr_rr(word_t v)
 /// Shift n left into Carry. LSB of n set to 0.
 inline word_t instr_sla(word_t v)
 {
-	_f = 0;
-	set(Flag::Carry, v & 0x80);
-	v = v << 1;
-	set(Flag::Zero, v == 0);
-	return v;
+	const addr_t t = v << 1;
+	set_lazy_flags(FlagsOp::Shift, t);
+	return t & 0xFF;
 }
 
 /// Shift n right into Carry. MSB doesn't change.
 inline word_t instr_sra(word_t v)
 {
-	_f = 0;
-	word_t t = v & 0x80;
-	set(Flag::Carry, v & 1);
-	v = (v >> 1) | t;
-	set(Flag::Zero, v == 0);
-	return v;
+	const addr_t t = (v >> 1) | (v & 0x80) | ((v & 1) << 8);
+	set_lazy_flags(FlagsOp::Shift, t);
+	return t & 0xFF;
 }
 
 /// Shift n right into Carry. MSB set to 0.
 inline word_t instr_srl(word_t v)
 {
-	_f = 0;
-	set(Flag::Carry, v & 1);
-	v = (v >> 1);
-	set(Flag::Zero, v == 0);
-	return v;
+	const addr_t t = (v >> 1) | ((v & 1) << 8);
+	set_lazy_flags(FlagsOp::Shift, t);
+	return t & 0xFF;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -580,3 +545,286 @@ inline word_t instr_res(word_t bit, word_t r)
 
 ///////////////////////////////////////////////////////////////////////////////
 
+///////////////////////////////////////////////////////////////////////////////
+// Opcode handlers
+
+/**
+ * Executes the (non prefixed) instruction 'Opcode'.
+ * Decoding (http://www.z80.info/decoding.htm) is resolved at compile time,
+ * each instantiation only keeps the code of its own instruction.
+**/
+template<word_t Opcode>
+inline void exec()
+{
+	constexpr word_t x = Opcode >> 6;			// bits 6 & 7
+	constexpr word_t y = (Opcode >> 3) & 0b111;	// bits 5 - 3
+	
+	switch(x)
+	{
+		case 0b00:
+		{
+			switch(Opcode & 0x0F)
+			{
+				case 0x0C: // Same logic
+				case 0x04: // INC
+				{
+					constexpr word_t dst_reg = extract_dst_reg(Opcode);
+					if(dst_reg > 6) // INC (HL)
+						write(get_hl(), instr_inc_impl(read(get_hl())));
+					else
+						instr_inc(_r[dst_reg]);
+					break;
+				}
+				case 0x0D: // Same logic
+				case 0x05: // DEC
+				{
+					constexpr word_t dst_reg = extract_dst_reg(Opcode);
+					if(dst_reg > 6) // DEC (HL)
+						write(get_hl(), instr_dec_impl(read(get_hl())));
+					else
+						instr_dec(_r[dst_reg]);
+					break;
+				}
+				case 0x0E: // LD reg, d8
+				case 0x06:
+				{
+					constexpr word_t dst_reg = extract_dst_reg(Opcode);
+					if(dst_reg > 6) // LD (HL), d8
+						write(get_hl(), fetch());
+					else
+						_r[dst_reg] = fetch();
+					break;
+				}
+				default: // Uncategorized codes
+				switch(Opcode)
+				{
+					case 0x00: instr_nop(); break;
+					case 0x10: instr_stop(); break;
+					case 0x20: instr_jr(!check(Flag::Zero), fetch()); break;
+					case 0x30: instr_jr(!check(Flag::Carry), fetch()); break;
+					
+					case 0x01: set_bc(fetch16()); break;
+					case 0x11: set_de(fetch16()); break;
+					case 0x21: set_hl(fetch16()); break;
+					case 0x31: _sp = fetch16(); break;
+					
+					case 0x02: write(get_bc(), _a); break;				// LD (BC), A
+					case 0x12: write(get_de(), _a); break;				// LD (DE), A
+					case 0x22: write(get_hl(), _a); incr_hl(); break;	// LD (HL+), A
+					case 0x32: write(get_hl(), _a); decr_hl(); break;	// LD (HL-), A
+					// INC 16bits Reg
+					case 0x03: set_bc(get_bc() + 1); break;
+					case 0x13: set_de(get_de() + 1); break;
+					case 0x23: incr_hl(); break;
+					case 0x33: ++_sp; break;
+					//
+					case 0x07: instr_rlca(); break;
+					case 0x17: instr_rla(); break;
+					case 0x27: instr_daa(); break;
+					case 0x37: instr_scf(); break;
+					//
+					case 0x08: _mmu->write16(fetch16(), _sp); break;	// 16bits LD
+					case 0x18: instr_jr(fetch()); break;
+					case 0x28: instr_jr(check(Flag::Zero), fetch()); break;
+					case 0x38: instr_jr(check(Flag::Carry), fetch()); break;
+					// ADD HL, 16bits Reg
+					case 0x09: instr_add_hl(get_bc()); break;
+					case 0x19: instr_add_hl(get_de()); break;
+					case 0x29: instr_add_hl(get_hl()); break;
+					case 0x39: instr_add_hl(_sp); break;
+					
+					case 0x0A: _a = read(get_bc()); break;
+					case 0x1A: _a = read(get_de()); break;
+					case 0x2A: _a = read(get_hl()); incr_hl(); break;
+					case 0x3A: _a = read(get_hl()); decr_hl(); break;
+					
+					case 0x0B: set_bc(get_bc() - 1); break;
+					case 0x1B: set_de(get_de() - 1); break;
+					case 0x2B: decr_hl(); break;
+					case 0x3B: --_sp; break;
+					
+					case 0x0F: instr_rrca(); break;
+					case 0x1F: instr_rra(); break;
+					case 0x2F: instr_cpl(); break;
+					case 0x3F: instr_ccf(); break;
+				}
+			}
+			break;
+		}
+		case 0b01: // LD on registers
+		{
+			constexpr word_t reg_src = extract_src_reg(Opcode);
+			constexpr word_t reg_dst = extract_dst_reg(Opcode);
+			if(reg_src > 6 && reg_dst > 6) // (HL), (HL) => HALT !
+				instr_halt();
+			else if(reg_dst > 6)
+				write(get_hl(), fetch_val(reg_src));
+			else
+				_r[reg_dst] = fetch_val(reg_src);
+			break;
+		}
+		case 0b10: // ALU on registers
+		{ 
+			const word_t value = fetch_val(extract_src_reg(Opcode));
+			switch(y)
+			{
+				case 0: instr_add(value); break;
+				case 1: instr_adc(value); break;
+				case 2: instr_sub(value); break;
+				case 3: instr_sbc(value); break;
+				case 4: instr_and(value); break;
+				case 5: instr_xor(value); break;
+				case 6: instr_or(value); break;
+				case 7: instr_cp(value); break;
+			}
+			break;
+		}
+		case 0b11:
+		{
+			switch(Opcode & 0x0F)
+			{
+				case 0x07: instr_rst(y * 0x08); break;
+				case 0x0F: instr_rst(y * 0x08); break;
+				default: // Uncategorized codes
+				switch(Opcode)
+				{
+					case 0xC0: instr_ret(!check(Flag::Zero)); break;
+					case 0xD0: instr_ret(!check(Flag::Carry)); break;
+					case 0xE0: write(0xFF00 + fetch(), _a); break;	//	LDH (n), a	
+					case 0xF0: _a = read(0xFF00 + fetch()); break;	//	LDH a, (n)
+					// POP
+					case 0xC1: set_bc(instr_pop()); break;
+					case 0xD1: set_de(instr_pop()); break;
+					case 0xE1: set_hl(instr_pop()); break;
+					case 0xF1: set_af(instr_pop()); break;
+					
+					case 0xC2: instr_jp(!check(Flag::Zero), fetch16()); break;
+					case 0xD2: instr_jp(!check(Flag::Carry), fetch16()); break;
+					case 0xE2: write(0xFF00 + _c, _a); break;	// LD ($FF00+C),A
+					case 0xF2: _a = read(0xFF00 + _c); break;	// LD A,($FF00+C)
+					
+					case 0xC3: instr_jp(fetch16()); break;
+					case 0xF3: instr_di(); break;
+					
+					case 0xC4: instr_call(!check(Flag::Zero), fetch16()); break;
+					case 0xD4: instr_call(!check(Flag::Carry), fetch16()); break;
+					
+					// PUSH
+					case 0xC5: instr_push(get_bc()); break;
+					case 0xD5: instr_push(get_de()); break;
+					case 0xE5: instr_push(get_hl()); break;
+					case 0xF5: instr_push(get_af()); break;
+					
+					case 0xC6: instr_add(fetch()); break;
+					case 0xD6: instr_sub(fetch()); break;
+					case 0xE6: instr_and(fetch()); break;
+					case 0xF6: instr_or(fetch()); break;
+					
+					case 0xC8: instr_ret(check(Flag::Zero)); break;
+					case 0xD8: instr_ret(check(Flag::Carry)); break;
+					case 0xE8: instr_add_sp(fetch()); break;		// ADD SP, n
+					case 0xF8: set_hl(add16(_sp, fetch())); break;	// LD HL,SP+r8 (16bits LD)
+					
+					case 0xC9: instr_ret(); break;
+					case 0xD9: instr_reti(); break;
+					case 0xE9: _pc = get_hl(); break;	// JP (HL)
+					case 0xF9: _sp = get_hl(); break;	// LD SP, HL
+					
+					case 0xCA: instr_jp(check(Flag::Zero), fetch16()); break;
+					case 0xDA: instr_jp(check(Flag::Carry), fetch16()); break;
+					case 0xEA: write(fetch16(), _a); break;	// 16bits LD
+					case 0xFA: _a = read(fetch16()); break;
+					
+					case 0xCB: // Prefix
+					{
+						const word_t opcode = fetch();
+						add_cycles(instr_cycles_cb[opcode]);
+						instr_cb_handlers[opcode](*this);
+						break;
+					}
+					case 0xFB: instr_ei(); break;
+				
+					case 0xCC: instr_call(check(Flag::Zero), fetch16()); break;
+					case 0xDC: instr_call(check(Flag::Carry), fetch16()); break;
+					
+					case 0xCD: instr_call(fetch16()); break;
+					
+					case 0xCE: instr_adc(fetch()); break;
+					case 0xDE: instr_sbc(fetch()); break;
+					case 0xEE: instr_xor(fetch()); break;
+					case 0xFE: instr_cp(fetch()); break;
+					default:
+						std::cerr << "Unknown opcode: " << Hexa8(Opcode) << std::endl;
+						break;
+				}
+			}
+		}
+	}
+}
+
+/// Executes the 0xCB prefixed instruction 'Opcode'.
+template<word_t Opcode>
+inline void exec_cb()
+{
+	constexpr word_t x = Opcode >> 6;			// bits 6 & 7
+	constexpr word_t y = (Opcode >> 3) & 0b111;	// bits 5 - 3
+	constexpr word_t reg = extract_src_reg(Opcode);
+	
+	if(reg < 7)
+	{
+		word_t& r = _r[reg];
+		switch(x)
+		{
+			case 0b00: // Shift & Rotate
+			{
+				switch(y)
+				{
+					case 0: r = instr_rlc(r); break;
+					case 1: r = instr_rrc(r); break;
+					case 2: r = instr_rl(r); break;
+					case 3: r = instr_rr(r); break;
+					case 4: r = instr_sla(r); break;
+					case 5: r = instr_sra(r); break;
+					case 6: r = instr_swap(r); break;
+					case 7: r = instr_srl(r); break;
+				}
+			}
+			break;
+			case 0b01: instr_bit(y, r); break;
+			case 0b10: r = instr_res(y, r); break;
+			case 0b11: r = instr_set(y, r); break;
+		}
+	} else { // (HL)
+		const addr_t addr = get_hl();
+		const word_t value = read(addr);
+		switch(x)
+		{
+			case 0b00: // Shift & Rotate
+			{
+				switch(y)
+				{
+					case 0: write(addr, instr_rlc(value)); break;
+					case 1: write(addr, instr_rrc(value)); break;
+					case 2: write(addr, instr_rl(value)); break;
+					case 3: write(addr, instr_rr(value)); break;
+					case 4: write(addr, instr_sla(value)); break;
+					case 5: write(addr, instr_sra(value)); break;
+					case 6: write(addr, instr_swap(value)); break;
+					case 7: write(addr, instr_srl(value)); break;
+				}
+			}
+			break;
+			case 0b01: instr_bit(y, value); break;
+			case 0b10: write(addr, instr_res(y, value)); break;
+			case 0b11: write(addr, instr_set(y, value)); break;
+		}
+	}
+}
+
+template<word_t Opcode>
+static void instr_handler(LR35902& cpu) { cpu.exec<Opcode>(); }
+
+template<word_t Opcode>
+static void instr_cb_handler(LR35902& cpu) { cpu.exec_cb<Opcode>(); }
+
+///////////////////////////////////////////////////////////////////////////////
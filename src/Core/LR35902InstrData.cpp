@@ -13,10 +13,10 @@ size_t	LR35902::instr_length[0x100] = {
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 9
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // A
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // B
-	1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1, // C
+	1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // C
 	1, 1, 3, 0, 3, 1, 2, 1, 1, 1, 3, 0, 3, 0, 2, 1, // D
-	2, 1, 2, 0, 0, 1, 2, 1, 2, 1, 3, 0, 0, 0, 2, 1, // E
-	2, 1, 2, 1, 0, 1, 2, 1, 2, 1, 3, 1, 0, 0, 2, 1  // F
+	2, 1, 1, 0, 0, 1, 2, 1, 2, 1, 3, 0, 0, 0, 2, 1, // E
+	2, 1, 1, 1, 0, 1, 2, 1, 2, 1, 3, 1, 0, 0, 2, 1  // F
 //  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
 };
 
@@ -60,6 +60,18 @@ size_t	LR35902::instr_cycles_cb[0x100] = {
 //  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
 };
 
+#define LR35902_HANDLER(op) &LR35902::instr_handler<op>,
+const LR35902::InstrHandler	LR35902::instr_handlers[0x100] = {
+	LR35902_OPCODES(LR35902_HANDLER)
+};
+#undef LR35902_HANDLER
+
+#define LR35902_CB_HANDLER(op) &LR35902::instr_cb_handler<op>,
+const LR35902::InstrHandler	LR35902::instr_cb_handlers[0x100] = {
+	LR35902_OPCODES(LR35902_CB_HANDLER)
+};
+#undef LR35902_CB_HANDLER
+
 std::string	LR35902::instr_str[0x100] = {
 	"NOP",
 	"LD BC,d16",
@@ -0,0 +1,770 @@
+#include "LR35902JIT.hpp"
+
+#include <cstring>
+#include <initializer_list>
+
+#if !defined(__x86_64__) && !defined(_M_X64)
+	#error "LR35902JIT: Only x86-64 is supported (disable WITH_JIT)."
+#endif
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+namespace
+{
+
+/// Minimal x86-64 encoder, all CPU fields are addressed as [rbx + disp32] (rbx = LR35902*).
+struct Emitter
+{
+	enum Reg8 : unsigned char { AL = 0, CL = 1, DL = 2, AH = 4 };
+
+	std::vector<unsigned char>	code;
+
+	void b(unsigned char v) { code.push_back(v); }
+	void bytes(std::initializer_list<unsigned char> l) { code.insert(code.end(), l.begin(), l.end()); }
+	void d16(uint16_t v) { b(v & 0xFF); b(v >> 8); }
+	void d32(uint32_t v) { for(int i = 0; i < 4; ++i) b((v >> (8 * i)) & 0xFF); }
+	void d64(uint64_t v) { for(int i = 0; i < 8; ++i) b((v >> (8 * i)) & 0xFF); }
+
+	/// opcode reg, [rbx + disp]
+	void mem(std::initializer_list<unsigned char> opcode, unsigned char reg, int32_t disp)
+	{
+		bytes(opcode);
+		b(0x80 | (reg << 3) | 0x03);
+		d32(static_cast<uint32_t>(disp));
+	}
+
+	void load8(Reg8 r, int32_t disp)		{ mem({0x8A}, r, disp); }		// mov r8, [rbx + disp]
+	void store8(int32_t disp, Reg8 r)		{ mem({0x88}, r, disp); }		// mov [rbx + disp], r8
+	void store8_imm(int32_t disp, uint8_t v)	{ mem({0xC6}, 0, disp); b(v); }			// mov byte [rbx + disp], imm8
+	void store16_imm(int32_t disp, uint16_t v)	{ mem({0x66, 0xC7}, 0, disp); d16(v); }	// mov word [rbx + disp], imm16
+	void movzx8(Reg8 r, int32_t disp)		{ mem({0x0F, 0xB6}, r, disp); }	// movzx r32, byte [rbx + disp]
+	void movzx16(Reg8 r, int32_t disp)		{ mem({0x0F, 0xB7}, r, disp); }	// movzx r32, word [rbx + disp]
+	void store16(int32_t disp, Reg8 r)		{ mem({0x66, 0x89}, r, disp); }	// mov [rbx + disp], r16
+	void add32_imm(int32_t disp, uint32_t v)	{ mem({0x81}, 0, disp); d32(v); }		// add dword [rbx + disp], imm32
+	void cmp8_imm(int32_t disp, uint8_t v)	{ mem({0x80}, 7, disp); b(v); }			// cmp byte [rbx + disp], imm8
+	void mov_eax_imm(uint32_t v)			{ b(0xB8); d32(v); }
+	void mov_r8d_imm(uint32_t v)			{ bytes({0x41, 0xB8}); d32(v); }
+	void movzx_r8d(int32_t disp)			{ mem({0x44, 0x0F, 0xB6}, 0, disp); }	// movzx r8d, byte [rbx + disp]
+
+	/// eax = 16bits register pair (high byte first in memory, see LR35902::_r)
+	void load_pair(int32_t hi)	{ movzx16(AL, hi); bytes({0x66, 0xC1, 0xC0, 0x08}); }	// rol ax, 8
+	/// Register pair = ax (clobbers it)
+	void store_pair(int32_t hi)	{ bytes({0x66, 0xC1, 0xC0, 0x08}); store16(hi, AL); }
+
+	void mov_rax_imm(uint64_t v) { bytes({0x48, 0xB8}); d64(v); }
+
+	/// call f(rbx)
+	void call(const void* f)
+	{
+	#ifdef _WIN32
+		bytes({0x48, 0x89, 0xD9});	// mov rcx, rbx
+	#else
+		bytes({0x48, 0x89, 0xDF});	// mov rdi, rbx
+	#endif
+		mov_rax_imm(reinterpret_cast<uint64_t>(f));
+		bytes({0xFF, 0xD0});		// call rax
+	}
+
+	/// call f(rbx, v)
+	void call(const void* f, uint32_t v)
+	{
+	#ifdef _WIN32
+		b(0xBA);	// mov edx, imm32
+	#else
+		b(0xBE);	// mov esi, imm32
+	#endif
+		d32(v);
+		call(f);
+	}
+
+	/// call f(rbx, eax, r8d)
+	void call_access(const void* f)
+	{
+	#ifdef _WIN32
+		bytes({0x89, 0xC2, 0x48, 0x89, 0xD9});					// mov edx, eax; mov rcx, rbx
+	#else
+		bytes({0x89, 0xC6, 0x44, 0x89, 0xC2, 0x48, 0x89, 0xDF});	// mov esi, eax; mov edx, r8d; mov rdi, rbx
+	#endif
+		mov_rax_imm(reinterpret_cast<uint64_t>(f));
+		bytes({0xFF, 0xD0});									// call rax
+	}
+
+	/// Emits a jump with a 32bits displacement, returns the position of the displacement.
+	size_t jump(std::initializer_list<unsigned char> opcode)
+	{
+		bytes(opcode);
+		d32(0);
+		return code.size() - 4;
+	}
+
+	void patch(size_t at, size_t target)
+	{
+		const uint32_t rel = static_cast<uint32_t>(target - (at + 4));
+		std::memcpy(code.data() + at, &rel, 4);
+	}
+};
+
+/**
+ * Computes in eax the first address accessed by the instruction if it is only known at runtime (see LR35902::io_access).
+ * @return Number of consecutive addresses accessed from eax (0 if none).
+**/
+template<typename Reg>
+int io_address(Emitter& e, word_t op, word_t cb, const Reg& reg, int32_t sp)
+{
+	switch(op)
+	{
+		case 0x02: case 0x0A: e.load_pair(reg(1)); return 1;		// (BC)
+		case 0x12: case 0x1A: e.load_pair(reg(3)); return 1;		// (DE)
+		case 0x22: case 0x2A: case 0x32: case 0x3A:
+		case 0x34: case 0x35: case 0x36: e.load_pair(reg(5)); return 1; // (HL)
+		case 0xE2: case 0xF2:										// (C)
+			e.movzx8(Emitter::AL, reg(2));
+			e.b(0x0D);												// or eax, 0xFF00
+			e.d32(0xFF00);
+			return 1;
+		case 0xCB:
+			if((cb & 0x07) != 0x06)
+				return 0;
+			e.load_pair(reg(5));
+			return 1;
+		case 0xC5: case 0xD5: case 0xE5: case 0xF5:					// PUSH, CALL, RST: SP - 2, SP - 1
+		case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+		case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+			e.movzx16(Emitter::AL, sp);
+			e.bytes({0x83, 0xE8, 0x02, 0x0F, 0xB7, 0xC0});			// sub eax, 2; movzx eax, ax
+			return 2;
+		case 0xC1: case 0xD1: case 0xE1: case 0xF1:					// POP, RET: SP, SP + 1
+		case 0xC9: case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+			e.movzx16(Emitter::AL, sp);
+			return 2;
+		default:
+			if(op >= 0x40 && op < 0xC0 && ((op & 0x07) == 0x06 || (op & 0xF8) == 0x70))
+			{
+				e.load_pair(reg(5));
+				return 1;
+			}
+			return 0;
+	}
+}
+
+}
+
+LR35902JIT::LR35902JIT(LR35902& cpu) :
+	_cpu(cpu)
+{
+}
+
+LR35902JIT::~LR35902JIT()
+{
+	clear();
+}
+
+word_t LR35902JIT::read(LR35902& cpu, addr_t addr)
+{
+	return cpu.read(addr);
+}
+
+void LR35902JIT::write(LR35902& cpu, addr_t addr, word_t value)
+{
+	cpu.write(addr, value);
+}
+
+bool LR35902JIT::step(LR35902& cpu, unsigned int idx)
+{
+	return cpu.native_step(idx);
+}
+
+std::string LR35902JIT::key(const LR35902::Block& block)
+{
+	std::string k;
+	k.reserve(5 * block.instrs.size());
+	for(const auto& i : block.instrs)
+	{
+		k.append(reinterpret_cast<const char*>(&i.addr), sizeof(i.addr));
+		k.push_back(static_cast<char>(i.opcode));
+		k.append(reinterpret_cast<const char*>(&i.operand), sizeof(i.operand));
+	}
+	return k;
+}
+
+LR35902::JITCode LR35902JIT::find(const LR35902::Block& block) const
+{
+	const auto it = _ram_translations.find(key(block));
+	return it != _ram_translations.end() ? it->second : nullptr;
+}
+
+LR35902::JITCode LR35902JIT::compile(const LR35902::Block& block, bool ram_code)
+{
+	using FlagsOp = LR35902::FlagsOp;
+	const size_t length = LR35902::native_length(block);
+	if(length == 0)
+		return nullptr;
+
+	const auto offset = [&](const void* field) {
+		return static_cast<int32_t>(static_cast<const char*>(field) - reinterpret_cast<const char*>(&_cpu));
+	};
+	const auto reg = [&](word_t r) { return offset(&_cpu._r[r]); };
+	const int32_t pc = offset(&_cpu._pc);
+	const int32_t sp = offset(&_cpu._sp);
+	const int32_t f = offset(&_cpu._f);
+	const int32_t flags_op = offset(&_cpu._flags_op);
+	const int32_t flags_operands = offset(&_cpu._flags_operands);
+	const int32_t flags_res = offset(&_cpu._flags_res);
+	const int32_t a = reg(0);
+	const int32_t operand = offset(&_cpu._operand);
+	const int32_t clock = offset(&_cpu._clock_instr_cycles);
+	const int32_t map_generation = offset(&_cpu._jit_map_generation);
+	const int32_t code_generation = offset(&_cpu._jit_code_generation);
+	const int32_t limit = offset(&_cpu._native_limit);
+	const int32_t native_next = offset(&_cpu._native_next);
+
+	Emitter e;
+	e.code.reserve(64 * length + 64);
+	e.b(0x53);										// push rbx
+#ifdef _WIN32
+	e.bytes({0x48, 0x83, 0xEC, 0x20});				// sub rsp, 32 (Shadow space)
+	e.bytes({0x48, 0x89, 0xCB});					// mov rbx, rcx
+#else
+	e.bytes({0x48, 0x89, 0xFB});					// mov rbx, rdi
+#endif
+
+	// Starts from the instruction _native_next (where a previous run() stopped), usually the first one.
+	e.mem({0x48, 0x8B}, 0, native_next);				// mov rax, [rbx + _native_next]
+	e.bytes({0x48, 0x85, 0xC0});						// test rax, rax
+	const size_t resume = e.jump({0x0F, 0x85});			// jnz
+	std::vector<size_t> starts;							// Of the translation of each instruction
+
+	std::vector<std::pair<size_t, uint32_t>> bailouts;	// (jump to patch, executed instructions)
+	std::vector<std::pair<size_t, uint32_t>> stops;		// Same, after LR35902::native_step (_pc up to date)
+	struct Step
+	{
+		std::vector<size_t>	jumps;	// Accesses to I/O registers, to patch
+		uint32_t			idx;
+		size_t				resume;
+	};
+	std::vector<Step> steps;							// LR35902::native_step instead of the translation
+
+	// Memory accesses: Pages mapped to host memory are accessed directly, the others through LR35902::read/write.
+	// eax = addr -> eax = value
+	const auto read = [&]() {
+		e.bytes({0x89, 0xC1, 0xC1, 0xE9, 0x08});				// mov ecx, eax; shr ecx, 8
+		e.bytes({0x48, 0xBA});									// mov rdx, read_map
+		e.d64(reinterpret_cast<uint64_t>(_cpu._mmu->read_map()));
+		e.bytes({0x48, 0x8B, 0x14, 0xCA, 0x48, 0x85, 0xD2});	// mov rdx, [rdx + rcx * 8]; test rdx, rdx
+		const size_t slow = e.jump({0x0F, 0x84});				// jz
+		e.bytes({0x0F, 0xB6, 0xC0, 0x0F, 0xB6, 0x04, 0x02});	// movzx eax, al; movzx eax, byte [rdx + rax]
+		const size_t done = e.jump({0xE9});
+		e.patch(slow, e.code.size());
+		e.call_access(reinterpret_cast<const void*>(&LR35902JIT::read));
+		e.bytes({0x0F, 0xB6, 0xC0});							// movzx eax, al
+		e.patch(done, e.code.size());
+	};
+	// [eax] = r8b
+	const auto write = [&]() {
+		e.bytes({0x89, 0xC1, 0xC1, 0xE9, 0x08});				// mov ecx, eax; shr ecx, 8
+		e.bytes({0x48, 0xBA});									// mov rdx, write_map
+		e.d64(reinterpret_cast<uint64_t>(_cpu._mmu->write_map()));
+		e.bytes({0x48, 0x8B, 0x14, 0xCA, 0x48, 0x85, 0xD2});	// mov rdx, [rdx + rcx * 8]; test rdx, rdx
+		const size_t slow = e.jump({0x0F, 0x84});				// jz
+		e.bytes({0x0F, 0xB6, 0xC0, 0x44, 0x88, 0x04, 0x02});	// movzx eax, al; mov [rdx + rax], r8b
+		const size_t done = e.jump({0xE9});
+		e.patch(slow, e.code.size());
+		e.call_access(reinterpret_cast<const void*>(&LR35902JIT::write));
+		e.patch(done, e.code.size());
+	};
+	// Stack: eax = SP - 1 (push) or SP (pop), SP updated
+	const auto push_sp = [&]() {
+		e.movzx16(Emitter::AL, sp);
+		e.bytes({0x83, 0xE8, 0x01, 0x0F, 0xB7, 0xC0});			// sub eax, 1; movzx eax, ax
+		e.store16(sp, Emitter::AL);
+	};
+	const auto pop_sp = [&]() {
+		e.movzx16(Emitter::AL, sp);
+		e.bytes({0x8D, 0x50, 0x01});							// lea edx, [rax + 1]
+		e.store16(sp, Emitter::DL);
+	};
+	const auto push = [&](addr_t value) {						// push(value), see LR35902::push
+		push_sp();
+		e.mov_r8d_imm(value >> 8);
+		write();
+		push_sp();
+		e.mov_r8d_imm(value & 0xFF);
+		write();
+	};
+	const auto pop_pc = [&]() {									// _pc = pop()
+		pop_sp();
+		read();
+		e.store8(pc, Emitter::AL);
+		pop_sp();
+		read();
+		e.store8(pc + 1, Emitter::AL);
+	};
+
+	// Flags: eax = carry() / zero() (see LR35902::carry, LR35902::zero), clobbers edx
+	const auto carry = [&]() {
+		e.movzx8(Emitter::AL, f);
+		e.bytes({0xC1, 0xE8, 0x04, 0x83, 0xE0, 0x01});			// shr eax, 4; and eax, 1
+		e.movzx16(Emitter::DL, flags_res);
+		e.bytes({0xC1, 0xEA, 0x08, 0x83, 0xE2, 0x01});			// shr edx, 8; and edx, 1
+		e.cmp8_imm(flags_op, static_cast<uint8_t>(FlagsOp::Dec));
+		e.bytes({0x0F, 0x47, 0xC2});							// cmova eax, edx
+	};
+	const auto zero = [&]() {
+		e.movzx8(Emitter::AL, f);
+		e.bytes({0xC1, 0xE8, 0x07, 0x31, 0xD2});				// shr eax, 7; xor edx, edx
+		e.cmp8_imm(flags_res, 0);
+		e.bytes({0x0F, 0x94, 0xC2});							// sete dl
+		e.cmp8_imm(flags_op, static_cast<uint8_t>(FlagsOp::None));
+		e.bytes({0x0F, 0x45, 0xC2});							// cmovne eax, edx
+	};
+	// Jumps if the condition of the opcode (NZ, Z, NC, C) doesn't hold, returns the jump to patch.
+	const auto unless = [&](word_t op) {
+		const word_t cc = (op >> 3) & 0x03;
+		if(cc < 2) zero(); else carry();
+		e.bytes({0x85, 0xC0});									// test eax, eax
+		return e.jump({0x0F, static_cast<unsigned char>(cc & 1 ? 0x84 : 0x85)}); // jz/jnz
+	};
+	// Lazy flags (see LR35902::set_lazy_flags), result in ax
+	const auto lazy_flags = [&](FlagsOp op, bool operands_in_dl = false) {
+		e.store16(flags_res, Emitter::AL);
+		if(operands_in_dl)
+			e.store8(flags_operands, Emitter::DL);
+		else
+			e.store8_imm(flags_operands, 0);
+		e.store8_imm(flags_op, static_cast<uint8_t>(op));
+	};
+
+	bool pc_up_to_date = true;
+	for(size_t idx = 0; idx < length; ++idx)
+	{
+		const auto& i = block.instrs[idx];
+		const word_t op = i.opcode;
+		const addr_t next = i.addr + i.length;
+		const word_t src = LR35902::extract_src_reg(op);
+		const word_t dst = LR35902::extract_dst_reg(op);
+		const auto bailout = [&](std::initializer_list<unsigned char> jcc) {
+			bailouts.emplace_back(e.jump(jcc), static_cast<uint32_t>(idx));
+		};
+		starts.push_back(e.code.size());
+
+		// Stops where the interpreter would leave LR35902::run (at least 2 instructions, see LR35902::native_limit)
+		if(idx >= 2)
+		{
+			e.mem({0x81}, 7, limit);								// cmp dword [rbx + _native_limit], idx
+			e.d32(static_cast<uint32_t>(idx));
+			bailout({0x0F, 0x86});									// jbe
+		}
+		// I/O accesses and changes of the interrupts state are left to the interpreter (see LR35902::native_step)
+		if(LR35902::needs_native_step(i))
+		{
+			e.call(reinterpret_cast<const void*>(&LR35902JIT::step), static_cast<uint32_t>(idx));
+			e.bytes({0x84, 0xC0});									// test al, al
+			stops.emplace_back(e.jump({0x0F, 0x84}), static_cast<uint32_t>(idx + 1)); // jz
+			pc_up_to_date = true;
+			continue;
+		}
+		Step step{{}, static_cast<uint32_t>(idx), 0};
+		const int io = io_address(e, op, i.operand & 0xFF, reg, sp);
+		for(int n = 0; n < io; ++n)
+		{
+			if(n > 0)
+				e.bytes({0xFF, 0xC0, 0x0F, 0xB7, 0xC0});			// inc eax; movzx eax, ax
+			e.bytes({0x89, 0xC1, 0x81, 0xE9});						// mov ecx, eax; sub ecx, 0xFF00
+			e.d32(0xFF00);
+			e.bytes({0x81, 0xF9});									// cmp ecx, 0x80
+			e.d32(0x80);
+			step.jumps.push_back(e.jump({0x0F, 0x82}));				// jb
+			e.b(0x3D);												// cmp eax, 0xFFFF
+			e.d32(0xFFFF);
+			step.jumps.push_back(e.jump({0x0F, 0x84}));				// je
+		}
+
+		bool sets_pc = false;	// Jumps, calls, returns and handlers
+		if(op == 0x00) {											// NOP
+		} else if(op >= 0x40 && op < 0x80 && op != 0x76) {			// LD r, r
+			if(dst == 7) {											// LD (HL), r
+				e.movzx_r8d(reg(src));
+				e.load_pair(reg(5));
+				write();
+			} else if(src == 7) {									// LD r, (HL)
+				e.load_pair(reg(5));
+				read();
+				e.store8(reg(dst), Emitter::AL);
+			} else if(src != dst) {
+				e.load8(Emitter::AL, reg(src));
+				e.store8(reg(dst), Emitter::AL);
+			}
+		} else if((op & 0xC7) == 0x06) {							// LD r, d8
+			if(dst == 7) {
+				e.mov_r8d_imm(i.operand & 0xFF);
+				e.load_pair(reg(5));
+				write();
+			} else {
+				e.store8_imm(reg(dst), i.operand & 0xFF);
+			}
+		} else if((op & 0xC6) == 0x04) {							// INC/DEC r
+			const bool dec = op & 0x01;
+			carry();												// keep_carry_only
+			e.bytes({0xC1, 0xE0, 0x04});							// shl eax, 4
+			e.store8(f, Emitter::AL);
+			if(dst == 7) {
+				e.load_pair(reg(5));
+				read();
+			} else {
+				e.movzx8(Emitter::AL, reg(dst));
+			}
+			e.bytes({0xFE, static_cast<unsigned char>(dec ? 0xC8 : 0xC0), 0x0F, 0xB6, 0xC0}); // inc/dec al; movzx eax, al
+			lazy_flags(dec ? FlagsOp::Dec : FlagsOp::Inc);
+			if(dst == 7) {
+				e.bytes({0x41, 0x89, 0xC0});						// mov r8d, eax
+				e.load_pair(reg(5));
+				write();
+			} else {
+				e.store8(reg(dst), Emitter::AL);
+			}
+		} else if((op >= 0x80 && op < 0xC0) || (op & 0xC7) == 0xC6) { // ALU A, r/(HL)/d8
+			const word_t kind = (op >> 3) & 0x07;					// ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+			if(op >= 0xC0) {
+				e.b(0xB9);											// mov ecx, imm32
+				e.d32(i.operand & 0xFF);
+			} else if(src == 7) {
+				e.load_pair(reg(5));
+				read();
+				e.bytes({0x89, 0xC1});								// mov ecx, eax
+			} else {
+				e.movzx8(Emitter::CL, reg(src));
+			}
+			if(kind == 1 || kind == 3) {
+				carry();
+				e.bytes({0x41, 0x89, 0xC0});						// mov r8d, eax
+			}
+			e.movzx8(Emitter::AL, a);
+			if(kind < 4 || kind == 7) {
+				e.bytes({0x89, 0xC2, 0x31, 0xCA});					// mov edx, eax; xor edx, ecx
+				if(kind < 2)
+					e.bytes({0x01, 0xC8});							// add eax, ecx
+				else
+					e.bytes({0x29, 0xC8});							// sub eax, ecx
+				if(kind == 1)
+					e.bytes({0x44, 0x01, 0xC0});					// add eax, r8d
+				else if(kind == 3)
+					e.bytes({0x44, 0x29, 0xC0});					// sub eax, r8d
+				lazy_flags(kind < 2 ? FlagsOp::Add : FlagsOp::Sub, true);
+			} else {
+				static const unsigned char ops[3] = {0x21, 0x31, 0x09};	// and, xor, or eax, ecx
+				e.bytes({ops[kind - 4], 0xC8});
+				lazy_flags(kind == 4 ? FlagsOp::And : FlagsOp::Or);
+			}
+			if(kind != 7)
+				e.store8(a, Emitter::AL);
+		} else if(op == 0x31) {										// LD SP, d16
+			e.store16_imm(sp, i.operand);
+		} else if(op == 0x33 || op == 0x3B) {						// INC/DEC SP
+			e.mem({0x66, 0xFF}, op == 0x33 ? 0 : 1, sp);
+		} else if(op == 0xF9) {										// LD SP, HL
+			e.load_pair(reg(5));
+			e.store16(sp, Emitter::AL);
+		} else if((op & 0xCF) == 0x01) {							// LD rr, d16 (BC, DE, HL)
+			e.store8_imm(reg(1 + 2 * (op >> 4)), i.operand >> 8);
+			e.store8_imm(reg(2 + 2 * (op >> 4)), i.operand & 0xFF);
+		} else if((op & 0xC7) == 0x03 && op != 0x33 && op != 0x3B) { // INC/DEC rr
+			e.load_pair(reg(1 + 2 * (op >> 4)));
+			e.bytes({0x66, 0xFF, static_cast<unsigned char>((op & 0x0F) == 0x03 ? 0xC0 : 0xC8)}); // inc/dec ax
+			e.store_pair(reg(1 + 2 * (op >> 4)));
+		} else if((op & 0xE7) == 0x02 || (op & 0xE7) == 0x0A) {	// LD (BC/DE/HL+/HL-), A, LD A, (BC/DE/HL+/HL-)
+			const int32_t pair = reg(op < 0x20 ? 1 + 2 * (op >> 4) : 5);
+			if(op & 0x08) {
+				e.load_pair(pair);
+				read();
+				e.store8(a, Emitter::AL);
+			} else {
+				e.movzx_r8d(a);
+				e.load_pair(pair);
+				write();
+			}
+			if(op >= 0x20) {
+				e.load_pair(pair);
+				e.bytes({0x66, 0xFF, static_cast<unsigned char>(op < 0x30 ? 0xC0 : 0xC8)}); // inc/dec ax
+				e.store_pair(pair);
+			}
+		} else if(op == 0xEA || op == 0xE0 || op == 0xE2) {			// LD (a16), A, LDH (a8), A, LD (C), A
+			e.movzx_r8d(a);
+			if(op == 0xE2) {
+				e.movzx8(Emitter::AL, reg(2));
+				e.b(0x0D);											// or eax, 0xFF00
+				e.d32(0xFF00);
+			} else {
+				e.mov_eax_imm(op == 0xEA ? i.operand : 0xFF00 + (i.operand & 0xFF));
+			}
+			write();
+		} else if(op == 0xFA || op == 0xF0 || op == 0xF2) {			// LD A, (a16), LDH A, (a8), LD A, (C)
+			if(op == 0xF2) {
+				e.movzx8(Emitter::AL, reg(2));
+				e.b(0x0D);											// or eax, 0xFF00
+				e.d32(0xFF00);
+			} else {
+				e.mov_eax_imm(op == 0xFA ? i.operand : 0xFF00 + (i.operand & 0xFF));
+			}
+			read();
+			e.store8(a, Emitter::AL);
+		} else if(op == 0xC5 || op == 0xD5 || op == 0xE5) {			// PUSH BC/DE/HL
+			const int32_t hi = reg(1 + 2 * ((op >> 4) - 0x0C));
+			push_sp();
+			e.movzx_r8d(hi);
+			write();
+			push_sp();
+			e.movzx_r8d(hi + 1);
+			write();
+		} else if((op & 0xCF) == 0xC1) {							// POP BC/DE/HL/AF
+			const bool af = op == 0xF1;
+			const int32_t hi = af ? a : reg(1 + 2 * ((op >> 4) - 0x0C));
+			pop_sp();
+			read();
+			if(af) {												// set_f(lo & 0xF0)
+				e.bytes({0x83, 0xE0, 0xF0});						// and eax, 0xF0
+				e.store8(f, Emitter::AL);
+				e.store8_imm(flags_op, static_cast<uint8_t>(FlagsOp::None));
+			} else {
+				e.store8(hi + 1, Emitter::AL);
+			}
+			pop_sp();
+			read();
+			e.store8(hi, Emitter::AL);
+		} else if(op == 0xCB && (i.operand & 0x07) != 0x06) {		// Prefixed, on registers
+			const word_t cb = i.operand & 0xFF;
+			const int32_t r = reg(LR35902::extract_src_reg(cb));
+			const word_t bit = (cb >> 3) & 0x07;
+			e.add32_imm(clock, static_cast<uint32_t>(LR35902::instr_cycles_cb[cb]));
+			if(cb >= 0xC0) {										// SET
+				e.mem({0x80}, 1, r);								// or byte [r], mask
+				e.b(1 << bit);
+			} else if(cb >= 0x80) {									// RES
+				e.mem({0x80}, 4, r);								// and byte [r], ~mask
+				e.b(~(1 << bit) & 0xFF);
+			} else if(cb >= 0x40) {									// BIT: Z, H set, N reset, C kept
+				carry();
+				e.bytes({0xC1, 0xE0, 0x04, 0x83, 0xC8, 0x20});		// shl eax, 4; or eax, H
+				e.mem({0xF6}, 0, r);								// test byte [r], mask
+				e.b(1 << bit);
+				e.bytes({0x0F, 0x94, 0xC2, 0x0F, 0xB6, 0xD2});		// setz dl; movzx edx, dl
+				e.bytes({0xC1, 0xE2, 0x07, 0x09, 0xD0});			// shl edx, 7; or eax, edx
+				e.store8(f, Emitter::AL);
+				e.store8_imm(flags_op, static_cast<uint8_t>(FlagsOp::None));
+			} else {												// Rotations and shifts: eax = result, with the carry in bit 8
+				if(bit == 2 || bit == 3) {							// RL, RR: Old carry
+					carry();
+					e.bytes({0xC1, 0xE0, static_cast<unsigned char>(bit == 2 ? 0 : 7), 0x89, 0xC1}); // shl eax, 0/7; mov ecx, eax
+				}
+				e.movzx8(Emitter::AL, r);
+				e.bytes({0x89, 0xC2, 0x83, 0xE2, 0x01});			// mov edx, eax; and edx, 1 (bit 0)
+				switch(bit)
+				{
+					case 0:	e.bytes({0x89, 0xC2, 0xC1, 0xEA, 0x07, 0xD1, 0xE0, 0x09, 0xD0}); break;	// RLC: edx = v >> 7; shl eax, 1; or eax, edx
+					case 1: e.bytes({0x69, 0xD2, 0x80, 0x01, 0x00, 0x00, 0xD1, 0xE8, 0x09, 0xD0}); break; // RRC: imul edx, edx, 0x180; shr eax, 1; or eax, edx
+					case 2:	e.bytes({0xD1, 0xE0, 0x09, 0xC8}); break;	// RL: shl eax, 1; or eax, ecx
+					case 3: e.bytes({0xC1, 0xE2, 0x08, 0xD1, 0xE8, 0x09, 0xD0, 0x09, 0xC8}); break; // RR: shl edx, 8; shr eax, 1; or eax, edx; or eax, ecx
+					case 4: e.bytes({0xD1, 0xE0}); break;			// SLA: shl eax, 1
+					case 5: e.bytes({0xC1, 0xE2, 0x08, 0x89, 0xC1, 0x81, 0xE1, 0x80, 0x00, 0x00, 0x00, 0xD1, 0xE8, 0x09, 0xD0, 0x09, 0xC8}); break; // SRA: shl edx, 8; ecx = v & 0x80; shr eax, 1; or eax, edx; or eax, ecx
+					case 6: e.bytes({0xC0, 0xC0, 0x04}); break;		// SWAP: rol al, 4
+					case 7: e.bytes({0xC1, 0xE2, 0x08, 0xD1, 0xE8, 0x09, 0xD0}); break; // SRL: shl edx, 8; shr eax, 1; or eax, edx
+				}
+				e.store8(r, Emitter::AL);
+				lazy_flags(bit == 6 ? FlagsOp::Or : FlagsOp::Shift);
+			}
+		} else if(op == 0x07 || op == 0x0F || op == 0x17 || op == 0x1F) { // RLCA, RRCA, RLA, RRA: Z reset, C from bit 8
+			if(op >= 0x17) {
+				carry();
+				e.bytes({0xC1, 0xE0, static_cast<unsigned char>(op == 0x17 ? 0 : 7), 0x89, 0xC1}); // shl eax, 0/7; mov ecx, eax
+			}
+			e.movzx8(Emitter::AL, a);
+			e.bytes({0x89, 0xC2, 0x83, 0xE2, 0x01});				// mov edx, eax; and edx, 1
+			switch(op)
+			{
+				case 0x07: e.bytes({0x89, 0xC2, 0xC1, 0xEA, 0x07, 0xD1, 0xE0, 0x09, 0xD0}); break;
+				case 0x0F: e.bytes({0x69, 0xD2, 0x80, 0x01, 0x00, 0x00, 0xD1, 0xE8, 0x09, 0xD0}); break;
+				case 0x17: e.bytes({0xD1, 0xE0, 0x09, 0xC8}); break;
+				case 0x1F: e.bytes({0xC1, 0xE2, 0x08, 0xD1, 0xE8, 0x09, 0xD0, 0x09, 0xC8}); break;
+			}
+			e.store8(a, Emitter::AL);
+			lazy_flags(FlagsOp::Shift);
+			e.bytes({0xC1, 0xE8, 0x04, 0x83, 0xE0, 0x10});			// shr eax, 4; and eax, C
+			e.store8(f, Emitter::AL);
+			e.store8_imm(flags_op, static_cast<uint8_t>(FlagsOp::None));
+		} else if(op == 0x18 || op == 0xC3 || op == 0xCD || (op & 0xC7) == 0xC7 || op == 0xC9 || op == 0xE9) {
+			// Unconditional jumps, calls, returns
+			sets_pc = true;
+			if(op == 0xCD || (op & 0xC7) == 0xC7)
+				push(next);
+			if(op == 0xC9)
+				pop_pc();
+			else if(op == 0xE9) {
+				e.load_pair(reg(5));
+				e.store16(pc, Emitter::AL);
+			} else
+				e.store16_imm(pc, op == 0x18 ? static_cast<addr_t>(next + static_cast<int8_t>(i.operand)) :
+								  (op & 0xC7) == 0xC7 ? (op & 0x38) : i.operand);
+		} else if((op & 0xE7) == 0x20 || (op & 0xE7) == 0xC2 || (op & 0xE7) == 0xC4 || (op & 0xE7) == 0xC0) {
+			// Conditional jumps, calls, returns: Extra cycles if taken
+			sets_pc = true;
+			const size_t not_taken = unless(op);
+			const bool jr = (op & 0xE7) == 0x20;
+			e.add32_imm(clock, (op & 0xE7) == 0xC4 || (op & 0xE7) == 0xC0 ? 12 : 4);
+			if((op & 0xE7) == 0xC4)
+				push(next);
+			if((op & 0xE7) == 0xC0)
+				pop_pc();
+			else
+				e.store16_imm(pc, jr ? static_cast<addr_t>(next + static_cast<int8_t>(i.operand)) : i.operand);
+			const size_t done = e.jump({0xE9});
+			e.patch(not_taken, e.code.size());
+			e.store16_imm(pc, next);
+			e.patch(done, e.code.size());
+		} else {
+			// Interpreter handler (DAA, ADD HL, (HL) prefixed instructions...)
+			sets_pc = true;
+			e.store16_imm(pc, next);
+			if(i.length > 1)
+				e.store16_imm(operand, i.operand);
+			e.call(reinterpret_cast<const void*>(i.handler));
+		}
+		pc_up_to_date = sets_pc;
+
+		// Bails out if the following instructions may have changed (bank switch, self-modifying code)
+		if(LR35902::writes_memory(i) && idx + 1 < length)
+		{
+			e.mov_rax_imm(reinterpret_cast<uint64_t>(&_cpu._mmu->map_generation()));
+			e.bytes({0x8B, 0x00});									// mov eax, [rax]
+			e.mem({0x3B}, 0, map_generation);						// cmp eax, [rbx + _jit_map_generation]
+			bailouts.emplace_back(e.jump({0x0F, 0x85}), static_cast<uint32_t>(idx + 1)); // jne
+			if(ram_code)
+			{
+				e.mov_rax_imm(reinterpret_cast<uint64_t>(&_cpu._mmu->code_generation()));
+				e.bytes({0x8B, 0x00});								// mov eax, [rax]
+				e.mem({0x3B}, 0, code_generation);					// cmp eax, [rbx + _jit_code_generation]
+				bailouts.emplace_back(e.jump({0x0F, 0x85}), static_cast<uint32_t>(idx + 1)); // jne
+			}
+		}
+		
+		if(!step.jumps.empty())
+		{
+			step.resume = e.code.size();
+			steps.push_back(std::move(step));
+		}
+	}
+
+	if(!pc_up_to_date)
+	{
+		const auto& last = block.instrs[length - 1];
+		e.store16_imm(pc, last.addr + last.length);
+	}
+	e.mov_eax_imm(static_cast<uint32_t>(length));	// Executed instructions
+	const size_t epilogue = e.code.size();
+#ifdef _WIN32
+	e.bytes({0x48, 0x83, 0xC4, 0x20});				// add rsp, 32
+#endif
+	e.bytes({0x5B, 0xC3});							// pop rbx; ret
+
+	// The bailouts return before an instruction: The ones translated to native code don't update _pc.
+	for(const auto& b : bailouts)
+	{
+		e.patch(b.first, e.code.size());
+		e.store16_imm(pc, block.instrs[b.second].addr);
+		e.mov_eax_imm(b.second);
+		e.patch(e.jump({0xE9}), epilogue);
+	}
+	for(const auto& s : steps)
+	{
+		for(size_t j : s.jumps)
+			e.patch(j, e.code.size());
+		e.call(reinterpret_cast<const void*>(&LR35902JIT::step), s.idx);
+		e.bytes({0x84, 0xC0});										// test al, al
+		stops.emplace_back(e.jump({0x0F, 0x84}), s.idx + 1);		// jz
+		e.patch(e.jump({0xE9}), s.resume);
+	}
+	for(const auto& s : stops)
+	{
+		e.patch(s.first, e.code.size());
+		e.mov_eax_imm(s.second);
+		e.patch(e.jump({0xE9}), epilogue);
+	}
+
+	// Jump table to the instructions, with their offsets from the table (eax is the index of the first one not executed).
+	e.patch(resume, e.code.size());
+	e.bytes({0x48, 0x3D});											// cmp rax, length
+	e.d32(static_cast<uint32_t>(length));
+	e.patch(e.jump({0x0F, 0x83}), epilogue);						// jae
+	const size_t table = e.jump({0x48, 0x8D, 0x0D});				// lea rcx, [rip + table]
+	e.bytes({0x48, 0x63, 0x04, 0x81, 0x48, 0x01, 0xC8, 0xFF, 0xE0});	// movsxd rax, [rcx + rax * 4]; add rax, rcx; jmp rax
+	e.patch(table, e.code.size());
+	const size_t table_start = e.code.size();
+	for(size_t start : starts)
+		e.d32(static_cast<uint32_t>(start - table_start));
+
+	unsigned char* dst = alloc(e.code.size());
+	if(!dst)
+		return nullptr;
+	set_writable(dst, e.code.size(), true);
+	std::memcpy(dst, e.code.data(), e.code.size());
+	set_writable(dst, e.code.size(), false);
+	const auto code = reinterpret_cast<LR35902::JITCode>(dst);
+	if(ram_code)
+		_ram_translations[key(block)] = code;
+	return code;
+}
+
+void LR35902JIT::clear()
+{
+	for(const auto& c : _chunks)
+	{
+	#ifdef _WIN32
+		VirtualFree(c.data, 0, MEM_RELEASE);
+	#else
+		munmap(c.data, c.size);
+	#endif
+	}
+	_chunks.clear();
+	_ram_translations.clear();
+}
+
+unsigned char* LR35902JIT::alloc(size_t size)
+{
+	size = (size + 15) & ~size_t(15);
+	if(_chunks.empty() || _chunks.back().used + size > _chunks.back().size)
+	{
+		Chunk c;
+		c.size = std::max(ChunkSize, size);
+	#ifdef _WIN32
+		c.data = static_cast<unsigned char*>(VirtualAlloc(nullptr, c.size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READ));
+		if(!c.data)
+			return nullptr;
+	#else
+		void* p = mmap(nullptr, c.size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED)
+			return nullptr;
+		c.data = static_cast<unsigned char*>(p);
+	#endif
+		_chunks.push_back(c);
+	}
+	Chunk& c = _chunks.back();
+	unsigned char* r = c.data + c.used;
+	c.used += size;
+	return r;
+}
+
+void LR35902JIT::set_writable(unsigned char* data, size_t size, bool writable)
+{
+	// Never writable and executable at the same time. Only the pages of the new translation: Changing the
+	// protection of the whole chunk costs more than the translation itself.
+#ifdef _WIN32
+	DWORD old;
+	VirtualProtect(data, size, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old);
+#else
+	const uintptr_t first = reinterpret_cast<uintptr_t>(data) & ~uintptr_t(PageSize - 1);
+	const uintptr_t end = reinterpret_cast<uintptr_t>(data) + size;
+	mprotect(reinterpret_cast<void*>(first), end - first, writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC));
+#endif
+}
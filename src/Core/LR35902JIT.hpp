@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <Core/LR35902.hpp>
+
+/**
+ * x86-64 dynamic recompiler for LR35902 blocks (see LR35902::Block).
+ *
+ * Each translated block is a native function executing its instructions in a row, working directly on the
+ * fields of the CPU (registers, lazy flags, see LR35902::FlagsOp): Loads, stores, ALU, INC/DEC, rotations,
+ * prefixed instructions on registers, jumps, calls, returns and stack operations are translated to native code.
+ * Their memory accesses go directly to the pages mapped to host memory (see MMU::read_map), the others through
+ * LR35902::read/write. The remaining instructions (DAA, ADD HL, prefixed ones on (HL)...) become calls to their
+ * interpreter handler (LR35902::instr_handlers) with _pc and _operand set beforehand.
+ *
+ * A translation can start at any of its instructions (LR35902::_native_next, where a previous LR35902::run stopped).
+ * Instructions changing the interrupts state or accessing I/O registers are executed by LR35902::native_step, which
+ * synchronizes the other components first. A translation returns before an instruction the interpreter wouldn't
+ * execute in the same LR35902::run, and after a write if the executable memory changed (bank switch, self-modifying code).
+**/
+class LR35902JIT
+{
+public:
+	explicit LR35902JIT(LR35902& cpu);
+	LR35902JIT(const LR35902JIT&) =delete;
+	LR35902JIT& operator=(const LR35902JIT&) =delete;
+	~LR35902JIT();
+
+	/**
+	 * @param ram_code Block from WRAM/HRAM (may be modified while executing).
+	 * @return Translation of the block, or nullptr if it has to be interpreted.
+	**/
+	LR35902::JITCode compile(const LR35902::Block& block, bool ram_code);
+
+	/**
+	 * Blocks from WRAM/HRAM are rebuilt each time the executable RAM is written to (see LR35902::lookup_instr),
+	 * most of the time identically.
+	 * @return Translation of a previous block from WRAM/HRAM with the same instructions at the same addresses, or nullptr.
+	**/
+	LR35902::JITCode find(const LR35902::Block& block) const;
+
+	/// Releases all translations.
+	void clear();
+	/// @return true if the generated code reached its maximum size (see clear).
+	inline bool full() const { return _chunks.size() >= MaxChunks; }
+
+private:
+	LR35902&	_cpu;
+
+	/// Executable memory
+	struct Chunk
+	{
+		unsigned char*	data = nullptr;
+		size_t			size = 0;
+		size_t			used = 0;
+	};
+	std::vector<Chunk>	_chunks;
+	
+	std::unordered_map<std::string, LR35902::JITCode>	_ram_translations;	///< By content (see key)
+	
+	static std::string key(const LR35902::Block& block);
+
+	static constexpr size_t ChunkSize = 1024 * 1024;
+	static constexpr size_t MaxChunks = 64;
+
+	/// Memory accesses outside of the pages mapped to host memory, called by the translations.
+	static word_t read(LR35902& cpu, addr_t addr);
+	static void write(LR35902& cpu, addr_t addr, word_t value);
+	/// See LR35902::native_step
+	static bool step(LR35902& cpu, unsigned int idx);
+
+	unsigned char* alloc(size_t size);
+	static constexpr size_t PageSize = 4096;
+	static void set_writable(unsigned char* data, size_t size, bool writable);
+};
@@ -1,11 +1,13 @@
 #include "MMU.hpp"
 
+#include <algorithm>
 #include <cstring>
 
 MMU::MMU(Cartridge& cartridge) :
 	_cartridge(&cartridge),
 	_mem(new word_t[MemSize]),
-	_vram_bank1(new word_t[VRAMSize])
+	_vram_bank1(new word_t[VRAMSize]),
+	_tiles(_mem + 0x8000, _vram_bank1)
 {
 	for(int i = 0; i < 8; ++i)
 		_wram[i] = new word_t[WRAMSize];
@@ -13,8 +15,10 @@ MMU::MMU(Cartridge& cartridge) :
 }
 
 MMU::MMU(const MMU& mmu) :
+	_cartridge(mmu._cartridge),
 	_mem(new word_t[MemSize]),
-	_vram_bank1(new word_t[VRAMSize])
+	_vram_bank1(new word_t[VRAMSize]),
+	_tiles(_mem + 0x8000, _vram_bank1)
 {
 	for(int i = 0; i < 8; ++i)
 		_wram[i] = new word_t[WRAMSize];
@@ -45,7 +49,173 @@ void MMU::reset()
 	_hdma_cycles = false;
 	_pending_hdma = false;
 	_hdma_src = 0;
-	_hdma_dst = nullptr;
+	_hdma_dst_bank = 0;
+	_hdma_dst = 0;
+	_scheduler.reset();
+	_code_map.reset();
+	_code_pages.reset();
+	++_code_generation;
+	++_map_generation;
+	++_oam_generation;
+	++_vram_generation;
+	++_palette_generation;
+	_tiles.invalidate_all();
+	update_map();
+}
+
+void MMU::update_map()
+{
+	_cgb = cgb_mode();
+	update_cartridge_map();
+	update_vram_map();
+	update_wram_map();
+	// I/O registers and HRAM
+	_read_map[0xFF] = nullptr;
+	_write_map[0xFF] = nullptr;
+}
+
+void MMU::update_cartridge_map()
+{
+	for(unsigned int page = 0x00; page < 0x80; ++page)
+	{
+		_read_map[page] = reinterpret_cast<const word_t*>(_cartridge->read_page(page << 8));
+		_write_map[page] = nullptr; // MBC registers
+	}
+	
+	if(_mem[0xFF50] == 0x00) // Internal ROM (~BIOS), 0x0800 - 0x08FF is only partially mapped.
+	{
+		_read_map[0x00] = _mem;
+		for(unsigned int page = 0x02; page < 0x08; ++page)
+			_read_map[page] = _mem + (page << 8);
+		_read_map[0x08] = nullptr;
+	}
+	
+	for(unsigned int page = 0xA0; page < 0xC0; ++page)
+	{
+		_read_map[page] = reinterpret_cast<const word_t*>(_cartridge->read_page(page << 8));
+		_write_map[page] = reinterpret_cast<word_t*>(_cartridge->write_page(page << 8));
+	}
+	trap_pages();
+}
+
+void MMU::update_vram_map()
+{
+	word_t* const vram = (_cgb && _mem[VBK] != 0) ? _vram_bank1 - 0x8000 : _mem;
+	// Writes invalidate the decoded tiles (see TileCache) and the rendered lines (see vram_generation).
+	for(unsigned int page = 0x80; page < 0xA0; ++page)
+	{
+		_read_map[page] = vram + (page << 8);
+		_write_map[page] = nullptr;
+	}
+	trap_pages();
+}
+
+void MMU::update_wram_map()
+{
+	for(unsigned int page = 0xC0; page < 0xE0; ++page)
+	{
+		word_t* p = _mem + (page << 8);
+		if(_cgb)
+			p = page < 0xD0 ? _wram[0] + ((page - 0xC0) << 8) : _wram[get_wram_bank()] + ((page - 0xD0) << 8);
+		_read_map[page] = p;
+		_write_map[page] = _code_pages[page - 0xC0] ? nullptr : p;
+	}
+	
+	// Internal RAM mirror: Only reads are redirected (see read and write).
+	for(unsigned int page = 0xE0; page < 0xFE; ++page)
+	{
+		_read_map[page] = _mem + (page << 8) - 0x2000;
+		_write_map[page] = (page >= 0xF0 && _code_pages[page - 0xC0]) ? nullptr : _mem + (page << 8);
+	}
+	
+	// OAM: Writes are counted (see oam_generation).
+	_read_map[0xFE] = _mem + 0xFE00;
+	_write_map[0xFE] = nullptr;
+	trap_pages();
+}
+
+void MMU::add_watchpoint(addr_t addr, addr_t last, word_t kind)
+{
+	_watchpoints.push_back(Watchpoint{addr, std::max(addr, last), kind});
+	for(unsigned int page = addr >> 8; page <= static_cast<unsigned int>(_watchpoints.back().last >> 8); ++page)
+	{
+		if(kind & WatchRead)
+			_read_traps[page] = true;
+		if(kind & (WatchWrite | WatchChange))
+			_write_traps[page] = true;
+	}
+	trap_pages();
+}
+
+void MMU::rem_watchpoint(size_t index)
+{
+	_watchpoints.erase(_watchpoints.begin() + index);
+	const std::vector<Watchpoint> watchpoints = _watchpoints;
+	clear_watchpoints();
+	for(const Watchpoint& w : watchpoints)
+		add_watchpoint(w.addr, w.last, w.kind);
+}
+
+void MMU::clear_watchpoints()
+{
+	_watchpoints.clear();
+	_read_traps.reset();
+	_write_traps.reset();
+	update_map();
+}
+
+void MMU::trap_pages()
+{
+	if(_watchpoints.empty())
+		return;
+	for(unsigned int page = 0; page < 0x100; ++page)
+	{
+		if(_read_traps[page])
+			_read_map[page] = nullptr;
+		if(_write_traps[page])
+			_write_map[page] = nullptr;
+	}
+}
+
+word_t MMU::trapped_read(addr_t addr) const
+{
+	const word_t value = read_unmapped(addr);
+	for(const Watchpoint& w : _watchpoints)
+		if((w.kind & WatchRead) && addr >= w.addr && addr <= w.last)
+		{
+			_watch_hit = WatchHit{addr, value, value, WatchRead};
+			++_watch_hits;
+			break;
+		}
+	return value;
+}
+
+void MMU::trapped_write(addr_t addr, word_t value)
+{
+	const word_t old_value = read_unmapped(addr);
+	write_unmapped(addr, value);
+	for(const Watchpoint& w : _watchpoints)
+		if(addr >= w.addr && addr <= w.last &&
+		   ((w.kind & WatchWrite) || ((w.kind & WatchChange) && value != old_value)))
+		{
+			_watch_hit = WatchHit{addr, value, old_value, static_cast<word_t>(WatchWrite | (value != old_value ? WatchChange : 0))};
+			++_watch_hits;
+			break;
+		}
+}
+
+bool MMU::same_state(const MMU& mmu) const
+{
+	if(std::memcmp(_mem, mmu._mem, MemSize * sizeof(word_t)) != 0 ||
+	   std::memcmp(_vram_bank1, mmu._vram_bank1, VRAMSize * sizeof(word_t)) != 0)
+		return false;
+	for(int i = 0; i < 8; ++i)
+		if(std::memcmp(_wram[i], mmu._wram[i], WRAMSize * sizeof(word_t)) != 0)
+			return false;
+	return std::memcmp(_bg_palette_data, mmu._bg_palette_data, sizeof(_bg_palette_data)) == 0 &&
+		std::memcmp(_sprite_palette_data, mmu._sprite_palette_data, sizeof(_sprite_palette_data)) == 0 &&
+		_hdma_cycles == mmu._hdma_cycles && _pending_hdma == mmu._pending_hdma &&
+		_hdma_src == mmu._hdma_src && _hdma_dst_bank == mmu._hdma_dst_bank && _hdma_dst == mmu._hdma_dst;
 }
 
 void MMU::load_boot()
@@ -111,6 +281,7 @@ void MMU::init_dma(word_t val)
 	addr_t start = val * 0x100;
 	for(addr_t i = 0; i < 0xA0; ++i)
 		_mem[0xFE00 + i] = read(start + i);
+	++_oam_generation;
 }
 
 void MMU::check_hdma()
@@ -119,10 +290,12 @@ void MMU::check_hdma()
 	{
 		_hdma_cycles = true;
 		word_t length = read(HDMA5) & 0x7F;
+		word_t* const dst = (_hdma_dst_bank ? _vram_bank1 : _mem + 0x8000) + _hdma_dst;
 		for(addr_t i = 0; i < 0x10; ++i)
-			_hdma_dst[i] = read(_hdma_src + i);
+			dst[i] = read(_hdma_src + i);
+		invalidate_tiles(dst, 0x10);
 		
-		_hdma_dst += 0x10;
+		_hdma_dst = (_hdma_dst + 0x10) & 0x1FF0; // Stays in the VRAM
 		_hdma_src += 0x10;
 		
 		if(length == 0)
@@ -156,10 +329,12 @@ void MMU::init_vram_dma(word_t val)
 		word_t length = ((val & 0x7F) + 1);
 		for(addr_t i = 0; i < length * 0x10; ++i)
 			dest_ptr[i] = read(src + i);
+		invalidate_tiles(dest_ptr, length * 0x10);
 		_mem[HDMA5] = 0xFF;
 	} else { // H-Blank DMA
 		_hdma_src = src;
-		_hdma_dst = dest_ptr;
+		_hdma_dst_bank = _mem[VBK] ? 1 : 0;
+		_hdma_dst = dst;
 		_pending_hdma = true;
 	}
 }
@@ -1,11 +1,15 @@
 #pragma once
 
+#include <bitset>
 #include <cassert>
 #include <cstring>
 #include <iostream>
 #include <functional>
+#include <vector>
 
 #include <Core/Cartridge.hpp>
+#include <Core/Scheduler.hpp>
+#include <Core/TileCache.hpp>
 #include <Tools/Color.hpp>
 
 class MMU
@@ -14,6 +18,7 @@ public:
 	static constexpr size_t MemSize = 0x10000; // Bytes
 	static constexpr size_t WRAMSize = 0x1000; // Bytes
 	static constexpr size_t VRAMSize = 0x2000; // Bytes
+	static constexpr int RAMCodeBank = 0x200; ///< First code_bank identifier used for WRAM/HRAM (lower ones are ROM banks)
 	
 	enum Register : addr_t
 	{
@@ -120,8 +125,24 @@ public:
 		_hdma_cycles = mmu._hdma_cycles;
 		_pending_hdma = mmu._pending_hdma;
 		_hdma_src = mmu._hdma_src;
+		_hdma_dst_bank = mmu._hdma_dst_bank;
 		_hdma_dst = mmu._hdma_dst;
 		
+		// Everything may have changed.
+		_code_map.reset();
+		_code_pages.reset();
+		update_map();
+		_scheduler = mmu._scheduler;
+		_scheduler.invalidate(Scheduler::GPUMode);
+		_scheduler.invalidate(Scheduler::GPUInterrupt);
+		_scheduler.invalidate(Scheduler::Timer);
+		++_code_generation;
+		++_map_generation;
+		++_oam_generation;
+		++_vram_generation;
+		++_palette_generation;
+		_tiles.invalidate_all();
+		
 		return *this;
 	}
 	~MMU();
@@ -137,10 +158,30 @@ public:
 	inline void	write(addr_t addr, word_t value);
 	inline void	write16(addr_t addr, addr_t value);
 	
+	/// Decoded tile data, kept in sync with the VRAM (see TileCache).
+	inline TileCache& tiles() { return _tiles; }
+	
+	/// From the cartridge and force_cgb/force_dmg (the memory accesses use the mode of the last update_map).
 	inline bool cgb_mode() const;
+	inline bool double_speed() const { return _mem[KEY1] & 0x80; }
+	
+	inline Cartridge& get_cartridge() { return *_cartridge; }
+	/**
+	 * Rebuilds the memory map used by read and write (see _read_map).
+	 * Done when the boot ROM is mapped/unmapped (see load_boot, LR35902::reset_cart), has to be called
+	 * if the cartridge or force_cgb/force_dmg are modified from the outside at any other time.
+	**/
+	void update_map();
+	/// Compares the content of the memory (debug).
+	bool same_state(const MMU& mmu) const;
 	
 	inline color_t get_bg_color(word_t p, word_t c) { return get_color(_bg_palette_data, p, c); }
 	inline color_t get_sprite_color(word_t p, word_t c) { return get_color(_sprite_palette_data, p, c); }
+	/// CGB Only - Raw palette data: 8 palettes of 4 colors, 2 bytes each (see BGPD, OBPD, to_color)
+	inline const word_t (&get_bg_palette_data() const)[8][8] { return _bg_palette_data; }
+	inline const word_t (&get_sprite_palette_data() const)[8][8] { return _sprite_palette_data; }
+	/// CGB Only - Converts a color of the palette data (l: Low byte, h: High byte)
+	static inline color_t to_color(word_t l, word_t h);
 	
 	/// Loads a boot room according to gameboy type
 	void load_boot();
@@ -154,13 +195,124 @@ public:
 	/// CGB Only - Check if a HDMA transfer is pending (should be called once during each HBlank)
 	void check_hdma();
 	inline bool hdma_cycles() { bool r = _hdma_cycles; _hdma_cycles = false; return r; }
+	/// @return true if a HDMA transfer is pending or its cycles are not counted by the CPU yet.
+	inline bool hdma_active() const { return _pending_hdma || _hdma_cycles; }
+	
+	/**
+	 * Clock and upcoming events shared by the CPU and GPU.
+	 * GPU events are scheduled after each GPU step, and invalidated by writes to the registers they depend on.
+	**/
+	inline Scheduler& scheduler() { return _scheduler; }
+	inline const Scheduler& scheduler() const { return _scheduler; }
+	
+	/**
+	 * Identifies the memory bank mapped at addr for the CPU instructions cache:
+	 * ROM bank number (below RAMCodeBank), WRAM/HRAM bank (RAMCodeBank and above),
+	 * or -1 if code running from there shouldn't be cached (VRAM, external RAM, boot ROM...).
+	**/
+	inline int code_bank(addr_t addr) const;
+	/// Flags a WRAM/HRAM byte as cached code: Writing to it will increment the code generation.
+	inline void mark_code(addr_t addr);
+	/// Incremented each time a byte flagged by mark_code is modified.
+	inline const unsigned int& code_generation() const { return _code_generation; }
+	/// Incremented each time the mapping of executable memory may have changed (ROM/WRAM bank switch, boot ROM...).
+	inline const unsigned int& map_generation() const { return _map_generation; }
+	/// Pages accessible without going through read/write (see _read_map), for LR35902JIT.
+	inline const word_t* const* read_map() const { return _read_map; }
+	inline word_t* const* write_map() const { return _write_map; }
+	/// Incremented by each write to OAM (CPU or DMA), see GPU::update_sprites.
+	inline unsigned int oam_generation() const { return _oam_generation; }
+	/// Incremented by each write to VRAM, tile data or maps (CPU or DMA), see GPU::LineSignature.
+	inline unsigned int vram_generation() const { return _vram_generation; }
+	/// CGB Only - Incremented by each write to the palette data (BGPD, OBPD).
+	inline unsigned int palette_generation() const { return _palette_generation; }
+	
+	enum WatchKind : word_t
+	{
+		WatchRead	= 0x01,
+		WatchWrite	= 0x02,
+		WatchChange	= 0x04	///< Writes modifying the value
+	};
+	
+	/// Memory watchpoint on [addr, last].
+	struct Watchpoint
+	{
+		addr_t	addr;
+		addr_t	last;
+		word_t	kind;	///< WatchKind flags
+	};
+	
+	struct WatchHit
+	{
+		addr_t	addr = 0;
+		word_t	value = 0;		///< Value read or written
+		word_t	old_value = 0;	///< Value before the write
+		word_t	kind = 0;		///< WatchRead, or WatchWrite (| WatchChange if the value was modified)
+	};
+	
+	/**
+	 * Watchpoints trap the accesses through read and write (CPU, DMA sources) by removing their
+	 * pages from the memory map: The other pages keep their direct access.
+	 * The sound registers are handled by the APU and can't be watched.
+	 * Not copied nor cleared by reset (debug settings, like LR35902::add_breakpoint).
+	**/
+	void add_watchpoint(addr_t addr, addr_t last, word_t kind);
+	void rem_watchpoint(size_t index);
+	void clear_watchpoints();
+	inline const std::vector<Watchpoint>& get_watchpoints() const { return _watchpoints; }
+	inline bool has_watchpoints() const { return !_watchpoints.empty(); }
+	/// Incremented by each access matching a watchpoint (see get_watch_hit).
+	inline unsigned int watch_hits() const { return _watch_hits; }
+	inline const WatchHit& get_watch_hit() const { return _watch_hit; }
 	
 private:
+	friend class LR35902AOT; // See LR35902AOT::layout
+	
 	Cartridge* const _cartridge = nullptr;
 	
 	word_t*		_mem = nullptr;	///< This represent the whole address space and contains all that doesn't fit elsewhere.
 	word_t*		_wram[8];		///< Switchable bank of working RAM (CGB Only)
 	word_t*		_vram_bank1;	///< VRAM Bank 1 (Bank 0 is in _mem)
+	bool		_cgb = false;	///< cgb_mode() when the memory map was last built (see update_map)
+	TileCache	_tiles;
+	
+	std::bitset<0x4000>	_code_map;				///< Cached code in 0xC000 - 0xFFFF (see mark_code)
+	std::bitset<0x40>	_code_pages;			///< Pages of _code_map containing cached code
+	unsigned int		_code_generation = 0;
+	unsigned int		_map_generation = 0;
+	unsigned int		_oam_generation = 0;
+	unsigned int		_vram_generation = 0;
+	unsigned int		_palette_generation = 0;
+	
+	inline void check_code_write(addr_t addr);
+	
+	/**
+	 * Host memory backing each 256 bytes page of the address space, for the accesses without any side effect.
+	 * nullptr if the page has to go through the complete read/write: I/O and MBC registers, boot ROM,
+	 * RTC registers, cached code (see mark_code)...
+	**/
+	const word_t*	_read_map[0x100];
+	word_t*			_write_map[0x100];
+	
+	void update_cartridge_map();	///< 0x0000 - 0x7FFF, 0xA000 - 0xBFFF
+	void update_vram_map();			///< 0x8000 - 0x9FFF
+	/// Flags the tiles modified by a write of size bytes at vram (in _mem or _vram_bank1), and the VRAM as modified.
+	inline void invalidate_tiles(const word_t* vram, size_t size);
+	void update_wram_map();			///< 0xC000 - 0xFEFF
+	
+	std::vector<Watchpoint>	_watchpoints;
+	std::bitset<0x100>		_read_traps;	///< Pages with a read watchpoint
+	std::bitset<0x100>		_write_traps;	///< Pages with a write/change watchpoint
+	mutable unsigned int	_watch_hits = 0;
+	mutable WatchHit		_watch_hit;
+	
+	/// Removes the watched pages from the memory map (after each update of the map).
+	void trap_pages();
+	word_t trapped_read(addr_t addr) const;
+	void trapped_write(addr_t addr, word_t value);
+	/// Complete read/write, for the pages not in the memory map.
+	inline word_t read_unmapped(addr_t addr) const;
+	inline void write_unmapped(addr_t addr, word_t value);
 	
 	void init_dma(word_t val);
 	void update_joypad(word_t value);
@@ -172,7 +324,10 @@ private:
 	bool		_hdma_cycles = false;	///< Signals the CPU 0x10 bytes has been transfered via HDMA.
 	bool		_pending_hdma = false;
 	addr_t		_hdma_src = 0;
-	word_t* 	_hdma_dst = nullptr;
+	word_t		_hdma_dst_bank = 0;		///< VRAM bank of _hdma_dst
+	addr_t		_hdma_dst = 0;			///< Offset in the VRAM bank (not a pointer: Valid in copies of the MMU)
+	
+	Scheduler	_scheduler;
 	
 	void init_vram_dma(word_t val);
 	
@@ -191,16 +346,70 @@ private:
 
 inline bool MMU::cgb_mode() const 
 {
-	/// @todo Better
 	return force_cgb || (!force_dmg && _cartridge->getCGBFlag() != Cartridge::No);
 }
 
+inline int MMU::code_bank(addr_t addr) const
+{
+	switch(addr & 0xF000)
+	{
+	case 0x0000:
+		if((addr < 0x0100 || in_range(addr, 0x200, 0x08FF)) && _mem[0xFF50] == 0x00) // Internal ROM (~BIOS)
+			return -1;
+		[[fallthrough]];
+	case 0x1000: [[fallthrough]];
+	case 0x2000: [[fallthrough]];
+	case 0x3000:
+		return 0;
+	case 0x4000: [[fallthrough]];
+	case 0x5000: [[fallthrough]];
+	case 0x6000: [[fallthrough]];
+	case 0x7000:
+		return _cartridge->getCurrentROMBank();
+	case 0xC000:
+		return RAMCodeBank;
+	case 0xD000:
+		return RAMCodeBank + (_cgb ? static_cast<int>(get_wram_bank()) : 1);
+	case 0xF000:
+		if(in_range(addr, 0xFF80, 0xFFFF))											// HRAM
+			return RAMCodeBank + 8;
+	}
+	return -1;
+}
+
+inline void MMU::mark_code(addr_t addr)
+{
+	_code_map[addr - 0xC000] = true;
+	_code_pages[(addr - 0xC000) >> 8] = true;
+	_write_map[addr >> 8] = nullptr; // Writes have to be checked (see check_code_write)
+}
+
+inline void MMU::check_code_write(addr_t addr)
+{
+	if(_code_map[addr - 0xC000])
+	{
+		_code_map.reset();
+		_code_pages.reset();
+		++_code_generation;
+		update_wram_map();
+	}
+}
+
 inline word_t MMU::read(addr_t addr) const
+{
+	if(const word_t* page = _read_map[addr >> 8])
+		return page[addr & 0xFF];
+	if(_read_traps[addr >> 8])
+		return trapped_read(addr);
+	return read_unmapped(addr);
+}
+
+inline word_t MMU::read_unmapped(addr_t addr) const
 {
 	switch(addr & 0xF000)
 	{
 	case 0x0000:
-		if((addr < 0x0100 || in_range(addr, 0x200, 0x08FF)) && read(0xFF50) == 0x00) // Internal ROM (~BIOS)
+		if((addr < 0x0100 || in_range(addr, 0x200, 0x08FF)) && _mem[0xFF50] == 0x00) // Internal ROM (~BIOS)
 			return _mem[addr];
 		[[fallthrough]]; // Other adresses in this range are redirected to the cartridge
 	case 0x1000: [[fallthrough]];
@@ -213,18 +422,18 @@ inline word_t MMU::read(addr_t addr) const
 		return static_cast<word_t>(_cartridge->read(addr));                          // 0x0000 - 0x8000
 	case 0x8000: [[fallthrough]];
 	case 0x9000:
-		if(cgb_mode() && _mem[VBK] != 0)	                                         // Switchable VRAM
+		if(_cgb && _mem[VBK] != 0)	                                                 // Switchable VRAM
 			return _vram_bank1[addr - 0x8000];
 		break;
 	case 0xA000: [[fallthrough]];
 	case 0xB000:								                                     // External RAM
 		return _cartridge->read(addr);
 	case 0xC000:	
-		if(cgb_mode())					                                             // CGB Mode - Working RAM Bank 0
+		if(_cgb)					                                                 // CGB Mode - Working RAM Bank 0
 			return _wram[0][addr - 0xC000];
 		break;
 	case 0xD000:		
-		if(cgb_mode())					                                             // CGB Mode - Working RAM
+		if(_cgb)					                                                 // CGB Mode - Working RAM
 			return _wram[get_wram_bank()][addr - 0xD000];
 		break;
 	case 0xE000: [[fallthrough]];
@@ -266,6 +475,16 @@ inline addr_t MMU::read16(addr_t addr)
 }
 
 inline void	MMU::write(addr_t addr, word_t value)
+{
+	if(word_t* page = _write_map[addr >> 8])
+		page[addr & 0xFF] = value;
+	else if(_write_traps[addr >> 8])
+		trapped_write(addr, value);
+	else
+		write_unmapped(addr, value);
+}
+
+inline void MMU::write_unmapped(addr_t addr, word_t value)
 {
 	switch(addr & 0xF000)
 	{
@@ -278,26 +497,34 @@ inline void	MMU::write(addr_t addr, word_t value)
 	case 0x6000: [[fallthrough]];
 	case 0x7000: // Memory Banks management (0x0000-0x8000)
 		_cartridge->write(addr, value);
+		++_map_generation;
+		update_cartridge_map();
 		break;
 	case 0x8000: [[fallthrough]];
 	case 0x9000: // Switchable VRAM
-		if(cgb_mode() && read(VBK) != 0) 
+		++_vram_generation;
+		if(_cgb && read(VBK) != 0) {
 			_vram_bank1[addr - 0x8000] = value;
-		else 
+			_tiles.invalidate(1, addr - 0x8000);
+		} else {
 			_mem[addr] = value;
+			_tiles.invalidate(0, addr - 0x8000);
+		}
 		break;
 	case 0xA000: [[fallthrough]];
 	case 0xB000: // External RAM
 		_cartridge->write(addr, value);
 		break;
 	case 0xC000: // CGB Mode - Working RAM Bank 0
-		if(cgb_mode()) 
+		check_code_write(addr);
+		if(_cgb) 
 			_wram[0][addr - 0xC000] = value;
 		else 
 			_mem[addr] = value;
 		break;
 	case 0xD000: // CGB Mode - Switchable WRAM Banks
-		if(cgb_mode()) 
+		check_code_write(addr);
+		if(_cgb) 
 			_wram[get_wram_bank()][addr - 0xD000] = value;
 		else 
 			_mem[addr] = value;
@@ -316,14 +543,27 @@ inline void	MMU::write(addr_t addr, word_t value)
 			// written to the STAT register ($ff41) while the gameboy is either in HBLANK or VBLANK mode.
 			// It doesn't seem to happen when the gameboy is in OAM or VRAM mode, or when the display 
 			// is disabled. (Info from Martin Korth.)
-			if(!cgb_mode() && (_mem[Register::LCDC] & 0x80)
+			if(!_cgb && (_mem[Register::LCDC] & 0x80)
 				&& one_of(_mem[Register::STAT] & 3, 0, 1))
 				_mem[Register::IF] |= 0b10;
 				
 			_mem[Register::STAT] = (_mem[Register::STAT] & 7) | (value & 0xF8);
+			_scheduler.invalidate(Scheduler::GPUInterrupt);
 			break;
 		case Register::LY: // LY reset when written to
 			_mem[Register::LY] = 0;
+			_scheduler.invalidate(Scheduler::GPUMode);
+			_scheduler.invalidate(Scheduler::GPUInterrupt);
+			break;
+		case Register::LCDC: // Registers checked by each GPU step: It has to catch up right away.
+		case Register::LYC:
+			_mem[addr] = value;
+			_scheduler.invalidate(Scheduler::GPUMode);
+			_scheduler.invalidate(Scheduler::GPUInterrupt);
+			break;
+		case Register::IE: // Used to predict the next GPU event that may wake up the CPU
+			_mem[addr] = value;
+			_scheduler.invalidate(Scheduler::GPUInterrupt);
 			break;
 		case Register::DIV: // DIV reset when written to
 			_mem[Register::DIV] = 0;
@@ -342,15 +582,32 @@ inline void	MMU::write(addr_t addr, word_t value)
 			break;
 		case Register::VBK: // VRAM Memory Bank (This fixes Oracle of Season...)
 			_mem[VBK] = value & 1;
+			update_vram_map();
 			break;
 		case Register::P1: // Joypad Register
 			update_joypad(value);
 			break;
 		case Register::KEY1: // Double Speed - Switch
 			if(value & 0x01) _mem[KEY1] = (_mem[KEY1] & 0x80) ? 0x00 : 0x80;
+			// GPU events are scheduled in CPU cycles
+			_scheduler.invalidate(Scheduler::GPUMode);
+			_scheduler.invalidate(Scheduler::GPUInterrupt);
+			break;
+		case Register::SVBK: // WRAM Bank
+			_mem[addr] = value;
+			++_map_generation;
+			update_wram_map();
+			break;
+		case 0xFF50: // Boot ROM Switch
+			_mem[addr] = value;
+			++_map_generation;
+			update_map(); // Also picks up a newly loaded cartridge (CGB mode)
 			break;
 		default:
+			check_code_write(addr);
 			_mem[addr] = value;
+			if(addr >= 0xFE00 && addr < 0xFEA0) // OAM
+				++_oam_generation;
 			break;
 		}
 		break;
@@ -365,6 +622,15 @@ inline void	MMU::write16(addr_t addr, addr_t value)
 	write(addr + 1, static_cast<word_t>(value >> 8));
 }
 
+inline void MMU::invalidate_tiles(const word_t* vram, size_t size)
+{
+	++_vram_generation;
+	if(vram >= _vram_bank1 && vram < _vram_bank1 + VRAMSize)
+		_tiles.invalidate(1, static_cast<addr_t>(vram - _vram_bank1), size);
+	else
+		_tiles.invalidate(0, static_cast<addr_t>(vram - (_mem + 0x8000)), size);
+}
+
 inline size_t MMU::get_wram_bank() const
 {
 	size_t s = read(SVBK) & 0x7;	// 0 - 7
@@ -387,6 +653,7 @@ inline void MMU::write_bg_palette_data(word_t val)
 	word_t c = bgpi & 7;
 	word_t p = (bgpi >> 3) & 7;
 	_bg_palette_data[p][c] = val;
+	++_palette_generation;
 	if(bgpi & 0x80) // Auto Increment
 		write(BGPI, word_t(0x80 + ((bgpi + 1) & 0x7F)));
 }
@@ -405,15 +672,19 @@ inline void MMU::write_sprite_palette_data(word_t val)
 	word_t c = obpi & 7;
 	word_t p = (obpi >> 3) & 7;
 	_sprite_palette_data[p][c] = val;
+	++_palette_generation;
 	if(obpi & 0x80) // Auto Increment
 		write(OBPI, word_t(0x80 + ((obpi + 1) & 0x7F)));
 }
 
 inline color_t MMU::get_color(const word_t (&pd)[8][8], word_t p, word_t c)
+{
+	return to_color(pd[p][c * 2], pd[p][c * 2 + 1]);
+}
+
+inline color_t MMU::to_color(word_t l, word_t h)
 {
 	color_t r;
-	word_t l = pd[p][c * 2];
-	word_t h = pd[p][c * 2 + 1];
 	addr_t pal = (h << 8) + l;
 	r.r = pal & 0x001F;
 	r.g = (pal >> 5) & 0x001F;
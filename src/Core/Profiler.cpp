@@ -0,0 +1,274 @@
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+
+#include <Core/LR35902.hpp>
+
+void Profiler::reset()
+{
+	_counters.clear();
+	std::fill(std::begin(_opcodes), std::end(_opcodes), 0);
+	std::fill(std::begin(_cb_opcodes), std::end(_cb_opcodes), 0);
+	_instructions = 0;
+	_running_cycles = 0;
+	_halted_cycles = 0;
+	_idle_cycles = 0;
+	
+	_nodes.assign(1, Node{0, 0});
+	_children.clear();
+	_stack.clear();
+	_current = 0;
+}
+
+uint32_t Profiler::child(uint32_t parent, Location routine)
+{
+	const uint64_t key = (static_cast<uint64_t>(parent) << 32) | routine;
+	auto it = _children.find(key);
+	if(it != _children.end())
+		return it->second;
+	const uint32_t node = static_cast<uint32_t>(_nodes.size());
+	_nodes.emplace_back(routine, parent);
+	_children.emplace(key, node);
+	return node;
+}
+
+std::vector<std::pair<Profiler::Location, Profiler::Counters>> Profiler::hot_spots(size_t count) const
+{
+	std::vector<std::pair<Location, Counters>> r(_counters.begin(), _counters.end());
+	const auto by_cycles = [](const std::pair<Location, Counters>& l, const std::pair<Location, Counters>& r) {
+		return l.second.cycles > r.second.cycles || (l.second.cycles == r.second.cycles && l.first < r.first);
+	};
+	count = std::min(count, r.size());
+	std::partial_sort(r.begin(), r.begin() + count, r.end(), by_cycles);
+	r.resize(count);
+	return r;
+}
+
+std::vector<Profiler::Routine> Profiler::routines() const
+{
+	std::unordered_map<Location, Routine> by_location;
+	std::vector<Location> path;
+	for(uint32_t n = 1; n < _nodes.size(); ++n)
+	{
+		const Node& node = _nodes[n];
+		Routine& r = by_location[node.routine];
+		r.location = node.routine;
+		r.exclusive += node.cycles;
+		r.calls += node.calls;
+		// Inclusive cycles: Charged once to each distinct routine of the stack (recursion).
+		path.clear();
+		for(uint32_t a = n; a != 0; a = _nodes[a].parent)
+			if(std::find(path.begin(), path.end(), _nodes[a].routine) == path.end())
+			{
+				path.push_back(_nodes[a].routine);
+				by_location[_nodes[a].routine].inclusive += node.cycles;
+			}
+	}
+	
+	std::vector<Routine> r;
+	r.reserve(by_location.size());
+	for(const auto& p : by_location)
+		r.push_back(p.second);
+	std::sort(r.begin(), r.end(), [](const Routine& l, const Routine& r) {
+		return l.inclusive > r.inclusive || (l.inclusive == r.inclusive && l.location < r.location);
+	});
+	return r;
+}
+
+void Profiler::write_report(std::ostream& out, size_t count) const
+{
+	const uint64_t total = _running_cycles + _halted_cycles;
+	const auto percent = [](uint64_t v, uint64_t total) {
+		return total == 0 ? 0.0 : 100.0 * v / total;
+	};
+
+	char line[128];
+	out << "Instructions: " << _instructions << "\n";
+	std::snprintf(line, sizeof(line), "Running: %llu cycles (%.2f%%), including %llu fast-forwarded in idle loops\n",
+		static_cast<unsigned long long>(_running_cycles), percent(_running_cycles, total),
+		static_cast<unsigned long long>(_idle_cycles));
+	out << line;
+	std::snprintf(line, sizeof(line), "Halted: %llu cycles (%.2f%%)\n",
+		static_cast<unsigned long long>(_halted_cycles), percent(_halted_cycles, total));
+	out << line;
+
+	if(_nodes.size() > 1)
+	{
+		const uint64_t total_routines = std::max<uint64_t>(1, _running_cycles + _halted_cycles);
+		out << "\nRoutines (by inclusive cycles):\n";
+		std::snprintf(line, sizeof(line), "%-24s %14s %8s %14s %8s %10s\n", "Routine", "Inclusive", "%", "Exclusive", "%", "Calls");
+		out << line;
+		const auto routines = this->routines();
+		for(size_t i = 0; i < std::min(count, routines.size()); ++i)
+		{
+			const Routine& r = routines[i];
+			std::snprintf(line, sizeof(line), "%-24s %14llu %7.2f%% %14llu %7.2f%% %10llu\n", routine_name(r.location).c_str(),
+				static_cast<unsigned long long>(r.inclusive), percent(r.inclusive, total_routines),
+				static_cast<unsigned long long>(r.exclusive), percent(r.exclusive, total_routines),
+				static_cast<unsigned long long>(r.calls));
+			out << line;
+		}
+	}
+
+	out << "\nHot spots (by cycles):\n";
+	std::snprintf(line, sizeof(line), "%-12s %14s %8s %14s  %s\n", "Location", "Cycles", "%", "Instructions", "Instruction");
+	out << line;
+	for(const auto& p : hot_spots(count))
+	{
+		const Counters& c = p.second;
+		std::snprintf(line, sizeof(line), "%-12s %14llu %7.2f%% %14llu  %s\n", name(p.first).c_str(),
+			static_cast<unsigned long long>(c.cycles), percent(c.cycles, _running_cycles),
+			static_cast<unsigned long long>(c.instructions),
+			c.opcode == 0xCB ? LR35902::instr_cb_str[c.cb_opcode].c_str() : LR35902::instr_str[c.opcode].c_str());
+		out << line;
+	}
+
+	out << "\nOpcodes (by frequency):\n";
+	std::vector<std::pair<uint64_t, int>> opcodes; // (Count, Opcode), 0x1xx for 0xCB prefixed ones
+	for(int i = 0; i < 0x100; ++i)
+	{
+		if(_opcodes[i] > 0) opcodes.emplace_back(_opcodes[i], i);
+		if(_cb_opcodes[i] > 0) opcodes.emplace_back(_cb_opcodes[i], 0x100 | i);
+	}
+	std::sort(opcodes.begin(), opcodes.end(), std::greater<std::pair<uint64_t, int>>());
+	for(const auto& p : opcodes)
+	{
+		const bool cb = p.second & 0x100;
+		std::snprintf(line, sizeof(line), "%s%02X %14llu %7.2f%%  %s\n", cb ? "CB " : "   ", p.second & 0xFF,
+			static_cast<unsigned long long>(p.first), percent(p.first, _instructions),
+			cb ? LR35902::instr_cb_str[p.second & 0xFF].c_str() : LR35902::instr_str[p.second].c_str());
+		out << line;
+	}
+}
+
+void Profiler::write_collapsed(std::ostream& out) const
+{
+	if(_nodes.size() > 1)
+	{
+		if(_nodes[0].cycles > 0)
+			out << "(root) " << _nodes[0].cycles << "\n";
+		for(uint32_t n = 1; n < _nodes.size(); ++n)
+			if(_nodes[n].cycles > 0)
+				out << stack_name(n) << " " << _nodes[n].cycles << "\n";
+		return;
+	}
+	
+	// Sorted for stable outputs.
+	const std::map<Location, Counters> sorted(_counters.begin(), _counters.end());
+	for(const auto& p : sorted)
+		if(p.second.cycles > 0)
+			out << region(p.first) << ";" << name(p.first) << " " << p.second.cycles << "\n";
+	if(_halted_cycles > 0)
+		out << "HALT " << _halted_cycles << "\n";
+}
+
+bool Profiler::save(const std::string& report_path, const std::string& collapsed_path) const
+{
+	std::ofstream report(report_path);
+	std::ofstream collapsed(collapsed_path);
+	if(!report || !collapsed)
+		return false;
+	write_report(report);
+	write_collapsed(collapsed);
+	return true;
+}
+
+std::string Profiler::stack_name(uint32_t node) const
+{
+	std::vector<uint32_t> path;
+	for(; node != 0; node = _nodes[node].parent)
+		path.push_back(node);
+	std::string r;
+	for(auto it = path.rbegin(); it != path.rend(); ++it)
+	{
+		if(!r.empty())
+			r += ';';
+		r += routine_name(_nodes[*it].routine);
+	}
+	return r;
+}
+
+std::string Profiler::name(Location l)
+{
+	const int b = bank(l);
+	char str[16];
+	if(b < 0)
+		std::snprintf(str, sizeof(str), "%04X", address(l));
+	else if(b < MMU::RAMCodeBank)
+		std::snprintf(str, sizeof(str), "%02X:%04X", b, address(l));
+	else if(b - MMU::RAMCodeBank < 8)
+		std::snprintf(str, sizeof(str), "WRAM%d:%04X", b - MMU::RAMCodeBank, address(l));
+	else
+		std::snprintf(str, sizeof(str), "HRAM:%04X", address(l));
+	return str;
+}
+
+std::string Profiler::region(Location l)
+{
+	const int b = bank(l);
+	char str[16];
+	const addr_t a = address(l);
+	if(b < 0) // Not cached, see MMU::code_bank
+		return a < 0x8000 ? "BOOT" : a < 0xA000 ? "VRAM" : a < 0xC000 ? "SRAM" : "RAM";
+	else if(b < MMU::RAMCodeBank)
+		std::snprintf(str, sizeof(str), "ROM %02X", b);
+	else if(b - MMU::RAMCodeBank < 8)
+		std::snprintf(str, sizeof(str), "WRAM%d", b - MMU::RAMCodeBank);
+	else
+		std::snprintf(str, sizeof(str), "HRAM");
+	return str;
+}
+
+bool Profiler::load_symbols(const std::string& path)
+{
+	_symbols.clear();
+	std::ifstream file(path);
+	if(!file)
+		return false;
+	std::string line;
+	while(std::getline(file, line))
+	{
+		unsigned int bank, addr;
+		char symbol[256];
+		if(line.empty() || line[0] == ';')
+			continue;
+		if(std::sscanf(line.c_str(), "%x:%x %255s", &bank, &addr, symbol) == 3 && addr <= 0xFFFF)
+			add_symbol(symbol_location(bank, static_cast<addr_t>(addr)), symbol);
+	}
+	return true;
+}
+
+void Profiler::add_symbol(Location l, const std::string& symbol, bool replace)
+{
+	if(replace)
+		_symbols[l] = symbol;
+	else
+		_symbols.emplace(l, symbol);
+}
+
+std::string Profiler::routine_name(Location l) const
+{
+	if(l == Halted)
+		return "HALT";
+	auto it = _symbols.find(l);
+	return it != _symbols.end() ? it->second : name(l);
+}
+
+Profiler::Location Profiler::symbol_location(unsigned int bank, addr_t addr)
+{
+	if(addr < 0x4000)
+		return location(0, addr);
+	if(addr < 0x8000)
+		return location(static_cast<int>(bank), addr);
+	if(in_range(addr, 0xC000, 0xD000))
+		return location(MMU::RAMCodeBank, addr);
+	if(in_range(addr, 0xD000, 0xE000))
+		return location(MMU::RAMCodeBank + std::max(1, static_cast<int>(bank & 7)), addr);
+	if(in_range(addr, 0xFF80, 0xFFFF))
+		return location(MMU::RAMCodeBank + 8, addr);
+	return location(-1, addr);
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Tools/Common.hpp>
+
+/**
+ * Guest code profiler: Counts the instructions executed and the clock cycles spent
+ * for each (code bank, address), see LR35902::profiler.
+ *
+ * With call_graph, the cycles are also charged to the current node of a call tree, following a
+ * shadow stack updated on CALL/RST/interrupts and RET/RETI (see call and ret), giving the
+ * inclusive and exclusive cycles of each routine. Routines are named after their symbol
+ * if any (see load_symbols), by their location otherwise.
+ *
+ * Only built with USE_PROFILER: The CPU doesn't even test whether it is enabled otherwise.
+ * Every instruction is accounted for (no sampling), including the cycles of an interrupt
+ * dispatch (charged to the instruction following it) and the iterations of an idle loop
+ * skipped at once (charged to the start of the loop, see LR35902::skip_idle_loop).
+**/
+class Profiler
+{
+public:
+	struct Counters
+	{
+		uint64_t	instructions = 0;
+		uint64_t	cycles = 0;
+		word_t		opcode = 0;
+		word_t		cb_opcode = 0;	///< Opcode following a 0xCB prefix
+	};
+
+	/// (code bank + 1) << 16 | address, see MMU::code_bank
+	using Location = uint32_t;
+	/// Pseudo routine of the cycles spent halted (call graph only)
+	static constexpr Location Halted = 0xFFFFFFFF;
+	/// Maximum depth of the shadow stack: Deeper calls (runaway recursion) are charged to their caller.
+	static constexpr size_t MaxDepth = 256;
+
+	struct Routine
+	{
+		Location	location = 0;
+		uint64_t	inclusive = 0;	///< Cycles spent in the routine and the ones it called
+		uint64_t	exclusive = 0;	///< Cycles spent in the routine itself
+		uint64_t	calls = 0;
+	};
+
+	bool	enabled = false;
+	bool	call_graph = false;
+
+	/// Clears all counters and the call graph (symbols are kept).
+	void reset();
+
+	/// Records an executed instruction (and the cycles it took, in clock cycles).
+	inline void instruction(int bank, addr_t addr, word_t opcode, word_t cb_opcode, unsigned int cycles);
+	/// Cycles spent fast-forwarding an idle loop starting at addr.
+	inline void idle_loop(int bank, addr_t addr, unsigned int cycles);
+	inline void halted(unsigned int cycles);
+	
+	/**
+	 * Enters a routine (call graph only).
+	 * @param return_sp Value of SP once the return address is popped (before the call).
+	**/
+	inline void call(int bank, addr_t addr, addr_t return_sp);
+	/// Leaves all the routines whose return address is at or below sp (call graph only).
+	inline void ret(addr_t sp);
+
+	inline uint64_t get_instructions() const { return _instructions; }
+	inline uint64_t get_running_cycles() const { return _running_cycles; }
+	inline uint64_t get_halted_cycles() const { return _halted_cycles; }
+	inline uint64_t get_idle_cycles() const { return _idle_cycles; }
+	inline const uint64_t* get_opcode_counts() const { return _opcodes; }
+	inline const uint64_t* get_cb_opcode_counts() const { return _cb_opcodes; }
+	inline const std::unordered_map<Location, Counters>& get_counters() const { return _counters; }
+
+	/// @return The count most expensive locations, by decreasing cycles.
+	std::vector<std::pair<Location, Counters>> hot_spots(size_t count) const;
+
+	/// @return Routines of the call graph, by decreasing inclusive cycles.
+	std::vector<Routine> routines() const;
+
+	/// Sorted text report: Totals, routines, hot spots and opcode frequencies.
+	void write_report(std::ostream& out, size_t count = 100) const;
+	/**
+	 * Stacks and their exclusive cycles, one 'a;b;c cycles' line each, as expected by flamegraph tools.
+	 * Call stacks if the call graph was recorded, 'region;location' otherwise.
+	**/
+	void write_collapsed(std::ostream& out) const;
+	bool save(const std::string& report_path, const std::string& collapsed_path) const;
+
+	static inline Location location(int bank, addr_t addr) { return (static_cast<uint32_t>(bank + 1) << 16) | addr; }
+	static inline int bank(Location l) { return static_cast<int>(l >> 16) - 1; }
+	static inline addr_t address(Location l) { return static_cast<addr_t>(l & 0xFFFF); }
+	/// 'BB:AAAA' for ROM banks, 'WRAMn:AAAA' or 'HRAM:AAAA' for RAM, 'AAAA' for uncached memory.
+	static std::string name(Location l);
+	/// Memory region of the location ('ROM BB', 'WRAMn', ...).
+	static std::string region(Location l);
+
+	/**
+	 * Loads a symbol file ('BB:AAAA Name' lines, as produced by rgblink -n or used by BGB).
+	 * Replaces the current symbols. @return false if the file couldn't be opened.
+	**/
+	bool load_symbols(const std::string& path);
+	/// @param replace If false, an existing symbol for this location is kept.
+	void add_symbol(Location l, const std::string& symbol, bool replace = true);
+	inline bool has_symbols() const { return !_symbols.empty(); }
+	/// Symbol of the location, or its name if it has none.
+	std::string routine_name(Location l) const;
+	/// Location matching a symbol file entry (addresses outside of the switchable areas ignore the bank).
+	static Location symbol_location(unsigned int bank, addr_t addr);
+
+private:
+	struct Node
+	{
+		Location	routine;
+		uint32_t	parent;
+		uint64_t	cycles = 0;		///< Exclusive
+		uint64_t	calls = 0;
+		
+		Node(Location r, uint32_t p) : routine(r), parent(p) {}
+	};
+	
+	struct Frame
+	{
+		uint32_t	caller;			///< Node to return to
+		addr_t		return_sp;
+	};
+	
+
+	std::unordered_map<Location, Counters>	_counters;
+	uint64_t	_opcodes[0x100] = {0};
+	uint64_t	_cb_opcodes[0x100] = {0};
+	uint64_t	_instructions = 0;
+	uint64_t	_running_cycles = 0;
+	uint64_t	_halted_cycles = 0;
+	uint64_t	_idle_cycles = 0;		///< Part of _running_cycles
+	
+	std::vector<Node>						_nodes{Node{0, 0}};	///< Call tree, _nodes[0] is the root
+	std::unordered_map<uint64_t, uint32_t>	_children;			///< (parent << 32) | routine -> Node
+	std::vector<Frame>						_stack;				///< Shadow call stack
+	uint32_t								_current = 0;		///< Node being executed
+	
+	std::unordered_map<Location, std::string>	_symbols;
+	
+	uint32_t child(uint32_t parent, Location routine);
+	/// Path from the root to the node, excluding the root.
+	std::string stack_name(uint32_t node) const;
+};
+
+inline void Profiler::instruction(int bank, addr_t addr, word_t opcode, word_t cb_opcode, unsigned int cycles)
+{
+	Counters& c = _counters[location(bank, addr)];
+	++c.instructions;
+	c.cycles += cycles;
+	c.opcode = opcode;
+	c.cb_opcode = cb_opcode;
+
+	++_instructions;
+	_running_cycles += cycles;
+	if(call_graph)
+		_nodes[_current].cycles += cycles;
+	if(opcode == 0xCB)
+		++_cb_opcodes[cb_opcode];
+	else
+		++_opcodes[opcode];
+}
+
+inline void Profiler::idle_loop(int bank, addr_t addr, unsigned int cycles)
+{
+	_counters[location(bank, addr)].cycles += cycles;
+	_running_cycles += cycles;
+	_idle_cycles += cycles;
+	if(call_graph)
+		_nodes[_current].cycles += cycles;
+}
+
+inline void Profiler::halted(unsigned int cycles)
+{
+	_halted_cycles += cycles;
+	if(call_graph)
+		_nodes[child(_current, Halted)].cycles += cycles;
+}
+
+inline void Profiler::call(int bank, addr_t addr, addr_t return_sp)
+{
+	ret(return_sp); // Routines whose return address was discarded, their stack is reused.
+	const uint32_t caller = _current;
+	if(_stack.size() < MaxDepth)
+		_current = child(_current, location(bank, addr));
+	++_nodes[_current].calls;
+	_stack.push_back(Frame{caller, return_sp});
+}
+
+inline void Profiler::ret(addr_t sp)
+{
+	// The stack grows downward: Frames above sp were popped, even if their return address
+	// was discarded by the routine (POP then JP...). Returns to a manually pushed address are ignored.
+	while(!_stack.empty() && _stack.back().return_sp <= sp)
+	{
+		_current = _stack.back().caller;
+		_stack.pop_back();
+	}
+}
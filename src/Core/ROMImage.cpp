@@ -0,0 +1,106 @@
+#include "ROMImage.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+namespace
+{
+	// Opened images, by path. Expired entries are replaced by the next open.
+	std::mutex														opened_mutex;
+	std::unordered_map<std::string, std::weak_ptr<const ROMImage>>	opened;
+}
+
+std::shared_ptr<const ROMImage> ROMImage::open(const std::string& path, std::string& error)
+{
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0)
+	{
+		error = std::strerror(errno);
+		return nullptr;
+	}
+	if(!S_ISREG(st.st_mode))
+	{
+		error = "Not a regular file";
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(opened_mutex);
+	auto it = opened.find(path);
+	if(it != opened.end())
+	{
+		auto image = it->second.lock();
+		if(image && image->_size == static_cast<size_t>(st.st_size) && image->_device == static_cast<uint64_t>(st.st_dev) &&
+			image->_inode == static_cast<uint64_t>(st.st_ino) && image->_modified == static_cast<int64_t>(st.st_mtime))
+			return image;
+	}
+
+	std::shared_ptr<ROMImage> image(new ROMImage());
+	image->_device = st.st_dev;
+	image->_inode = st.st_ino;
+	image->_modified = st.st_mtime;
+	if(st.st_size > 0)
+	{
+#ifndef _WIN32
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0)
+		{
+			error = std::strerror(errno);
+			return nullptr;
+		}
+		void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); // The mapping keeps the file
+		if(mapping == MAP_FAILED)
+		{
+			error = std::strerror(errno);
+			return nullptr;
+		}
+		image->_mapping = mapping;
+		image->_data = static_cast<const byte_t*>(mapping);
+#else
+		std::ifstream file(path, std::ios::binary);
+		image->_buffer.resize(st.st_size);
+		if(!file.read(image->_buffer.data(), image->_buffer.size()))
+		{
+			error = "Read error.";
+			return nullptr;
+		}
+		image->_data = image->_buffer.data();
+#endif
+		image->_size = st.st_size;
+	}
+	opened[path] = image;
+	return image;
+}
+
+std::shared_ptr<const ROMImage> ROMImage::from_memory(std::vector<byte_t>&& data)
+{
+	std::shared_ptr<ROMImage> image(new ROMImage());
+	image->_buffer = std::move(data);
+	image->_data = image->_buffer.data();
+	image->_size = image->_buffer.size();
+	return image;
+}
+
+const std::shared_ptr<const ROMImage>& ROMImage::empty_image()
+{
+	static const std::shared_ptr<const ROMImage> empty(new ROMImage());
+	return empty;
+}
+
+ROMImage::~ROMImage()
+{
+#ifndef _WIN32
+	if(_mapping)
+		munmap(_mapping, _size);
+#endif
+}
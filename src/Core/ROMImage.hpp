@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Tools/Common.hpp>
+
+/**
+ * Immutable content of a ROM, shared by all the Cartridges running it (copies, save states...).
+ *
+ * Files are memory mapped read only: Pages are only read from the disk when first accessed, and
+ * the system shares them with every other mapping of the file. Opening a file already opened
+ * in this process (and not modified since) returns the same image.
+**/
+class ROMImage
+{
+public:
+	/// @return Image of the file at path, nullptr on error (described by error).
+	static std::shared_ptr<const ROMImage> open(const std::string& path, std::string& error);
+	/// @return Image owning data (a ROM extracted from an archive...), without copying it.
+	static std::shared_ptr<const ROMImage> from_memory(std::vector<byte_t>&& data);
+	/// @return Shared image of size 0.
+	static const std::shared_ptr<const ROMImage>& empty_image();
+
+	ROMImage(const ROMImage&) =delete;
+	ROMImage& operator=(const ROMImage&) =delete;
+	~ROMImage();
+
+	inline const byte_t* data() const { return _data; }
+	inline size_t size() const { return _size; }
+	inline bool empty() const { return _size == 0; }
+	inline byte_t operator[](size_t i) const { return _data[i]; }
+
+private:
+	ROMImage() =default;
+
+	const byte_t*		_data = nullptr;
+	size_t				_size = 0;
+	void*				_mapping = nullptr;	///< Mapped file, nullptr if the data is in _buffer
+	std::vector<byte_t>	_buffer;
+
+	// Identifies the opened file, to share the image (see open).
+	uint64_t			_device = 0;
+	uint64_t			_inode = 0;
+	int64_t				_modified = 0;
+};
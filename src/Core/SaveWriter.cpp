@@ -0,0 +1,166 @@
+#include "SaveWriter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+SaveWriter::SaveWriter(const std::string& path, const byte_t* data, size_t size) :
+	_path(path),
+	_image(data, data + size)
+{
+	_thread = std::thread(&SaveWriter::run, this);
+}
+
+SaveWriter::~SaveWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wake.notify_one();
+	_thread.join();
+}
+
+size_t SaveWriter::submit(const byte_t* data, size_t size)
+{
+	size_t changed = 0;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		size = std::min(size, _image.size());
+		for(size_t offset = 0; offset < size; offset += PageSize)
+		{
+			const size_t len = std::min(PageSize, size - offset);
+			if(std::memcmp(_image.data() + offset, data + offset, len) != 0)
+			{
+				std::memcpy(_image.data() + offset, data + offset, len);
+				++changed;
+			}
+		}
+		_dirty = _dirty || changed > 0;
+	}
+	if(changed > 0)
+		_wake.notify_one();
+	return changed;
+}
+
+void SaveWriter::flush()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_written.wait(lock, [&] { return !_dirty && !_writing; });
+}
+
+std::string SaveWriter::take_error()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	std::string error;
+	std::swap(error, _error);
+	return error;
+}
+
+void SaveWriter::run()
+{
+	std::vector<byte_t> data;
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(true)
+	{
+		_wake.wait(lock, [&] { return _dirty || _stop; });
+		if(!_dirty) // Stopping, nothing left to write
+			break;
+		data = _image;
+		_dirty = false;
+		_writing = true;
+		lock.unlock();
+
+		std::string error;
+		const bool success = write_file(_path, data.data(), data.size(), error);
+
+		lock.lock();
+		_writing = false;
+		if(!success)
+			_error = "Error writing '" + _path + "': " + error;
+		_written.notify_all();
+	}
+	_written.notify_all();
+}
+
+bool SaveWriter::write_file(const std::string& path, const byte_t* data, size_t size, std::string& error)
+{
+	const std::string tmp_path = path + ".tmp";
+#ifndef _WIN32
+	const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		error = std::strerror(errno);
+		return false;
+	}
+	size_t written = 0;
+	while(written < size)
+	{
+		const ssize_t r = ::write(fd, data + written, size - written);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0)
+		{
+			error = std::strerror(errno);
+			break;
+		}
+		if(r == 0) // errno isn't set
+		{
+			error = "Short write (" + std::to_string(written) + " of " + std::to_string(size) + " bytes).";
+			break;
+		}
+		written += static_cast<size_t>(r);
+	}
+	// The content has to reach the disk before the rename does.
+	if(written == size && ::fsync(fd) != 0)
+		error = std::strerror(errno);
+	const bool success = written == size && error.empty();
+	::close(fd);
+	if(!success)
+	{
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+#else
+	{
+		std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+		if(!file.write(data, size) || !file.flush())
+		{
+			error = "Write error.";
+			return false;
+		}
+	}
+	std::remove(path.c_str()); // rename doesn't replace an existing file on Windows
+#endif
+	if(std::rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		error = std::strerror(errno);
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+#ifndef _WIN32
+	// The rename itself only reaches the disk with the directory.
+	const size_t slash = path.find_last_of('/');
+	const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	const int dir_fd = ::open(dir.c_str(), O_RDONLY);
+	if(dir_fd < 0)
+	{
+		error = "Couldn't open the directory: " + std::string(std::strerror(errno));
+		return false;
+	}
+	const bool synced = ::fsync(dir_fd) == 0 || errno == EINVAL; // Not supported by some file systems
+	if(!synced)
+		error = "Couldn't sync the directory: " + std::string(std::strerror(errno));
+	::close(dir_fd);
+	return synced;
+#else
+	return true;
+#endif
+}
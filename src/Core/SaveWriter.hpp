@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Tools/Common.hpp>
+
+/**
+ * Writes a battery save (see Cartridge::SaveMode::WriteBehind) from a background thread.
+ *
+ * submit only copies the pages which changed since the previous call; the thread coalesces all the
+ * changes submitted while it was writing, and replaces the file atomically (see write_file): A crash
+ * never leaves a partially written save, and loses at most the changes not submitted yet.
+**/
+class SaveWriter
+{
+public:
+	static constexpr size_t PageSize = 0x100;
+
+	/// data: Current content of the file.
+	SaveWriter(const std::string& path, const byte_t* data, size_t size);
+	SaveWriter(const SaveWriter&) =delete;
+	SaveWriter& operator=(const SaveWriter&) =delete;
+	/// Writes the pending changes.
+	~SaveWriter();
+
+	/**
+	 * Schedules the write of data (same size as the initial content), if it changed.
+	 * @return Number of changed pages
+	**/
+	size_t submit(const byte_t* data, size_t size);
+	/// Waits for the pending changes to be written.
+	void flush();
+	/// @return Description of the last write error, cleared by the call.
+	std::string take_error();
+
+	/// Writes to a temporary file replacing the one at path once complete, then syncs its directory (POSIX).
+	static bool write_file(const std::string& path, const byte_t* data, size_t size, std::string& error);
+
+private:
+	const std::string		_path;
+	std::vector<byte_t>		_image;		///< Content to write, guarded by _mutex like the following members
+	bool					_dirty = false;
+	bool					_writing = false;
+	bool					_stop = false;
+	std::string				_error;
+
+	std::mutex				_mutex;
+	std::condition_variable	_wake;
+	std::condition_variable	_written;
+	std::thread				_thread;
+
+	void run();
+};
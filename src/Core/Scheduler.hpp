@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+/**
+ * Upcoming events of the emulated hardware, timestamped in CPU clock cycles since reset.
+ *
+ * The CPU advances the clock and runs freely until the earliest deadline (see LR35902::run),
+ * the component owning an event reschedules it once synchronized. An event scheduled at
+ * or before now() is due: Its owner has to be synchronized before going any further.
+ *
+ * There's only a handful of event kinds, each with at most one pending occurrence:
+ * The deadlines are stored by kind, and the earliest one is kept up to date on each change.
+**/
+class Scheduler
+{
+public:
+	enum Event : unsigned int
+	{
+		GPUMode,		///< Next GPU mode change (LY/STAT update, line rendering, HDMA block)
+		GPUInterrupt,	///< Next GPU mode change that may request an enabled interrupt (or end of frame)
+		Timer,			///< TIMA overflow
+		EventCount
+	};
+
+	static constexpr uint64_t Never = std::numeric_limits<uint64_t>::max();
+
+	/// Everything is due.
+	inline void reset()
+	{
+		_now = 0;
+		for(auto& d : _deadlines)
+			d = 0;
+		_next = 0;
+	}
+
+	inline uint64_t now() const { return _now; }
+	inline void advance(unsigned int cycles) { _now += cycles; }
+
+	/// @return Earliest deadline
+	inline uint64_t next() const { return _next; }
+	inline uint64_t deadline(Event e) const { return _deadlines[e]; }
+	inline bool due(Event e) const { return _deadlines[e] <= _now; }
+	/// @return Cycles before the event, 0 if due.
+	inline uint64_t until(Event e) const { return due(e) ? 0 : _deadlines[e] - _now; }
+
+	inline void schedule(Event e, uint64_t cycles) { set(e, _now + cycles); }
+	/// The event is due: Its owner has to be synchronized to compute its next occurrence.
+	inline void invalidate(Event e) { set(e, _now); }
+	inline void cancel(Event e) { set(e, Never); }
+
+private:
+	uint64_t	_now = 0;
+	uint64_t	_deadlines[EventCount] = {0};
+	uint64_t	_next = 0;
+
+	inline void set(Event e, uint64_t deadline)
+	{
+		const uint64_t previous = _deadlines[e];
+		_deadlines[e] = deadline;
+		if(deadline <= _next)
+		{
+			_next = deadline;
+		} else if(previous == _next) {
+			_next = Never;
+			for(auto d : _deadlines)
+				_next = d < _next ? d : _next;
+		}
+	}
+};
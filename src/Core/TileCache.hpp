@@ -0,0 +1,89 @@
+#pragma once
+
+#include <bitset>
+#include <memory>
+
+#include <Tools/Common.hpp>
+
+/**
+ * Tile data of both VRAM banks (0x8000 - 0x97FF), decoded to one color index (0 - 3) per pixel,
+ * with a horizontally flipped copy.
+ *
+ * Tiles are written far less often than they are drawn: The MMU flags the tiles modified
+ * by each write to their data (CPU, HDMA...), they are decoded again on their next use.
+**/
+class TileCache
+{
+public:
+	static constexpr size_t TilesPerBank = 384;
+	static constexpr addr_t TileDataSize = TilesPerBank * 16; ///< Bytes, from the start of the VRAM
+
+	/// Color indices of a tile: [flipped][y][x]
+	struct Tile
+	{
+		word_t pixels[2][8][8];
+	};
+
+	/// bank0, bank1: Tile data (start of each VRAM bank)
+	TileCache(const word_t* bank0, const word_t* bank1) :
+		_vram{bank0, bank1}
+	{
+		_dirty.set();
+	}
+	TileCache(const TileCache&) =delete;
+	TileCache& operator=(const TileCache&) =delete;
+
+	/// offset: From the start of the VRAM, the tile maps are ignored.
+	inline void invalidate(word_t bank, addr_t offset)
+	{
+		if(offset < TileDataSize)
+			_dirty[bank * TilesPerBank + (offset >> 4)] = true;
+	}
+	/// Invalidates the tiles in [offset, offset + size[
+	inline void invalidate(word_t bank, addr_t offset, size_t size)
+	{
+		for(size_t o = offset & ~0xF; o < offset + size && o < TileDataSize; o += 16)
+			_dirty[bank * TilesPerBank + (o >> 4)] = true;
+	}
+	inline void invalidate_all() { _dirty.set(); }
+
+	/// @param index Tile number from 0x8000 (0 - 383)
+	inline const Tile& get(word_t bank, size_t index)
+	{
+		const size_t i = bank * TilesPerBank + index;
+		if(_dirty[i])
+			decode(i);
+		return _tiles[i];
+	}
+
+	/// @return Color indices of the line y (0 - 7) of the tile
+	inline const word_t* row(word_t bank, size_t index, word_t y, bool xflip)
+	{
+		return get(bank, index).pixels[xflip][y];
+	}
+
+private:
+	const word_t*					_vram[2];
+	std::unique_ptr<Tile[]>			_tiles;	///< Allocated by the first decode: Copies of the MMU (--jit-verify, NativeCheck...) are rarely drawn
+	std::bitset<2 * TilesPerBank>	_dirty;	///< Tiles to decode again
+
+	void decode(size_t i)
+	{
+		if(!_tiles) // All the tiles are dirty until then
+			_tiles.reset(new Tile[2 * TilesPerBank]);
+		const word_t* data = _vram[i / TilesPerBank] + 16 * (i % TilesPerBank);
+		Tile& tile = _tiles[i];
+		for(int y = 0; y < 8; ++y)
+		{
+			const word_t l = data[2 * y];
+			const word_t h = data[2 * y + 1];
+			for(int x = 0; x < 8; ++x)
+			{
+				const word_t color = ((l >> (7 - x)) & 1) | (((h >> (7 - x)) & 1) << 1);
+				tile.pixels[0][y][x] = color;
+				tile.pixels[1][y][7 - x] = color;
+			}
+		}
+		_dirty[i] = false;
+	}
+};
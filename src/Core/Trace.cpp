@@ -0,0 +1,106 @@
+#include "Trace.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <Core/Disassembler.hpp>
+
+namespace
+{
+	constexpr char		TraceMagic[8] = {'S', 'B', 'T', 'R', 'A', 'C', 'E', '\0'};
+	constexpr uint32_t	TraceVersion = 3;
+
+	struct TraceHeader
+	{
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	record_size;
+		uint64_t	count;
+	};
+}
+
+std::string TraceRecord::disassembly() const
+{
+	const word_t bytes[3] = {opcode, static_cast<word_t>(operand & 0xFF), static_cast<word_t>(operand >> 8)};
+	char str[32];
+	Disassembler::format(Disassembler::decode(bytes, sizeof(bytes), pc), str, sizeof(str));
+	return str;
+}
+
+std::string TraceRecord::location() const
+{
+	char str[16];
+	if(bank == NoBank)
+		std::snprintf(str, sizeof(str), "---:%04X", pc);
+	else
+		std::snprintf(str, sizeof(str), "%03X:%04X", bank, pc);
+	return str;
+}
+
+std::string TraceRecord::registers() const
+{
+	char str[48];
+	std::snprintf(str, sizeof(str), "AF=%02X%02X BC=%02X%02X DE=%02X%02X HL=%02X%02X SP=%04X", a, f(), b, c, d, e, h, l, sp);
+	return str;
+}
+
+void TraceRecorder::start(size_t capacity)
+{
+	size_t c = 1;
+	while(c < capacity)
+		c <<= 1;
+	if(c != _capacity)
+	{
+		_records.reset(new TraceRecord[c]);
+		_capacity = c;
+	}
+	clear();
+	_recording = true;
+}
+
+void TraceRecorder::clear()
+{
+	_next = 0;
+	_size = 0;
+}
+
+bool TraceRecorder::dump(const std::string& path) const
+{
+	std::ofstream file(path, std::ios::binary);
+	if(!file)
+		return false;
+	TraceHeader header;
+	std::memcpy(header.magic, TraceMagic, sizeof(TraceMagic));
+	header.version = TraceVersion;
+	header.record_size = sizeof(TraceRecord);
+	header.count = _size;
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	// At most two contiguous parts: From the oldest record to the end of the buffer, then from its start.
+	const size_t first = (_next - _size) & (_capacity - 1);
+	const size_t first_count = std::min(_size, _capacity - first);
+	if(first_count > 0)
+		file.write(reinterpret_cast<const char*>(&_records[first]), first_count * sizeof(TraceRecord));
+	if(_size > first_count)
+		file.write(reinterpret_cast<const char*>(&_records[0]), (_size - first_count) * sizeof(TraceRecord));
+	return static_cast<bool>(file);
+}
+
+bool TraceRecorder::load(const std::string& path, std::vector<TraceRecord>& records)
+{
+	std::ifstream file(path, std::ios::binary);
+	TraceHeader header;
+	if(!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		std::memcmp(header.magic, TraceMagic, sizeof(TraceMagic)) != 0 ||
+		header.version != TraceVersion || header.record_size != sizeof(TraceRecord))
+		return false;
+	// The count is checked against the size of the file before allocating anything.
+	const std::streamoff start = file.tellg();
+	file.seekg(0, std::ios::end);
+	const std::streamoff end = file.tellg();
+	if(start < 0 || end < start || header.count > static_cast<uint64_t>(end - start) / sizeof(TraceRecord))
+		return false;
+	file.seekg(start);
+	records.resize(static_cast<size_t>(header.count));
+	return static_cast<bool>(file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(TraceRecord)));
+}
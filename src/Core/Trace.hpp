@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Tools/Common.hpp>
+
+/**
+ * CPU state before the execution of an instruction (see TraceRecorder).
+**/
+struct TraceRecord
+{
+	static constexpr uint16_t NoBank = 0xFFF; ///< bank of the code outside of ROM and WRAM/HRAM (VRAM, boot ROM...)
+
+	uint32_t	cycles;		///< Low 32 bits of the clock (see LR35902::get_clock_cycles)
+	addr_t		pc;
+	addr_t		sp;
+	addr_t		operand;	///< Immediate operand (8 or 16bits), or opcode following a 0xCB prefix
+	word_t		opcode;
+	word_t		a, b, c, d, e, h, l;
+	uint16_t	bank : 12;	///< MMU::code_bank: ROM bank, or MMU::RAMCodeBank + WRAM bank (8 for HRAM), NoBank elsewhere
+	uint16_t	flags : 4;	///< High nibble of F (its low nibble is always 0)
+
+	inline word_t f() const { return static_cast<word_t>(flags << 4); }
+
+	/// Instruction with its operands (see Disassembler::format).
+	std::string disassembly() const;
+	/// 'BBB:AAAA' (bank in hexadecimal, '---' if none)
+	std::string location() const;
+	/// 'AF=XXXX BC=XXXX DE=XXXX HL=XXXX SP=XXXX'
+	std::string registers() const;
+};
+
+static_assert(sizeof(TraceRecord) == 20, "TraceRecord isn't packed");
+
+/**
+ * Fixed-size ring buffer of the last executed instructions (see LR35902::trace).
+ *
+ * The records are allocated once by start, recording only overwrites the oldest one.
+ * The 32 bits cycle stamps wrap around every ~17 minutes of emulated time (single speed).
+**/
+class TraceRecorder
+{
+public:
+	static constexpr size_t DefaultCapacity = 1 << 20; ///< Records (20MB)
+
+	TraceRecorder() =default;
+	/// Copies don't record (see LR35902::operator=).
+	TraceRecorder(const TraceRecorder&) {}
+	TraceRecorder& operator=(const TraceRecorder&) { return *this; }
+
+	/// Clears the trace and starts recording. @param capacity Rounded up to a power of two.
+	void start(size_t capacity = DefaultCapacity);
+	inline void stop() { _recording = false; }
+	inline bool recording() const { return _recording; }
+	void clear();
+
+	/// Slot of the next record, overwriting the oldest one if full.
+	inline TraceRecord& next()
+	{
+		TraceRecord& r = _records[_next];
+		_next = (_next + 1) & (_capacity - 1);
+		if(_size < _capacity)
+			++_size;
+		return r;
+	}
+
+	inline size_t size() const { return _size; }
+	inline size_t capacity() const { return _capacity; }
+	/// @param i 0 is the oldest record.
+	inline const TraceRecord& operator[](size_t i) const { return _records[(_next - _size + i) & (_capacity - 1)]; }
+
+	/**
+	 * Writes the trace (oldest record first) to a binary file: 'SBTRACE' magic, version,
+	 * record size and count, followed by the records as laid out in memory (little endian).
+	**/
+	bool dump(const std::string& path) const;
+	/// Reads a file written by dump, false if it isn't one (or if it's truncated).
+	static bool load(const std::string& path, std::vector<TraceRecord>& records);
+
+private:
+	std::unique_ptr<TraceRecord[]>	_records;
+	size_t							_capacity = 0;
+	size_t							_next = 0;
+	size_t							_size = 0;
+	bool							_recording = false;
+};
@@ -10,6 +10,9 @@
 #include <imgui-SFML.h>
 
 #include <Core/GameBoy.hpp>
+#ifdef USE_AOT
+	#include <Core/LR35902AOT.hpp>
+#endif
 #include <GBAudioStream.hpp>
 
 #include <Tools/CommandLine.hpp>
@@ -43,6 +46,7 @@ float max_speed_factor = 0.f;
 size_t sample_rate = 44100;	// Audio sample rate
 size_t frame_skip = 0;		// Increase for better performances.
 std::string rom_path("");
+std::string aot_path("");	// Ahead-of-time translations of the ROM (see LR35902AOT)
 std::deque<std::string> logs;
 std::ostringstream log_line;
 
@@ -86,6 +90,7 @@ std::unique_ptr<color_t[]> tile_maps[2];
 // Timing
 sf::Clock timing_clock;
 sf::Clock delta_clock; // GUI Clock
+sf::Clock autosave_clock;
 double frame_time = 0;
 double last_screen_update = 0;
 size_t speed_update = 10;
@@ -126,6 +131,9 @@ void update_vsync();
 void reset();
 void load_empty_rom();
 void clear_breakpoints();
+void save_profile();
+void save_trace();
+void save_coverage();
 void modify_volume(float v);
 void load_movie(const char* movie_path);
 void get_frame_input();
@@ -138,14 +146,30 @@ template<typename T, typename ...Args>
 void log(const T& msg, Args... args);
 
 void update_screen() {
+	static bool blended = false; // The texture holds the post-processed screen
 	if(post_process)
 	{
 		for(unsigned int i = 0; i < gpu.ScreenWidth * gpu.ScreenHeight; ++i) // Extremely basic, LCDs doesn't work like this.
 			screen_buffer[i] = (1.0f - blend_speed) * screen_buffer[i] + blend_speed * gpu.get_screen()[i];
 		gameboy_screen.update(reinterpret_cast<const uint8_t*>(screen_buffer.get()));
-	} else {
+		blended = true;
+	} else if(blended) {
 		gameboy_screen.update(reinterpret_cast<const uint8_t*>(gpu.get_screen()));
+		blended = false;
+	} else {
+		// Only uploads the modified rows
+		const auto& changed = gpu.get_changed_lines();
+		for(unsigned int l = 0; l < gpu.ScreenHeight;)
+		{
+			unsigned int end = l;
+			while(end < gpu.ScreenHeight && changed[end])
+				++end;
+			if(end > l)
+				gameboy_screen.update(reinterpret_cast<const uint8_t*>(gpu.get_screen() + l * gpu.ScreenWidth), gpu.ScreenWidth, end - l, 0, l);
+			l = end + 1;
+		}
 	}
+	gpu.clear_changed_lines();
 }
 
 /*
@@ -298,6 +322,30 @@ int main(int argc, char* argv[])
 		mmu.force_dmg = true;
 	if(has_option(argc, argv, "--cgb"))
 		mmu.force_cgb = true;
+	if(has_option(argc, argv, "--jit"))
+		cpu.set_jit(LR35902::JITMode::On);
+	if(has_option(argc, argv, "--jit-verify"))
+		cpu.set_jit(LR35902::JITMode::Verify);
+	if(has_option(argc, argv, "--async-save"))
+		cartridge.set_save_mode(Cartridge::SaveMode::WriteBehind);
+	if(has_option(argc, argv, "--mapped-save"))
+		cartridge.set_save_mode(Cartridge::SaveMode::Mapped);
+#ifdef USE_PROFILER
+	if(has_option(argc, argv, "--profile"))
+		cpu.profiler().enabled = cpu.profiler().call_graph = true;
+#endif
+#ifdef USE_TRACE
+	if(has_option(argc, argv, "--trace"))
+		cpu.trace().start();
+#endif
+#ifdef USE_COVERAGE
+	if(has_option(argc, argv, "--coverage"))
+		cpu.coverage().enabled = true;
+#endif
+#ifdef USE_AOT
+	if(const char* path = get_option(argc, argv, "$aot"))
+		aot_path = path;
+#endif
 	
 	// Audio buffers
 	gb_snd_buffer.clock_rate(LR35902::ClockRate);
@@ -390,17 +438,34 @@ int main(int argc, char* argv[])
 				movie_save_frame();
 				do
 				{
-					cpu.execute();
+					// Single instructions when stepping in the debugger, otherwise runs up to the next event.
+					size_t cycles = 0;
+					if(debug && !frame_by_frame)
+					{
+						const size_t frame_cycles = cpu.frame_cycles;
+						cpu.execute();
+						cycles = cpu.frame_cycles - frame_cycles;
+					} else {
+						cycles = cpu.run();
+					}
 					
-					if(cpu.get_instr_cycles() == 0)
+					if(cycles == 0)
 						break;
 
-					size_t instr_cycles = (cpu.double_speed() ? cpu.get_instr_cycles() / 2 :
-																cpu.get_instr_cycles());
-					gpu.step(instr_cycles, i == frame_skip);
-					elapsed_cycles += instr_cycles;
-					speed_mesure_cycles += instr_cycles;
+					gpu.step(cycles, i == frame_skip);
+					elapsed_cycles += cycles;
+					speed_mesure_cycles += cycles;
 			
+					if(cpu.reached_watchpoint())
+					{
+						const MMU::WatchHit& hit = mmu.get_watch_hit();
+						log((hit.kind & MMU::WatchRead) ? "Read " : "Wrote ", Hexa8(hit.value), (hit.kind & MMU::WatchRead) ? " from " : " to ",
+							Hexa(hit.addr), (hit.kind & MMU::WatchChange) ? " (was " + Hexa8(hit.old_value).str() + ")" : "",
+							", stopped before ", Hexa(cpu.get_pc()));
+						debug = true;
+						step = false;
+						break;
+					}
 					if(cpu.reached_breakpoint())
 					{
 						log("Stepped on a breakpoint at ", Hexa(cpu.get_pc()));
@@ -415,6 +480,13 @@ int main(int argc, char* argv[])
 			
 			push_save_state();
 			
+			// Saving in the background is cheap: Loses at most a second of progress on a crash.
+			if(cartridge.get_save_mode() != Cartridge::SaveMode::Sync && autosave_clock.getElapsedTime().asSeconds() >= 1.0f)
+			{
+				cartridge.save();
+				autosave_clock.restart();
+			}
+			
 			size_t frame_cycles = cpu.frame_cycles;
 			bool stereo = apu.end_frame(frame_cycles);
 			if(with_sound)
@@ -490,6 +562,10 @@ int main(int argc, char* argv[])
     }
 	
 	cartridge.save();
+	cpu.save_idle_loops(cartridge.idle_loops_path());
+	save_profile();
+	save_trace();
+	save_coverage();
 	
 #ifdef USE_DISCORD_RPC
 	Discord_Shutdown();
@@ -512,6 +588,12 @@ void help()
 			//<< "  $ms \"path\" \tSpecify a output movie file." << std::endl
 			<< "  --dmg \tForce DMG mode." << std::endl
 			<< "  --cgb \tForce CGB mode." << std::endl
+			<< "  --jit \tTranslate the game code to native code (if built WITH_JIT)." << std::endl
+			<< "  --jit-verify \tSame, but compares each translation to the interpreter (slow)." << std::endl
+			<< "  --profile \tProfile the game code, saved on exit (if built WITH_PROFILER)." << std::endl
+			<< "  --trace \tRecord the last executed instructions, saved on exit (if built WITH_TRACE)." << std::endl
+			<< "  --async-save \tSave every second in the background." << std::endl
+			<< "  --mapped-save \tUse the save file as the cartridge RAM." << std::endl
 			<< " See the README.md for more and up-to-date informations." << std::endl
 			<< "------------------------------------------------------------" << std::endl;
 }
@@ -797,7 +879,9 @@ void gui()
 		{
 			ImGui::Text("%s: 0x%04X", "PC", cpu.get_pc());
 			ImGui::Text("%s: 0x%04X", "SP", cpu.get_sp());
-			ImGui::Text("%s: %s", "Instruction", cpu.get_disassembly().c_str());
+			char instr_text[64];
+			cpu.get_disassembly(cpu.get_pc(), instr_text, sizeof(instr_text));
+			ImGui::Text("%s: %s", "Instruction", instr_text);
 			ImGui::Text("%s: 0x%04X", "AF", cpu.get_af());
 			ImGui::Text("%s: 0x%04X", "BC", cpu.get_bc());
 			ImGui::Text("%s: 0x%04X", "DE", cpu.get_de());
@@ -854,13 +938,24 @@ void gui()
 		if(ImGui::CollapsingHeader("Breakpoints"))
 		{
 			static char addr_buff[32];
-			ImGui::InputText("##addr", addr_buff, 32, ImGuiInputTextFlags_CharsHexadecimal);
+			static char bank_buff[8];
+			static char condition_buff[128];
+			ImGui::PushItemWidth(60);
+			ImGui::InputText("Address##breakpoint", addr_buff, 32, ImGuiInputTextFlags_CharsHexadecimal);
 			ImGui::SameLine();
+			ImGui::InputText("Bank (optional)##breakpoint", bank_buff, 8, ImGuiInputTextFlags_CharsHexadecimal);
+			ImGui::PopItemWidth();
+			ImGui::InputText("Condition (e.g. A == $3C && [HL] != 0)##breakpoint", condition_buff, 128);
 			if(ImGui::Button("Add breakpoint") && strlen(addr_buff) > 0)
 			{
 				try
 				{
-					cpu.add_breakpoint(std::stoul(addr_buff, nullptr, 16));
+					Condition condition;
+					if(!condition.compile(condition_buff))
+						log("Error in the breakpoint condition: ", condition.get_error());
+					else
+						cpu.add_breakpoint(std::stoul(addr_buff, nullptr, 16),
+							strlen(bank_buff) > 0 ? static_cast<int>(std::stoul(bank_buff, nullptr, 16)) : Breakpoint::AnyBank, condition);
 				} catch(std::exception& e) {
 					log("Exception: '", e.what(), "', raised while adding a breakpoint.");
 				}
@@ -872,8 +967,8 @@ void gui()
 			[] (void* data, int idx, const char** out_text) -> bool {
 				if(labels.size() < static_cast<size_t>(idx + 1))
 					labels.resize(idx + 1);
-				auto addr = cpu.get_breakpoints()[idx];
-				labels[idx] = Hexa(addr).str() + " (" + cpu.get_disassembly(addr) + ")";
+				const Breakpoint& b = cpu.get_breakpoints()[idx];
+				labels[idx] = b.name() + " (" + cpu.get_disassembly(b.addr) + ")";
 				out_text[0] = labels[idx].c_str();
 				return true;
 			}, nullptr, cpu.get_breakpoints().size());
@@ -881,13 +976,63 @@ void gui()
 			if(selected_breakpoint < static_cast<int>(cpu.get_breakpoints().size()))
 				if(ImGui::Button("Remove breakpoint"))
 				{
-					cpu.get_breakpoints().erase(cpu.get_breakpoints().begin() + selected_breakpoint);
+					cpu.rem_breakpoint(selected_breakpoint);
 					selected_breakpoint = 0;
 				}
 			
 			if(ImGui::Button("Clear breakpoints"))
 				clear_breakpoints();
 		}
+		if(ImGui::CollapsingHeader("Watchpoints"))
+		{
+			static char first_buff[8];
+			static char last_buff[8];
+			static bool watch_read = false, watch_write = true, watch_change = false;
+			ImGui::PushItemWidth(60);
+			ImGui::InputText("First##watchpoint", first_buff, 8, ImGuiInputTextFlags_CharsHexadecimal);
+			ImGui::SameLine();
+			ImGui::InputText("Last (optional)##watchpoint", last_buff, 8, ImGuiInputTextFlags_CharsHexadecimal);
+			ImGui::PopItemWidth();
+			ImGui::Checkbox("Read##watchpoint", &watch_read);
+			ImGui::SameLine();
+			ImGui::Checkbox("Write##watchpoint", &watch_write);
+			ImGui::SameLine();
+			ImGui::Checkbox("Change##watchpoint", &watch_change);
+			if(ImGui::Button("Add watchpoint") && strlen(first_buff) > 0 && (watch_read || watch_write || watch_change))
+			{
+				try
+				{
+					const addr_t first = std::stoul(first_buff, nullptr, 16);
+					mmu.add_watchpoint(first, strlen(last_buff) > 0 ? std::stoul(last_buff, nullptr, 16) : first,
+						(watch_read ? MMU::WatchRead : 0) | (watch_write ? MMU::WatchWrite : 0) | (watch_change ? MMU::WatchChange : 0));
+				} catch(std::exception& e) {
+					log("Exception: '", e.what(), "', raised while adding a watchpoint.");
+				}
+			}
+			
+			static int selected_watchpoint = 0;
+			static std::vector<std::string> labels;
+			ImGui::ListBox("Watchpoints", &selected_watchpoint,
+			[] (void* data, int idx, const char** out_text) -> bool {
+				if(labels.size() < static_cast<size_t>(idx + 1))
+					labels.resize(idx + 1);
+				const MMU::Watchpoint& w = mmu.get_watchpoints()[idx];
+				labels[idx] = Hexa(w.addr).str() + (w.last != w.addr ? "-" + Hexa(w.last).str() : "") + 
+					((w.kind & MMU::WatchRead) ? " R" : "") + ((w.kind & MMU::WatchWrite) ? " W" : "") + ((w.kind & MMU::WatchChange) ? " C" : "");
+				out_text[0] = labels[idx].c_str();
+				return true;
+			}, nullptr, mmu.get_watchpoints().size());
+			
+			if(selected_watchpoint < static_cast<int>(mmu.get_watchpoints().size()))
+				if(ImGui::Button("Remove watchpoint"))
+				{
+					mmu.rem_watchpoint(selected_watchpoint);
+					selected_watchpoint = 0;
+				}
+			
+			if(ImGui::Button("Clear watchpoints"))
+				mmu.clear_watchpoints();
+		}
 		if(ImGui::CollapsingHeader("Memory"))
 		{
 			auto printable_ascii = [](char c) -> char {
@@ -918,47 +1063,165 @@ void gui()
 		}
 		if(ImGui::CollapsingHeader("Analyser (WIP)"))
 		{
+			static std::vector<Analyser::Offset> analysed;
+			ImGui::Checkbox("Parallel##analyser", &analyser.parallel);
+			ImGui::SameLine();
 			if(ImGui::Button("Analyse"))
+			{
 				analyser.process(cartridge);
+				analyser.get_instructions(analysed);
+			}
 			ImGui::SameLine();
 			if(ImGui::Button("Analyse from PC"))
-				analyser.process(cartridge, cpu.get_pc());
-			ImGui::Text("Found %I64d instructions, generated %d labels.", analyser.instructions.size(), analyser.get_label_count());
-			if(!analyser.instructions.empty())
+			{
+				analyser.process(cartridge, cartridge.getCurrentROMBank(), cpu.get_pc());
+				analyser.get_instructions(analysed);
+			}
+		#ifdef USE_COVERAGE
+			CodeCoverage& coverage = cpu.coverage();
+			ImGui::Checkbox("Record executed code", &coverage.enabled);
+			ImGui::SameLine();
+			if(ImGui::Button("Analyse executed code"))
+			{
+				analyser.process(cartridge, coverage);
+				analyser.get_instructions(analysed);
+			}
+			ImGui::Text("Executed %d instructions, %d indirect jump destinations.", static_cast<int>(coverage.get_executed_count()), 
+				static_cast<int>(coverage.get_indirect_jump_count()));
+		#endif
+			ImGui::Text("Found %d instructions in %d banks, generated %d labels.", static_cast<int>(analysed.size()), 
+				static_cast<int>(analyser.get_bank_count()), analyser.get_label_count());
+			if(!analysed.empty())
 			{
 				ImGui::BeginChild("Analysed Memory##view", ImVec2(0,400));
-				ImGuiListClipper clipper(analyser.instructions.size());
+				ImGuiListClipper clipper(analysed.size());
 				while(clipper.Step())
 				{
-					auto instr_it = analyser.instructions.begin();
-					for(int i = 0; i < clipper.DisplayStart; ++i)
-						++instr_it;
 					for(int idx = clipper.DisplayStart; idx < clipper.DisplayEnd; ++idx)
 					{
-						addr_t addr = *instr_it;
-						// If the disassembly wasn't part of the CPU class, we could
-						// have some addresses replaced with the corresponding label...
-						if(addr < analyser.labels.size() && analyser.labels[addr])
-							ImGui::Text("%s: 0x%04X 0x%02X [%d] %s", 
-								analyser.labels[addr].name.c_str(),
-								addr, 
-								mmu.read(addr), 
-								static_cast<int>(cpu.instr_length[mmu.read(addr)]), 
-								cpu.get_disassembly(addr).c_str()
-							);
-						else
-							ImGui::Text("      0x%04X 0x%02X [%d] %s", 
-								addr, 
-								mmu.read(addr), 
-								static_cast<int>(cpu.instr_length[mmu.read(addr)]), 
-								cpu.get_disassembly(addr).c_str()
-							);
-						++instr_it;
+						const Analyser::Offset offset = analysed[idx];
+						const int bank = Analyser::bank(offset);
+						const addr_t addr = Analyser::address(offset);
+						const word_t* data = reinterpret_cast<const word_t*>(cartridge.rom_bank_data(bank)) + offset % Analyser::BankSize;
+						const DisassembledInstr instr = Disassembler::decode(data, Analyser::BankSize - offset % Analyser::BankSize, addr);
+						const char* target_name = nullptr;
+						if(instr.has_target && instr.target < 0x8000)
+							target_name = analyser.get_label(Analyser::offset(instr.target < 0x4000 ? 0 : bank, instr.target));
+						char text[64];
+						Disassembler::format(instr, text, sizeof(text), target_name);
+						const char* label = analyser.get_label(offset);
+						ImGui::Text("%-8s %02X:%04X 0x%02X [%d] %s", 
+							label ? label : "",
+							bank,
+							addr, 
+							data[0], 
+							static_cast<int>(instr.length), 
+							text
+						);
 					}
 				}
 				ImGui::EndChild();
 			}
 		}
+	#ifdef USE_PROFILER
+		if(ImGui::CollapsingHeader("Profiler"))
+		{
+			Profiler& profiler = cpu.profiler();
+			ImGui::Checkbox("Enabled##profiler", &profiler.enabled);
+			ImGui::SameLine();
+			ImGui::Checkbox("Call graph##profiler", &profiler.call_graph);
+			ImGui::SameLine();
+			if(ImGui::Button("Reset##profiler"))
+				profiler.reset();
+			ImGui::SameLine();
+			if(ImGui::Button("Save##profiler"))
+				save_profile();
+			
+			const uint64_t running = profiler.get_running_cycles();
+			const uint64_t total = std::max<uint64_t>(1, running + profiler.get_halted_cycles());
+			ImGui::Text("Instructions: %llu, Running: %.2f%% (Idle loops: %.2f%%), Halted: %.2f%%",
+				static_cast<unsigned long long>(profiler.get_instructions()),
+				100.0 * running / total,
+				100.0 * profiler.get_idle_cycles() / total,
+				100.0 * profiler.get_halted_cycles() / total);
+			ImGui::PlotHistogram("Opcodes", [] (void* data, int idx) {
+				return static_cast<float>(static_cast<const uint64_t*>(data)[idx]);
+			}, const_cast<uint64_t*>(profiler.get_opcode_counts()), 0x100, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 80));
+			
+			ImGui::BeginChild("Hot spots##view", ImVec2(0, 300));
+			ImGui::Columns(4, "Hot spots");
+			ImGui::Text("Location"); ImGui::NextColumn();
+			ImGui::Text("Cycles"); ImGui::NextColumn();
+			ImGui::Text("Instructions"); ImGui::NextColumn();
+			ImGui::Text("Instruction"); ImGui::NextColumn();
+			ImGui::Separator();
+			for(const auto& p : profiler.hot_spots(64))
+			{
+				const Profiler::Counters& c = p.second;
+				ImGui::Text("%s", Profiler::name(p.first).c_str()); ImGui::NextColumn();
+				ImGui::Text("%llu (%.2f%%)", static_cast<unsigned long long>(c.cycles), 100.0 * c.cycles / std::max<uint64_t>(1, running));
+				ImGui::NextColumn();
+				ImGui::Text("%llu", static_cast<unsigned long long>(c.instructions)); ImGui::NextColumn();
+				ImGui::Text("%s", c.opcode == 0xCB ? LR35902::instr_cb_str[c.cb_opcode].c_str() : LR35902::instr_str[c.opcode].c_str());
+				ImGui::NextColumn();
+			}
+			ImGui::Columns(1);
+			ImGui::EndChild();
+			
+			if(!profiler.has_symbols() && analyser.get_label_count() > 0 && ImGui::Button("Name routines after the Analyser labels"))
+			{
+				analyser.for_each_label([&] (Analyser::Offset offset, const std::string& name) {
+					profiler.add_symbol(Profiler::location(Analyser::bank(offset), Analyser::address(offset)), name, false);
+				});
+			}
+			ImGui::BeginChild("Routines##view", ImVec2(0, 300));
+			ImGui::Columns(4, "Routines");
+			ImGui::Text("Routine"); ImGui::NextColumn();
+			ImGui::Text("Inclusive"); ImGui::NextColumn();
+			ImGui::Text("Exclusive"); ImGui::NextColumn();
+			ImGui::Text("Calls"); ImGui::NextColumn();
+			ImGui::Separator();
+			const auto routines = profiler.routines();
+			for(size_t i = 0; i < std::min<size_t>(64, routines.size()); ++i)
+			{
+				const Profiler::Routine& r = routines[i];
+				ImGui::Text("%s", profiler.routine_name(r.location).c_str()); ImGui::NextColumn();
+				ImGui::Text("%llu (%.2f%%)", static_cast<unsigned long long>(r.inclusive), 100.0 * r.inclusive / total); ImGui::NextColumn();
+				ImGui::Text("%llu (%.2f%%)", static_cast<unsigned long long>(r.exclusive), 100.0 * r.exclusive / total); ImGui::NextColumn();
+				ImGui::Text("%llu", static_cast<unsigned long long>(r.calls)); ImGui::NextColumn();
+			}
+			ImGui::Columns(1);
+			ImGui::EndChild();
+		}
+	#endif
+	#ifdef USE_TRACE
+		if(ImGui::CollapsingHeader("Trace"))
+		{
+			TraceRecorder& trace = cpu.trace();
+			bool recording = trace.recording();
+			if(ImGui::Checkbox("Record##trace", &recording))
+			{
+				if(recording)
+					trace.start();
+				else
+					trace.stop();
+			}
+			ImGui::SameLine();
+			if(ImGui::Button("Save##trace"))
+				save_trace();
+			ImGui::SameLine();
+			ImGui::Text("%zu / %zu instructions", trace.size(), trace.capacity());
+			
+			ImGui::BeginChild("Trace##view", ImVec2(0, 300));
+			const size_t count = std::min<size_t>(32, trace.size());
+			for(size_t i = trace.size() - count; i < trace.size(); ++i)
+			{
+				const TraceRecord& r = trace[i];
+				ImGui::Text("%10u %s  %-20s %s", r.cycles, r.location().c_str(), r.disassembly().c_str(), r.registers().c_str());
+			}
+			ImGui::EndChild();
+		}
+	#endif
 		if(ImGui::CollapsingHeader("Sound"))
 		{
 			if(snd_buffer.get_buffer() != nullptr)
@@ -980,6 +1243,47 @@ void clear_breakpoints()
 	log("Cleared breakpoints.");
 }
 
+void save_profile()
+{
+#ifdef USE_PROFILER
+	const Profiler& profiler = cpu.profiler();
+	if(profiler.get_instructions() == 0 || cartridge.file_path("").empty())
+		return;
+	const std::string report_path = cartridge.file_path(".profile.txt");
+	const std::string collapsed_path = cartridge.file_path(".folded");
+	if(profiler.save(report_path, collapsed_path))
+		log("Saved profile to '", report_path, "' and '", collapsed_path, "'.");
+	else
+		log("Error: Profile could not be saved to '", report_path, "'.");
+#endif
+}
+
+void save_trace()
+{
+#ifdef USE_TRACE
+	const TraceRecorder& trace = cpu.trace();
+	if(trace.size() == 0 || cartridge.file_path("").empty())
+		return;
+	const std::string path = cartridge.file_path(".trace");
+	if(trace.dump(path))
+		log("Saved the last ", trace.size(), " instructions to '", path, "'.");
+	else
+		log("Error: Trace could not be saved to '", path, "'.");
+#endif
+}
+
+void save_coverage()
+{
+#ifdef USE_COVERAGE
+	const CodeCoverage& coverage = cpu.coverage();
+	if(coverage.empty() || cartridge.file_path("").empty())
+		return;
+	const std::string path = cartridge.file_path(".code");
+	if(!coverage.save(path))
+		log("Error: Code coverage could not be saved to '", path, "'.");
+#endif
+}
+
 void advance_frame()
 {
 	frame_by_frame = true;
@@ -1059,6 +1363,16 @@ void toggle_speed()
 void reset()
 {
 	cartridge.save();
+	cpu.save_idle_loops(cartridge.idle_loops_path());
+	save_profile();
+	save_trace();
+	save_coverage();
+#ifdef USE_PROFILER
+	cpu.profiler().reset();
+#endif
+#ifdef USE_TRACE
+	cpu.trace().clear();
+#endif
 	
 	if(use_movie)
 	{
@@ -1127,7 +1441,7 @@ void reset()
 						{
 							log("Error extracting file (mz_zip_reader_extract_file_to_mem).");
 						} else {
-							if(!cartridge.load_from_memory(reinterpret_cast<unsigned char*>(buffer.data()), buffer.size())) 
+							if(!cartridge.load_from_memory(std::move(buffer))) 
 							{
 								log("Error loading '", filename, "' from '", rom_path, "', continuing...");
 							} else {
@@ -1160,6 +1474,21 @@ void reset()
 				mmu.load_boot();
 		} else
 			cpu.reset_cart();
+		cpu.load_idle_loops(cartridge.idle_loops_path());
+	#ifdef USE_COVERAGE
+		cpu.coverage().clear();
+		cpu.coverage().load(cartridge.file_path(".code"));
+	#endif
+	#ifdef USE_AOT
+		if(!aot_path.empty() && cpu.load_aot(aot_path))
+			log("Loaded ", cpu.get_aot()->size(), " translated blocks from '", aot_path, "'.");
+	#endif
+	#ifdef USE_PROFILER
+		// Symbols exported alongside the ROM by its assembler (rgblink -n)
+		const std::string sym_path = rom_path.substr(0, period_pos) + ".sym";
+		if(cpu.profiler().load_symbols(sym_path))
+			log("Loaded symbols from '", sym_path, "'.");
+	#endif
 	}
 	gpu.reset();
 	
@@ -1205,26 +1534,15 @@ void load_empty_rom()
 
 void update_tiledata()
 {
-	word_t tile_l;
-	word_t tile_h;
-	word_t tile_data0, tile_data1;
 	for(int tm = 0; tm < 2; ++tm)
 	{
 		for(int t = 0; t < 256 + 128; ++t)
 		{
 			size_t tile_off = 8 * (t % 16) + (16 * 8 * 8) * (t / 16); 
+			const TileCache::Tile& tile = mmu.tiles().get(tm, t);
 			for(int y = 0; y < 8; ++y)
-			{
-				tile_l = mmu.read_vram(tm, 0x8000 + t * 16 + y * 2);
-				tile_h = mmu.read_vram(tm, 0x8000 + t * 16 + y * 2 + 1);
-				GPU::palette_translation(tile_l, tile_h, tile_data0, tile_data1);
 				for(int x = 0; x < 8; ++x)
-				{
-					word_t shift = ((7 - x) % 4) * 2;
-					word_t color = ((x > 3 ? tile_data1 : tile_data0) >> shift) & 0b11;
-					tile_data[tm][tile_off + 16 * 8 * y + x] = std::min((4 - color) * 64, 255);
-				}
-			}
+					tile_data[tm][tile_off + 16 * 8 * y + x] = std::min((4 - tile.pixels[0][y][x]) * 64, 255);
 		}
 		gameboy_tiledata[tm].update(reinterpret_cast<uint8_t*>(tile_data[tm].get()));
 	}
@@ -1232,32 +1550,19 @@ void update_tiledata()
 
 void update_tilemaps()
 {
-	word_t tile_l;
-	word_t tile_h;
-	word_t tile_data0, tile_data1;
 	for(int tm = 0; tm < 2; ++tm)
 	{
 		addr_t mapoffs = (tm == 0) ? 0x9800 : 0x9C00;
 		bool select = (gpu.get_lcdc() & GPU::BGWindowsTileDataSelect);
-		addr_t base_tile_data = select ? 0x8000 : 0x9000;
 		for(int t = 0; t < 32 * 32; ++t)
 		{
 			size_t tile_off = (8 * 8 * 32) * (t / 32) + 8 * (t % 32);
+			word_t ti = mmu.read_vram(0, mapoffs + t);
+			// Second Tile Set: Signed index from 0x9000
+			const TileCache::Tile& tile = mmu.tiles().get(tm, select ? ti : 256 + static_cast<int8_t>(ti));
 			for(int y = 0; y < 8; ++y)
-			{
-				int ti = mmu.read_vram(0, mapoffs + t);
-				if(!select && (ti & 0x80))
-					 ti = -((~ti + 1) & 0xFF);
-				tile_l = mmu.read_vram(tm, base_tile_data + ti * 16 + y * 2);
-				tile_h = mmu.read_vram(tm, base_tile_data + ti * 16 + y * 2 + 1);
-				GPU::palette_translation(tile_l, tile_h, tile_data0, tile_data1);
 				for(int x = 0; x < 8; ++x)
-				{
-					word_t shift = ((7 - x) % 4) * 2;
-					word_t color = ((x > 3 ? tile_data1 : tile_data0) >> shift) & 0b11;
-					tile_maps[tm][tile_off + (8 * 32) * y +  + x] = std::min((4 - color) * 64, 255);
-				}
-			}
+					tile_maps[tm][tile_off + (8 * 32) * y + x] = std::min((4 - tile.pixels[0][y][x]) * 64, 255);
 		}
 		gameboy_tilemap[tm].update(reinterpret_cast<uint8_t*>(tile_maps[tm].get()));
 	}
@@ -0,0 +1,189 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include <Analysis/Analyser.hpp>
+#include <Core/Coverage.hpp>
+#include <Core/LR35902AOT.hpp>
+#include <Tools/CommandLine.hpp>
+
+/**
+ * Translates the code of a ROM to C++, for LR35902AOT: One function per block found by the Analyser
+ * (starting at a label or following a jump, call or return), with their table.
+ *
+ * Usage: AOTCompiler "path/to/rom" [$out "path/to/output.cpp"] [$coverage "path/to/rom.code"]
+ *  $out		Defaults to the ROM path followed by '.aot.cpp'.
+ *  $coverage	Code executed by SenBoy (--coverage, see CodeCoverage), to also find the code reached by indirect jumps.
+ *
+ * Only built WITH_AOT. The output has to be built as a shared library with the same sources and options as
+ * SenBoy and AOTCompiler (see LR35902AOT::ABI and layout), e.g.
+ *  g++ -std=c++14 -O2 -shared -fPIC -DUSE_AOT -Isrc -Iext/Gb_Snd_Emu-0.1.4 rom.gb.aot.cpp -o rom.so
+ * then loaded with 'SenBoy rom.gb $aot rom.so'.
+**/
+
+/// Same blocks as LR35902::build_block, from the content of the ROM bank.
+static LR35902::Block build_block(const word_t* data, int bank, addr_t addr)
+{
+	const addr_t start = bank == 0 ? 0x0000 : 0x4000;
+	const unsigned int end = start + 0x4000;
+	LR35902::Block b;
+	do
+	{
+		LR35902::DecodedInstr i;
+		i.addr = addr;
+		i.opcode = data[addr - start];
+		i.handler = LR35902::instr_handlers[i.opcode];
+		i.cycles = LR35902::instr_cycles[i.opcode];
+		i.length = (i.opcode == 0x10 || LR35902::instr_length[i.opcode] == 0) ? 1 : LR35902::instr_length[i.opcode];
+		// Instructions overlapping two banks are never cached.
+		if(addr + i.length > end)
+			break;
+		i.operand = i.length > 2 ? data[addr - start + 1] | (data[addr - start + 2] << 8) :
+					i.length > 1 ? data[addr - start + 1] : 0;
+		b.instrs.push_back(i);
+		b.cycles += i.cycles;
+		addr += i.length;
+	} while(!LR35902::ends_block(b.instrs.back().opcode) && addr < end);
+	return b;
+}
+
+static void write_block(std::ostream& out, const LR35902::Block& b, int bank)
+{
+	char line[128];
+	std::snprintf(line, sizeof(line), "static unsigned int block_%02X_%04X(LR35902& cpu)\n{\n", bank, b.instrs[0].addr);
+	out << line;
+	const size_t length = LR35902::native_length(b);
+	out << "\tconst unsigned int start = A::start(cpu);\n\tswitch(start)\n\t{\n\tdefault: return start;\n";
+	for(size_t idx = 0; idx < length; ++idx)
+	{
+		const LR35902::DecodedInstr& i = b.instrs[idx];
+		const addr_t next = i.addr + i.length;
+		const unsigned int n = static_cast<unsigned int>(idx);
+		char text[64];
+		const word_t bytes[3] = {i.opcode, static_cast<word_t>(i.operand & 0xFF), static_cast<word_t>(i.operand >> 8)};
+		Disassembler::format(Disassembler::decode(bytes, i.length, i.addr), text, sizeof(text));
+		std::snprintf(line, sizeof(line), "\tcase %u:\n\tif(A::stop(cpu, %u)) return %u;\n", n, n, n);
+		out << line;
+		if(LR35902::needs_native_step(i))
+		{
+			std::snprintf(line, sizeof(line), "\tif(!A::step(cpu, %u)) return %u;", n, n + 1);
+			out << line << "\t// " << text << "\n";
+			continue;
+		}
+		if(i.opcode == 0xCB)
+			std::snprintf(line, sizeof(line), "\tif(A::io_access<0xCB>(cpu, 0x%02X))", i.operand);
+		else
+			std::snprintf(line, sizeof(line), "\tif(A::io_access<0x%02X>(cpu))", i.opcode);
+		out << line;
+		std::snprintf(line, sizeof(line), " { if(!A::step(cpu, %u)) return %u; }\n\telse ", n, n + 1);
+		out << line;
+		if(i.opcode == 0xCB)
+			std::snprintf(line, sizeof(line), "A::exec_cb<0x%02X>(cpu, 0x%04X);", i.operand, next);
+		else if(i.length > 1)
+			std::snprintf(line, sizeof(line), "A::exec<0x%02X>(cpu, 0x%04X, 0x%X);", i.opcode, next, i.operand);
+		else
+			std::snprintf(line, sizeof(line), "A::exec<0x%02X>(cpu, 0x%04X);", i.opcode, next);
+		out << line << "\t// " << text << "\n";
+		if(LR35902::writes_memory(i) && idx + 1 < length)
+			out << "\tif(A::remapped(cpu)) return " << idx + 1 << ";\n";
+	}
+	out << "\t}\n\treturn " << length << ";\n}\n\n";
+}
+
+int main(int argc, char* argv[])
+{
+	const char* rom_path = get_file(argc, argv);
+	if(rom_path == nullptr)
+	{
+		std::cerr << "Usage: " << argv[0] << " \"path/to/rom\" [$out \"path/to/output.cpp\"] [$coverage \"path/to/rom.code\"]" << std::endl;
+		return 1;
+	}
+	Cartridge cartridge;
+	if(!cartridge.load(rom_path))
+	{
+		std::cerr << "Error: Couldn't load '" << rom_path << "'." << std::endl;
+		return 1;
+	}
+
+	Analyser analyser;
+	analyser.process(cartridge);
+	if(const char* coverage_path = get_option(argc, argv, "$coverage"))
+	{
+		CodeCoverage coverage;
+		if(!coverage.load(coverage_path))
+		{
+			std::cerr << "Error: '" << coverage_path << "' is not a valid coverage file." << std::endl;
+			return 1;
+		}
+		analyser.process(cartridge, coverage);
+	}
+
+	// Blocks start at jump/call targets, and after the instructions ending a block (returns, branches not taken...)
+	std::vector<Analyser::Offset> instructions;
+	analyser.get_instructions(instructions);
+	const word_t* rom = reinterpret_cast<const word_t*>(cartridge.rom_bank_data(0)); // Indexed by Analyser::Offset
+	std::vector<Analyser::Offset> starts;
+	for(size_t i = 0; i < instructions.size(); ++i)
+	{
+		const Analyser::Offset o = instructions[i];
+		bool follows_end = false;
+		if(i > 0)
+		{
+			const word_t prev = rom[instructions[i - 1]];
+			follows_end = LR35902::ends_block(prev) && instructions[i - 1] + std::max<size_t>(1, LR35902::instr_length[prev]) == o;
+		}
+		if(analyser.is_label(o) || follows_end)
+			starts.push_back(o);
+	}
+
+	const char* out_option = get_option(argc, argv, "$out");
+	const std::string out_path = out_option ? out_option : std::string(rom_path) + ".aot.cpp";
+	std::ofstream out(out_path, std::ios::trunc);
+	if(!out)
+	{
+		std::cerr << "Error: Couldn't write '" << out_path << "'." << std::endl;
+		return 1;
+	}
+	out << "// Generated by AOTCompiler from '" << rom_path << "' (" << cartridge.getName() << "), see LR35902AOT.\n\n"
+		<< "#include <Core/LR35902AOT.hpp>\n\n"
+		<< "#ifndef USE_AOT\n\t#error \"Has to be built with the options of SenBoy, including USE_AOT.\"\n#endif\n"
+		<< "static_assert(LR35902AOT::ABI == 0x" << std::hex << LR35902AOT::ABI << std::dec << ", \"Has to be built with the options of AOTCompiler.\");\n"
+		<< "static_assert(LR35902AOT::layout() == 0x" << std::hex << LR35902AOT::layout() << std::dec << ", \"Has to be built from the sources of AOTCompiler.\");\n\n"
+		<< "using A = LR35902AOT;\n\n";
+
+	std::vector<std::pair<uint32_t, const LR35902::Block*>> entries;
+	std::vector<LR35902::Block> blocks;
+	blocks.reserve(starts.size());
+	for(Analyser::Offset o : starts)
+	{
+		const int bank = Analyser::bank(o);
+		const addr_t addr = Analyser::address(o);
+		const word_t* data = reinterpret_cast<const word_t*>(cartridge.rom_bank_data(bank));
+		blocks.push_back(build_block(data, bank, addr));
+		if(LR35902::native_length(blocks.back()) == 0)
+		{
+			blocks.pop_back();
+			continue;
+		}
+		write_block(out, blocks.back(), bank);
+		entries.emplace_back((static_cast<uint32_t>(bank) << 16) | addr, &blocks.back());
+	}
+
+	out << "static const LR35902AOT::Entry entries[] = {\n";
+	char line[128];
+	for(const auto& e : entries)
+	{
+		std::snprintf(line, sizeof(line), "\t{0x%08X, %u, %u, block_%02X_%04X},\n", e.first,
+			static_cast<unsigned int>(e.second->instrs.size()), e.second->cycles, e.first >> 16, e.first & 0xFFFF);
+		out << line;
+	}
+	out << "};\n\n"
+		<< "extern \"C\" const LR35902AOT::Module* senboy_aot_module()\n{\n"
+		<< "\tstatic const LR35902AOT::Module module = {LR35902AOT::Version, 0x" << std::hex << LR35902AOT::ABI << ", 0x" << LR35902AOT::layout() << std::dec << ", "
+		<< cartridge.getHeaderChecksum() << ", " << cartridge.getChecksum() << ", " << entries.size() << ", entries};\n"
+		<< "\treturn &module;\n}\n";
+
+	std::cerr << "Translated " << entries.size() << " blocks (" << starts.size() - entries.size() << " left to the interpreter) to '"
+			  << out_path << "'." << std::endl;
+	return out ? 0 : 1;
+}
@@ -15,9 +15,14 @@ GPU			gpu(mmu);
 // Timing
 std::chrono::high_resolution_clock timing_clock;
 	
-int main()
+int main(int argc, char* argv[])
 {
 	std::cout << "Using '" << rom_path << "'.\n";
+	if(argc > 1 && std::string(argv[1]) == "--jit")
+	{
+		cpu.set_jit(LR35902::JITMode::On);
+		std::cout << "JIT enabled.\n";
+	}
 
 	apu.reset();
 	cpu.reset();
@@ -30,12 +35,28 @@ int main()
 	cpu.reset_cart();
 	gpu.reset();
 	
+	// Runs like SenBoy (translated code only runs inside LR35902::run) up to the final loop of the tests.
+	size_t frames = 0;
 	auto start = timing_clock.now();
 	while(cpu.get_pc() != 0x06F1)
-		cpu.execute();
+	{
+		const size_t cycles = cpu.run();
+		if(cycles == 0)
+			break;
+		gpu.step(cycles, false);
+		if(cpu.frame_cycles > 70224)
+		{
+			apu.end_frame(cpu.frame_cycles);
+			cpu.frame_cycles = 0;
+			++frames;
+		}
+	}
 	auto end = timing_clock.now();
 	
 	std::chrono::duration<double> diff = end - start;
 	std::cout << "Time: " << diff.count() * 1000 << "ms." << std::endl;
+	const uint64_t instructions = cpu.get_instruction_count();
+	std::cout << "Instructions: " << instructions << " (" << instructions / diff.count() / 1e6 << " MIPS)." << std::endl;
+	std::cout << "Frames: " << frames << " (" << frames / diff.count() << " FPS)." << std::endl;
 	return diff.count() * 1000;
 }
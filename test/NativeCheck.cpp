@@ -0,0 +1,102 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include <Tools/CommandLine.hpp>
+#ifdef USE_AOT
+	#include <Core/LR35902AOT.hpp>
+#endif
+
+#include "TestGameBoy.hpp"
+
+/**
+ * Checks that native code (LR35902JIT, LR35902AOT) runs exactly like the interpreter: Runs the ROM on
+ * two emulators in lockstep, one of them executing the translated blocks, and compares their state
+ * (screen, CPU registers and clock, memory) after each frame.
+ * Unlike --jit-verify, which compares each block to the interpreter running the same block in isolation,
+ * this also catches translations diverging from the interpreter in their interactions with the other
+ * components (interrupts, timers, GPU...).
+ *
+ * Usage: NativeCheck "path/to/rom" [$frames N] [$aot "path/to/module"] [-nojit] [-cgb]
+ *  $frames	Number of frames to compare (1500 by default).
+ *  $aot	Also runs the blocks translated ahead of time (if built WITH_AOT, see AOTCompiler).
+ *  -nojit	Disables the JIT (if built WITH_JIT), e.g. to only check a module.
+ *  -cgb	Forces the Color GameBoy mode (see MMU::force_cgb).
+ * Returns 0 if all the frames are identical.
+**/
+
+/// @return Description of the first difference between the states of a and b, empty if there's none.
+std::string compare(const GameBoy& a, const GameBoy& b)
+{
+	const LR35902& ca = a.cpu;
+	const LR35902& cb = b.cpu;
+	if(ca.get_pc() != cb.get_pc() || ca.get_sp() != cb.get_sp() || ca.get_af() != cb.get_af() ||
+	   ca.get_bc() != cb.get_bc() || ca.get_de() != cb.get_de() || ca.get_hl() != cb.get_hl())
+		return "CPU registers (PC " + Hexa(ca.get_pc()).str() + ", expected " + Hexa(cb.get_pc()).str() + ")";
+	if(ca.get_clock_cycles() != cb.get_clock_cycles())
+		return "Clock (" + std::to_string(ca.get_clock_cycles()) + " cycles, expected " + std::to_string(cb.get_clock_cycles()) + ")";
+	constexpr size_t ScreenSize = GPU::ScreenWidth * GPU::ScreenHeight * sizeof(color_t);
+	if(hash(a.gpu.get_screen(), ScreenSize) != hash(b.gpu.get_screen(), ScreenSize))
+		return "Screen";
+	if(!a.mmu.same_state(b.mmu))
+		return "Memory";
+	return "";
+}
+
+int main(int argc, char* argv[])
+{
+	const char* path = get_file(argc, argv);
+	if(path == nullptr)
+	{
+		std::cerr << "Usage: " << argv[0] << " \"path/to/rom\" [$frames N] [$aot \"path/to/module\"] [-nojit] [-cgb]" << std::endl;
+		return 1;
+	}
+	const char* frames_opt = get_option(argc, argv, "$frames");
+	const int frames = frames_opt ? std::atoi(frames_opt) : 1500;
+	const bool cgb = has_option(argc, argv, "-cgb");
+
+	GameBoy native;
+	GameBoy reference;
+	if(!native.load(path, cgb) || !reference.load(path, cgb))
+	{
+		std::cerr << "Error loading '" << path << "'." << std::endl;
+		return 1;
+	}
+	bool translated = false;
+#ifdef USE_JIT
+	if(!has_option(argc, argv, "-nojit"))
+	{
+		native.cpu.set_jit(LR35902::JITMode::On);
+		translated = true;
+	}
+#endif
+#ifdef USE_AOT
+	if(const char* aot_path = get_option(argc, argv, "$aot"))
+	{
+		if(!native.cpu.load_aot(aot_path))
+			return 1;
+		translated = true;
+	}
+#endif
+	if(!translated)
+	{
+		std::cerr << "Nothing to check: Build WITH_JIT, or WITH_AOT and load a module ($aot)." << std::endl;
+		return 1;
+	}
+
+	uint64_t frames_hash = hash(nullptr, 0);
+	for(int f = 0; f < frames; ++f)
+	{
+		native.run_frame();
+		reference.run_frame();
+		const std::string difference = compare(native, reference);
+		if(!difference.empty())
+		{
+			std::cerr << "Frame " << f << ": " << difference << " differs from the interpreter." << std::endl;
+			return 1;
+		}
+		frames_hash = hash(native.gpu.get_screen(), GPU::ScreenWidth * GPU::ScreenHeight * sizeof(color_t), frames_hash);
+	}
+	std::cout << frames << " identical frames (hash " << std::hex << frames_hash << std::dec << ")." << std::endl;
+	return 0;
+}
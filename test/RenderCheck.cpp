@@ -0,0 +1,165 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <Tools/CommandLine.hpp>
+
+#include "TestGameBoy.hpp"
+
+/**
+ * Checks that the vectorized scanline compositor (GPU::vectorized), skipping the unchanged lines
+ * (GPU::skip_unchanged), renders exactly like the reference one: Runs the ROM on two emulators
+ * in lockstep, one with each compositor, and compares the hashes of their frames.
+ * The vectorized one can also output another format (see GPU::Format), converted back to RGBA8
+ * (RGB565: the reference screen is converted instead).
+ *
+ * Both compositors could drift together: The hash of all the frames is also checked against the one of the
+ * original renderer (before the vectorized compositor), from GoldenFrames for the known ROMs or from $expect.
+ *
+ * Usage: RenderCheck "path/to/rom" [$frames N] [$format rgba8|rgb565|indexed] [$expect XXXXXXXXXXXXXXXX] [-cgb]
+ *  $frames	Number of frames to compare (600 by default).
+ *  $format	Output format of the vectorized compositor (rgba8 by default).
+ *  $expect	Hash of the frames (hexadecimal, as printed), overriding GoldenFrames.
+ *  -cgb	Forces the Color GameBoy mode (see MMU::force_cgb).
+ * Returns 0 if all the frames are identical (and match the original renderer, when its hash is known).
+**/
+
+constexpr int DefaultFrames = 600;
+
+/// Hashes of the first DefaultFrames frames of the original renderer, as computed by RenderCheck.
+struct Golden
+{
+	checksum_t	checksum;	///< Of the ROM (see Cartridge::getChecksum)
+	bool		cgb;
+	uint64_t	rgba8;		///< Also the one of the indexed format
+	uint64_t	rgb565;
+};
+
+const Golden GoldenFrames[] = {
+	{0xF530, false, 0x9fd354a00a9a9647, 0x7ea461f1c0cd165d},	// cpu_instrs (Blargg's test ROMs)
+	{0x6022, false, 0xee7eb16c576456b5, 0xeafdfeca1ada4651},	// Pocket Demo (PD)
+	{0x6022, true,  0xcd91ab1ab6f1fc05, 0x141cb455da5506a5},
+	{0x7365, false, 0x3558236a840bdda5, 0x9193d7e4ae0a2f45},	// Witness, The (PD)
+	{0x7365, true,  0xcd91ab1ab6f1fc05, 0x141cb455da5506a5},
+	{0x0304, false, 0x6c7cf9e18c9573b6, 0xc258b8ada4773479},	// James Bond Demo (PD)
+	{0x0304, true,  0x6e9e3024ce021aa4, 0xd1934111401aa073},
+	{0xFFCD, false, 0x67429bb603e10144, 0xc61fe283bf6e1916}		// GB Tic-Tac-Toe (PD)
+};
+
+/// @return The screen of gpu as RGBA8 (or RGB565 if rgb565), in buffer
+const color_t* get_screen(const GPU& gpu, bool rgb565, std::vector<color_t>& buffer)
+{
+	buffer.resize(GPU::ScreenWidth * GPU::ScreenHeight);
+	switch(gpu.get_format())
+	{
+		case GPU::Format::Indexed:
+			gpu.to_rgba8(buffer.data());
+			break;
+		case GPU::Format::RGB565:
+			for(size_t i = 0; i < buffer.size(); ++i)
+			{
+				const uint16_t c = gpu.get_screen_rgb565()[i];
+				buffer[i] = color_t{0};
+				buffer[i].r = c >> 11;
+				buffer[i].g = (c >> 5) & 0x3F;
+				buffer[i].b = c & 0x1F;
+			}
+			break;
+		default:
+			if(!rgb565)
+				return gpu.get_screen();
+			for(size_t i = 0; i < buffer.size(); ++i)
+			{
+				const color_t& c = gpu.get_screen()[i];
+				buffer[i] = color_t{0};
+				buffer[i].r = c.r >> 3;
+				buffer[i].g = c.g >> 2;
+				buffer[i].b = c.b >> 3;
+			}
+			break;
+	}
+	return buffer.data();
+}
+
+int main(int argc, char* argv[])
+{
+	const char* path = get_file(argc, argv);
+	if(path == nullptr)
+	{
+		std::cerr << "Usage: " << argv[0] << " \"path/to/rom\" [$frames N] [$format rgba8|rgb565|indexed] [$expect XXXXXXXXXXXXXXXX] [-cgb]" << std::endl;
+		return 1;
+	}
+	const char* frames_opt = get_option(argc, argv, "$frames");
+	const int frames = frames_opt ? std::atoi(frames_opt) : DefaultFrames;
+	const bool cgb = has_option(argc, argv, "-cgb");
+	const std::string format_opt = get_option(argc, argv, "$format") ? get_option(argc, argv, "$format") : "rgba8";
+	GPU::Format format = GPU::Format::RGBA8;
+	if(format_opt == "rgb565")
+		format = GPU::Format::RGB565;
+	else if(format_opt == "indexed")
+		format = GPU::Format::Indexed;
+	else if(format_opt != "rgba8")
+	{
+		std::cerr << "Unknown format '" << format_opt << "'." << std::endl;
+		return 1;
+	}
+
+	GameBoy vectorized;
+	GameBoy reference;
+	if(!vectorized.load(path, cgb) || !reference.load(path, cgb))
+	{
+		std::cerr << "Error loading '" << path << "'." << std::endl;
+		return 1;
+	}
+	const char* expect_opt = get_option(argc, argv, "$expect");
+	bool expect = expect_opt != nullptr;
+	uint64_t expected_hash = expect_opt ? std::strtoull(expect_opt, nullptr, 16) : 0;
+	for(const Golden& g : GoldenFrames)
+		if(!expect_opt && frames == DefaultFrames && g.checksum == reference.cartridge.getChecksum() && g.cgb == cgb)
+		{
+			expect = true;
+			expected_hash = format == GPU::Format::RGB565 ? g.rgb565 : g.rgba8;
+		}
+	
+	vectorized.gpu.vectorized = true;
+	vectorized.gpu.set_format(format);
+	reference.gpu.vectorized = false;
+	reference.gpu.skip_unchanged = false;
+
+	constexpr size_t LineSize = GPU::ScreenWidth * sizeof(color_t);
+	uint64_t frames_hash = hash(nullptr, 0);
+	std::vector<color_t> screen_buffer, expected_buffer;
+	size_t rendered_lines = 0;
+	for(int f = 0; f < frames; ++f)
+	{
+		vectorized.run_frame();
+		reference.run_frame();
+		rendered_lines += vectorized.gpu.get_changed_lines().count();
+		vectorized.gpu.clear_changed_lines();
+		const color_t* screen = get_screen(vectorized.gpu, false, screen_buffer);
+		const color_t* expected = get_screen(reference.gpu, format == GPU::Format::RGB565, expected_buffer);
+		const uint64_t h = hash(screen, GPU::ScreenHeight * LineSize);
+		if(h != hash(expected, GPU::ScreenHeight * LineSize))
+		{
+			for(int l = 0; l < GPU::ScreenHeight; ++l)
+				if(hash(screen + l * GPU::ScreenWidth, LineSize) != hash(expected + l * GPU::ScreenWidth, LineSize))
+				{
+					std::cerr << "Frame " << f << ": Line " << l << " differs from the reference." << std::endl;
+					break;
+				}
+			return 1;
+		}
+		frames_hash = hash(&h, sizeof(h), frames_hash);
+	}
+	std::cout << frames << " identical frames (hash " << std::hex << frames_hash << std::dec << "), "
+			  << rendered_lines << " lines rendered out of " << frames * GPU::ScreenHeight << "." << std::endl;
+	if(expect && frames_hash != expected_hash)
+	{
+		std::cerr << "The frames differ from the original renderer (hash " << std::hex << expected_hash << std::dec << ")." << std::endl;
+		return 1;
+	}
+	if(expect)
+		std::cout << "Same frames as the original renderer." << std::endl;
+	return 0;
+}
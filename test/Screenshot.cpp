@@ -87,7 +87,7 @@ int main(int argc, char* argv[])
 					{
 						return 1;
 					} else {
-						if(!cartridge.load_from_memory(reinterpret_cast<unsigned char*>(buffer.data()), buffer.size())) 
+						if(!cartridge.load_from_memory(std::move(buffer))) 
 						{
 							return 1;
 						} else {
@@ -133,12 +133,10 @@ int main(int argc, char* argv[])
 		for(int i = 0; i < 60 * shot_period; ++i) {
 			//std::cout << "Frame " << i << std::endl;
 			while(cpu.frame_cycles <= 70224) {
-				cpu.execute();
-				if(cpu.get_instr_cycles() == 0)
+				size_t cycles = cpu.run();
+				if(cycles == 0)
 					break;
-				size_t instr_cycles = (cpu.double_speed() ? cpu.get_instr_cycles() / 2 :
-												cpu.get_instr_cycles());
-				gpu.step(instr_cycles, save_video);
+				gpu.step(cycles, save_video);
 			} 
 			
 			if(save_video) {
@@ -160,12 +158,10 @@ int main(int argc, char* argv[])
 		
 		if(shot != shot_count - 1) {
 			while(cpu.frame_cycles <= 70224) {
-				cpu.execute();
-				if(cpu.get_instr_cycles() == 0)
+				size_t cycles = cpu.run();
+				if(cycles == 0)
 					break;
-				size_t instr_cycles = (cpu.double_speed() ? cpu.get_instr_cycles() / 2 :
-												cpu.get_instr_cycles());
-				gpu.step(instr_cycles);
+				gpu.step(cycles);
 			}
 			
 			auto count = std::to_string(shot);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <Core/GameBoy.hpp>
+
+/**
+ * @file Shared by the tools comparing two emulators running in lockstep (NativeCheck, RenderCheck).
+**/
+
+/// Headless GameBoy, no input, started without the boot ROM (see LR35902::reset_cart).
+struct GameBoy
+{
+	Cartridge	cartridge;
+	MMU			mmu{cartridge};
+	Gb_Apu		apu;
+	LR35902		cpu{mmu, apu};
+	GPU			gpu{mmu};
+
+	bool load(const std::string& path, bool cgb)
+	{
+		mmu.force_cgb = cgb;
+		apu.reset();
+		cpu.reset();
+		mmu.reset();
+		for(auto* callback : {&mmu.callback_joy_up, &mmu.callback_joy_down, &mmu.callback_joy_left, &mmu.callback_joy_right,
+							  &mmu.callback_joy_select, &mmu.callback_joy_start, &mmu.callback_joy_b, &mmu.callback_joy_a})
+			*callback = [] () -> bool { return false; };
+		if(!cartridge.load(path))
+			return false;
+		cpu.reset_cart();
+		gpu.reset();
+		return true;
+	}
+
+	void run_frame()
+	{
+		while(cpu.frame_cycles <= 70224)
+		{
+			size_t cycles = cpu.run();
+			if(cycles == 0)
+				break;
+			gpu.step(cycles);
+		}
+		apu.end_frame(cpu.frame_cycles);
+		cpu.frame_cycles = 0;
+	}
+};
+
+/// FNV-1a
+inline uint64_t hash(const void* data, size_t size, uint64_t h = 0xcbf29ce484222325)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for(size_t i = 0; i < size; ++i)
+		h = (h ^ bytes[i]) * 0x100000001b3;
+	return h;
+}
@@ -0,0 +1,61 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include <Core/Trace.hpp>
+#include <Tools/CommandLine.hpp>
+
+/**
+ * Prints a trace saved by SenBoy (--trace, see TraceRecorder::dump).
+ *
+ * Usage: TraceDecoder "path/to/trace" [$pc XXXX] [$bank XX] [$find "text"] [$last N]
+ *  $pc, $bank	Only the instructions at this address/in this bank (hexadecimal, see TraceRecord::bank:
+ *				WRAM/HRAM banks from 200, e.g. 201 for WRAM bank 1, FFF for the code outside of ROM and WRAM).
+ *  $find		Only the instructions whose disassembly contains text (e.g. "CALL", "($FF40)").
+ *  $last		Only the last N matching instructions.
+**/
+int main(int argc, char* argv[])
+{
+	const char* path = get_file(argc, argv);
+	if(path == nullptr)
+	{
+		std::cerr << "Usage: " << argv[0] << " \"path/to/trace\" [$pc XXXX] [$bank XX] [$find \"text\"] [$last N]" << std::endl;
+		return 1;
+	}
+
+	std::vector<TraceRecord> records;
+	if(!TraceRecorder::load(path, records))
+	{
+		std::cerr << "Error: '" << path << "' is not a valid trace file." << std::endl;
+		return 1;
+	}
+
+	const char* pc = get_option(argc, argv, "$pc");
+	const char* bank = get_option(argc, argv, "$bank");
+	const char* find = get_option(argc, argv, "$find");
+	const char* last = get_option(argc, argv, "$last");
+	const auto matches = [&](const TraceRecord& r) {
+		return (pc == nullptr || r.pc == std::strtoul(pc, nullptr, 16)) &&
+			   (bank == nullptr || r.bank == std::strtoul(bank, nullptr, 16)) &&
+			   (find == nullptr || r.disassembly().find(find) != std::string::npos);
+	};
+
+	std::vector<size_t> selected;
+	for(size_t i = 0; i < records.size(); ++i)
+		if(matches(records[i]))
+			selected.push_back(i);
+	if(last != nullptr)
+	{
+		const size_t n = std::strtoul(last, nullptr, 10);
+		if(n < selected.size())
+			selected.erase(selected.begin(), selected.end() - n);
+	}
+
+	for(size_t i : selected)
+	{
+		const TraceRecord& r = records[i];
+		std::printf("%8zu %10u %s  %-20s %s\n", i, r.cycles, r.location().c_str(), r.disassembly().c_str(), r.registers().c_str());
+	}
+	std::cerr << selected.size() << " / " << records.size() << " instructions." << std::endl;
+	return 0;
+}